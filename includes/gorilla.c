@@ -0,0 +1,341 @@
+/*
+ * gorilla.c
+ *
+ *  Bit level layout of a block, most significant bit first:
+ *
+ *  first sample    time (64 bits), value (32 bits: float bits or multiple of quantum)
+ *  next samples    interval difference, then value
+ *
+ *  Signed differences use a prefix selecting the width:
+ *      0           0
+ *      10          small       (times 7 bits, quantized values 4 bits)
+ *      110         medium      (9 / 7 bits)
+ *      1110        large       (12 / 12 bits)
+ *      1111        full width  (64 / 32 bits)
+ *
+ *  XOR coded values:
+ *      0           same value
+ *      10          XOR bits inside the previous window of meaningful bits
+ *      11          new window: leading zeros (5 bits), length - 1 (5 bits), XOR bits
+ *
+ *  Bits are stored with a read-modify-write of every byte they touch, so a
+ *  sample rolled back by gorilla_encode leaves nothing behind for the next.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "gorilla.h"
+
+#define GORILLA_NO_WINDOW	0xFF
+
+/**
+ * Widths of the signed difference classes, the last one is the full width
+ */
+static const uint8_t gorilla_time_widths[4] = { 7, 9, 12, 64 };
+static const uint8_t gorilla_value_widths[4] = { 4, 7, 12, 32 };
+
+/**
+ * Appends the n low bits of value, sets overflow if they don't fit.
+ */
+static void gorilla_put(gorilla_encoder_t *enc, uint64_t value, int n)
+{
+	if (enc->overflow || (uint64_t)enc->bits + n > (uint64_t)enc->size * 8)
+	{
+		enc->overflow = true;
+		return;
+	}
+
+	while (n > 0)
+	{
+		int free = 8 - (enc->bits & 7);
+		int take = (n < free) ? n : free;
+		uint8_t mask = (uint8_t)(((1U << take) - 1) << (free - take));
+		uint8_t chunk = (uint8_t)(((value >> (n - take)) << (free - take)) & mask);
+		uint8_t *byte = &enc->buf[enc->bits >> 3];
+
+		*byte = (*byte & ~mask) | chunk;
+		enc->bits += take;
+		n -= take;
+	}
+}
+
+/**
+ * Reads n bits, sets error past the end of the block.
+ */
+static uint64_t gorilla_get(gorilla_decoder_t *dec, int n)
+{
+	uint64_t value = 0;
+
+	if (dec->error || (uint64_t)dec->bits + n > (uint64_t)dec->size * 8)
+	{
+		dec->error = true;
+		return 0;
+	}
+
+	while (n > 0)
+	{
+		int left = 8 - (dec->bits & 7);
+		int take = (n < left) ? n : left;
+		uint8_t chunk = (uint8_t)(dec->buf[dec->bits >> 3] >> (left - take)) & (uint8_t)((1U << take) - 1);
+
+		value = (value << take) | chunk;
+		dec->bits += take;
+		n -= take;
+	}
+
+	return value;
+}
+
+static void gorilla_put_signed(gorilla_encoder_t *enc, int64_t value, const uint8_t widths[4])
+{
+	if (value == 0)
+	{
+		gorilla_put(enc, 0, 1);
+		return;
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		int64_t limit = (int64_t)1 << (widths[i] - 1);
+
+		if (value >= -limit && value < limit)
+		{
+			// i + 1 ones and a zero
+			gorilla_put(enc, (1U << (i + 2)) - 2, i + 2);
+			gorilla_put(enc, (uint64_t)value & ((1ULL << widths[i]) - 1), widths[i]);
+			return;
+		}
+	}
+
+	gorilla_put(enc, 0xF, 4);
+	gorilla_put(enc, (uint64_t)value, widths[3]);
+}
+
+static int64_t gorilla_get_signed(gorilla_decoder_t *dec, const uint8_t widths[4])
+{
+	int width = widths[3];
+	uint64_t value;
+
+	if (gorilla_get(dec, 1) == 0)
+	{
+		return 0;
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		if (gorilla_get(dec, 1) == 0)
+		{
+			width = widths[i];
+			break;
+		}
+	}
+
+	value = gorilla_get(dec, width);
+	if (width < 64 && (value >> (width - 1)) != 0)
+	{
+		// Sign extension
+		value |= ~0ULL << width;
+	}
+
+	return (int64_t)value;
+}
+
+/**
+ * Multiple of quantum nearest to a value, saturated to 32 bits.
+ */
+static int32_t gorilla_quantize(float value, float quantum)
+{
+	float q = roundf(value / quantum);
+
+	if (!(q > (float)INT32_MIN))
+	{
+		// NaN included
+		return INT32_MIN;
+	}
+	if (q >= (float)INT32_MAX)
+	{
+		return INT32_MAX;
+	}
+
+	return (int32_t)q;
+}
+
+static void gorilla_put_xor(gorilla_encoder_t *enc, uint32_t bits)
+{
+	uint32_t x = bits ^ enc->value;
+
+	if (x == 0)
+	{
+		gorilla_put(enc, 0, 1);
+		return;
+	}
+
+	int leading = __builtin_clz(x);
+	int trailing = __builtin_ctz(x);
+
+	if (enc->leading != GORILLA_NO_WINDOW && leading >= enc->leading && trailing >= enc->trailing)
+	{
+		gorilla_put(enc, 0x2, 2);
+		gorilla_put(enc, x >> enc->trailing, 32 - enc->leading - enc->trailing);
+		return;
+	}
+
+	int length = 32 - leading - trailing;
+
+	gorilla_put(enc, 0x3, 2);
+	gorilla_put(enc, (uint64_t)leading, 5);
+	gorilla_put(enc, (uint64_t)(length - 1), 5);
+	gorilla_put(enc, x >> trailing, length);
+	enc->leading = (uint8_t)leading;
+	enc->trailing = (uint8_t)trailing;
+}
+
+static uint32_t gorilla_get_xor(gorilla_decoder_t *dec)
+{
+	if (gorilla_get(dec, 1) == 0)
+	{
+		return dec->value;
+	}
+
+	if (gorilla_get(dec, 1) == 0)
+	{
+		if (dec->leading == GORILLA_NO_WINDOW)
+		{
+			dec->error = true;
+			return dec->value;
+		}
+		return dec->value ^ ((uint32_t)gorilla_get(dec, 32 - dec->leading - dec->trailing) << dec->trailing);
+	}
+
+	int leading = (int)gorilla_get(dec, 5);
+	int length = (int)gorilla_get(dec, 5) + 1;
+
+	if (leading + length > 32)
+	{
+		dec->error = true;
+		return dec->value;
+	}
+	dec->leading = (uint8_t)leading;
+	dec->trailing = (uint8_t)(32 - leading - length);
+
+	return dec->value ^ ((uint32_t)gorilla_get(dec, length) << dec->trailing);
+}
+
+void gorilla_encoder_init(gorilla_encoder_t *enc, uint8_t *buf, size_t size, float quantum)
+{
+	memset(enc, 0x00, sizeof(*enc));
+	enc->buf = buf;
+	enc->size = (uint32_t)size;
+	enc->quantum = quantum;
+	enc->leading = GORILLA_NO_WINDOW;
+}
+
+bool gorilla_encode(gorilla_encoder_t *enc, int64_t time, float value)
+{
+	gorilla_encoder_t saved = *enc;
+	uint32_t bits;
+
+	if (enc->quantum > 0.0f)
+	{
+		bits = (uint32_t)gorilla_quantize(value, enc->quantum);
+	}
+	else
+	{
+		memcpy(&bits, &value, sizeof(bits));
+	}
+
+	enc->overflow = false;
+	if (enc->count == 0)
+	{
+		gorilla_put(enc, (uint64_t)time, 64);
+		gorilla_put(enc, bits, 32);
+	}
+	else
+	{
+		int64_t delta = time - enc->time;
+
+		gorilla_put_signed(enc, delta - enc->delta, gorilla_time_widths);
+		enc->delta = delta;
+
+		if (enc->quantum > 0.0f)
+		{
+			gorilla_put_signed(enc, (int64_t)(int32_t)bits - (int32_t)enc->value, gorilla_value_widths);
+		}
+		else
+		{
+			gorilla_put_xor(enc, bits);
+		}
+	}
+
+	if (enc->overflow)
+	{
+		*enc = saved;
+		enc->overflow = true;
+		return false;
+	}
+
+	enc->time = time;
+	enc->value = bits;
+	enc->count++;
+
+	return true;
+}
+
+void gorilla_decoder_init(gorilla_decoder_t *dec, const uint8_t *buf, size_t size, uint32_t count, float quantum)
+{
+	memset(dec, 0x00, sizeof(*dec));
+	dec->buf = buf;
+	dec->size = (uint32_t)size;
+	dec->count = count;
+	dec->quantum = quantum;
+	dec->leading = GORILLA_NO_WINDOW;
+}
+
+bool gorilla_decode(gorilla_decoder_t *dec, int64_t *time, float *value)
+{
+	bool first = (dec->bits == 0);
+
+	if (dec->count == 0 || dec->error)
+	{
+		return false;
+	}
+
+	if (first)
+	{
+		dec->time = (int64_t)gorilla_get(dec, 64);
+		dec->value = (uint32_t)gorilla_get(dec, 32);
+	}
+	else
+	{
+		dec->delta += gorilla_get_signed(dec, gorilla_time_widths);
+		dec->time += dec->delta;
+
+		if (dec->quantum > 0.0f)
+		{
+			// Modulo 2^32, the full width difference of two saturated multiples can take 33 bits
+			dec->value += (uint32_t)gorilla_get_signed(dec, gorilla_value_widths);
+		}
+		else
+		{
+			dec->value = gorilla_get_xor(dec);
+		}
+	}
+
+	if (dec->error)
+	{
+		return false;
+	}
+
+	*time = dec->time;
+	if (dec->quantum > 0.0f)
+	{
+		*value = (float)(int32_t)dec->value * dec->quantum;
+	}
+	else
+	{
+		memcpy(value, &dec->value, sizeof(*value));
+	}
+	dec->count--;
+
+	return true;
+}
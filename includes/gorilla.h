@@ -0,0 +1,117 @@
+/*
+ * gorilla.h
+ *
+ *  Compression of (timestamp, float) series after Facebook's Gorilla
+ *  (Pelkonen et al., VLDB 2015), plain C with no FreeRTOS so the same code
+ *  runs on the device and in host tools.
+ *
+ *  Timestamps (ms) are coded as the difference between consecutive
+ *  intervals: a periodic sampler costs 1 bit per sample, a few ms of
+ *  jitter 9 bits. Values are coded one of two ways:
+ *
+ *  - quantum 0: the XOR of the float with the previous one, lossless. An
+ *    unchanged value costs 1 bit, a change the bits that differ.
+ *  - quantum > 0: the value rounded to a multiple of quantum, coded as the
+ *    difference with the previous multiple. Readings of a sensor with a
+ *    known resolution (the LM35 gives 0.1 °C steps) compress much better
+ *    than their float XOR, and lose nothing if quantum is the resolution.
+ *
+ *  A block is the bits of one encoder over a caller buffer: it starts with
+ *  the first sample in full and decodes on its own, so blocks are the
+ *  random access points of a series. The decoder needs the sample count,
+ *  kept by the caller next to the block.
+ */
+
+#ifndef INCLUDES_GORILLA_H_
+#define INCLUDES_GORILLA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes the first sample of a block takes at most (64 bit time, 32 bit value)
+#define GORILLA_FIRST_SAMPLE_BYTES	12
+
+/**
+ * Encoder, one block
+ */
+typedef struct gorilla_encoder
+{
+	uint8_t *buf;
+	uint32_t size;					///> bytes of buf
+	uint32_t bits;					///> bits written
+	uint32_t count;					///> samples encoded
+	float quantum;					///> 0 for XOR coded values
+	bool overflow;					///> set while a sample does not fit, see gorilla_encode
+	uint8_t leading;				///> zero bits before the last XOR window, 0xFF before the first
+	uint8_t trailing;				///> zero bits after it
+	int64_t time;					///> previous timestamp
+	int64_t delta;					///> previous interval
+	uint32_t value;					///> previous float bits, or multiple of quantum
+} gorilla_encoder_t;
+
+/**
+ * Decoder, one block
+ */
+typedef struct gorilla_decoder
+{
+	const uint8_t *buf;
+	uint32_t size;
+	uint32_t bits;					///> bits read
+	uint32_t count;					///> samples left
+	float quantum;
+	bool error;						///> the block ended before count samples
+	uint8_t leading;
+	uint8_t trailing;
+	int64_t time;
+	int64_t delta;
+	uint32_t value;
+} gorilla_decoder_t;
+
+/**
+ * Starts a block.
+ * @param enc encoder.
+ * @param buf block storage, holds at least GORILLA_FIRST_SAMPLE_BYTES.
+ * @param size bytes of buf.
+ * @param quantum resolution of the values, 0 for lossless XOR coding.
+ */
+void gorilla_encoder_init(gorilla_encoder_t *enc, uint8_t *buf, size_t size, float quantum);
+
+/**
+ * Appends a sample. A sample that does not fit leaves the block as it was,
+ * the caller closes the block and starts the next one with it.
+ * @param enc encoder.
+ * @param time timestamp, ms.
+ * @param value value.
+ * @return false if the block is full.
+ */
+bool gorilla_encode(gorilla_encoder_t *enc, int64_t time, float value);
+
+/**
+ * Bytes of the block written so far.
+ */
+static inline size_t gorilla_encoder_bytes(const gorilla_encoder_t *enc)
+{
+	return (enc->bits + 7) / 8;
+}
+
+/**
+ * Starts reading a block.
+ * @param dec decoder.
+ * @param buf block.
+ * @param size bytes of the block.
+ * @param count samples in the block.
+ * @param quantum quantum the block was encoded with.
+ */
+void gorilla_decoder_init(gorilla_decoder_t *dec, const uint8_t *buf, size_t size, uint32_t count, float quantum);
+
+/**
+ * Reads the next sample.
+ * @param dec decoder.
+ * @param time receives the timestamp, ms.
+ * @param value receives the value.
+ * @return false after the last sample, or if the block is corrupt (dec->error).
+ */
+bool gorilla_decode(gorilla_decoder_t *dec, int64_t *time, float *value);
+
+#endif /* INCLUDES_GORILLA_H_ */
@@ -0,0 +1,233 @@
+/*
+ * lf_ring.c
+ *
+ *  Lock-free SPSC and MPSC rings.
+ *
+ *  Indexes are free running 32 bit counters masked on access, so a full
+ *  ring (head - tail == count) and an empty one (head == tail) differ and
+ *  wrapping is handled by unsigned arithmetic.
+ */
+
+#include <string.h>
+
+#include "lf_ring.h"
+
+/**
+ * Sequence number at the start of an lf_mpsc slot.
+ */
+static inline uint32_t *lf_mpsc_seq(uint8_t *slot)
+{
+	return (uint32_t *)slot;
+}
+
+static inline uint8_t *lf_mpsc_slot(const lf_mpsc_t *ring, uint32_t pos)
+{
+	return ring->slots + (size_t)(pos & ring->mask) * ring->slot_size;
+}
+
+bool lf_spsc_init(lf_spsc_t *ring, void *storage, size_t elem_size, uint32_t count)
+{
+	if (count == 0 || (count & (count - 1)) != 0)
+	{
+		return false;
+	}
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = count - 1;
+	ring->elem_size = elem_size;
+	ring->slots = storage;
+
+	return true;
+}
+
+void *lf_spsc_claim(lf_spsc_t *ring)
+{
+	uint32_t head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask)
+	{
+		return NULL;
+	}
+
+	return ring->slots + (size_t)(head & ring->mask) * ring->elem_size;
+}
+
+void lf_spsc_commit(lf_spsc_t *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void *lf_spsc_peek(lf_spsc_t *ring)
+{
+	uint32_t tail = ring->tail;
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+	{
+		return NULL;
+	}
+
+	return ring->slots + (size_t)(tail & ring->mask) * ring->elem_size;
+}
+
+void lf_spsc_release(lf_spsc_t *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+bool lf_spsc_push(lf_spsc_t *ring, const void *elem)
+{
+	void *slot = lf_spsc_claim(ring);
+
+	if (slot == NULL)
+	{
+		return false;
+	}
+
+	memcpy(slot, elem, ring->elem_size);
+	lf_spsc_commit(ring);
+
+	return true;
+}
+
+bool lf_spsc_pop(lf_spsc_t *ring, void *elem)
+{
+	void *slot = lf_spsc_peek(ring);
+
+	if (slot == NULL)
+	{
+		return false;
+	}
+
+	memcpy(elem, slot, ring->elem_size);
+	lf_spsc_release(ring);
+
+	return true;
+}
+
+uint32_t lf_spsc_count(const lf_spsc_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+bool lf_mpsc_init(lf_mpsc_t *ring, void *storage, size_t elem_size, uint32_t count)
+{
+	if (count == 0 || (count & (count - 1)) != 0)
+	{
+		return false;
+	}
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = count - 1;
+	ring->elem_size = elem_size;
+	ring->slot_size = LF_MPSC_SLOT_SIZE(elem_size);
+	ring->slots = storage;
+	ring->dropped = 0;
+
+	// A slot is free for the producer whose position equals its sequence
+	for (uint32_t i = 0; i < count; i++)
+	{
+		*lf_mpsc_seq(lf_mpsc_slot(ring, i)) = i;
+	}
+
+	return true;
+}
+
+void *lf_mpsc_claim(lf_mpsc_t *ring)
+{
+	uint32_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	for (;;)
+	{
+		uint8_t *slot = lf_mpsc_slot(ring, pos);
+		int32_t diff = (int32_t)(__atomic_load_n(lf_mpsc_seq(slot), __ATOMIC_ACQUIRE) - pos);
+
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				return slot + LF_MPSC_HEADER_SIZE;
+			}
+			// pos was reloaded by the failed compare-and-swap
+		}
+		else if (diff < 0)
+		{
+			// The consumer has not released this slot from the previous lap
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		else
+		{
+			// Another producer claimed it
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void lf_mpsc_commit(lf_mpsc_t *ring, void *elem)
+{
+	uint32_t *seq = lf_mpsc_seq((uint8_t *)elem - LF_MPSC_HEADER_SIZE);
+
+	// The slot header is all a commit needs, ring pairs the call with lf_mpsc_claim
+	(void)ring;
+
+	// The sequence still holds the claimed position, no other producer can touch it
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+void *lf_mpsc_peek(lf_mpsc_t *ring)
+{
+	uint8_t *slot = lf_mpsc_slot(ring, ring->tail);
+
+	if (__atomic_load_n(lf_mpsc_seq(slot), __ATOMIC_ACQUIRE) != ring->tail + 1)
+	{
+		return NULL;
+	}
+
+	return slot + LF_MPSC_HEADER_SIZE;
+}
+
+void lf_mpsc_release(lf_mpsc_t *ring)
+{
+	uint8_t *slot = lf_mpsc_slot(ring, ring->tail);
+
+	// Free for the producer one lap ahead
+	__atomic_store_n(lf_mpsc_seq(slot), ring->tail + ring->mask + 1, __ATOMIC_RELEASE);
+	ring->tail++;
+}
+
+bool lf_mpsc_push(lf_mpsc_t *ring, const void *elem)
+{
+	void *slot = lf_mpsc_claim(ring);
+
+	if (slot == NULL)
+	{
+		return false;
+	}
+
+	memcpy(slot, elem, ring->elem_size);
+	lf_mpsc_commit(ring, slot);
+
+	return true;
+}
+
+bool lf_mpsc_pop(lf_mpsc_t *ring, void *elem)
+{
+	void *slot = lf_mpsc_peek(ring);
+
+	if (slot == NULL)
+	{
+		return false;
+	}
+
+	memcpy(elem, slot, ring->elem_size);
+	lf_mpsc_release(ring);
+
+	return true;
+}
+
+uint32_t lf_mpsc_get_dropped(const lf_mpsc_t *ring)
+{
+	return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,155 @@
+/*
+ * lf_ring.h
+ *
+ *  Lock-free bounded rings of fixed size elements over caller provided
+ *  storage, built on the GCC __atomic builtins only (no FreeRTOS), so the
+ *  same code runs on the device and in host tools.
+ *
+ *  lf_spsc: one producer, one consumer. Head and tail are each written by
+ *  one side, a push or a pop is one acquire load and one release store.
+ *
+ *  lf_mpsc: any number of producers (tasks of both cores and ISRs), one
+ *  consumer. Every slot carries a sequence number (D. Vyukov's bounded
+ *  queue): a producer claims a slot with one compare-and-swap on the head
+ *  and publishes it by storing the sequence.
+ *
+ *  Neither ring blocks: a full ring refuses the element and an empty ring
+ *  returns nothing, so both can be used from an ISR. Waking the consumer
+ *  is left to the caller (task notification, periodic drain).
+ *
+ *  The claim/commit and peek/release pairs work on the slot in place, for
+ *  elements that are filled or read field by field. A producer interrupted
+ *  between claim and commit holds back the consumer at that slot, other
+ *  producers carry on.
+ */
+
+#ifndef INCLUDES_LF_RING_H_
+#define INCLUDES_LF_RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes of the lf_mpsc slot header, keeps 8 byte elements aligned
+#define LF_MPSC_HEADER_SIZE			8
+
+// Bytes a slot of an lf_mpsc ring takes
+#define LF_MPSC_SLOT_SIZE(_elem_size)	(LF_MPSC_HEADER_SIZE + (((_elem_size) + 7) & ~(size_t)7))
+
+/**
+ * Declares static storage for a ring, count must be a power of two
+ */
+#define LF_SPSC_STORAGE(_name, _elem_size, _count) \
+	static uint64_t _name[((_elem_size) * (_count) + 7) / 8]
+#define LF_MPSC_STORAGE(_name, _elem_size, _count) \
+	static uint64_t _name[LF_MPSC_SLOT_SIZE(_elem_size) * (_count) / 8]
+
+/**
+ * Single producer, single consumer ring
+ */
+typedef struct lf_spsc
+{
+	uint32_t head;					///> next slot to write, only the producer stores it
+	uint32_t tail;					///> next slot to read, only the consumer stores it
+	uint32_t mask;					///> slot count - 1
+	uint32_t elem_size;
+	uint8_t *slots;
+} lf_spsc_t;
+
+/**
+ * Multi producer, single consumer ring
+ */
+typedef struct lf_mpsc
+{
+	uint32_t head;					///> next slot to claim
+	uint32_t tail;					///> next slot to read, only the consumer touches it
+	uint32_t mask;
+	uint32_t elem_size;
+	uint32_t slot_size;
+	uint8_t *slots;
+	uint32_t dropped;				///> pushes refused because the ring was full
+} lf_mpsc_t;
+
+/**
+ * Initializes a ring.
+ * @param ring ring to initialize.
+ * @param storage elem_size * count bytes, see LF_SPSC_STORAGE.
+ * @param elem_size size of an element.
+ * @param count number of slots, a power of two.
+ * @return false if count is not a power of two.
+ */
+bool lf_spsc_init(lf_spsc_t *ring, void *storage, size_t elem_size, uint32_t count);
+
+/**
+ * Copies an element into the ring.
+ * @return false if the ring is full.
+ */
+bool lf_spsc_push(lf_spsc_t *ring, const void *elem);
+
+/**
+ * Copies the oldest element out of the ring.
+ * @return false if the ring is empty.
+ */
+bool lf_spsc_pop(lf_spsc_t *ring, void *elem);
+
+/**
+ * Gets the slot the next element goes in, NULL if the ring is full.
+ * The element is visible to the consumer after lf_spsc_commit.
+ */
+void *lf_spsc_claim(lf_spsc_t *ring);
+void lf_spsc_commit(lf_spsc_t *ring);
+
+/**
+ * Gets the oldest element in place, NULL if the ring is empty.
+ * The slot is handed back to the producer by lf_spsc_release.
+ */
+void *lf_spsc_peek(lf_spsc_t *ring);
+void lf_spsc_release(lf_spsc_t *ring);
+
+/**
+ * Gets the number of elements in the ring, exact only from the producer or the consumer.
+ */
+uint32_t lf_spsc_count(const lf_spsc_t *ring);
+
+/**
+ * Initializes a ring.
+ * @param ring ring to initialize.
+ * @param storage LF_MPSC_SLOT_SIZE(elem_size) * count bytes, 8 byte aligned, see LF_MPSC_STORAGE.
+ * @param elem_size size of an element.
+ * @param count number of slots, a power of two.
+ * @return false if count is not a power of two.
+ */
+bool lf_mpsc_init(lf_mpsc_t *ring, void *storage, size_t elem_size, uint32_t count);
+
+/**
+ * Copies an element into the ring.
+ * @return false if the ring is full, the refusal is counted in dropped.
+ */
+bool lf_mpsc_push(lf_mpsc_t *ring, const void *elem);
+
+/**
+ * Copies the oldest element out of the ring, consumer only.
+ * @return false if the ring is empty or its oldest slot is not committed yet.
+ */
+bool lf_mpsc_pop(lf_mpsc_t *ring, void *elem);
+
+/**
+ * Claims a slot, NULL if the ring is full (counted in dropped).
+ * The element is visible to the consumer after lf_mpsc_commit.
+ */
+void *lf_mpsc_claim(lf_mpsc_t *ring);
+void lf_mpsc_commit(lf_mpsc_t *ring, void *elem);
+
+/**
+ * Gets the oldest committed element in place, NULL if there is none, consumer only.
+ * The slot is handed back to the producers by lf_mpsc_release.
+ */
+void *lf_mpsc_peek(lf_mpsc_t *ring);
+void lf_mpsc_release(lf_mpsc_t *ring);
+
+/**
+ * Gets the number of pushes refused because the ring was full.
+ */
+uint32_t lf_mpsc_get_dropped(const lf_mpsc_t *ring);
+
+#endif /* INCLUDES_LF_RING_H_ */
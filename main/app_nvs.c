@@ -8,11 +8,13 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "esp_log.h"
 #include "nvs_flash.h"
 
 #include "app_nvs.h"
+#include "dlog.h"
 #include "wifi_app.h"
 
 // Tag for logging to the monitor
@@ -21,116 +23,249 @@ static const char TAG[] = "nvs";
 // NVS name space used for station mode credentials
 const char app_nvs_sta_creds_namespace[] = "stacreds";
 
-esp_err_t app_nvs_save_sta_creds(void)
+// NVS name space used for OTA upload progress and flashed image hashes
+const char app_nvs_ota_namespace[] = "ota";
+
+/**
+ * Finds a saved network by SSID.
+ * @return index, -1 if not found.
+ */
+static int app_nvs_find_network(const app_nvs_network_t *networks, size_t count, const char *ssid)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (strncmp(networks[i].ssid, ssid, MAX_SSID_LENGTH) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Writes the network list.
+ */
+static esp_err_t app_nvs_write_networks(const app_nvs_network_t *networks, size_t count)
 {
 	nvs_handle handle;
 	esp_err_t esp_err;
-	ESP_LOGI(TAG, "app_nvs_save_sta_creds: Saving station mode credentials to flash");
 
-	wifi_config_t *wifi_sta_config = wifi_app_get_wifi_config();
+	esp_err = nvs_open(app_nvs_sta_creds_namespace, NVS_READWRITE, &handle);
+	if (esp_err != ESP_OK)
+	{
+		DLOGE(TAG, "app_nvs_write_networks: Error (%s) opening NVS handle!", esp_err_to_name(esp_err));
+		return esp_err;
+	}
 
-	if (wifi_sta_config)
+	if (count > 0)
 	{
-		esp_err = nvs_open(app_nvs_sta_creds_namespace, NVS_READWRITE, &handle);
-		if (esp_err != ESP_OK)
+		esp_err = nvs_set_blob(handle, "networks", networks, count * sizeof(app_nvs_network_t));
+	}
+	else
+	{
+		esp_err = nvs_erase_key(handle, "networks");
+		if (esp_err == ESP_ERR_NVS_NOT_FOUND)
 		{
-			printf("app_nvs_save_sta_creds: Error (%s) opening NVS handle!\n", esp_err_to_name(esp_err));
-			return esp_err;
+			esp_err = ESP_OK;
 		}
+	}
+	if (esp_err == ESP_OK)
+	{
+		// The list replaces the single network of earlier firmware
+		nvs_erase_key(handle, "ssid");
+		nvs_erase_key(handle, "password");
+		esp_err = nvs_commit(handle);
+	}
+	nvs_close(handle);
+
+	if (esp_err != ESP_OK)
+	{
+		DLOGE(TAG, "app_nvs_write_networks: Error (%s) saving the network list!", esp_err_to_name(esp_err));
+	}
+
+	return esp_err;
+}
+
+bool app_nvs_load_networks(app_nvs_network_t *networks, size_t *count)
+{
+	nvs_handle handle;
+	size_t size = APP_NVS_MAX_NETWORKS * sizeof(app_nvs_network_t);
+
+	*count = 0;
+	if (nvs_open(app_nvs_sta_creds_namespace, NVS_READONLY, &handle) != ESP_OK)
+	{
+		return false;
+	}
 
-		// Set SSID
-		esp_err = nvs_set_blob(handle, "ssid", wifi_sta_config->sta.ssid, MAX_SSID_LENGTH);
-		if (esp_err != ESP_OK)
+	if (nvs_get_blob(handle, "networks", networks, &size) == ESP_OK)
+	{
+		*count = size / sizeof(app_nvs_network_t);
+	}
+	else
+	{
+		// Single network saved by earlier firmware, rewritten as a list on the next successful connection
+		size_t ssid_size = MAX_SSID_LENGTH;
+		size_t password_size = MAX_PASSWORD_LENGTH;
+
+		memset(&networks[0], 0x00, sizeof(app_nvs_network_t));
+		if (nvs_get_blob(handle, "ssid", networks[0].ssid, &ssid_size) == ESP_OK
+				&& nvs_get_blob(handle, "password", networks[0].password, &password_size) == ESP_OK
+				&& networks[0].ssid[0] != '\0')
 		{
-			printf("app_nvs_save_sta_creds: Error (%s) setting SSID to NVS!\n", esp_err_to_name(esp_err));
-			return esp_err;
+			*count = 1;
 		}
+	}
+	nvs_close(handle);
 
-		// Set Password
-		esp_err = nvs_set_blob(handle, "password", wifi_sta_config->sta.password, MAX_PASSWORD_LENGTH);
-		if (esp_err != ESP_OK)
+	return *count > 0;
+}
+
+esp_err_t app_nvs_save_network(const char *ssid, const char *password, int priority, bool connected)
+{
+	app_nvs_network_t networks[APP_NVS_MAX_NETWORKS];
+	app_nvs_network_t saved;
+	uint32_t newest = 0;
+	size_t count;
+	int index;
+
+	app_nvs_load_networks(networks, &count);
+
+	index = app_nvs_find_network(networks, count, ssid);
+	if (index < 0)
+	{
+		if (count < APP_NVS_MAX_NETWORKS)
 		{
-			printf("app_nvs_save_sta_creds: Error (%s) setting Password to NVS!\n", esp_err_to_name(esp_err));
-			return esp_err;
+			index = count++;
 		}
+		else
+		{
+			// Replace the least preferred network, the one that connected least recently among equals
+			index = 0;
+			for (int i = 1; i < count; i++)
+			{
+				if (networks[i].priority < networks[index].priority
+						|| (networks[i].priority == networks[index].priority && networks[i].last_success < networks[index].last_success))
+				{
+					index = i;
+				}
+			}
+			ESP_LOGI(TAG, "app_nvs_save_network: list full, replacing %s", networks[index].ssid);
+		}
+		memset(&networks[index], 0x00, sizeof(app_nvs_network_t));
+		memcpy(networks[index].ssid, ssid, strnlen(ssid, MAX_SSID_LENGTH));
+	}
+	saved = networks[index];
 
-		// Commit credentials to NVS
-		esp_err = nvs_commit(handle);
-		if (esp_err != ESP_OK)
+	// The station configuration fields are not terminated when full
+	memset(networks[index].password, 0x00, sizeof(networks[index].password));
+	memcpy(networks[index].password, password, strnlen(password, MAX_PASSWORD_LENGTH));
+	if (priority >= 0)
+	{
+		networks[index].priority = priority;
+	}
+
+	// last_success is a per-device connection counter, not a time: the clock is not
+	// set yet when the station gets its IP address. Reconnecting to the network that
+	// already ranks as the most recent one leaves the list, and the flash, untouched.
+	if (connected)
+	{
+		for (int i = 0; i < count; i++)
 		{
-			printf("app_nvs_save_sta_creds: Error (%s) comitting credentials to NVS!\n", esp_err_to_name(esp_err));
-			return esp_err;
+			if (i != index && networks[i].last_success > newest)
+			{
+				newest = networks[i].last_success;
+			}
+		}
+		if (networks[index].last_success <= newest)
+		{
+			networks[index].last_success = newest + 1;
 		}
-		nvs_close(handle);
-		ESP_LOGI(TAG, "app_nvs_save_sta_creds: wrote wifi_sta_config: Station SSID: %s Password: %s", wifi_sta_config->sta.ssid, wifi_sta_config->sta.password);
 	}
 
-	printf("app_nvs_save_sta_creds: returned ESP_OK\n");
-	return ESP_OK;
+	if (memcmp(&saved, &networks[index], sizeof(app_nvs_network_t)) == 0)
+	{
+		return ESP_OK;
+	}
+
+	ESP_LOGI(TAG, "app_nvs_save_network: SSID: %s priority: %d", networks[index].ssid, networks[index].priority);
+	return app_nvs_write_networks(networks, count);
 }
 
-bool app_nvs_load_sta_creds(void)
+esp_err_t app_nvs_forget_network(const char *ssid)
 {
-	nvs_handle handle;
-	esp_err_t esp_err;
+	app_nvs_network_t networks[APP_NVS_MAX_NETWORKS];
+	size_t count;
+	int index;
 
-	ESP_LOGI(TAG, "app_nvs_load_sta_creds: Loading Wifi credentials from flash");
+	app_nvs_load_networks(networks, &count);
 
-	if (nvs_open(app_nvs_sta_creds_namespace, NVS_READONLY, &handle) == ESP_OK)
+	index = app_nvs_find_network(networks, count, ssid);
+	if (index < 0)
 	{
-		wifi_config_t *wifi_sta_config = wifi_app_get_wifi_config();
+		return ESP_ERR_NOT_FOUND;
+	}
 
-		memset(wifi_sta_config, 0x00, sizeof(wifi_config_t));
+	memmove(&networks[index], &networks[index + 1], (count - index - 1) * sizeof(app_nvs_network_t));
+	count--;
 
-		// Allocate buffer
-		size_t wifi_config_size = sizeof(wifi_config_t);
-		uint8_t *wifi_config_buff = (uint8_t*)malloc(sizeof(uint8_t) * wifi_config_size);
-		memset(wifi_config_buff, 0x00, sizeof(wifi_config_size));
+	ESP_LOGI(TAG, "app_nvs_forget_network: SSID: %s, %u left", ssid, (unsigned)count);
+	return app_nvs_write_networks(networks, count);
+}
 
-		// Load SSID
-		wifi_config_size = sizeof(wifi_sta_config->sta.ssid);
-		esp_err = nvs_get_blob(handle, "ssid", wifi_config_buff, &wifi_config_size);
-		if (esp_err != ESP_OK)
-		{
-			free(wifi_config_buff);
-			printf("app_nvs_load_sta_creds: (%s) no station SSID found in NVS\n", esp_err_to_name(esp_err));
-			return false;
-		}
-		memcpy(wifi_sta_config->sta.ssid, wifi_config_buff, wifi_config_size);
+esp_err_t app_nvs_save_sta_creds(void)
+{
+	const wifi_app_sta_config_t *sta_config = wifi_app_sta_config_acquire();
+	esp_err_t esp_err;
 
-		// Load Password
-		wifi_config_size = sizeof(wifi_sta_config->sta.password);
-		esp_err = nvs_get_blob(handle, "password", wifi_config_buff, &wifi_config_size);
-		if (esp_err != ESP_OK)
-		{
-			free(wifi_config_buff);
-			printf("app_nvs_load_sta_creds: (%s) retrieving password!\n", esp_err_to_name(esp_err));
-			return false;
-		}
-		memcpy(wifi_sta_config->sta.password, wifi_config_buff, wifi_config_size);
+	DLOGI(TAG, "app_nvs_save_sta_creds: Saving station mode credentials to flash");
 
-		free(wifi_config_buff);
-		nvs_close(handle);
+	esp_err = app_nvs_save_network(sta_config->ssid, sta_config->password, -1, true);
+	wifi_app_sta_config_release(sta_config);
 
-		printf("app_nvs_load_sta_creds: SSID: %s Password: %s\n", wifi_sta_config->sta.ssid, wifi_sta_config->sta.password);
-		return wifi_sta_config->sta.ssid[0] != '\0';
-	}
-	else
+	return esp_err;
+}
+
+bool app_nvs_load_sta_creds(void)
+{
+	app_nvs_network_t networks[APP_NVS_MAX_NETWORKS];
+	size_t count;
+	int best = 0;
+
+	DLOGI(TAG, "app_nvs_load_sta_creds: Loading Wifi credentials from flash");
+
+	if (!app_nvs_load_networks(networks, &count))
 	{
+		DLOGI(TAG, "app_nvs_load_sta_creds: no station network found in NVS");
 		return false;
 	}
+
+	// Highest priority, then most recent success
+	for (int i = 1; i < count; i++)
+	{
+		if (networks[i].priority > networks[best].priority
+				|| (networks[i].priority == networks[best].priority && networks[i].last_success > networks[best].last_success))
+		{
+			best = i;
+		}
+	}
+
+	wifi_app_set_sta_config(networks[best].ssid, networks[best].password);
+
+	ESP_LOGI(TAG, "app_nvs_load_sta_creds: %u networks, SSID: %s", (unsigned)count, networks[best].ssid);
+	return true;
 }
 
 esp_err_t app_nvs_clear_sta_creds(void)
 {
 	nvs_handle handle;
 	esp_err_t esp_err;
-	ESP_LOGI(TAG, "app_nvs_clear_sta_creds: Clearing Wifi station mode credentials from flash");
+	DLOGI(TAG, "app_nvs_clear_sta_creds: Clearing Wifi station mode credentials from flash");
 
 	esp_err = nvs_open(app_nvs_sta_creds_namespace, NVS_READWRITE, &handle);
 	if (esp_err != ESP_OK)
 	{
-		printf("app_nvs_clear_sta_creds: Error (%s) opening NVS handle!\n", esp_err_to_name(esp_err));
+		DLOGE(TAG, "app_nvs_clear_sta_creds: Error (%s) opening NVS handle!", esp_err_to_name(esp_err));
 		return esp_err;
 	}
 
@@ -138,7 +273,8 @@ esp_err_t app_nvs_clear_sta_creds(void)
 	esp_err = nvs_erase_all(handle);
 	if (esp_err != ESP_OK)
 	{
-		printf("app_nvs_clear_sta_creds: Error (%s) erasing station mode credentials!\n", esp_err_to_name(esp_err));
+		DLOGE(TAG, "app_nvs_clear_sta_creds: Error (%s) erasing station mode credentials!", esp_err_to_name(esp_err));
+		nvs_close(handle);
 		return esp_err;
 	}
 
@@ -146,55 +282,123 @@ esp_err_t app_nvs_clear_sta_creds(void)
 	esp_err = nvs_commit(handle);
 	if (esp_err != ESP_OK)
 	{
-		printf("app_nvs_clear_sta_creds: Error (%s) NVS commit!\n", esp_err_to_name(esp_err));
+		DLOGE(TAG, "app_nvs_clear_sta_creds: Error (%s) NVS commit!", esp_err_to_name(esp_err));
+		nvs_close(handle);
 		return esp_err;
 	}
 	nvs_close(handle);
 
-	printf("app_nvs_clear_sta_creds: returned ESP_OK\n");
+	DLOGI(TAG, "app_nvs_clear_sta_creds: returned ESP_OK");
 	return ESP_OK;
 }
 
+esp_err_t app_nvs_save_sta_cache(const app_nvs_sta_cache_t *cache)
+{
+	nvs_handle handle;
+	esp_err_t esp_err;
 
+	esp_err = nvs_open(app_nvs_sta_creds_namespace, NVS_READWRITE, &handle);
+	if (esp_err != ESP_OK)
+	{
+		DLOGE(TAG, "app_nvs_save_sta_cache: Error (%s) opening NVS handle!", esp_err_to_name(esp_err));
+		return esp_err;
+	}
 
+	esp_err = nvs_set_blob(handle, "cache", cache, sizeof(app_nvs_sta_cache_t));
+	if (esp_err == ESP_OK)
+	{
+		esp_err = nvs_commit(handle);
+	}
+	nvs_close(handle);
 
+	if (esp_err != ESP_OK)
+	{
+		DLOGE(TAG, "app_nvs_save_sta_cache: Error (%s) saving station cache!", esp_err_to_name(esp_err));
+	}
 
+	return esp_err;
+}
 
+bool app_nvs_load_sta_cache(app_nvs_sta_cache_t *cache)
+{
+	nvs_handle handle;
+	size_t size = sizeof(app_nvs_sta_cache_t);
 
+	if (nvs_open(app_nvs_sta_creds_namespace, NVS_READONLY, &handle) != ESP_OK)
+	{
+		return false;
+	}
 
+	esp_err_t esp_err = nvs_get_blob(handle, "cache", cache, &size);
+	nvs_close(handle);
 
+	return esp_err == ESP_OK && size == sizeof(app_nvs_sta_cache_t);
+}
 
+esp_err_t app_nvs_save_ota_progress(const app_nvs_ota_progress_t *progress)
+{
+	nvs_handle handle;
+	esp_err_t esp_err;
 
+	esp_err = nvs_open(app_nvs_ota_namespace, NVS_READWRITE, &handle);
+	if (esp_err != ESP_OK)
+	{
+		DLOGE(TAG, "app_nvs_save_ota_progress: Error (%s) opening NVS handle!", esp_err_to_name(esp_err));
+		return esp_err;
+	}
 
+	esp_err = nvs_set_blob(handle, "progress", progress, sizeof(app_nvs_ota_progress_t));
+	if (esp_err == ESP_OK)
+	{
+		esp_err = nvs_commit(handle);
+	}
+	nvs_close(handle);
 
+	if (esp_err != ESP_OK)
+	{
+		DLOGE(TAG, "app_nvs_save_ota_progress: Error (%s) saving OTA progress!", esp_err_to_name(esp_err));
+	}
 
+	return esp_err;
+}
 
+bool app_nvs_load_ota_progress(app_nvs_ota_progress_t *progress)
+{
+	nvs_handle handle;
+	size_t size = sizeof(app_nvs_ota_progress_t);
 
+	if (nvs_open(app_nvs_ota_namespace, NVS_READONLY, &handle) != ESP_OK)
+	{
+		return false;
+	}
 
+	esp_err_t esp_err = nvs_get_blob(handle, "progress", progress, &size);
+	nvs_close(handle);
 
+	return esp_err == ESP_OK && size == sizeof(app_nvs_ota_progress_t);
+}
 
+esp_err_t app_nvs_clear_ota_progress(void)
+{
+	nvs_handle handle;
+	esp_err_t esp_err;
 
+	esp_err = nvs_open(app_nvs_ota_namespace, NVS_READWRITE, &handle);
+	if (esp_err != ESP_OK)
+	{
+		return esp_err;
+	}
 
+	esp_err = nvs_erase_key(handle, "progress");
+	if (esp_err == ESP_OK)
+	{
+		esp_err = nvs_commit(handle);
+	}
+	else if (esp_err == ESP_ERR_NVS_NOT_FOUND)
+	{
+		esp_err = ESP_OK;
+	}
+	nvs_close(handle);
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+	return esp_err;
+}
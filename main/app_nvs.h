@@ -8,22 +8,128 @@
 #ifndef MAIN_APP_NVS_H_
 #define MAIN_APP_NVS_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Station networks the device remembers
+#define APP_NVS_MAX_NETWORKS		5
+
+/**
+ * Saved station network
+ */
+typedef struct app_nvs_network
+{
+	char ssid[33];					///> MAX_SSID_LENGTH + 1
+	char password[65];				///> MAX_PASSWORD_LENGTH + 1
+	uint8_t priority;				///> higher is preferred
+	uint32_t last_success;			///> connection counter of the last connection that got an IP address, 0 if never
+} app_nvs_network_t;
+
+/**
+ * Loads the saved station networks.
+ * @param networks APP_NVS_MAX_NETWORKS entries.
+ * @param count number of networks loaded.
+ * @return true if at least one network was found.
+ */
+bool app_nvs_load_networks(app_nvs_network_t *networks, size_t *count);
+
+/**
+ * Adds a network to the saved list or updates it, the least preferred network
+ * is replaced when the list is full.
+ * @param ssid SSID of the network.
+ * @param password password of the network.
+ * @param priority priority, -1 to keep the saved one (0 for a new network).
+ * @param connected true to rank the network as the most recently connected one.
+ * @return ESP_OK if successful, the list is only written when an entry changes.
+ */
+esp_err_t app_nvs_save_network(const char *ssid, const char *password, int priority, bool connected);
+
+/**
+ * Removes a network from the saved list.
+ * @param ssid SSID of the network.
+ * @return ESP_OK if successful, ESP_ERR_NOT_FOUND if the network was not saved.
+ */
+esp_err_t app_nvs_forget_network(const char *ssid);
+
 /**
- * Saves station mode Wifi credentials to NVS
+ * Saves the station mode Wifi credentials in the network list, as connected now
  * @return ESP_OK if successful.
  */
 esp_err_t app_nvs_save_sta_creds(void);
 
 /**
- * Loads the previously saved credentials from NVS.
+ * Loads the credentials of the preferred saved network (priority, then most recent success).
  * @return true if previously saved credentials were found.
  */
 bool app_nvs_load_sta_creds(void);
 
 /**
- * Clears station mode credentials from NVS
+ * Clears every saved network and the cached access point from NVS
  * @return ESP_OK if successful.
  */
 esp_err_t app_nvs_clear_sta_creds(void);
 
+/**
+ * Access point and lease of the last successful station connection
+ */
+typedef struct app_nvs_sta_cache
+{
+	char ssid[33];					///> network the cache belongs to
+	uint8_t bssid[6];				///> access point the station associated with
+	uint8_t channel;				///> primary channel of the access point
+	uint8_t reserved;
+	uint32_t ip;					///> lease, network byte order
+	uint32_t netmask;
+	uint32_t gw;
+	uint32_t dns;
+} app_nvs_sta_cache_t;
+
+/**
+ * Saves the access point and lease of the last successful connection next to the credentials
+ * @param cache cache to save.
+ * @return ESP_OK if successful.
+ */
+esp_err_t app_nvs_save_sta_cache(const app_nvs_sta_cache_t *cache);
+
+/**
+ * Loads the access point and lease of the last successful connection.
+ * @param cache output.
+ * @return true if a cache was found, app_nvs_clear_sta_creds clears it.
+ */
+bool app_nvs_load_sta_cache(app_nvs_sta_cache_t *cache);
+
+/**
+ * Progress of a resumable OTA upload, persisted after every committed chunk
+ */
+typedef struct app_nvs_ota_progress
+{
+	uint8_t image_sha256[32];		///> hash of the image being uploaded, as announced by the client
+	uint32_t image_size;			///> total image size
+	uint32_t offset;				///> bytes flashed and committed so far
+	uint32_t partition_address;		///> update partition the bytes were written to
+} app_nvs_ota_progress_t;
+
+/**
+ * Saves the progress of a resumable OTA upload to NVS
+ * @param progress progress to save.
+ * @return ESP_OK if successful.
+ */
+esp_err_t app_nvs_save_ota_progress(const app_nvs_ota_progress_t *progress);
+
+/**
+ * Loads the progress of a resumable OTA upload from NVS.
+ * @param progress output.
+ * @return true if an upload in progress was found.
+ */
+bool app_nvs_load_ota_progress(app_nvs_ota_progress_t *progress);
+
+/**
+ * Clears the progress of a resumable OTA upload from NVS
+ * @return ESP_OK if successful.
+ */
+esp_err_t app_nvs_clear_ota_progress(void);
+
 #endif /* MAIN_APP_NVS_H_ */
@@ -0,0 +1,253 @@
+/*
+ * boot.c
+ *
+ *  Boot orchestrator. A stage whose dependencies are done is queued to the
+ *  worker of its core; the worker runs it and, unless it is async, marks
+ *  it done, which queues the stages that were waiting on it. The done and
+ *  queued masks are only changed under a spinlock, so every stage is
+ *  queued exactly once whichever core completes its last dependency.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "boot.h"
+#include "metrics.h"
+#include "tasks_common.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "boot";
+
+// Queued to a worker to end it
+#define BOOT_WORKER_EXIT			0xFF
+
+/**
+ * Timeline of a stage, microseconds since power on
+ */
+typedef struct boot_timeline
+{
+	int64_t ready_us;
+	int64_t start_us;
+	int64_t end_us;
+	int64_t done_us;
+} boot_timeline_t;
+
+static const boot_stage_t *g_stages;
+static boot_timeline_t g_timeline[BOOT_STAGE_COUNT];
+static int64_t g_milestones_us[BOOT_MILESTONE_COUNT];
+
+static portMUX_TYPE g_boot_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t g_done_mask;
+static uint32_t g_queued_mask;
+static uint32_t g_ran_count;
+
+// Ready stages of each core, and given when the last stage has run
+static QueueHandle_t g_ready[portNUM_PROCESSORS];
+static SemaphoreHandle_t g_all_ran;
+
+/**
+ * Reads a milestone in milliseconds, for the boot_milestone_ms gauges.
+ */
+static int32_t boot_read_milestone(void *arg)
+{
+	return (int32_t)(__atomic_load_n(&g_milestones_us[(uintptr_t)arg], __ATOMIC_RELAXED) / 1000);
+}
+
+#define BOOT_MILESTONE_METRIC(_milestone, _id) \
+	METRICS_GAUGE_FN_INIT("boot_milestone_ms", "Time from power on to a boot milestone, 0 until reached", "milestone=\"" _milestone "\"", boot_read_milestone, (void *)(_id))
+static metrics_gauge_t g_milestone_metrics[BOOT_MILESTONE_COUNT] = {
+	BOOT_MILESTONE_METRIC("first_sample", BOOT_MILESTONE_FIRST_SAMPLE),
+	BOOT_MILESTONE_METRIC("first_http_response", BOOT_MILESTONE_FIRST_HTTP_RESPONSE),
+	BOOT_MILESTONE_METRIC("sta_got_ip", BOOT_MILESTONE_STA_GOT_IP),
+};
+static const char *g_milestone_keys[BOOT_MILESTONE_COUNT] = {
+	"firstSample", "firstHttpResponse", "staGotIp",
+};
+
+/**
+ * Queues the stages whose dependencies are all done. Called under g_boot_lock.
+ * @param ready receives the stages to queue.
+ * @return number of stages in ready.
+ */
+static int boot_collect_ready(uint8_t *ready)
+{
+	int count = 0;
+	int64_t now_us = esp_timer_get_time();
+
+	for (int i = 0; i < BOOT_STAGE_COUNT; i++)
+	{
+		if (!(g_queued_mask & BOOT_DEP(i)) && (g_stages[i].depends & g_done_mask) == g_stages[i].depends)
+		{
+			g_queued_mask |= BOOT_DEP(i);
+			g_timeline[i].ready_us = now_us;
+			ready[count++] = i;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Hands ready stages to the workers of their cores.
+ */
+static void boot_dispatch(const uint8_t *ready, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		xQueueSend(g_ready[g_stages[ready[i]].core], &ready[i], portMAX_DELAY);
+	}
+}
+
+void boot_stage_done(boot_stage_id_e id)
+{
+	uint8_t ready[BOOT_STAGE_COUNT];
+	int count = 0;
+
+	if (g_stages == NULL)
+	{
+		return;
+	}
+
+	portENTER_CRITICAL(&g_boot_lock);
+	if (!(g_done_mask & BOOT_DEP(id)))
+	{
+		g_done_mask |= BOOT_DEP(id);
+		g_timeline[id].done_us = esp_timer_get_time();
+		count = boot_collect_ready(ready);
+	}
+	portEXIT_CRITICAL(&g_boot_lock);
+
+	boot_dispatch(ready, count);
+}
+
+/**
+ * Worker task, runs the stages queued to its core.
+ * @param pvParameters core.
+ */
+static void boot_worker(void *pvParameters)
+{
+	QueueHandle_t queue = g_ready[(uintptr_t)pvParameters];
+	uint8_t id;
+
+	for (;;)
+	{
+		if (xQueueReceive(queue, &id, portMAX_DELAY) != pdTRUE)
+		{
+			continue;
+		}
+		if (id == BOOT_WORKER_EXIT)
+		{
+			break;
+		}
+
+		g_timeline[id].start_us = esp_timer_get_time();
+		g_stages[id].start();
+		g_timeline[id].end_us = esp_timer_get_time();
+
+		if (!g_stages[id].async)
+		{
+			boot_stage_done(id);
+		}
+
+		if (__atomic_add_fetch(&g_ran_count, 1, __ATOMIC_ACQ_REL) == BOOT_STAGE_COUNT)
+		{
+			uint8_t exit = BOOT_WORKER_EXIT;
+
+			for (int core = 0; core < portNUM_PROCESSORS; core++)
+			{
+				xQueueSend(g_ready[core], &exit, portMAX_DELAY);
+			}
+			xSemaphoreGive(g_all_ran);
+		}
+	}
+
+	vTaskDelete(NULL);
+}
+
+void boot_run(const boot_stage_t *stages)
+{
+	uint8_t ready[BOOT_STAGE_COUNT];
+	int count;
+
+	g_stages = stages;
+	g_all_ran = xSemaphoreCreateBinary();
+	for (uintptr_t core = 0; core < portNUM_PROCESSORS; core++)
+	{
+		// Every stage and the exit marker fit, dispatching never waits
+		g_ready[core] = xQueueCreate(BOOT_STAGE_COUNT + 1, sizeof(uint8_t));
+		xTaskCreatePinnedToCore(&boot_worker, (core == 0) ? "boot_0" : "boot_1", BOOT_WORKER_STACK_SIZE, (void *)core, BOOT_WORKER_PRIORITY, NULL, core);
+	}
+
+	for (int i = 0; i < BOOT_MILESTONE_COUNT; i++)
+	{
+		metrics_register(&g_milestone_metrics[i].base);
+	}
+
+	portENTER_CRITICAL(&g_boot_lock);
+	count = boot_collect_ready(ready);
+	portEXIT_CRITICAL(&g_boot_lock);
+	boot_dispatch(ready, count);
+
+	if (xSemaphoreTake(g_all_ran, pdMS_TO_TICKS(BOOT_TIMEOUT_MS)) != pdTRUE)
+	{
+		for (int i = 0; i < BOOT_STAGE_COUNT; i++)
+		{
+			if (g_timeline[i].end_us == 0)
+			{
+				ESP_LOGW(TAG, "Stage %s has not run, waiting for 0x%08" PRIx32, stages[i].name, stages[i].depends & ~g_done_mask);
+			}
+		}
+		return;
+	}
+
+	for (int i = 0; i < BOOT_STAGE_COUNT; i++)
+	{
+		ESP_LOGI(TAG, "%-12s core %d  ready %6" PRId64 " ms  run %5" PRId64 " ms  done %6" PRId64 " ms", stages[i].name, (int)stages[i].core,
+				g_timeline[i].ready_us / 1000, (g_timeline[i].end_us - g_timeline[i].start_us) / 1000, g_timeline[i].done_us / 1000);
+	}
+}
+
+void boot_mark(boot_milestone_e milestone)
+{
+	int64_t expected = 0;
+
+	// Relaxed load first, the common case after boot is a milestone already set
+	if (__atomic_load_n(&g_milestones_us[milestone], __ATOMIC_RELAXED) == 0)
+	{
+		__atomic_compare_exchange_n(&g_milestones_us[milestone], &expected, esp_timer_get_time(), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+esp_err_t boot_render_json(text_writer_fn_t write, void *ctx)
+{
+	esp_err_t err = write("{\"stages\":[", 11, ctx);
+
+	for (int i = 0; err == ESP_OK && g_stages != NULL && i < BOOT_STAGE_COUNT; i++)
+	{
+		err = text_writer_printf(write, ctx, "%s{\"name\":\"%s\",\"core\":%d,\"readyUs\":%" PRId64 ",\"startUs\":%" PRId64 ",\"endUs\":%" PRId64 ",\"doneUs\":%" PRId64 "}",
+				(i > 0) ? "," : "", g_stages[i].name, (int)g_stages[i].core,
+				g_timeline[i].ready_us, g_timeline[i].start_us, g_timeline[i].end_us, g_timeline[i].done_us);
+	}
+	if (err == ESP_OK)
+	{
+		err = write("],\"milestones\":{", 16, ctx);
+	}
+	for (int i = 0; err == ESP_OK && i < BOOT_MILESTONE_COUNT; i++)
+	{
+		err = text_writer_printf(write, ctx, "%s\"%s\":%" PRId64, (i > 0) ? "," : "", g_milestone_keys[i], __atomic_load_n(&g_milestones_us[i], __ATOMIC_RELAXED));
+	}
+	if (err == ESP_OK)
+	{
+		err = write("}}", 2, ctx);
+	}
+
+	return err;
+}
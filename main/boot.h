@@ -0,0 +1,103 @@
+/*
+ * boot.h
+ *
+ *  Boot orchestrator. Every subsystem is a stage that names the stages it
+ *  depends on; a stage starts as soon as they are done, on the worker of
+ *  its core, so independent stages start in parallel on both cores. The
+ *  time every stage became ready, started, returned and was done is kept,
+ *  with the first sensor sample, HTTP response and IP address, and served
+ *  by /boot.json.
+ */
+
+#ifndef MAIN_BOOT_H_
+#define MAIN_BOOT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#include "text_writer.h"
+
+// How long boot_run waits for every stage before logging the ones left
+#define BOOT_TIMEOUT_MS				15000
+
+/**
+ * Stages, index of the table given to boot_run
+ */
+typedef enum boot_stage_id
+{
+	BOOT_STAGE_NVS = 0,
+	BOOT_STAGE_METRICS,
+	BOOT_STAGE_DLOG,
+	BOOT_STAGE_EVENT_BUS,
+	BOOT_STAGE_WIFI,
+	BOOT_STAGE_WIFI_LINK,
+	BOOT_STAGE_SNTP,
+	BOOT_STAGE_OTA,
+	BOOT_STAGE_OTA_PULL,
+	BOOT_STAGE_HTTP_SERVER,
+	BOOT_STAGE_SETTINGS,
+	BOOT_STAGE_SENSOR_LOG,
+	BOOT_STAGE_SENSORS,
+	BOOT_STAGE_COUNT,
+} boot_stage_id_e;
+
+#define BOOT_DEP(_id)				(1U << (_id))
+
+/**
+ * Points of the boot timeline recorded by the subsystems, see boot_mark
+ */
+typedef enum boot_milestone
+{
+	BOOT_MILESTONE_FIRST_SAMPLE = 0,	///> first sensor reading published
+	BOOT_MILESTONE_FIRST_HTTP_RESPONSE,	///> first request handled by the web server
+	BOOT_MILESTONE_STA_GOT_IP,			///> first IP address of the station
+	BOOT_MILESTONE_COUNT,
+} boot_milestone_e;
+
+/**
+ * Stage description
+ */
+typedef struct boot_stage
+{
+	const char *name;
+	void (*start)(void);
+	uint32_t depends;				///> BOOT_DEP mask of the stages to wait for
+	BaseType_t core;				///> core of the worker that runs start
+	bool async;						///> done when the subsystem calls boot_stage_done, not when start returns
+} boot_stage_t;
+
+/**
+ * Runs the stages in dependency order on one worker task per core.
+ * Returns once every stage has run, or after BOOT_TIMEOUT_MS; stages
+ * still waiting then start whenever their dependencies are done.
+ * @param stages BOOT_STAGE_COUNT stages indexed by boot_stage_id_e, must stay valid.
+ */
+void boot_run(const boot_stage_t *stages);
+
+/**
+ * Marks a stage done, for async stages once the subsystem is ready.
+ * @param id stage.
+ */
+void boot_stage_done(boot_stage_id_e id);
+
+/**
+ * Records a milestone, only the first call counts. Can be called from any task.
+ * @param milestone milestone reached.
+ */
+void boot_mark(boot_milestone_e milestone);
+
+/**
+ * Renders the boot timeline as JSON, times in microseconds since power on (0 if not reached):
+ * {"stages":[{"name":"nvs","core":0,"readyUs":..,"startUs":..,"endUs":..,"doneUs":..},...],
+ *  "milestones":{"firstSample":..,"firstHttpResponse":..,"staGotIp":..}}
+ * @param write output function.
+ * @param ctx passed to write.
+ * @return ESP_OK, otherwise the first error returned by write.
+ */
+esp_err_t boot_render_json(text_writer_fn_t write, void *ctx);
+
+#endif /* MAIN_BOOT_H_ */
@@ -0,0 +1,547 @@
+/*
+ * dlog.c
+ *
+ *  Deferred logging: per-core record rings, formatting task and history.
+ *
+ *  Each ring is an lf_mpsc ring written in place: a producer claims a
+ *  slot, fills the record and commits it, so tasks and ISRs on the same
+ *  core never block each other. Only the dlog task consumes.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_timer.h"
+
+#include "dlog.h"
+#include "lf_ring.h"
+#include "tasks_common.h"
+
+// Kinds of argument, 2 bits each in dlog_site_t.arg_kinds
+#define DLOG_KIND_INT			0
+#define DLOG_KIND_INT64			1
+#define DLOG_KIND_DOUBLE		2		///> stored as float
+#define DLOG_KIND_PTR			3
+
+#define DLOG_ARGS_UNPARSED		-1
+#define DLOG_ARGS_SYNC			-2
+
+// Tags with a level of their own
+#define DLOG_MAX_TAG_LEVELS		16
+
+// How often the task drains the rings
+#define DLOG_DRAIN_PERIOD_MS	50
+
+/**
+ * Record of one log line
+ */
+typedef struct dlog_record
+{
+	const dlog_site_t *site;
+	uint32_t time;					///> esp_timer_get_time() >> 10, ~1 ms units
+	uint16_t suppressed;
+	uintptr_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+/**
+ * Runtime level of a tag
+ */
+typedef struct dlog_tag_level
+{
+	char tag[16];
+	esp_log_level_t level;
+} dlog_tag_level_t;
+
+_Static_assert((DLOG_RING_SLOTS & (DLOG_RING_SLOTS - 1)) == 0, "DLOG_RING_SLOTS must be a power of two");
+
+// Ring of each core
+static lf_mpsc_t g_rings[portNUM_PROCESSORS];
+static uint64_t g_ring_storage[portNUM_PROCESSORS][LF_MPSC_SLOT_SIZE(sizeof(dlog_record_t)) * DLOG_RING_SLOTS / 8];
+static bool g_started = false;
+
+// Runtime levels, read by call sites only when g_level_gen changes
+static dlog_tag_level_t g_tag_levels[DLOG_MAX_TAG_LEVELS];
+static esp_log_level_t g_default_level = CONFIG_LOG_DEFAULT_LEVEL;
+static uint32_t g_level_gen = 0;
+static portMUX_TYPE g_level_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Formatted history, g_history_total is the offset of the next byte
+static char g_history[DLOG_HISTORY_SIZE];
+static uint32_t g_history_total = 0;
+static SemaphoreHandle_t g_history_lock = NULL;
+
+/**
+ * Parses the format once per call site: the kind of every argument and the words they take.
+ */
+static void dlog_parse_site(dlog_site_t *site)
+{
+	int words = 0;
+	int count = 0;
+	uint16_t kinds = 0;
+
+	for (const char *p = site->fmt; *p != '\0'; p++)
+	{
+		if (*p != '%')
+		{
+			continue;
+		}
+		p++;
+		if (*p == '%')
+		{
+			continue;
+		}
+
+		int longs = 0;
+		int kind = -1;
+		for (; *p != '\0' && kind < 0; p++)
+		{
+			switch (*p)
+			{
+				case '*':
+					site->arg_words = DLOG_ARGS_SYNC;
+					return;
+				case 'l':
+					longs++;
+					break;
+				case 'j':
+				case 'q':
+					longs = 2;
+					break;
+				case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+					kind = (longs >= 2) ? DLOG_KIND_INT64 : DLOG_KIND_INT;
+					break;
+				case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+					kind = DLOG_KIND_DOUBLE;
+					break;
+				case 's': case 'p':
+					kind = DLOG_KIND_PTR;
+					break;
+				case 'n':
+					site->arg_words = DLOG_ARGS_SYNC;
+					return;
+			}
+		}
+		p--;
+
+		if (kind < 0)
+		{
+			break;
+		}
+
+		words += (kind == DLOG_KIND_INT64) ? (sizeof(int64_t) + sizeof(uintptr_t) - 1) / sizeof(uintptr_t) : 1;
+		if (words > DLOG_MAX_ARGS || count == 8)
+		{
+			site->arg_words = DLOG_ARGS_SYNC;
+			return;
+		}
+		kinds |= kind << (2 * count++);
+	}
+
+	site->arg_kinds = kinds;
+	__atomic_store_n(&site->arg_words, words, __ATOMIC_RELEASE);
+}
+
+/**
+ * Gets the runtime level of a tag.
+ */
+static esp_log_level_t dlog_lookup_level(const char *tag)
+{
+	esp_log_level_t level = g_default_level;
+
+	portENTER_CRITICAL_SAFE(&g_level_lock);
+	for (int i = 0; i < DLOG_MAX_TAG_LEVELS && g_tag_levels[i].tag[0] != '\0'; i++)
+	{
+		if (strcmp(g_tag_levels[i].tag, tag) == 0)
+		{
+			level = g_tag_levels[i].level;
+			break;
+		}
+	}
+	portEXIT_CRITICAL_SAFE(&g_level_lock);
+
+	return level;
+}
+
+void dlog_write(dlog_site_t *site, ...)
+{
+	va_list args;
+	uint32_t gen = __atomic_load_n(&g_level_gen, __ATOMIC_RELAXED);
+
+	// Racing refreshes store the same value
+	if (site->tag_level_gen != gen)
+	{
+		site->tag_level = dlog_lookup_level(site->tag);
+		site->tag_level_gen = gen;
+	}
+	if (site->level > site->tag_level)
+	{
+		return;
+	}
+
+	int arg_words = __atomic_load_n(&site->arg_words, __ATOMIC_ACQUIRE);
+	if (arg_words == DLOG_ARGS_UNPARSED)
+	{
+		dlog_parse_site(site);
+		arg_words = site->arg_words;
+	}
+
+	if (arg_words == DLOG_ARGS_SYNC || !__atomic_load_n(&g_started, __ATOMIC_ACQUIRE))
+	{
+		va_start(args, site);
+		esp_log_write(site->level, site->tag, "%c (%lu) %s: ", "NEWIDV"[site->level], (unsigned long)esp_log_timestamp(), site->tag);
+		esp_log_writev(site->level, site->tag, site->fmt, args);
+		esp_log_write(site->level, site->tag, "\n");
+		va_end(args);
+		return;
+	}
+
+	uint32_t time = (uint32_t)(esp_timer_get_time() >> 10);
+
+	// Rate limit per call site over ~1 s windows, approximate when tasks race
+#if DLOG_RATE_LIMIT > 0
+	uint32_t window = time >> 10;
+	if (site->window != window)
+	{
+		site->window = window;
+		site->window_count = 0;
+	}
+	if (site->window_count >= DLOG_RATE_LIMIT)
+	{
+		site->suppressed++;
+		return;
+	}
+	site->window_count++;
+#endif
+
+	// Claim a slot
+	lf_mpsc_t *ring = &g_rings[xPortGetCoreID()];
+	dlog_record_t *record = lf_mpsc_claim(ring);
+
+	if (record == NULL)
+	{
+		// Full, counted by the ring
+		return;
+	}
+
+	record->site = site;
+	record->time = time;
+	record->suppressed = site->suppressed;
+	site->suppressed = 0;
+
+	va_start(args, site);
+	uint16_t kinds = site->arg_kinds;
+	for (int word = 0; word < arg_words; kinds >>= 2)
+	{
+		switch (kinds & 3)
+		{
+			case DLOG_KIND_INT:
+				record->args[word++] = (uintptr_t)va_arg(args, unsigned int);
+				break;
+			case DLOG_KIND_INT64:
+			{
+				int64_t value = va_arg(args, long long);
+				memcpy(&record->args[word], &value, sizeof(value));
+				word += (sizeof(int64_t) + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+				break;
+			}
+			case DLOG_KIND_DOUBLE:
+			{
+				float value = (float)va_arg(args, double);
+				memcpy(&record->args[word++], &value, sizeof(value));
+				break;
+			}
+			case DLOG_KIND_PTR:
+				record->args[word++] = (uintptr_t)va_arg(args, void *);
+				break;
+		}
+	}
+	va_end(args);
+
+	// Publish
+	lf_mpsc_commit(ring, record);
+}
+
+/**
+ * Formats a record.
+ * @return length of the line, truncated to size - 1.
+ */
+static size_t dlog_format(const dlog_record_t *record, char *buf, size_t size)
+{
+	static const char letters[] = "NEWIDV";
+	const dlog_site_t *site = record->site;
+	const char *p = site->fmt;
+	uint16_t kinds = site->arg_kinds;
+	int word = 0;
+	size_t len;
+	char spec[16];
+
+	len = snprintf(buf, size, "%c (%lu) %s: ", letters[site->level], (unsigned long)(((uint64_t)record->time * 1024) / 1000), site->tag);
+
+	while (*p != '\0' && len < size - 1)
+	{
+		if (*p != '%' || p[1] == '%')
+		{
+			buf[len++] = *p;
+			p += (*p == '%') ? 2 : 1;
+			continue;
+		}
+
+		// Copy the conversion without length modifiers, the value is passed at its stored width
+		size_t spec_len = 0;
+		spec[spec_len++] = *p++;
+		while (*p != '\0' && strchr("diuxXocfFeEgGaAsp", *p) == NULL)
+		{
+			if (strchr("hljztLq", *p) == NULL && spec_len < sizeof(spec) - 4)
+			{
+				spec[spec_len++] = *p;
+			}
+			p++;
+		}
+		if (*p == '\0')
+		{
+			break;
+		}
+		char conversion = *p++;
+
+		int n = 0;
+		switch (kinds & 3)
+		{
+			case DLOG_KIND_INT:
+				spec[spec_len++] = conversion;
+				spec[spec_len] = '\0';
+				n = snprintf(&buf[len], size - len, spec, (unsigned int)record->args[word++]);
+				break;
+			case DLOG_KIND_INT64:
+			{
+				int64_t value;
+				memcpy(&value, &record->args[word], sizeof(value));
+				word += (sizeof(int64_t) + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+				spec[spec_len++] = 'l';
+				spec[spec_len++] = 'l';
+				spec[spec_len++] = conversion;
+				spec[spec_len] = '\0';
+				n = snprintf(&buf[len], size - len, spec, (long long)value);
+				break;
+			}
+			case DLOG_KIND_DOUBLE:
+			{
+				float value;
+				memcpy(&value, &record->args[word++], sizeof(value));
+				spec[spec_len++] = conversion;
+				spec[spec_len] = '\0';
+				n = snprintf(&buf[len], size - len, spec, (double)value);
+				break;
+			}
+			case DLOG_KIND_PTR:
+				spec[spec_len++] = conversion;
+				spec[spec_len] = '\0';
+				n = snprintf(&buf[len], size - len, spec, (void *)record->args[word++]);
+				break;
+		}
+		kinds >>= 2;
+
+		if (n > 0)
+		{
+			len += n;
+		}
+		if (len >= size)
+		{
+			len = size - 1;
+		}
+	}
+
+	if (record->suppressed > 0 && len < size - 1)
+	{
+		len += snprintf(&buf[len], size - len, " (%u suppressed)", record->suppressed);
+		if (len >= size)
+		{
+			len = size - 1;
+		}
+	}
+
+	return len;
+}
+
+/**
+ * Appends formatted text to the history.
+ */
+static void dlog_history_append(const char *data, size_t len)
+{
+	xSemaphoreTake(g_history_lock, portMAX_DELAY);
+	for (size_t i = 0; i < len; i++)
+	{
+		g_history[(g_history_total + i) % DLOG_HISTORY_SIZE] = data[i];
+	}
+	g_history_total += len;
+	xSemaphoreGive(g_history_lock);
+}
+
+/**
+ * dlog task, formats the records of both cores in time order.
+ * @param pvParameters parameter which can be passed to the task.
+ */
+static void dlog_task(void *pvParameters)
+{
+	char line[192];
+	uint32_t reported_drops = 0;
+
+	for (;;)
+	{
+		for (;;)
+		{
+			lf_mpsc_t *oldest_ring = NULL;
+			dlog_record_t *oldest = NULL;
+
+			for (int core = 0; core < portNUM_PROCESSORS; core++)
+			{
+				dlog_record_t *record = lf_mpsc_peek(&g_rings[core]);
+				if (record != NULL && (oldest == NULL || (int32_t)(record->time - oldest->time) < 0))
+				{
+					oldest = record;
+					oldest_ring = &g_rings[core];
+				}
+			}
+			if (oldest == NULL)
+			{
+				break;
+			}
+
+			size_t len = dlog_format(oldest, line, sizeof(line) - 1);
+			lf_mpsc_release(oldest_ring);
+
+			line[len++] = '\n';
+			fwrite(line, 1, len, stdout);
+			dlog_history_append(line, len);
+		}
+
+		uint32_t dropped = dlog_get_dropped();
+		if (dropped != reported_drops)
+		{
+			int len = snprintf(line, sizeof(line), "W dlog: %lu records dropped, ring full\n", (unsigned long)(dropped - reported_drops));
+			fwrite(line, 1, len, stdout);
+			dlog_history_append(line, len);
+			reported_drops = dropped;
+		}
+
+		fflush(stdout);
+		vTaskDelay(pdMS_TO_TICKS(DLOG_DRAIN_PERIOD_MS));
+	}
+}
+
+void dlog_start(void)
+{
+	if (g_started)
+	{
+		return;
+	}
+
+	for (int core = 0; core < portNUM_PROCESSORS; core++)
+	{
+		lf_mpsc_init(&g_rings[core], g_ring_storage[core], sizeof(dlog_record_t), DLOG_RING_SLOTS);
+	}
+
+	g_history_lock = xSemaphoreCreateMutex();
+	xTaskCreatePinnedToCore(&dlog_task, "dlog", DLOG_TASK_STACK_SIZE, NULL, DLOG_TASK_PRIORITY, NULL, DLOG_TASK_CORE_ID);
+
+	__atomic_store_n(&g_started, true, __ATOMIC_RELEASE);
+}
+
+esp_err_t dlog_level_set(const char *tag, esp_log_level_t level)
+{
+	esp_err_t err = ESP_OK;
+
+	portENTER_CRITICAL(&g_level_lock);
+	if (strcmp(tag, "*") == 0)
+	{
+		g_default_level = level;
+	}
+	else
+	{
+		int i;
+		for (i = 0; i < DLOG_MAX_TAG_LEVELS && g_tag_levels[i].tag[0] != '\0'; i++)
+		{
+			if (strcmp(g_tag_levels[i].tag, tag) == 0)
+			{
+				break;
+			}
+		}
+
+		if (i == DLOG_MAX_TAG_LEVELS)
+		{
+			err = ESP_ERR_NO_MEM;
+		}
+		else
+		{
+			strlcpy(g_tag_levels[i].tag, tag, sizeof(g_tag_levels[i].tag));
+			g_tag_levels[i].level = level;
+		}
+	}
+	if (err == ESP_OK)
+	{
+		__atomic_fetch_add(&g_level_gen, 1, __ATOMIC_RELAXED);
+	}
+	portEXIT_CRITICAL(&g_level_lock);
+
+	// Lines from esp_log keep following the same levels
+	if (err == ESP_OK)
+	{
+		esp_log_level_set(tag, level);
+	}
+
+	return err;
+}
+
+uint32_t dlog_history_get_offset(void)
+{
+	return __atomic_load_n(&g_history_total, __ATOMIC_RELAXED);
+}
+
+esp_err_t dlog_history_read(uint32_t offset, uint32_t end, text_writer_fn_t write, void *ctx)
+{
+	char chunk[128];
+	esp_err_t err = ESP_OK;
+
+	while (err == ESP_OK)
+	{
+		size_t len = 0;
+
+		// Copy a chunk under the lock, the write can be a slow socket
+		xSemaphoreTake(g_history_lock, portMAX_DELAY);
+		uint32_t oldest = (g_history_total > DLOG_HISTORY_SIZE) ? g_history_total - DLOG_HISTORY_SIZE : 0;
+		if (offset < oldest || offset > g_history_total)
+		{
+			offset = oldest;
+		}
+		while (offset < end && len < sizeof(chunk))
+		{
+			chunk[len++] = g_history[offset++ % DLOG_HISTORY_SIZE];
+		}
+		xSemaphoreGive(g_history_lock);
+
+		if (len == 0)
+		{
+			break;
+		}
+		err = write(chunk, len, ctx);
+	}
+
+	return err;
+}
+
+uint32_t dlog_get_dropped(void)
+{
+	uint32_t dropped = 0;
+
+	for (int core = 0; core < portNUM_PROCESSORS; core++)
+	{
+		dropped += lf_mpsc_get_dropped(&g_rings[core]);
+	}
+
+	return dropped;
+}
@@ -0,0 +1,129 @@
+/*
+ * dlog.h
+ *
+ *  Deferred logging.
+ *
+ *  A call site records a pointer to its static descriptor (tag, format,
+ *  level) and the raw argument words into a lock-free ring of the current
+ *  core; the dlog task formats the records and writes them to the console
+ *  and to a history buffer served by GET /log. The calling task never
+ *  formats and never waits for the UART.
+ *
+ *  Arguments are copied as words, so %s arguments must point to strings
+ *  that outlive the record: literals, esp_err_to_name(), static buffers.
+ *  Formats the recorder cannot defer (more than DLOG_MAX_ARGS words, '*'
+ *  width or precision) are written synchronously with esp_log_writev.
+ */
+
+#ifndef MAIN_DLOG_H_
+#define MAIN_DLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "text_writer.h"
+
+// Argument words stored per record
+#define DLOG_MAX_ARGS			5
+
+// Records per core, power of two
+#define DLOG_RING_SLOTS			CONFIG_DLOG_RING_SLOTS
+
+// Records a call site may emit per ~1 s window, 0 for no limit
+#define DLOG_RATE_LIMIT			CONFIG_DLOG_RATE_LIMIT
+
+// Size of the formatted history served by GET /log
+#define DLOG_HISTORY_SIZE		CONFIG_DLOG_HISTORY_SIZE
+
+/**
+ * Call site descriptor, one static instance per DLOG* statement
+ */
+typedef struct dlog_site
+{
+	const char *tag;
+	const char *fmt;
+	esp_log_level_t level;
+	int8_t arg_words;				///> words the arguments take, -1 not parsed yet, -2 not deferrable
+	uint16_t arg_kinds;				///> 2 bits per argument, see dlog.c
+	int8_t tag_level;				///> cached level of the tag
+	uint32_t tag_level_gen;			///> dlog_level_set generation tag_level was read at
+	uint32_t window;				///> rate limit window and records emitted in it
+	uint16_t window_count;
+	uint16_t suppressed;			///> records dropped by the rate limit since the last one emitted
+} dlog_site_t;
+
+#define DLOG_SITE_INIT(_level, _tag, _fmt) \
+	{ .tag = (_tag), .fmt = (_fmt), .level = (_level), .arg_words = -1, .tag_level_gen = UINT32_MAX }
+
+/**
+ * Lets the compiler check the format against the arguments, never called.
+ */
+static inline __attribute__((format(printf, 1, 2))) void dlog_check_format(const char *fmt, ...)
+{
+}
+
+/**
+ * Records a log line at the given level.
+ */
+#define DLOG(_level, _tag, _fmt, ...) do { \
+		static dlog_site_t _dlog_site = DLOG_SITE_INIT(_level, _tag, _fmt); \
+		if (0) \
+		{ \
+			dlog_check_format(_fmt, ##__VA_ARGS__); \
+		} \
+		if ((_level) <= CONFIG_LOG_MAXIMUM_LEVEL) \
+		{ \
+			dlog_write(&_dlog_site, ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+#define DLOGE(_tag, _fmt, ...)	DLOG(ESP_LOG_ERROR, _tag, _fmt, ##__VA_ARGS__)
+#define DLOGW(_tag, _fmt, ...)	DLOG(ESP_LOG_WARN, _tag, _fmt, ##__VA_ARGS__)
+#define DLOGI(_tag, _fmt, ...)	DLOG(ESP_LOG_INFO, _tag, _fmt, ##__VA_ARGS__)
+#define DLOGD(_tag, _fmt, ...)	DLOG(ESP_LOG_DEBUG, _tag, _fmt, ##__VA_ARGS__)
+
+/**
+ * Initializes the rings and starts the dlog task. Records made before are
+ * written synchronously.
+ */
+void dlog_start(void);
+
+/**
+ * Records a log line, used through the DLOG* macros.
+ * @param site call site descriptor.
+ */
+void dlog_write(dlog_site_t *site, ...);
+
+/**
+ * Sets the level of a tag at runtime, "*" sets the level of every tag
+ * without one of its own.
+ * @param tag log tag.
+ * @param level records above this level are discarded at the call site.
+ * @return ESP_OK, otherwise ESP_ERR_NO_MEM if too many tags have a level.
+ */
+esp_err_t dlog_level_set(const char *tag, esp_log_level_t level);
+
+/**
+ * Gets the offset the next formatted byte will be written at.
+ */
+uint32_t dlog_history_get_offset(void);
+
+/**
+ * Reads the formatted history between two offsets.
+ * @param offset start, moved forward to the oldest byte still buffered.
+ * @param end offset to stop at, from dlog_history_get_offset.
+ * @param write output function.
+ * @param ctx passed to write.
+ * @return ESP_OK, otherwise the first error returned by write.
+ */
+esp_err_t dlog_history_read(uint32_t offset, uint32_t end, text_writer_fn_t write, void *ctx);
+
+/**
+ * Gets the number of records dropped because a ring was full.
+ */
+uint32_t dlog_get_dropped(void);
+
+#endif /* MAIN_DLOG_H_ */
@@ -0,0 +1,153 @@
+/*
+ * event_bus.c
+ *
+ *  Event bus over statically allocated FreeRTOS queues.
+ *
+ *  A subscriber slot is reserved under a spinlock, its queue is created
+ *  outside it and the slot is published with a release store, so
+ *  publishers walk the table without taking a lock.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "event_bus.h"
+#include "metrics.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "event_bus";
+
+/**
+ * Subscriber slot
+ */
+struct event_bus_subscriber
+{
+	const char *name;
+	uint32_t topics;
+	QueueHandle_t queue;
+	StaticQueue_t queue_buffer;
+	uint32_t dropped;
+	bool ready;						///> set once the queue exists
+};
+
+static event_bus_subscriber_t g_subscribers[EVENT_BUS_MAX_SUBSCRIBERS];
+static int g_subscriber_count;
+
+// Queue storage shared by the subscribers, handed out in order
+static uint8_t g_pool[EVENT_BUS_POOL_EVENTS * sizeof(event_bus_event_t)];
+static size_t g_pool_used;
+
+static portMUX_TYPE g_subscribe_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Bus metrics, indexed by event_bus_topic_e
+#define EVENT_BUS_PUBLISHED_METRIC(_topic) METRICS_COUNTER_INIT("event_bus_published_total", "Events published", "topic=\"" _topic "\"")
+#define EVENT_BUS_DROPPED_METRIC(_topic) METRICS_COUNTER_INIT("event_bus_dropped_total", "Events a subscriber queue had no room for", "topic=\"" _topic "\"")
+static metrics_counter_t g_published[EVENT_BUS_TOPIC_COUNT] = {
+	EVENT_BUS_PUBLISHED_METRIC("wifi_app"),
+	EVENT_BUS_PUBLISHED_METRIC("status"),
+	EVENT_BUS_PUBLISHED_METRIC("sensor"),
+};
+static metrics_counter_t g_dropped[EVENT_BUS_TOPIC_COUNT] = {
+	EVENT_BUS_DROPPED_METRIC("wifi_app"),
+	EVENT_BUS_DROPPED_METRIC("status"),
+	EVENT_BUS_DROPPED_METRIC("sensor"),
+};
+
+void event_bus_start(void)
+{
+	for (int i = 0; i < EVENT_BUS_TOPIC_COUNT; i++)
+	{
+		metrics_register(&g_published[i].base);
+	}
+	for (int i = 0; i < EVENT_BUS_TOPIC_COUNT; i++)
+	{
+		metrics_register(&g_dropped[i].base);
+	}
+}
+
+event_bus_subscriber_t *event_bus_subscribe(const char *name, uint32_t topics, size_t depth)
+{
+	event_bus_subscriber_t *subscriber = NULL;
+	uint8_t *storage = NULL;
+	size_t size = depth * sizeof(event_bus_event_t);
+
+	portENTER_CRITICAL(&g_subscribe_lock);
+	if (g_subscriber_count < EVENT_BUS_MAX_SUBSCRIBERS && depth > 0 && g_pool_used + size <= sizeof(g_pool))
+	{
+		subscriber = &g_subscribers[g_subscriber_count++];
+		storage = &g_pool[g_pool_used];
+		g_pool_used += size;
+	}
+	portEXIT_CRITICAL(&g_subscribe_lock);
+
+	if (subscriber == NULL)
+	{
+		ESP_LOGE(TAG, "event_bus_subscribe: no room for %s (%u events)", name, (unsigned)depth);
+		return NULL;
+	}
+
+	subscriber->name = name;
+	subscriber->topics = topics;
+	subscriber->queue = xQueueCreateStatic(depth, sizeof(event_bus_event_t), storage, &subscriber->queue_buffer);
+	__atomic_store_n(&subscriber->ready, true, __ATOMIC_RELEASE);
+
+	return subscriber;
+}
+
+bool event_bus_publish(event_bus_event_t *event)
+{
+	bool in_isr = xPortInIsrContext();
+	BaseType_t higher_priority_task_woken = pdFALSE;
+	bool delivered = true;
+	int count = __atomic_load_n(&g_subscriber_count, __ATOMIC_RELAXED);
+
+	event->time_ms = (uint32_t)(esp_timer_get_time() / 1000);
+	metrics_counter_inc(&g_published[event->topic]);
+
+	for (int i = 0; i < count; i++)
+	{
+		event_bus_subscriber_t *subscriber = &g_subscribers[i];
+		BaseType_t sent;
+
+		if (!__atomic_load_n(&subscriber->ready, __ATOMIC_ACQUIRE) || (subscriber->topics & EVENT_BUS_TOPIC_BIT(event->topic)) == 0)
+		{
+			continue;
+		}
+
+		if (in_isr)
+		{
+			sent = xQueueSendFromISR(subscriber->queue, event, &higher_priority_task_woken);
+		}
+		else
+		{
+			sent = xQueueSend(subscriber->queue, event, 0);
+		}
+
+		if (sent != pdTRUE)
+		{
+			__atomic_fetch_add(&subscriber->dropped, 1, __ATOMIC_RELAXED);
+			metrics_counter_inc(&g_dropped[event->topic]);
+			delivered = false;
+		}
+	}
+
+	if (in_isr && higher_priority_task_woken)
+	{
+		portYIELD_FROM_ISR();
+	}
+
+	return delivered;
+}
+
+bool event_bus_receive(event_bus_subscriber_t *subscriber, event_bus_event_t *event, TickType_t ticks_to_wait)
+{
+	return xQueueReceive(subscriber->queue, event, ticks_to_wait) == pdTRUE;
+}
+
+uint32_t event_bus_get_dropped(const event_bus_subscriber_t *subscriber)
+{
+	return __atomic_load_n(&subscriber->dropped, __ATOMIC_RELAXED);
+}
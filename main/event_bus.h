@@ -0,0 +1,115 @@
+/*
+ * event_bus.h
+ *
+ *  Publish/subscribe bus carrying the Wi-Fi application commands, the
+ *  status messages of the HTTP monitor and the sensor readings.
+ *
+ *  Each subscriber owns a queue carved out of a static pool and receives
+ *  the topics of its mask. Publishing copies the event into the queue of
+ *  every subscriber of the topic without waiting, from a task or an ISR;
+ *  an event that does not fit is dropped for that subscriber and counted.
+ */
+
+#ifndef MAIN_EVENT_BUS_H_
+#define MAIN_EVENT_BUS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "http_server.h"
+#include "wifi_app.h"
+
+// Subscribers the bus can hold
+#define EVENT_BUS_MAX_SUBSCRIBERS		6
+
+// Events the queues of all subscribers can hold together
+#define EVENT_BUS_POOL_EVENTS			32
+
+/**
+ * Topics
+ */
+typedef enum event_bus_topic
+{
+	EVENT_BUS_TOPIC_WIFI_APP = 0,	///> commands of the WiFi application task
+	EVENT_BUS_TOPIC_STATUS,			///> WiFi, OTA and time status, see http_server_message_e
+	EVENT_BUS_TOPIC_SENSOR,			///> sensor readings
+	EVENT_BUS_TOPIC_COUNT,
+} event_bus_topic_e;
+
+#define EVENT_BUS_TOPIC_BIT(_topic)		(1U << (_topic))
+
+/**
+ * Sensors publishing readings
+ */
+typedef enum event_bus_sensor
+{
+	EVENT_BUS_SENSOR_TEMPERATURE = 0,	///> LM35, degrees Celsius
+	EVENT_BUS_SENSOR_DISTANCE,			///> ultrasonic, centimeters
+} event_bus_sensor_e;
+
+/**
+ * Event, data is selected by topic
+ */
+typedef struct event_bus_event
+{
+	event_bus_topic_e topic;
+	uint32_t time_ms;				///> set by event_bus_publish
+	union
+	{
+		struct
+		{
+			wifi_app_message_e msgID;
+			uint16_t reason;		///> wifi_err_reason_t of WIFI_APP_MSG_STA_DISCONNECTED, 0 otherwise
+			wifi_app_reconnect_e reconnect;	///> connection of WIFI_APP_MSG_STA_RECONNECT
+		} wifi_app;
+		http_server_message_e status;
+		struct
+		{
+			event_bus_sensor_e sensor;
+			float value;
+		} sensor;
+	} data;
+} event_bus_event_t;
+
+typedef struct event_bus_subscriber event_bus_subscriber_t;
+
+/**
+ * Registers the bus metrics.
+ */
+void event_bus_start(void);
+
+/**
+ * Adds a subscriber. Subscribers are never removed.
+ * @param name name used in log messages.
+ * @param topics mask of EVENT_BUS_TOPIC_BIT values.
+ * @param depth events the subscriber queue holds.
+ * @return the subscriber, NULL if the subscriber table or the pool is full.
+ */
+event_bus_subscriber_t *event_bus_subscribe(const char *name, uint32_t topics, size_t depth);
+
+/**
+ * Copies an event to every subscriber of its topic, never blocks.
+ * Can be called from an ISR.
+ * @param event event to publish, time_ms is set.
+ * @return true if every subscriber received the event.
+ */
+bool event_bus_publish(event_bus_event_t *event);
+
+/**
+ * Waits for the next event of a subscriber.
+ * @param subscriber subscriber returned by event_bus_subscribe.
+ * @param event receives the event.
+ * @param ticks_to_wait ticks to wait, portMAX_DELAY to wait forever.
+ * @return true if an event was received.
+ */
+bool event_bus_receive(event_bus_subscriber_t *subscriber, event_bus_event_t *event, TickType_t ticks_to_wait);
+
+/**
+ * Gets the number of events dropped because the queue of a subscriber was full.
+ */
+uint32_t event_bus_get_dropped(const event_bus_subscriber_t *subscriber);
+
+#endif /* MAIN_EVENT_BUS_H_ */
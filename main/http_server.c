@@ -5,19 +5,45 @@
  *      Author: kjagu
  */
 
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
 #include "esp_http_server.h"
+#if CONFIG_HTTP_SERVER_HTTPS
+#include "esp_https_server.h"
+#endif
 #include "esp_log.h"
 #include "esp_ota_ops.h"
 #include "esp_timer.h"
 #include "esp_wifi.h"
 #include "lwip/ip4_addr.h"
+#include "lwip/sockets.h"
 #include "sys/param.h"
 
 #include "sensors_app.h"
+#include "dlog.h"
+#include "event_bus.h"
 #include "http_server.h"
+#include "metrics.h"
+#include "multipart_parser.h"
+#include "ota_app.h"
+#include "ota_pull.h"
+#include "ota_resume.h"
+#include "ota_stream.h"
+#include "rate_limit.h"
+#include "sensor_log.h"
+#include "settings.h"
 #include "sntp_time_sync.h"
 #include "tasks_common.h"
+#include "boot.h"
+#include "telemetry.h"
 #include "wifi_app.h"
+#include "wifi_link.h"
 
 // Tag used for ESP serial console messages
 static const char TAG[] = "http_server";
@@ -37,8 +63,130 @@ static httpd_handle_t http_server_handle = NULL;
 // HTTP server monitor task handle
 static TaskHandle_t task_http_server_monitor = NULL;
 
-// Queue handle used to manipulate the main queue of events
-static QueueHandle_t http_server_monitor_queue_handle;
+// Event bus subscription of the HTTP server monitor
+static event_bus_subscriber_t *http_server_monitor_subscriber;
+
+/**
+ * Registered URI handler with its request metrics
+ */
+typedef struct http_server_route
+{
+	char uri[32];
+	httpd_method_t method;
+	esp_err_t (*handler)(httpd_req_t *req);
+	void *user_ctx;
+	rate_limit_class_e rate_class;
+	bool async;						///> runs on a worker task instead of the httpd task
+	char labels[48];
+	metrics_counter_t requests;
+	metrics_counter_t errors;
+	metrics_histogram_t latency;
+} http_server_route_t;
+
+// Instrumented routes, one per registered URI handler
+static http_server_route_t http_server_routes[HTTP_SERVER_MAX_URI_HANDLERS];
+static int http_server_route_count = 0;
+
+/**
+ * Per connection state, the httpd session context of the socket
+ */
+typedef struct http_server_session
+{
+	uint32_t client_ip;				///> network byte order, read once when the connection opens
+	int64_t opened_us;
+	int64_t last_active_us;			///> start of the last request, or the connection being opened
+	uint32_t requests;
+	bool busy;						///> a request of the connection is on the worker pool
+	bool idle_close;				///> closed by http_server_close_idle
+} http_server_session_t;
+
+// Open connections, only changed on the httpd task
+static uint32_t http_server_session_count = 0;
+
+// Runs http_server_close_idle on the httpd task, kept across server restarts
+static esp_timer_handle_t http_server_idle_timer = NULL;
+
+/**
+ * Why a connection was closed, index of http_server_sessions_closed
+ */
+typedef enum http_server_close_reason
+{
+	HTTP_SERVER_CLOSE_CLIENT = 0,
+	HTTP_SERVER_CLOSE_IDLE,
+	HTTP_SERVER_CLOSE_LRU,
+	HTTP_SERVER_CLOSE_COUNT,
+} http_server_close_reason_e;
+
+static metrics_counter_t http_server_sessions_opened = METRICS_COUNTER_INIT("http_sessions_opened_total", "Connections accepted", NULL);
+static metrics_counter_t http_server_sessions_closed[HTTP_SERVER_CLOSE_COUNT] = {
+		// lru: the least recently active connection, closed while every socket was in use, which is the one httpd purges for a new client
+		[HTTP_SERVER_CLOSE_CLIENT] = METRICS_COUNTER_INIT("http_sessions_closed_total", "Connections closed, by the client or on an error, idle, or purged for a new client", "reason=\"client\""),
+		[HTTP_SERVER_CLOSE_IDLE] = METRICS_COUNTER_INIT("http_sessions_closed_total", "Connections closed, by the client or on an error, idle, or purged for a new client", "reason=\"idle\""),
+		[HTTP_SERVER_CLOSE_LRU] = METRICS_COUNTER_INIT("http_sessions_closed_total", "Connections closed, by the client or on an error, idle, or purged for a new client", "reason=\"lru\""),
+};
+static metrics_gauge_t http_server_sessions_open = METRICS_GAUGE_INIT("http_sessions_open", "Open connections", NULL);
+static metrics_counter_t http_server_sessions_reused = METRICS_COUNTER_INIT("http_session_reused_requests_total", "Requests served over a connection that served one before", NULL);
+
+// Connections last from one request to a dashboard left open for an hour
+static const uint32_t http_server_session_bounds_us[] = {
+	100000, 1000000, 5000000, 10000000, 30000000, 60000000, 300000000, 600000000, 1800000000, 3600000000,
+};
+static metrics_histogram_t http_server_session_duration = METRICS_HISTOGRAM_INIT("http_session_duration_seconds", "Time from accepting a connection to closing it", NULL, http_server_session_bounds_us);
+
+/**
+ * Rate limit class of a URI and whether it runs on the worker pool
+ */
+typedef struct http_server_route_policy
+{
+	const char *uri;
+	rate_limit_class_e rate_class;
+	bool async;
+} http_server_route_policy_t;
+
+// URIs not listed here are polled by the page (RATE_LIMIT_CLASS_POLL) and run on the httpd task
+static const http_server_route_policy_t http_server_route_policies[] = {
+		{ "/", RATE_LIMIT_CLASS_STATIC, false },
+		{ "/jquery-3.3.1.min.js", RATE_LIMIT_CLASS_STATIC, false },
+		{ "/app.css", RATE_LIMIT_CLASS_STATIC, false },
+		{ "/app.js", RATE_LIMIT_CLASS_STATIC, false },
+		{ "/favicon.ico", RATE_LIMIT_CLASS_STATIC, false },
+		{ "/OTAupdate", RATE_LIMIT_CLASS_NONE, true },
+		{ "/OTAresume.json", RATE_LIMIT_CLASS_CONTROL, false },
+		{ "/OTApull", RATE_LIMIT_CLASS_CONTROL, false },
+		{ "/wifiConnect.json", RATE_LIMIT_CLASS_CONTROL, false },
+		{ "/wifiConnectStatus", RATE_LIMIT_CLASS_CONTROL, false },
+		{ "/wifiConnectInfo.json", RATE_LIMIT_CLASS_CONTROL, false },
+		{ "/wifiDisconnect.json", RATE_LIMIT_CLASS_CONTROL, false },
+		{ "/logLevel", RATE_LIMIT_CLASS_CONTROL, false },
+		{ "/settings.json", RATE_LIMIT_CLASS_CONTROL, false },
+		{ "/sensorLog.json", RATE_LIMIT_CLASS_POLL, true },
+};
+
+/**
+ * Request handed to the worker pool
+ */
+typedef struct http_server_async_req
+{
+	httpd_req_t *req;				///> copy made by httpd_req_async_handler_begin
+	http_server_route_t *route;
+	int64_t start_us;
+} http_server_async_req_t;
+
+// Worker pool: queue of pending requests and free slots (workers + queue length)
+static QueueHandle_t http_server_async_queue = NULL;
+static SemaphoreHandle_t http_server_async_slots = NULL;
+
+// Worker pool tasks, each one renders into its own buffer
+static TaskHandle_t http_server_workers[HTTP_SERVER_ASYNC_WORKERS];
+
+static metrics_counter_t http_server_async_rejected = METRICS_COUNTER_INIT("http_async_rejected_total", "Requests refused with 503 because the worker pool was busy", NULL);
+
+// Requests refused with 429, per rate limit class
+static metrics_counter_t http_server_rate_limited[RATE_LIMIT_CLASS_COUNT] = {
+		[RATE_LIMIT_CLASS_STATIC] = METRICS_COUNTER_INIT("http_rate_limited_total", "Requests refused with 429", "class=\"static\""),
+		[RATE_LIMIT_CLASS_POLL] = METRICS_COUNTER_INIT("http_rate_limited_total", "Requests refused with 429", "class=\"poll\""),
+		[RATE_LIMIT_CLASS_CONTROL] = METRICS_COUNTER_INIT("http_rate_limited_total", "Requests refused with 429", "class=\"control\""),
+};
 
 /**
  * ESP32 timer configuration passed to esp_timer_create.
@@ -63,83 +211,134 @@ extern const uint8_t app_js_end[]					asm("_binary_app_js_end");
 extern const uint8_t favicon_ico_start[]			asm("_binary_favicon_ico_start");
 extern const uint8_t favicon_ico_end[]				asm("_binary_favicon_ico_end");
 
+#if CONFIG_HTTP_SERVER_HTTPS
+// Embedded server certificate and key (main/certs)
+extern const uint8_t servercert_pem_start[]			asm("_binary_servercert_pem_start");
+extern const uint8_t servercert_pem_end[]			asm("_binary_servercert_pem_end");
+extern const uint8_t prvtkey_pem_start[]			asm("_binary_prvtkey_pem_start");
+extern const uint8_t prvtkey_pem_end[]				asm("_binary_prvtkey_pem_end");
+
+// Start of the handshake in progress, handshakes run one at a time on the httpd task
+static int64_t g_tls_handshake_start_us = 0;
+static int32_t g_tls_session_count = 0;
+
+// TLS metrics, a resumed handshake skips the ECDHE and signature and shows up in the low buckets
+static metrics_counter_t g_tls_handshakes = METRICS_COUNTER_INIT("tls_handshakes_total", "Completed TLS handshakes", NULL);
+static metrics_histogram_t g_tls_handshake_latency = METRICS_HISTOGRAM_INIT("tls_handshake_duration_seconds", "Time from ClientHello to the end of the TLS handshake", NULL, metrics_latency_bounds_us);
+static metrics_gauge_t g_tls_sessions_open = METRICS_GAUGE_INIT("tls_sessions_open", "Open TLS connections", NULL);
+#endif
+
 /**
- * Checks the g_fw_update_status and creates the fw_update_reset timer if g_fw_update_status is true.
+ * Starts the fw_update_reset timer once, after the first successful OTA update.
  */
 static void http_server_fw_update_reset_timer(void)
 {
-	if (g_fw_update_status == OTA_UPDATE_SUCCESSFUL)
-	{
-		ESP_LOGI(TAG, "http_server_fw_update_reset_timer: FW updated successful starting FW update reset timer");
+	static bool started = false;
 
-		// Give the web page a chance to receive an acknowledge back and initialize the timer
-		ESP_ERROR_CHECK(esp_timer_create(&fw_update_reset_args, &fw_update_reset));
-		ESP_ERROR_CHECK(esp_timer_start_once(fw_update_reset, 8000000));
+	if (__atomic_exchange_n(&started, true, __ATOMIC_ACQ_REL))
+	{
+		return;
 	}
-	else
+
+	ESP_LOGI(TAG, "http_server_fw_update_reset_timer: FW updated successful starting FW update reset timer");
+
+	// Give the web page a chance to receive an acknowledge back and initialize the timer
+	ESP_ERROR_CHECK(esp_timer_create(&fw_update_reset_args, &fw_update_reset));
+	ESP_ERROR_CHECK(esp_timer_start_once(fw_update_reset, 8000000));
+}
+
+/**
+ * Applies a status message to the sticky WiFi, OTA and time status words.
+ * Runs in the sender's context, so a message the event bus drops still
+ * updates the status reported to the web page and still starts the reset timer.
+ * @param msgID message ID from the http_server_message_e enum.
+ */
+static void http_server_monitor_apply(http_server_message_e msgID)
+{
+	switch (msgID)
 	{
-		ESP_LOGI(TAG, "http_server_fw_update_reset_timer: FW update unsuccessful");
+		case HTTP_MSG_WIFI_CONNECT_INIT:
+			__atomic_store_n(&g_wifi_connect_status, HTTP_WIFI_STATUS_CONNECTING, __ATOMIC_RELAXED);
+			break;
+
+		case HTTP_MSG_WIFI_CONNECT_SUCCESS:
+			__atomic_store_n(&g_wifi_connect_status, HTTP_WIFI_STATUS_CONNECT_SUCCESS, __ATOMIC_RELAXED);
+			break;
+
+		case HTTP_MSG_WIFI_CONNECT_FAIL:
+			__atomic_store_n(&g_wifi_connect_status, HTTP_WIFI_STATUS_CONNECT_FAILED, __ATOMIC_RELAXED);
+			break;
+
+		case HTTP_MSG_WIFI_USER_DISCONNECT:
+			__atomic_store_n(&g_wifi_connect_status, HTTP_WIFI_STATUS_DISCONNECTED, __ATOMIC_RELAXED);
+			break;
+
+		case HTTP_MSG_OTA_UPDATE_SUCCESSFUL:
+			__atomic_store_n(&g_fw_update_status, OTA_UPDATE_SUCCESSFUL, __ATOMIC_RELAXED);
+			http_server_fw_update_reset_timer();
+			break;
+
+		case HTTP_MSG_OTA_UPDATE_FAILED:
+			__atomic_store_n(&g_fw_update_status, OTA_UPDATE_FAILED, __ATOMIC_RELAXED);
+			break;
+
+		case HTTP_MSG_TIME_SERVICE_INITIALIZED:
+			__atomic_store_n(&g_is_local_time_set, true, __ATOMIC_RELAXED);
+			break;
+
+		default:
+			break;
 	}
 }
 
 /**
- * HTTP server monitor task used to track events of the HTTP server
+ * HTTP server monitor task used to track events of the HTTP server.
+ * The status words are already set by http_server_monitor_send_message,
+ * the events only serve as notifications here.
  * @param pvParameters parameter which can be passed to the task.
  */
 static void http_server_monitor(void *parameter)
 {
-	http_server_queue_message_t msg;
+	event_bus_event_t event;
 
 	for (;;)
 	{
-		if (xQueueReceive(http_server_monitor_queue_handle, &msg, portMAX_DELAY))
+		if (event_bus_receive(http_server_monitor_subscriber, &event, portMAX_DELAY))
 		{
-			switch (msg.msgID)
+			switch (event.data.status)
 			{
 				case HTTP_MSG_WIFI_CONNECT_INIT:
 					ESP_LOGI(TAG, "HTTP_MSG_WIFI_CONNECT_INIT");
-					
-					g_wifi_connect_status = HTTP_WIFI_STATUS_CONNECTING;
 
 					break;
 
 				case HTTP_MSG_WIFI_CONNECT_SUCCESS:
 					ESP_LOGI(TAG, "HTTP_MSG_WIFI_CONNECT_SUCCESS");
 
-					g_wifi_connect_status = HTTP_WIFI_STATUS_CONNECT_SUCCESS;
-
 					break;
 
 				case HTTP_MSG_WIFI_CONNECT_FAIL:
 					ESP_LOGI(TAG, "HTTP_MSG_WIFI_CONNECT_FAIL");
 
-					g_wifi_connect_status = HTTP_WIFI_STATUS_CONNECT_FAILED;
-
 					break;
 
 				case HTTP_MSG_WIFI_USER_DISCONNECT:
 					ESP_LOGI(TAG, "HTTP_MSG_WIFI_USER_DISCONNECT");
 
-					g_wifi_connect_status = HTTP_WIFI_STATUS_DISCONNECTED;
-
 					break;
 
 				case HTTP_MSG_OTA_UPDATE_SUCCESSFUL:
 					ESP_LOGI(TAG, "HTTP_MSG_OTA_UPDATE_SUCCESSFUL");
-					g_fw_update_status = OTA_UPDATE_SUCCESSFUL;
-					http_server_fw_update_reset_timer();
 
 					break;
 
 				case HTTP_MSG_OTA_UPDATE_FAILED:
 					ESP_LOGI(TAG, "HTTP_MSG_OTA_UPDATE_FAILED");
-					g_fw_update_status = OTA_UPDATE_FAILED;
 
 					break;
 
 				case HTTP_MSG_TIME_SERVICE_INITIALIZED:
 					ESP_LOGI(TAG, "HTTP_MSG_TIME_SERVICE_INITIALIZED");
-					g_is_local_time_set = true;
 
 					break;
 
@@ -150,6 +349,43 @@ static void http_server_monitor(void *parameter)
 	}
 }
 
+/**
+ * Sends telemetry fields as JSON, or as CBOR when the client sends "Accept: application/cbor".
+ * An empty JSON response keeps the previous behaviour of an empty body.
+ * @param req HTTP request to respond to.
+ * @param fields fields to send.
+ * @param count number of fields.
+ * @return ESP_OK, otherwise the httpd_resp_send error.
+ */
+static esp_err_t http_server_send_telemetry(httpd_req_t *req, const telemetry_field_t *fields, size_t count)
+{
+	char accept[64];
+	uint8_t buff[HTTP_SERVER_TELEMETRY_BUFFER_SIZE];
+	size_t len;
+
+	httpd_resp_set_hdr(req, "Vary", "Accept");
+
+	if (httpd_req_get_hdr_value_str(req, "Accept", accept, sizeof(accept)) != ESP_ERR_NOT_FOUND
+			&& strstr(accept, TELEMETRY_CBOR_MEDIA_TYPE) != NULL)
+	{
+		len = telemetry_encode_cbor(fields, count, buff, sizeof(buff));
+		httpd_resp_set_type(req, TELEMETRY_CBOR_MEDIA_TYPE);
+	}
+	else
+	{
+		len = (count > 0) ? telemetry_encode_json(fields, count, (char *)buff, sizeof(buff)) : 0;
+		httpd_resp_set_type(req, "application/json");
+	}
+
+	if (len == 0 && count > 0)
+	{
+		ESP_LOGE(TAG, "http_server_send_telemetry: response does not fit in %d bytes", HTTP_SERVER_TELEMETRY_BUFFER_SIZE);
+		return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Response too large");
+	}
+
+	return httpd_resp_send(req, (const char *)buff, len);
+}
+
 /**
  * Jquery get handler is requested when accessing the web page.
  * @param req HTTP request for which the uri needs to be handled.
@@ -157,7 +393,7 @@ static void http_server_monitor(void *parameter)
  */
 static esp_err_t http_server_jquery_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "Jquery requested");
+	DLOGI(TAG, "Jquery requested");
 
 	httpd_resp_set_type(req, "application/javascript");
 	httpd_resp_send(req, (const char *)jquery_3_3_1_min_js_start, jquery_3_3_1_min_js_end - jquery_3_3_1_min_js_start);
@@ -172,7 +408,7 @@ static esp_err_t http_server_jquery_handler(httpd_req_t *req)
  */
 static esp_err_t http_server_index_html_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "index.html requested");
+	DLOGI(TAG, "index.html requested");
 
 	httpd_resp_set_type(req, "text/html");
 	httpd_resp_send(req, (const char *)index_html_start, index_html_end - index_html_start);
@@ -187,7 +423,7 @@ static esp_err_t http_server_index_html_handler(httpd_req_t *req)
  */
 static esp_err_t http_server_app_css_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "app.css requested");
+	DLOGI(TAG, "app.css requested");
 
 	httpd_resp_set_type(req, "text/css");
 	httpd_resp_send(req, (const char *)app_css_start, app_css_end - app_css_start);
@@ -202,7 +438,7 @@ static esp_err_t http_server_app_css_handler(httpd_req_t *req)
  */
 static esp_err_t http_server_app_js_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "app.js requested");
+	DLOGI(TAG, "app.js requested");
 
 	httpd_resp_set_type(req, "application/javascript");
 	httpd_resp_send(req, (const char *)app_js_start, app_js_end - app_js_start);
@@ -217,7 +453,7 @@ static esp_err_t http_server_app_js_handler(httpd_req_t *req)
  */
 static esp_err_t http_server_favicon_ico_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "favicon.ico requested");
+	DLOGI(TAG, "favicon.ico requested");
 
 	httpd_resp_set_type(req, "image/x-icon");
 	httpd_resp_send(req, (const char *)favicon_ico_start, favicon_ico_end - favicon_ico_start);
@@ -226,27 +462,258 @@ static esp_err_t http_server_favicon_ico_handler(httpd_req_t *req)
 }
 
 /**
- * Receives the .bin file fia the web page and handles the firmware update
+ * Multipart parser callback, forwards the uploaded file content to the OTA stream decoder.
+ * @param data file bytes.
+ * @param len number of bytes.
+ * @param ctx unused.
+ * @return ESP_OK, otherwise the OTA pipeline error.
+ */
+static esp_err_t http_server_OTA_write_cb(const uint8_t *data, size_t len, void *ctx)
+{
+	return ota_stream_write(data, len);
+}
+
+/**
+ * Reads the hex encoded image hash sent by the resumable uploader.
+ * @param req HTTP request.
+ * @param image_sha256 32 byte output.
+ * @return true if the X-OTA-Image-SHA256 header holds a valid hash.
+ */
+static bool http_server_get_image_sha256_hdr(httpd_req_t *req, uint8_t *image_sha256)
+{
+	char hex[65];
+
+	if (httpd_req_get_hdr_value_str(req, "X-OTA-Image-SHA256", hex, sizeof(hex)) != ESP_OK || strlen(hex) != 64)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < 32; i++)
+	{
+		unsigned int byte;
+		if (sscanf(&hex[i * 2], "%2x", &byte) != 1)
+		{
+			return false;
+		}
+		image_sha256[i] = (uint8_t)byte;
+	}
+
+	return true;
+}
+
+/**
+ * Sends the resumable upload position back to the web page.
+ * @param req HTTP request.
+ * @param status HTTP status line, NULL for 200 OK.
+ * @param installed the image is already running.
+ * @param next_offset offset the next chunk has to start at.
+ * @param complete the image was flashed completely.
+ */
+static void http_server_send_OTA_resume_json(httpd_req_t *req, const char *status, bool installed, uint32_t next_offset, bool complete)
+{
+	char resumeJSON[100];
+
+	sprintf(resumeJSON, "{\"installed\":%d,\"next_offset\":%" PRIu32 ",\"complete\":%d}", installed ? 1 : 0, next_offset, complete ? 1 : 0);
+
+	if (status != NULL)
+	{
+		httpd_resp_set_status(req, status);
+	}
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_send(req, resumeJSON, strlen(resumeJSON));
+}
+
+/**
+ * OTAresume.json handler tells the web page whether the image is already installed
+ * and from which offset an interrupted upload of it can continue.
+ * Expects the X-OTA-Image-SHA256 and X-OTA-Image-Size headers.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_OTA_resume_json_handler(httpd_req_t *req)
+{
+	uint8_t image_sha256[32];
+	char size_str[16];
+
+	DLOGI(TAG, "/OTAresume.json requested");
+
+	if (!http_server_get_image_sha256_hdr(req, image_sha256)
+			|| httpd_req_get_hdr_value_str(req, "X-OTA-Image-Size", size_str, sizeof(size_str)) != ESP_OK)
+	{
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing image hash or size");
+		return ESP_OK;
+	}
+
+	if (ota_resume_is_installed(image_sha256))
+	{
+		ESP_LOGI(TAG, "http_server_OTA_resume_json_handler: image is already running, skipping update");
+		http_server_send_OTA_resume_json(req, NULL, true, 0, true);
+		return ESP_OK;
+	}
+
+	http_server_send_OTA_resume_json(req, NULL, false, ota_resume_get_next_offset(image_sha256, strtoul(size_str, NULL, 10)), false);
+
+	return ESP_OK;
+}
+
+/**
+ * Receives one "Content-Range: bytes start-end/size" chunk of a resumable upload.
+ * A chunk that does not start at the committed offset gets 416 with the offset to continue from,
+ * a chunk that finds the OTA pipeline busy gets 503 with Retry-After.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @param content_range value of the Content-Range header.
+ * @param ota_buff receive buffer of OTA_RECV_BUFFER_SIZE bytes.
+ * @return ESP_OK, otherwise ESP_FAIL if the connection has to be closed.
+ */
+static esp_err_t http_server_OTA_chunk_handler(httpd_req_t *req, const char *content_range, uint8_t *ota_buff)
+{
+	uint8_t image_sha256[32];
+	unsigned long start, end, image_size;
+	int content_received = 0;
+	int recv_len;
+	bool image_complete = false;
+	esp_err_t err;
+
+	if (sscanf(content_range, "bytes %lu-%lu/%lu", &start, &end, &image_size) != 3
+			|| end < start || end >= image_size
+			|| (int)(end - start + 1) != req->content_len
+			|| !http_server_get_image_sha256_hdr(req, image_sha256))
+	{
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad Content-Range or image hash");
+		return ESP_FAIL;
+	}
+
+	if (start == 0 && ota_resume_is_installed(image_sha256))
+	{
+		ESP_LOGI(TAG, "http_server_OTA_chunk_handler: image is already running, skipping update");
+		http_server_send_OTA_resume_json(req, NULL, true, 0, true);
+		return ESP_FAIL;
+	}
+
+	// The body is not read on an error, so the connection is closed after the reply
+	err = ota_resume_chunk_begin(image_sha256, start, image_size);
+	if (err == ESP_ERR_INVALID_ARG)
+	{
+		http_server_send_OTA_resume_json(req, "416 Range Not Satisfiable", false, ota_resume_get_next_offset(image_sha256, image_size), false);
+		return ESP_FAIL;
+	}
+	if (err == ESP_ERR_INVALID_STATE)
+	{
+		// Nothing wrong with the chunk, the same one can be sent again
+		httpd_resp_set_status(req, "503 Service Unavailable");
+		httpd_resp_set_hdr(req, "Retry-After", HTTP_SERVER_ASYNC_RETRY_AFTER);
+		httpd_resp_set_type(req, "text/plain");
+		httpd_resp_send(req, "OTA pipeline busy", HTTPD_RESP_USE_STRLEN);
+		return ESP_FAIL;
+	}
+	if (err != ESP_OK)
+	{
+		ESP_LOGI(TAG, "http_server_OTA_chunk_handler: Error with OTA begin (%s)", esp_err_to_name(err));
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA begin failed");
+		http_server_monitor_send_message(HTTP_MSG_OTA_UPDATE_FAILED);
+		return ESP_FAIL;
+	}
+
+	while (content_received < req->content_len)
+	{
+		if ((recv_len = httpd_req_recv(req, (char *)ota_buff, MIN(req->content_len - content_received, OTA_RECV_BUFFER_SIZE))) <= 0)
+		{
+			if (recv_len == HTTPD_SOCK_ERR_TIMEOUT)
+			{
+				continue;
+			}
+			// Keep what was committed, the client resumes from there
+			ESP_LOGI(TAG, "http_server_OTA_chunk_handler: connection lost at offset %lu", start + content_received);
+			ota_resume_chunk_abort();
+			return ESP_FAIL;
+		}
+		content_received += recv_len;
+
+		err = ota_resume_chunk_write(ota_buff, recv_len);
+		if (err != ESP_OK)
+		{
+			ESP_LOGI(TAG, "http_server_OTA_chunk_handler: OTA write error %s", esp_err_to_name(err));
+			ota_resume_chunk_abort();
+			httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA write failed");
+			http_server_monitor_send_message(HTTP_MSG_OTA_UPDATE_FAILED);
+			return ESP_FAIL;
+		}
+	}
+
+	err = ota_resume_chunk_end(&image_complete);
+	if (err != ESP_OK)
+	{
+		ESP_LOGI(TAG, "http_server_OTA_chunk_handler: OTA commit error %s", esp_err_to_name(err));
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA commit failed");
+		http_server_monitor_send_message(HTTP_MSG_OTA_UPDATE_FAILED);
+		return ESP_FAIL;
+	}
+
+	http_server_send_OTA_resume_json(req, NULL, false, ota_resume_get_offset(), image_complete);
+
+	if (image_complete)
+	{
+		http_server_monitor_send_message(HTTP_MSG_OTA_UPDATE_SUCCESSFUL);
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Receives the .bin (or .bin.gz / delta patch) file fia the web page and handles the firmware update
  * @param req HTTP request for which the uri needs to be handled.
  * @return ESP_OK, otherwise ESP_FAIL if timeout occurs and the update cannot be started.
  */
-esp_err_t http_server_OTA_update_handler(httpd_req_t *req)
+static esp_err_t http_server_OTA_receive(httpd_req_t *req)
 {
-	esp_ota_handle_t ota_handle;
+	// Static so the receive buffer doesn't live on the task stack, the caller's claim makes uploads exclusive
+	static uint8_t ota_buff[OTA_RECV_BUFFER_SIZE];
 
-	char ota_buff[1024];
+	multipart_parser_t parser;
+	char content_type[128];
+	char content_range[48];
+	bool is_multipart = false;
 	int content_length = req->content_len;
 	int content_received = 0;
 	int recv_len;
-	bool is_req_body_started = false;
 	bool flash_successful = false;
+	esp_err_t err;
+
+	// Chunks of a resumable upload
+	if (httpd_req_get_hdr_value_str(req, "Content-Range", content_range, sizeof(content_range)) == ESP_OK)
+	{
+		return http_server_OTA_chunk_handler(req, content_range, ota_buff);
+	}
+
+	// The web page sends a multipart form, anything else (e.g. curl --data-binary) is the raw image
+	if (httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type)) == ESP_OK
+			&& strstr(content_type, "multipart/form-data") != NULL)
+	{
+		if (multipart_parser_init(&parser, content_type, http_server_OTA_write_cb, NULL) != ESP_OK)
+		{
+			ESP_LOGI(TAG, "http_server_OTA_update_handler: No multipart boundary found");
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing multipart boundary");
+			return ESP_FAIL;
+		}
+		is_multipart = true;
+	}
+
+	// A single-shot upload overwrites whatever an interrupted resumable upload left in the partition
+	ota_resume_reset();
 
-	const esp_partition_t *update_partition = esp_ota_get_next_update_partition(NULL);
+	err = ota_stream_begin(content_length);
+	if (err != ESP_OK)
+	{
+		ESP_LOGE(TAG, "http_server_OTA_update_handler: Error (%s) with OTA begin, cancelling OTA", esp_err_to_name(err));
+		http_server_monitor_send_message(HTTP_MSG_OTA_UPDATE_FAILED);
+		return ESP_FAIL;
+	}
+	ESP_LOGI(TAG, "http_server_OTA_update_handler: OTA file size: %d", content_length);
 
-	do
+	while (content_received < content_length)
 	{
 		// Read the data for the request
-		if ((recv_len = httpd_req_recv(req, ota_buff, MIN(content_length, sizeof(ota_buff)))) < 0)
+		if ((recv_len = httpd_req_recv(req, (char *)ota_buff, MIN(content_length - content_received, sizeof(ota_buff)))) < 0)
 		{
 			// Check if timeout occurred
 			if (recv_len == HTTPD_SOCK_ERR_TIMEOUT)
@@ -255,54 +722,31 @@ esp_err_t http_server_OTA_update_handler(httpd_req_t *req)
 				continue; ///> Retry receiving if timeout occurred
 			}
 			ESP_LOGI(TAG, "http_server_OTA_update_handler: OTA other Error %d", recv_len);
+			ota_stream_abort();
+			http_server_monitor_send_message(HTTP_MSG_OTA_UPDATE_FAILED);
 			return ESP_FAIL;
 		}
-		printf("http_server_OTA_update_handler: OTA RX: %d of %d\r", content_received, content_length);
-
-		// Is this the first data we are receiving
-		// If so, it will have the information in the header that we need.
-		if (!is_req_body_started)
+		if (recv_len == 0)
 		{
-			is_req_body_started = true;
-
-			// Get the location of the .bin file content (remove the web form data)
-			char *body_start_p = strstr(ota_buff, "\r\n\r\n") + 4;
-			int body_part_len = recv_len - (body_start_p - ota_buff);
-
-			printf("http_server_OTA_update_handler: OTA file size: %d\r\n", content_length);
-
-			esp_err_t err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &ota_handle);
-			if (err != ESP_OK)
-			{
-				printf("http_server_OTA_update_handler: Error with OTA begin, cancelling OTA\r\n");
-				return ESP_FAIL;
-			}
-			else
-			{
-				;
-				//printf("http_server_OTA_update_handler: Writing to partition subtype %d at offset 0x%u\r\n", update_partition->subtype, update_partition->address);
-			}
-
-			// Write this first part of the data
-			esp_ota_write(ota_handle, body_start_p, body_part_len);
-			content_received += body_part_len;
+			break;
 		}
-		else
+		content_received += recv_len;
+
+		// Hand the data to the pipeline, flashing happens on the OTA writer task
+		err = is_multipart ? multipart_parser_feed(&parser, ota_buff, recv_len) : ota_stream_write(ota_buff, recv_len);
+		if (err != ESP_OK)
 		{
-			// Write OTA data
-			esp_ota_write(ota_handle, ota_buff, recv_len);
-			content_received += recv_len;
+			ESP_LOGI(TAG, "http_server_OTA_update_handler: OTA write error %s", esp_err_to_name(err));
+			break;
 		}
+	}
 
-	} while (recv_len > 0 && content_received < content_length);
-
-	if (esp_ota_end(ota_handle) == ESP_OK)
+	if (err == ESP_OK && content_received == content_length && (!is_multipart || multipart_parser_is_done(&parser)))
 	{
-		// Lets update the partition
-		if (esp_ota_set_boot_partition(update_partition) == ESP_OK)
+		if (ota_stream_end() == ESP_OK)
 		{
 			const esp_partition_t *boot_partition = esp_ota_get_boot_partition();
-			ESP_LOGI(TAG, "http_server_OTA_update_handler: Next boot partition subtype %d at offset 0x%u", boot_partition->subtype, boot_partition->address);
+			ESP_LOGI(TAG, "http_server_OTA_update_handler: Next boot partition subtype %d at offset 0x%" PRIx32, boot_partition->subtype, boot_partition->address);
 			flash_successful = true;
 		}
 		else
@@ -312,7 +756,8 @@ esp_err_t http_server_OTA_update_handler(httpd_req_t *req)
 	}
 	else
 	{
-		ESP_LOGI(TAG, "http_server_OTA_update_handler: esp_ota_end ERROR!!!");
+		ESP_LOGI(TAG, "http_server_OTA_update_handler: incomplete upload (%d of %d bytes)", content_received, content_length);
+		ota_stream_abort();
 	}
 
 	// We won't update the global variables throughout the file, so send the message about the status
@@ -321,6 +766,29 @@ esp_err_t http_server_OTA_update_handler(httpd_req_t *req)
 	return ESP_OK;
 }
 
+/**
+ * OTA update handler, runs on the worker pool. Claims the update partition
+ * before any resume state or flash is touched: one upload at a time, and
+ * none while a pull is checking or downloading.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return the http_server_OTA_receive result, ESP_FAIL if another upload or a pull is running.
+ */
+esp_err_t http_server_OTA_update_handler(httpd_req_t *req)
+{
+	if (!ota_app_claim(OTA_APP_OWNER_UPLOAD))
+	{
+		httpd_resp_set_status(req, "409 Conflict");
+		httpd_resp_send(req, "OTA update in progress", HTTPD_RESP_USE_STRLEN);
+		return ESP_FAIL;
+	}
+
+	esp_err_t err = http_server_OTA_receive(req);
+
+	ota_app_release(OTA_APP_OWNER_UPLOAD);
+
+	return err;
+}
+
 /**
  * OTA status handler responds with the firmware update status after the OTA update is started
  * and responds with the compile time/date when the page is first requested
@@ -329,14 +797,51 @@ esp_err_t http_server_OTA_update_handler(httpd_req_t *req)
  */
 esp_err_t http_server_OTA_status_handler(httpd_req_t *req)
 {
-	char otaJSON[100];
+	ota_app_stats_t ota_stats;
+	ota_pull_stats_t pull_stats;
+
+	DLOGI(TAG, "OTAstatus requested");
+
+	ota_app_get_stats(&ota_stats);
+	ota_pull_get_stats(&pull_stats);
+
+	const telemetry_field_t fields[] = {
+			TELEMETRY_INT("ota_update_status", __atomic_load_n(&g_fw_update_status, __ATOMIC_RELAXED)),
+			TELEMETRY_STRING("compile_time", __TIME__),
+			TELEMETRY_STRING("compile_date", __DATE__),
+			TELEMETRY_INT("ota_in_progress", ota_stats.in_progress ? 1 : 0),
+			TELEMETRY_INT("ota_bytes_written", ota_stats.bytes_written),
+			TELEMETRY_INT("ota_image_size", ota_stats.image_size),
+			TELEMETRY_INT("ota_elapsed_ms", ota_stats.elapsed_ms),
+			TELEMETRY_INT("ota_throughput_bps", ota_stats.throughput_bps),
+			TELEMETRY_INT("ota_format", ota_stream_get_format()),
+			TELEMETRY_INT("ota_bytes_uploaded", ota_stream_get_bytes_in()),
+			TELEMETRY_INT("ota_pull_state", pull_stats.state),
+			TELEMETRY_INT("ota_pull_bytes", pull_stats.bytes_read),
+			TELEMETRY_INT("ota_pull_size", pull_stats.image_size),
+	};
+
+	return http_server_send_telemetry(req, fields, sizeof(fields) / sizeof(fields[0]));
+}
 
-	ESP_LOGI(TAG, "OTAstatus requested");
+/**
+ * OTApull handler makes the device check the local update server for new firmware.
+ * Progress is reported by /OTAstatus.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_OTA_pull_handler(httpd_req_t *req)
+{
+	DLOGI(TAG, "/OTApull requested");
 
-	sprintf(otaJSON, "{\"ota_update_status\":%d,\"compile_time\":\"%s\",\"compile_date\":\"%s\"}", g_fw_update_status, __TIME__, __DATE__);
+	if (ota_pull_check_now() != ESP_OK)
+	{
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA pull not running");
+		return ESP_OK;
+	}
 
 	httpd_resp_set_type(req, "application/json");
-	httpd_resp_send(req, otaJSON, strlen(otaJSON));
+	httpd_resp_send(req, "{\"ota_pull\":\"started\"}", HTTPD_RESP_USE_STRLEN);
 
 	return ESP_OK;
 }
@@ -374,23 +879,17 @@ static esp_err_t http_server_get_dht_sensor_readings_json_handler(httpd_req_t *r
 }*/
 static esp_err_t http_server_get_dht_sensor_readings_json_handler(httpd_req_t *req)
 {
-    ESP_LOGI(TAG, "/dhtSensor.json requested");
+    DLOGI(TAG, "/dhtSensor.json requested");
 
-    char dhtSensorJSON[200];
+    // No JSON os números continuam como string ("23.4"), o app.js espera assim; no CBOR são float/int nativos
+    const telemetry_field_t fields[] = {
+        TELEMETRY_FLOAT_QUOTED("temp", sensors_get_temp(), 1),
+        TELEMETRY_FLOAT_QUOTED("distance", sensors_get_distance(), 1),
+        TELEMETRY_INT_QUOTED("actuator", sensors_get_actuator_status() ? 1 : 0),
+        TELEMETRY_FLOAT_QUOTED("cooling_power", sensors_get_cooling_power(), 1), // NOVO
+    };
 
-    float temp = sensors_get_temp();
-    float dist = sensors_get_distance();
-    bool atuador = sensors_get_actuator_status();
-    float cooling_power = sensors_get_cooling_power(); // NOVO
-
-    sprintf(dhtSensorJSON,
-        "{\"temp\":\"%.1f\",\"distance\":\"%.1f\",\"actuator\":\"%d\",\"cooling_power\":\"%.1f\"}", 
-        temp, dist, atuador ? 1 : 0, cooling_power);
-
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, dhtSensorJSON, strlen(dhtSensorJSON));
-
-    return ESP_OK;
+    return http_server_send_telemetry(req, fields, sizeof(fields) / sizeof(fields[0]));
 }
 /**
  * wifiConnect.json handler is invoked after the connect button is pressed
@@ -400,7 +899,7 @@ static esp_err_t http_server_get_dht_sensor_readings_json_handler(httpd_req_t *r
  */
 static esp_err_t http_server_wifi_connect_json_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "/wifiConnect.json requested");
+	DLOGI(TAG, "/wifiConnect.json requested");
 
 	size_t len_ssid = 0, len_pass = 0;
 	char *ssid_str = NULL, *pass_str = NULL;
@@ -427,11 +926,21 @@ static esp_err_t http_server_wifi_connect_json_handler(httpd_req_t *req)
 		}
 	}
 
+	// Get the optional priority header, the network is preferred over saved networks of lower priority
+	int priority = -1;
+	char priority_str[8];
+	if (httpd_req_get_hdr_value_str(req, "my-connect-priority", priority_str, sizeof(priority_str)) == ESP_OK)
+	{
+		priority = atoi(priority_str);
+		if (priority < 0 || priority > UINT8_MAX)
+		{
+			priority = -1;
+		}
+	}
+	wifi_app_set_connect_priority(priority);
+
 	// Update the Wifi networks configuration and let the wifi application know
-	wifi_config_t* wifi_config = wifi_app_get_wifi_config();
-	memset(wifi_config, 0x00, sizeof(wifi_config_t));
-	memcpy(wifi_config->sta.ssid, ssid_str, len_ssid);
-	memcpy(wifi_config->sta.password, pass_str, len_pass);
+	wifi_app_set_sta_config(ssid_str, pass_str);
 	wifi_app_send_message(WIFI_APP_MSG_CONNECTING_FROM_HTTP_SERVER);
 
 	free(ssid_str);
@@ -447,16 +956,13 @@ static esp_err_t http_server_wifi_connect_json_handler(httpd_req_t *req)
  */
 static esp_err_t http_server_wifi_connect_status_json_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "/wifiConnectStatus requested");
-
-	char statusJSON[100];
-
-	sprintf(statusJSON, "{\"wifi_connect_status\":%d}", g_wifi_connect_status);
+	DLOGI(TAG, "/wifiConnectStatus requested");
 
-	httpd_resp_set_type(req, "application/json");
-	httpd_resp_send(req, statusJSON, strlen(statusJSON));
+	const telemetry_field_t fields[] = {
+			TELEMETRY_INT("wifi_connect_status", __atomic_load_n(&g_wifi_connect_status, __ATOMIC_RELAXED)),
+	};
 
-	return ESP_OK;
+	return http_server_send_telemetry(req, fields, sizeof(fields) / sizeof(fields[0]));
 }
 
 /**
@@ -466,16 +972,13 @@ static esp_err_t http_server_wifi_connect_status_json_handler(httpd_req_t *req)
  */
 static esp_err_t http_server_get_wifi_connect_info_json_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "/wifiConnectInfo.json requested");
-
-	char ipInfoJSON[200];
-	memset(ipInfoJSON, 0, sizeof(ipInfoJSON));
+	DLOGI(TAG, "/wifiConnectInfo.json requested");
 
 	char ip[IP4ADDR_STRLEN_MAX];
 	char netmask[IP4ADDR_STRLEN_MAX];
 	char gw[IP4ADDR_STRLEN_MAX];
 
-	if (g_wifi_connect_status == HTTP_WIFI_STATUS_CONNECT_SUCCESS)
+	if (__atomic_load_n(&g_wifi_connect_status, __ATOMIC_RELAXED) == HTTP_WIFI_STATUS_CONNECT_SUCCESS)
 	{
 		wifi_ap_record_t wifi_data;
 		ESP_ERROR_CHECK(esp_wifi_sta_get_ap_info(&wifi_data));
@@ -487,13 +990,19 @@ static esp_err_t http_server_get_wifi_connect_info_json_handler(httpd_req_t *req
 		esp_ip4addr_ntoa(&ip_info.netmask, netmask, IP4ADDR_STRLEN_MAX);
 		esp_ip4addr_ntoa(&ip_info.gw, gw, IP4ADDR_STRLEN_MAX);
 
-		sprintf(ipInfoJSON, "{\"ip\":\"%s\",\"netmask\":\"%s\",\"gw\":\"%s\",\"ap\":\"%s\"}", ip, netmask, gw, ssid);
-	}
+		const telemetry_field_t fields[] = {
+				TELEMETRY_STRING("ip", ip),
+				TELEMETRY_STRING("netmask", netmask),
+				TELEMETRY_STRING("gw", gw),
+				TELEMETRY_STRING("ap", ssid),
+				TELEMETRY_INT("timeToIp", wifi_app_get_time_to_ip_ms()),
+				TELEMETRY_INT("rssi", wifi_app_get_rssi()),
+		};
 
-	httpd_resp_set_type(req, "application/json");
-	httpd_resp_send(req, ipInfoJSON, strlen(ipInfoJSON));
+		return http_server_send_telemetry(req, fields, sizeof(fields) / sizeof(fields[0]));
+	}
 
-	return ESP_OK;
+	return http_server_send_telemetry(req, NULL, 0);
 }
 
 /**
@@ -503,7 +1012,7 @@ static esp_err_t http_server_get_wifi_connect_info_json_handler(httpd_req_t *req
  */
 static esp_err_t http_server_wifi_disconnect_json_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "wifiDisconect.json requested");
+	DLOGI(TAG, "wifiDisconect.json requested");
 
 	wifi_app_send_message(WIFI_APP_MSG_USER_REQUESTED_STA_DISCONNECT);
 
@@ -517,19 +1026,18 @@ static esp_err_t http_server_wifi_disconnect_json_handler(httpd_req_t *req)
  */
 static esp_err_t http_server_get_local_time_json_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "/localTime.json requested");
+	DLOGI(TAG, "/localTime.json requested");
 
-	char localTimeJSON[100] = {0};
-
-	if (g_is_local_time_set)
+	if (__atomic_load_n(&g_is_local_time_set, __ATOMIC_RELAXED))
 	{
-		sprintf(localTimeJSON, "{\"time\":\"%s\"}", sntp_time_sync_get_time());
-	}
+		const telemetry_field_t fields[] = {
+				TELEMETRY_STRING("time", sntp_time_sync_get_time()),
+		};
 
-	httpd_resp_set_type(req, "application/json");
-	httpd_resp_send(req, localTimeJSON, strlen(localTimeJSON));
+		return http_server_send_telemetry(req, fields, sizeof(fields) / sizeof(fields[0]));
+	}
 
-	return ESP_OK;
+	return http_server_send_telemetry(req, NULL, 0);
 }
 
 /**
@@ -539,44 +1047,883 @@ static esp_err_t http_server_get_local_time_json_handler(httpd_req_t *req)
  */
 static esp_err_t http_server_get_ap_ssid_json_handler(httpd_req_t *req)
 {
-	ESP_LOGI(TAG, "/apSSID.json requested");
-
-	char ssidJSON[50];
-
-	wifi_config_t *wifi_config = wifi_app_get_wifi_config();
-	esp_wifi_get_config(ESP_IF_WIFI_AP, wifi_config);
-	char *ssid = (char*)wifi_config->ap.ssid;
+	DLOGI(TAG, "/apSSID.json requested");
 
-	sprintf(ssidJSON, "{\"ssid\":\"%s\"}", ssid);
+	// Copy out of the snapshot, the driver field is not always terminated
+	char ssid[MAX_SSID_LENGTH + 1] = {0};
+	const wifi_ap_config_t *ap_config = wifi_app_ap_config_acquire();
+	memcpy(ssid, ap_config->ssid, MAX_SSID_LENGTH);
+	wifi_app_ap_config_release(ap_config);
 
-	httpd_resp_set_type(req, "application/json");
-	httpd_resp_send(req, ssidJSON, strlen(ssidJSON));
+	const telemetry_field_t fields[] = {
+			TELEMETRY_STRING("ssid", ssid),
+	};
 
-	return ESP_OK;
+	return http_server_send_telemetry(req, fields, sizeof(fields) / sizeof(fields[0]));
 }
 
 /**
- * Sets up the default httpd server configuration.
- * @return http server instance handle if successful, NULL otherwise.
+ * Gets the IPv4 address of the client of a connection.
+ * @param sockfd socket of the connection.
+ * @return address in network byte order, 0 if it could not be read.
  */
-static httpd_handle_t http_server_configure(void)
+static uint32_t http_server_get_client_ip(int sockfd)
 {
-	// Generate the default configuration
-	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
 
-	http_server_monitor_queue_handle = xQueueCreate(3, sizeof(http_server_queue_message_t));
-    
-    if (http_server_monitor_queue_handle == NULL) {
-        ESP_LOGE(TAG, "Falha critica: Nao foi possivel criar a fila");
-        return NULL; 
-    }
+	if (getpeername(sockfd, (struct sockaddr *)&addr, &addr_len) != 0)
+	{
+		return 0;
+	}
 
-	// Create HTTP server monitor task
-	xTaskCreatePinnedToCore(&http_server_monitor, "http_server_monitor", HTTP_SERVER_MONITOR_STACK_SIZE, NULL, HTTP_SERVER_MONITOR_PRIORITY, &task_http_server_monitor, HTTP_SERVER_MONITOR_CORE_ID);
+	if (addr.ss_family == AF_INET6)
+	{
+		// With IPv6 enabled the server socket reports IPv4 clients as ::ffff:a.b.c.d
+		const uint8_t *ip6 = ((struct sockaddr_in6 *)&addr)->sin6_addr.s6_addr;
+		uint32_t ip;
+		memcpy(&ip, &ip6[12], sizeof(ip));
+		return ip;
+	}
 
+	return ((struct sockaddr_in *)&addr)->sin_addr.s_addr;
+}
 
-	// The core that the HTTP server will run on
-	config.core_id = HTTP_SERVER_TASK_CORE_ID;
+/**
+ * Admission control, refuses the request with 429 when the client is over
+ * the rate of the route class.
+ * @param req HTTP request.
+ * @param route route of the request.
+ * @return true if the handler may run, false if the request was answered.
+ */
+static bool http_server_admit(httpd_req_t *req, http_server_route_t *route)
+{
+	http_server_session_t *session = (http_server_session_t *)req->sess_ctx;
+	uint32_t retry_after_s;
+	char retry_after[12];
+
+	// Per client, not per connection: opening another connection must not refill the buckets
+	uint32_t client_ip = (session != NULL) ? session->client_ip : http_server_get_client_ip(httpd_req_to_sockfd(req));
+
+	if (rate_limit_admit(client_ip, route->rate_class, &retry_after_s))
+	{
+		return true;
+	}
+
+	metrics_counter_inc(&http_server_rate_limited[route->rate_class]);
+	DLOGW(TAG, "http_server_admit: %s rate limited (%s class), retry after %" PRIu32 " s", route->uri, rate_limit_class_name(route->rate_class), retry_after_s);
+
+	snprintf(retry_after, sizeof(retry_after), "%" PRIu32, retry_after_s);
+	httpd_resp_set_status(req, "429 Too Many Requests");
+	httpd_resp_set_hdr(req, "Retry-After", retry_after);
+	httpd_resp_set_type(req, "text/plain");
+	httpd_resp_send(req, "Too many requests", HTTPD_RESP_USE_STRLEN);
+
+	return false;
+}
+
+/**
+ * Calls the real handler of a route and records its metrics.
+ * @param req HTTP request.
+ * @param route route of the request.
+ * @param start_us time the request was received, queueing included.
+ * @return the handler result.
+ */
+static esp_err_t http_server_run_route(httpd_req_t *req, http_server_route_t *route, int64_t start_us)
+{
+	req->user_ctx = route->user_ctx;
+	esp_err_t err = route->handler(req);
+	boot_mark(BOOT_MILESTONE_FIRST_HTTP_RESPONSE);
+
+	metrics_histogram_observe(&route->latency, (uint32_t)(esp_timer_get_time() - start_us));
+	metrics_counter_inc(&route->requests);
+	if (err != ESP_OK)
+	{
+		metrics_counter_inc(&route->errors);
+	}
+
+	return err;
+}
+
+/**
+ * Worker pool task, runs the queued requests of the async routes.
+ * @param pvParameters parameter which can be passed to the task.
+ */
+static void http_server_worker(void *pvParameters)
+{
+	http_server_async_req_t async_req;
+
+	for (;;)
+	{
+		if (xQueueReceive(http_server_async_queue, &async_req, portMAX_DELAY) == pdTRUE)
+		{
+			http_server_session_t *session = (http_server_session_t *)async_req.req->sess_ctx;
+
+			if (http_server_run_route(async_req.req, async_req.route, async_req.start_us) != ESP_OK)
+			{
+				// Same as a failing handler on the httpd task
+				httpd_sess_trigger_close(async_req.req->handle, httpd_req_to_sockfd(async_req.req));
+			}
+
+			// The session lives until the request is completed
+			if (session != NULL)
+			{
+				session->last_active_us = esp_timer_get_time();
+				session->busy = false;
+			}
+			httpd_req_async_handler_complete(async_req.req);
+			xSemaphoreGive(http_server_async_slots);
+		}
+	}
+}
+
+/**
+ * Hands a request to the worker pool, or refuses it with 503 when every
+ * worker is busy and the queue is full.
+ * @param req HTTP request.
+ * @param route route of the request.
+ * @param start_us time the request was received.
+ * @return ESP_OK, otherwise ESP_FAIL if the request could not be copied.
+ */
+static esp_err_t http_server_queue_async(httpd_req_t *req, http_server_route_t *route, int64_t start_us)
+{
+	http_server_async_req_t async_req = { .route = route, .start_us = start_us };
+
+	if (xSemaphoreTake(http_server_async_slots, 0) != pdTRUE)
+	{
+		metrics_counter_inc(&http_server_async_rejected);
+		DLOGW(TAG, "http_server_queue_async: worker pool busy, refusing %s", route->uri);
+
+		httpd_resp_set_status(req, "503 Service Unavailable");
+		httpd_resp_set_hdr(req, "Retry-After", HTTP_SERVER_ASYNC_RETRY_AFTER);
+		httpd_resp_set_type(req, "text/plain");
+		httpd_resp_send(req, "Server busy", HTTPD_RESP_USE_STRLEN);
+		return ESP_OK;
+	}
+
+	if (httpd_req_async_handler_begin(req, &async_req.req) != ESP_OK)
+	{
+		xSemaphoreGive(http_server_async_slots);
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+		return ESP_FAIL;
+	}
+
+	// An upload can outlast the idle timeout, the connection is not idle until the worker is done
+	if (req->sess_ctx != NULL)
+	{
+		((http_server_session_t *)req->sess_ctx)->busy = true;
+	}
+
+	// A slot was taken, so the queue has room
+	xQueueSend(http_server_async_queue, &async_req, 0);
+
+	return ESP_OK;
+}
+
+/**
+ * Instrumented entry point of every URI handler: applies the rate limit,
+ * counts the request and records the handler latency, then calls the real
+ * handler, or queues it for the worker pool.
+ * @param req HTTP request, user_ctx points to the http_server_route_t.
+ * @return the handler result.
+ */
+static esp_err_t http_server_instrumented_handler(httpd_req_t *req)
+{
+	http_server_route_t *route = (http_server_route_t *)req->user_ctx;
+	http_server_session_t *session = (http_server_session_t *)req->sess_ctx;
+	int64_t start_us = esp_timer_get_time();
+
+	if (session != NULL)
+	{
+		if (session->requests++ > 0)
+		{
+			metrics_counter_inc(&http_server_sessions_reused);
+		}
+		session->last_active_us = start_us;
+	}
+
+	if (!http_server_admit(req, route))
+	{
+		return ESP_OK;
+	}
+
+	if (route->async)
+	{
+		return http_server_queue_async(req, route, start_us);
+	}
+
+	return http_server_run_route(req, route, start_us);
+}
+
+/**
+ * Creates the worker pool, kept across server restarts.
+ * @return ESP_OK, otherwise ESP_ERR_NO_MEM.
+ */
+static esp_err_t http_server_start_workers(void)
+{
+	char name[16];
+
+	if (http_server_async_queue != NULL)
+	{
+		return ESP_OK;
+	}
+
+	http_server_async_queue = xQueueCreate(HTTP_SERVER_ASYNC_QUEUE_LENGTH, sizeof(http_server_async_req_t));
+	http_server_async_slots = xSemaphoreCreateCounting(HTTP_SERVER_ASYNC_WORKERS + HTTP_SERVER_ASYNC_QUEUE_LENGTH,
+			HTTP_SERVER_ASYNC_WORKERS + HTTP_SERVER_ASYNC_QUEUE_LENGTH);
+	if (http_server_async_queue == NULL || http_server_async_slots == NULL)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+
+	for (int i = 0; i < HTTP_SERVER_ASYNC_WORKERS; i++)
+	{
+		snprintf(name, sizeof(name), "http_worker_%d", i);
+		xTaskCreatePinnedToCore(&http_server_worker, name, HTTP_SERVER_WORKER_STACK_SIZE, NULL, HTTP_SERVER_WORKER_PRIORITY, &http_server_workers[i], HTTP_SERVER_WORKER_CORE_ID);
+	}
+
+	metrics_register(&http_server_async_rejected.base);
+
+	return ESP_OK;
+}
+
+/**
+ * Registers a URI handler through http_server_instrumented_handler.
+ * @param uri_handler handler description, as for httpd_register_uri_handler.
+ * @return the httpd_register_uri_handler result.
+ */
+static esp_err_t http_server_register_uri_handler(const httpd_uri_t *uri_handler)
+{
+	http_server_route_t *route = NULL;
+
+	// The server can be restarted, the metrics of a route are kept
+	for (int i = 0; i < http_server_route_count; i++)
+	{
+		if (http_server_routes[i].method == uri_handler->method && strcmp(http_server_routes[i].uri, uri_handler->uri) == 0)
+		{
+			route = &http_server_routes[i];
+			break;
+		}
+	}
+
+	if (route == NULL)
+	{
+		if (http_server_route_count == HTTP_SERVER_MAX_URI_HANDLERS)
+		{
+			return ESP_ERR_NO_MEM;
+		}
+		route = &http_server_routes[http_server_route_count++];
+
+		strlcpy(route->uri, uri_handler->uri, sizeof(route->uri));
+		route->method = uri_handler->method;
+		route->rate_class = RATE_LIMIT_CLASS_POLL;
+		route->async = false;
+		for (int i = 0; i < sizeof(http_server_route_policies) / sizeof(http_server_route_policies[0]); i++)
+		{
+			if (strcmp(http_server_route_policies[i].uri, route->uri) == 0)
+			{
+				route->rate_class = http_server_route_policies[i].rate_class;
+				route->async = http_server_route_policies[i].async;
+				break;
+			}
+		}
+		snprintf(route->labels, sizeof(route->labels), "handler=\"%s\",method=\"%s\"", route->uri, http_method_str(route->method));
+
+		route->requests = (metrics_counter_t)METRICS_COUNTER_INIT("http_requests_total", "Requests handled", route->labels);
+		route->errors = (metrics_counter_t)METRICS_COUNTER_INIT("http_request_errors_total", "Requests whose handler failed", route->labels);
+		route->latency = (metrics_histogram_t)METRICS_HISTOGRAM_INIT("http_request_duration_seconds", "Handler latency", route->labels, metrics_latency_bounds_us);
+	}
+	route->handler = uri_handler->handler;
+	route->user_ctx = uri_handler->user_ctx;
+
+	httpd_uri_t instrumented = *uri_handler;
+	instrumented.handler = http_server_instrumented_handler;
+	instrumented.user_ctx = route;
+
+	return httpd_register_uri_handler(http_server_handle, &instrumented);
+}
+
+/**
+ * Registers the route metrics, grouped by name as the Prometheus format expects.
+ */
+static void http_server_register_route_metrics(void)
+{
+	for (int i = 0; i < http_server_route_count; i++)
+	{
+		metrics_register(&http_server_routes[i].requests.base);
+	}
+	for (int i = 0; i < http_server_route_count; i++)
+	{
+		metrics_register(&http_server_routes[i].errors.base);
+	}
+	for (int i = 0; i < http_server_route_count; i++)
+	{
+		metrics_register(&http_server_routes[i].latency.base);
+	}
+	for (int i = 0; i < RATE_LIMIT_CLASS_COUNT; i++)
+	{
+		metrics_register(&http_server_rate_limited[i].base);
+	}
+}
+
+/**
+ * Output state of http_server_send_rendered
+ */
+typedef struct http_server_render_ctx
+{
+	httpd_req_t *req;
+	const void *arg;				///> renderer argument
+	char buff[HTTP_SERVER_RENDER_CHUNK_SIZE];
+	size_t len;
+} http_server_render_ctx_t;
+
+// Output state of the httpd task (first) and of each worker, static so the buffers don't live on the task stacks
+static http_server_render_ctx_t http_server_render_ctxs[1 + HTTP_SERVER_ASYNC_WORKERS];
+
+/**
+ * Renderer streamed by http_server_send_rendered.
+ * @param write writer to hand the output to.
+ * @param ctx passed to write, a http_server_render_ctx_t holding the renderer argument.
+ * @return ESP_OK, otherwise the first error returned by write.
+ */
+typedef esp_err_t (*http_server_render_fn_t)(text_writer_fn_t write, void *ctx);
+
+/**
+ * Renderer writer, collects the pieces and sends them as HTTP chunks.
+ */
+static esp_err_t http_server_render_write(const char *data, size_t len, void *ctx)
+{
+	http_server_render_ctx_t *out = (http_server_render_ctx_t *)ctx;
+
+	if (out->len + len > sizeof(out->buff))
+	{
+		esp_err_t err = httpd_resp_send_chunk(out->req, out->buff, out->len);
+		out->len = 0;
+		if (err != ESP_OK)
+		{
+			return err;
+		}
+	}
+
+	memcpy(&out->buff[out->len], data, len);
+	out->len += len;
+
+	return ESP_OK;
+}
+
+/**
+ * @return output state of the calling task, the httpd task or one of the workers.
+ */
+static http_server_render_ctx_t *http_server_render_ctx_get(void)
+{
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+	for (int i = 0; i < HTTP_SERVER_ASYNC_WORKERS; i++)
+	{
+		if (http_server_workers[i] == task)
+		{
+			return &http_server_render_ctxs[1 + i];
+		}
+	}
+
+	return &http_server_render_ctxs[0];
+}
+
+/**
+ * Streams the output of a renderer as a chunked response.
+ * @param req HTTP request being answered.
+ * @param type content type.
+ * @param render renderer.
+ * @param arg renderer argument, see http_server_render_ctx_t.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_send_rendered(httpd_req_t *req, const char *type, http_server_render_fn_t render, const void *arg)
+{
+	http_server_render_ctx_t *out = http_server_render_ctx_get();
+
+	out->req = req;
+	out->arg = arg;
+	out->len = 0;
+
+	httpd_resp_set_type(req, type);
+
+	if (render(http_server_render_write, out) == ESP_OK && out->len > 0)
+	{
+		httpd_resp_send_chunk(req, out->buff, out->len);
+	}
+	httpd_resp_send_chunk(req, NULL, 0);
+
+	return ESP_OK;
+}
+
+/**
+ * metrics handler responds with every registered metric in Prometheus text format.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_metrics_handler(httpd_req_t *req)
+{
+	return http_server_send_rendered(req, "text/plain; version=0.0.4", metrics_render, NULL);
+}
+
+/**
+ * boot.json handler responds with the boot timeline, see boot_render_json.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_boot_json_handler(httpd_req_t *req)
+{
+	return http_server_send_rendered(req, "application/json", boot_render_json, NULL);
+}
+
+/**
+ * wifiScan.json handler responds at once with the cached scan results, and asks for
+ * a background scan when they are stale, see wifi_app_scan_request.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_wifi_scan_json_handler(httpd_req_t *req)
+{
+	DLOGI(TAG, "/wifiScan.json requested");
+
+	wifi_app_scan_request();
+
+	return http_server_send_rendered(req, "application/json", wifi_app_scan_render_json, NULL);
+}
+
+/**
+ * wifiLink.json handler responds with the link quality history, see wifi_link_render_json.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_wifi_link_json_handler(httpd_req_t *req)
+{
+	DLOGI(TAG, "/wifiLink.json requested");
+
+	return http_server_send_rendered(req, "application/json", wifi_link_render_json, NULL);
+}
+
+/**
+ * dlog_history_read writer, sends each piece as an HTTP chunk.
+ */
+static esp_err_t http_server_log_write(const char *data, size_t len, void *ctx)
+{
+	return httpd_resp_send_chunk((httpd_req_t *)ctx, data, len);
+}
+
+/**
+ * log handler responds with the formatted log history. "?since=N" with the
+ * X-Log-Offset of the previous response returns only the new lines.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_log_handler(httpd_req_t *req)
+{
+	char query[32];
+	char since[12];
+	char offset_hdr[12];
+	uint32_t offset = 0;
+	uint32_t end = dlog_history_get_offset();
+
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK
+			&& httpd_query_key_value(query, "since", since, sizeof(since)) == ESP_OK)
+	{
+		offset = strtoul(since, NULL, 10);
+	}
+
+	snprintf(offset_hdr, sizeof(offset_hdr), "%" PRIu32, end);
+	httpd_resp_set_hdr(req, "X-Log-Offset", offset_hdr);
+	httpd_resp_set_type(req, "text/plain");
+
+	if (dlog_history_read(offset, end, http_server_log_write, req) == ESP_OK)
+	{
+		httpd_resp_send_chunk(req, NULL, 0);
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Range of /sensorLog.json
+ */
+typedef struct http_server_sensor_log_query
+{
+	uint32_t seq;
+	size_t limit;
+} http_server_sensor_log_query_t;
+
+/**
+ * sensor_log_render_json with the range of the request.
+ */
+static esp_err_t http_server_sensor_log_render(text_writer_fn_t write, void *ctx)
+{
+	const http_server_sensor_log_query_t *query = ((http_server_render_ctx_t *)ctx)->arg;
+
+	return sensor_log_render_json(query->seq, query->limit, write, ctx);
+}
+
+/**
+ * sensorLog.json handler streams the readings saved in flash, oldest first.
+ * "?seq=N" with the next of the previous response continues from there,
+ * "&limit=N" caps the records (SENSOR_LOG_READ_LIMIT at most).
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_sensor_log_json_handler(httpd_req_t *req)
+{
+	http_server_sensor_log_query_t range = { .seq = 0, .limit = SENSOR_LOG_READ_LIMIT };
+	char query[48];
+	char value[12];
+
+	DLOGI(TAG, "/sensorLog.json requested");
+
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+	{
+		if (httpd_query_key_value(query, "seq", value, sizeof(value)) == ESP_OK)
+		{
+			range.seq = strtoul(value, NULL, 10);
+		}
+		if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK && strtoul(value, NULL, 10) > 0)
+		{
+			range.limit = MIN(strtoul(value, NULL, 10), SENSOR_LOG_READ_LIMIT);
+		}
+	}
+
+	return http_server_send_rendered(req, "application/json", http_server_sensor_log_render, &range);
+}
+
+/**
+ * logLevel handler sets the runtime level of a log tag: "?tag=http_server&level=2",
+ * levels as esp_log_level_t (0 none to 5 verbose), tag "*" for the default.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_log_level_handler(httpd_req_t *req)
+{
+	char query[64];
+	char tag[16];
+	char level[4];
+
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK
+			|| httpd_query_key_value(query, "tag", tag, sizeof(tag)) != ESP_OK
+			|| httpd_query_key_value(query, "level", level, sizeof(level)) != ESP_OK
+			|| atoi(level) < ESP_LOG_NONE || atoi(level) > ESP_LOG_VERBOSE)
+	{
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected ?tag=<tag>&level=<0-5>");
+		return ESP_OK;
+	}
+
+	if (dlog_level_set(tag, (esp_log_level_t)atoi(level)) != ESP_OK)
+	{
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Too many tags with a level");
+		return ESP_OK;
+	}
+
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_send(req, "{\"log_level\":\"set\"}", HTTPD_RESP_USE_STRLEN);
+
+	return ESP_OK;
+}
+
+/**
+ * Stages every "name=value" pair of a settings query, then applies them all or none.
+ * @param query query string, split in place.
+ * @return ESP_OK, otherwise the error of the first invalid pair or of settings_apply.
+ */
+static esp_err_t http_server_settings_apply(char *query)
+{
+	settings_change_t change = { .staged = 0 };
+	char *save = NULL;
+	esp_err_t err = ESP_ERR_INVALID_ARG;
+
+	for (char *pair = strtok_r(query, "&", &save); pair != NULL; pair = strtok_r(NULL, "&", &save))
+	{
+		char *value = strchr(pair, '=');
+
+		if (value == NULL)
+		{
+			return ESP_ERR_INVALID_ARG;
+		}
+		*value++ = '\0';
+
+		err = settings_stage_text(&change, pair, value);
+		if (err != ESP_OK)
+		{
+			return err;
+		}
+	}
+
+	return (err == ESP_OK) ? settings_apply(&change) : err;
+}
+
+/**
+ * settings.json handler responds with the settings, their range and default.
+ * POST "?temp_on=41&temp_off=38" changes settings first, all or none: one
+ * invalid name or value, or temp_off/pwm_temp_min not below temp_on/pwm_temp_max
+ * afterwards, answers 400 and changes nothing.
+ * @param req HTTP request for which the uri needs to be handled.
+ * @return ESP_OK
+ */
+static esp_err_t http_server_settings_json_handler(httpd_req_t *req)
+{
+	char query[256];
+
+	DLOGI(TAG, "/settings.json requested");
+
+	if (req->method == HTTP_POST)
+	{
+		if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK
+				|| http_server_settings_apply(query) != ESP_OK)
+		{
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected ?<setting>=<value>&..., names and ranges in GET /settings.json, temp_off < temp_on, pwm_temp_min < pwm_temp_max");
+			return ESP_OK;
+		}
+	}
+
+	return http_server_send_rendered(req, "application/json", settings_render_json, NULL);
+}
+
+#if CONFIG_HTTP_SERVER_HTTPS
+/**
+ * Certificate selection hook, only used to timestamp the ClientHello.
+ * @param ssl TLS context of the handshake.
+ * @return 0 to keep the configured certificate.
+ */
+static int http_server_tls_client_hello_cb(mbedtls_ssl_context *ssl)
+{
+	g_tls_handshake_start_us = esp_timer_get_time();
+
+	return 0;
+}
+
+/**
+ * esp_https_server session callback, records the handshake time.
+ * @param user_cb session state and TLS context.
+ */
+static void http_server_tls_session_cb(esp_https_server_user_cb_arg_t *user_cb)
+{
+	if (user_cb->user_cb_state == HTTPD_SSL_USER_CB_SESS_CREATE)
+	{
+		if (g_tls_handshake_start_us != 0)
+		{
+			metrics_histogram_observe(&g_tls_handshake_latency, (uint32_t)(esp_timer_get_time() - g_tls_handshake_start_us));
+			g_tls_handshake_start_us = 0;
+		}
+		metrics_counter_inc(&g_tls_handshakes);
+		metrics_gauge_set(&g_tls_sessions_open, ++g_tls_session_count);
+	}
+	else if (user_cb->user_cb_state == HTTPD_SSL_USER_CB_SESS_CLOSE)
+	{
+		metrics_gauge_set(&g_tls_sessions_open, --g_tls_session_count);
+	}
+}
+#endif
+
+/**
+ * httpd open_fn, gives the connection its session context.
+ * @param hd server handle.
+ * @param sockfd socket of the new connection.
+ * @return ESP_OK, otherwise httpd closes the connection.
+ */
+static esp_err_t http_server_open_session(httpd_handle_t hd, int sockfd)
+{
+	http_server_session_t *session = calloc(1, sizeof(http_server_session_t));
+
+	if (session == NULL)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+
+	session->client_ip = http_server_get_client_ip(sockfd);
+	session->opened_us = esp_timer_get_time();
+	session->last_active_us = session->opened_us;
+	httpd_sess_set_ctx(hd, sockfd, session, free);
+
+	metrics_counter_inc(&http_server_sessions_opened);
+	metrics_gauge_set(&http_server_sessions_open, ++http_server_session_count);
+
+	return ESP_OK;
+}
+
+/**
+ * Tells whether a closing connection is the one httpd purges for a new client.
+ * httpd purges before it accepts, so open_fn never runs at capacity: the victim
+ * is recognised as the least recently active connection while every socket is in use.
+ * @param hd server handle.
+ * @param session session of the closing connection.
+ * @return true if the connection is the least recently active one at capacity.
+ */
+static bool http_server_is_lru_victim(httpd_handle_t hd, const http_server_session_t *session)
+{
+	int fds[HTTP_SERVER_MAX_OPEN_SOCKETS];
+	size_t count = HTTP_SERVER_MAX_OPEN_SOCKETS;
+
+	if (http_server_session_count < HTTP_SERVER_MAX_OPEN_SOCKETS || httpd_get_client_list(hd, &count, fds) != ESP_OK)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		const http_server_session_t *other = (const http_server_session_t *)httpd_sess_get_ctx(hd, fds[i]);
+
+		if (other != NULL && other != session && other->last_active_us < session->last_active_us)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * httpd close_fn, records why the connection is closed and closes its socket.
+ * The session context is freed by httpd afterwards.
+ * @param hd server handle.
+ * @param sockfd socket of the connection.
+ */
+static void http_server_close_session(httpd_handle_t hd, int sockfd)
+{
+	http_server_session_t *session = (http_server_session_t *)httpd_sess_get_ctx(hd, sockfd);
+
+	// No context if http_server_open_session failed
+	if (session != NULL)
+	{
+		http_server_close_reason_e reason = HTTP_SERVER_CLOSE_CLIENT;
+
+		if (session->idle_close)
+		{
+			reason = HTTP_SERVER_CLOSE_IDLE;
+		}
+		else if (http_server_is_lru_victim(hd, session))
+		{
+			reason = HTTP_SERVER_CLOSE_LRU;
+		}
+
+		metrics_counter_inc(&http_server_sessions_closed[reason]);
+		metrics_histogram_observe(&http_server_session_duration, (uint64_t)(esp_timer_get_time() - session->opened_us));
+		metrics_gauge_set(&http_server_sessions_open, --http_server_session_count);
+	}
+
+	close(sockfd);
+}
+
+/**
+ * Closes the connections without a request for CONFIG_HTTP_SERVER_IDLE_TIMEOUT_S,
+ * so browsers that keep connections alive don't hold sockets other clients need.
+ * Runs on the httpd task (httpd_queue_work), which owns the sessions.
+ * @param arg unused.
+ */
+static void http_server_close_idle(void *arg)
+{
+	int fds[HTTP_SERVER_MAX_OPEN_SOCKETS];
+	size_t count = HTTP_SERVER_MAX_OPEN_SOCKETS;
+	int64_t idle_since_us = esp_timer_get_time() - (int64_t)CONFIG_HTTP_SERVER_IDLE_TIMEOUT_S * 1000000;
+
+	if (http_server_handle == NULL || httpd_get_client_list(http_server_handle, &count, fds) != ESP_OK)
+	{
+		return;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		http_server_session_t *session = (http_server_session_t *)httpd_sess_get_ctx(http_server_handle, fds[i]);
+
+		if (session != NULL && !session->busy && !session->idle_close && session->last_active_us < idle_since_us)
+		{
+			session->idle_close = true;
+			httpd_sess_trigger_close(http_server_handle, fds[i]);
+		}
+	}
+}
+
+/**
+ * Idle timer callback, hands the sweep to the httpd task.
+ */
+static void http_server_idle_timer_cb(void *arg)
+{
+	httpd_handle_t handle = http_server_handle;
+
+	if (handle != NULL)
+	{
+		httpd_queue_work(handle, http_server_close_idle, NULL);
+	}
+}
+
+/**
+ * Starts httpd, over TLS when CONFIG_HTTP_SERVER_HTTPS is set.
+ * @param config plain HTTP configuration.
+ * @return the httpd_start / httpd_ssl_start result.
+ */
+static esp_err_t http_server_start_httpd(httpd_config_t *config)
+{
+#if CONFIG_HTTP_SERVER_HTTPS
+	httpd_ssl_config_t ssl_config = HTTPD_SSL_CONFIG_DEFAULT();
+
+	ssl_config.httpd = *config;
+
+	// Each TLS connection holds ~25 KB of buffers and context: keep few of
+	// them, alive between requests, and drop the least recently used one
+	// rather than refusing a new client
+	ssl_config.httpd.max_open_sockets = CONFIG_HTTP_SERVER_TLS_MAX_CONNECTIONS;
+	ssl_config.httpd.lru_purge_enable = true;
+	ssl_config.httpd.stack_size = MAX(config->stack_size, HTTP_SERVER_TLS_TASK_STACK_SIZE);
+
+	ssl_config.servercert = servercert_pem_start;
+	ssl_config.servercert_len = servercert_pem_end - servercert_pem_start;
+	ssl_config.prvtkey_pem = prvtkey_pem_start;
+	ssl_config.prvtkey_len = prvtkey_pem_end - prvtkey_pem_start;
+
+	// Returning browsers resume with a ticket instead of a full handshake
+	ssl_config.session_tickets = true;
+	ssl_config.user_cb = http_server_tls_session_cb;
+	ssl_config.cert_select_cb = http_server_tls_client_hello_cb;
+
+	metrics_register(&g_tls_handshakes.base);
+	metrics_register(&g_tls_handshake_latency.base);
+	metrics_register(&g_tls_sessions_open.base);
+
+	ESP_LOGI(TAG, "http_server_start_httpd: serving HTTPS on port '%d'", ssl_config.port_secure);
+
+	return httpd_ssl_start(&http_server_handle, &ssl_config);
+#else
+	return httpd_start(&http_server_handle, config);
+#endif
+}
+
+/**
+ * Sets up the default httpd server configuration.
+ * @return http server instance handle if successful, NULL otherwise.
+ */
+static httpd_handle_t http_server_configure(void)
+{
+	// Generate the default configuration
+	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+
+	// The subscription outlives http_server_stop, a restarted monitor keeps reading it
+	if (http_server_monitor_subscriber == NULL)
+	{
+		http_server_monitor_subscriber = event_bus_subscribe("http_server_monitor", EVENT_BUS_TOPIC_BIT(EVENT_BUS_TOPIC_STATUS), HTTP_SERVER_MONITOR_QUEUE_LENGTH);
+	}
+	if (http_server_monitor_subscriber == NULL)
+	{
+		ESP_LOGE(TAG, "http_server_configure: could not subscribe the monitor");
+		return NULL;
+	}
+
+	// Create HTTP server monitor task
+	xTaskCreatePinnedToCore(&http_server_monitor, "http_server_monitor", HTTP_SERVER_MONITOR_STACK_SIZE, NULL, HTTP_SERVER_MONITOR_PRIORITY, &task_http_server_monitor, HTTP_SERVER_MONITOR_CORE_ID);
+
+	// Worker pool for the long running handlers (OTA upload)
+	if (http_server_start_workers() != ESP_OK)
+	{
+		ESP_LOGE(TAG, "http_server_configure: could not create the worker pool");
+		return NULL;
+	}
+
+
+	// The core that the HTTP server will run on
+	config.core_id = HTTP_SERVER_TASK_CORE_ID;
 
 	// Adjust the default priority to 1 less than the wifi application task
 	config.task_priority = HTTP_SERVER_TASK_PRIORITY;
@@ -585,19 +1932,52 @@ static httpd_handle_t http_server_configure(void)
 	config.stack_size = HTTP_SERVER_TASK_STACK_SIZE;
 
 	// Increase uri handlers
-	config.max_uri_handlers = 20;
+	config.max_uri_handlers = HTTP_SERVER_MAX_URI_HANDLERS;
 
 	// Increase the timeout limits
 	config.recv_wait_timeout = 10;
 	config.send_wait_timeout = 10;
 
+	// Five stations with a few keep-alive connections each: purge the least recently used
+	// connection rather than refusing a new client, and probe the idle ones
+	config.max_open_sockets = HTTP_SERVER_MAX_OPEN_SOCKETS;
+	config.lru_purge_enable = true;
+	config.keep_alive_enable = true;
+	config.keep_alive_idle = HTTP_SERVER_KEEP_ALIVE_IDLE_S;
+	config.keep_alive_interval = HTTP_SERVER_KEEP_ALIVE_INTERVAL_S;
+	config.keep_alive_count = HTTP_SERVER_KEEP_ALIVE_COUNT;
+
+	// Per connection session contexts, see http_server_session_t
+	config.open_fn = http_server_open_session;
+	config.close_fn = http_server_close_session;
+
+	metrics_register(&http_server_sessions_opened.base);
+	for (int i = 0; i < HTTP_SERVER_CLOSE_COUNT; i++)
+	{
+		metrics_register(&http_server_sessions_closed[i].base);
+	}
+	metrics_register(&http_server_sessions_open.base);
+	metrics_register(&http_server_sessions_reused.base);
+	metrics_register(&http_server_session_duration.base);
+
+#if CONFIG_HTTP_SERVER_IDLE_TIMEOUT_S > 0
+	if (http_server_idle_timer == NULL)
+	{
+		const esp_timer_create_args_t idle_timer_args = {
+				.callback = &http_server_idle_timer_cb,
+				.name = "http_idle",
+		};
+		ESP_ERROR_CHECK(esp_timer_create(&idle_timer_args, &http_server_idle_timer));
+	}
+#endif
+
 	ESP_LOGI(TAG,
 			"http_server_configure: Starting server on port: '%d' with task priority: '%d'",
 			config.server_port,
 			config.task_priority);
 
 	// Start the httpd server
-	if (httpd_start(&http_server_handle, &config) == ESP_OK)
+	if (http_server_start_httpd(&config) == ESP_OK)
 	{
 		ESP_LOGI(TAG, "http_server_configure: Registering URI handlers");
 
@@ -608,7 +1988,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_jquery_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &jquery_js);
+		http_server_register_uri_handler(&jquery_js);
 
 		// register index.html handler
 		httpd_uri_t index_html = {
@@ -617,7 +1997,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_index_html_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &index_html);
+		http_server_register_uri_handler(&index_html);
 
 		// register app.css handler
 		httpd_uri_t app_css = {
@@ -626,7 +2006,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_app_css_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &app_css);
+		http_server_register_uri_handler(&app_css);
 
 		// register app.js handler
 		httpd_uri_t app_js = {
@@ -635,7 +2015,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_app_js_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &app_js);
+		http_server_register_uri_handler(&app_js);
 
 		// register favicon.ico handler
 		httpd_uri_t favicon_ico = {
@@ -644,7 +2024,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_favicon_ico_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &favicon_ico);
+		http_server_register_uri_handler(&favicon_ico);
 
 		// register OTAupdate handler
 		httpd_uri_t OTA_update = {
@@ -653,7 +2033,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_OTA_update_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &OTA_update);
+		http_server_register_uri_handler(&OTA_update);
 
 		// register OTAstatus handler
 		httpd_uri_t OTA_status = {
@@ -662,7 +2042,25 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_OTA_status_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &OTA_status);
+		http_server_register_uri_handler(&OTA_status);
+
+		// register OTAresume.json handler
+		httpd_uri_t OTA_resume_json = {
+				.uri = "/OTAresume.json",
+				.method = HTTP_POST,
+				.handler = http_server_OTA_resume_json_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&OTA_resume_json);
+
+		// register OTApull handler
+		httpd_uri_t OTA_pull = {
+				.uri = "/OTApull",
+				.method = HTTP_POST,
+				.handler = http_server_OTA_pull_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&OTA_pull);
 
 		// register dhtSensor.json handler
 		httpd_uri_t dht_sensor_json = {
@@ -671,7 +2069,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_get_dht_sensor_readings_json_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &dht_sensor_json);
+		http_server_register_uri_handler(&dht_sensor_json);
 
 		// register wifiConnect.json handler
 		httpd_uri_t wifi_connect_json = {
@@ -680,7 +2078,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_wifi_connect_json_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &wifi_connect_json);
+		http_server_register_uri_handler(&wifi_connect_json);
 
 		// register wifiConnectStatus.json handler
 		httpd_uri_t wifi_connect_status_json = {
@@ -689,7 +2087,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_wifi_connect_status_json_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &wifi_connect_status_json);
+		http_server_register_uri_handler(&wifi_connect_status_json);
 
 		// register wifiConnectInfo.json handler
 		httpd_uri_t wifi_connect_info_json = {
@@ -698,7 +2096,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_get_wifi_connect_info_json_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &wifi_connect_info_json);
+		http_server_register_uri_handler(&wifi_connect_info_json);
 
 		// register wifiDisconnect.json handler
 		httpd_uri_t wifi_disconnect_json = {
@@ -707,7 +2105,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_wifi_disconnect_json_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &wifi_disconnect_json);
+		http_server_register_uri_handler(&wifi_disconnect_json);
 
 		// register localTime.json handler
 		httpd_uri_t local_time_json = {
@@ -716,7 +2114,7 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_get_local_time_json_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &local_time_json);
+		http_server_register_uri_handler(&local_time_json);
 
 		// register apSSID.json handler
 		httpd_uri_t ap_ssid_json = {
@@ -725,7 +2123,94 @@ static httpd_handle_t http_server_configure(void)
 				.handler = http_server_get_ap_ssid_json_handler,
 				.user_ctx = NULL
 		};
-		httpd_register_uri_handler(http_server_handle, &ap_ssid_json);
+		http_server_register_uri_handler(&ap_ssid_json);
+
+		// register metrics handler
+		httpd_uri_t metrics = {
+				.uri = "/metrics",
+				.method = HTTP_GET,
+				.handler = http_server_metrics_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&metrics);
+
+		// register link quality handler
+		httpd_uri_t wifi_link_json = {
+				.uri = "/wifiLink.json",
+				.method = HTTP_GET,
+				.handler = http_server_wifi_link_json_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&wifi_link_json);
+
+		// register scan results handler
+		httpd_uri_t wifi_scan_json = {
+				.uri = "/wifiScan.json",
+				.method = HTTP_GET,
+				.handler = http_server_wifi_scan_json_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&wifi_scan_json);
+
+		// register boot timeline handler
+		httpd_uri_t boot_json = {
+				.uri = "/boot.json",
+				.method = HTTP_GET,
+				.handler = http_server_boot_json_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&boot_json);
+
+		// register log history handler
+		httpd_uri_t log_history = {
+				.uri = "/log",
+				.method = HTTP_GET,
+				.handler = http_server_log_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&log_history);
+
+		// register sensor log export handler
+		httpd_uri_t sensor_log_json = {
+				.uri = "/sensorLog.json",
+				.method = HTTP_GET,
+				.handler = http_server_sensor_log_json_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&sensor_log_json);
+
+		// register log level handler
+		httpd_uri_t log_level = {
+				.uri = "/logLevel",
+				.method = HTTP_POST,
+				.handler = http_server_log_level_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&log_level);
+
+		// register settings handlers, read and change
+		httpd_uri_t settings_json = {
+				.uri = "/settings.json",
+				.method = HTTP_GET,
+				.handler = http_server_settings_json_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&settings_json);
+
+		httpd_uri_t settings_set = {
+				.uri = "/settings.json",
+				.method = HTTP_POST,
+				.handler = http_server_settings_json_handler,
+				.user_ctx = NULL
+		};
+		http_server_register_uri_handler(&settings_set);
+
+		http_server_register_route_metrics();
+
+#if CONFIG_HTTP_SERVER_IDLE_TIMEOUT_S > 0
+		// Sweeping at half the timeout closes a connection within 1.5 timeouts of its last request
+		esp_timer_start_periodic(http_server_idle_timer, (uint64_t)CONFIG_HTTP_SERVER_IDLE_TIMEOUT_S * 500000);
+#endif
 
 		return http_server_handle;
 	}
@@ -743,9 +2228,17 @@ void http_server_start(void)
 
 void http_server_stop(void)
 {
+	if (http_server_idle_timer)
+	{
+		esp_timer_stop(http_server_idle_timer);
+	}
 	if (http_server_handle)
 	{
+#if CONFIG_HTTP_SERVER_HTTPS
+		httpd_ssl_stop(http_server_handle);
+#else
 		httpd_stop(http_server_handle);
+#endif
 		ESP_LOGI(TAG, "http_server_stop: stopping HTTP server");
 		http_server_handle = NULL;
 	}
@@ -759,9 +2252,20 @@ void http_server_stop(void)
 
 BaseType_t http_server_monitor_send_message(http_server_message_e msgID)
 {
-	http_server_queue_message_t msg;
-	msg.msgID = msgID;
-	return xQueueSend(http_server_monitor_queue_handle, &msg, portMAX_DELAY);
+	event_bus_event_t event = {
+		.topic = EVENT_BUS_TOPIC_STATUS,
+		.data.status = msgID,
+	};
+
+	http_server_monitor_apply(msgID);
+
+	if (!event_bus_publish(&event))
+	{
+		DLOGW(TAG, "http_server_monitor_send_message: status message %d dropped, status words updated anyway", (int)msgID);
+		return pdFALSE;
+	}
+
+	return pdTRUE;
 }
 
 void http_server_fw_update_reset_callback(void *arg)
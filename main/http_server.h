@@ -12,6 +12,38 @@
 #define OTA_UPDATE_SUCCESSFUL	1
 #define OTA_UPDATE_FAILED		-1
 
+// Size of the socket receive buffer used by the OTA update handler
+#define OTA_RECV_BUFFER_SIZE	4096
+
+// Number of URI handlers the server can register
+#define HTTP_SERVER_MAX_URI_HANDLERS	28
+
+// Worker pool for long handlers: workers, requests waiting for one, and the Retry-After of a 503 when both are full
+#define HTTP_SERVER_ASYNC_WORKERS		2
+#define HTTP_SERVER_ASYNC_QUEUE_LENGTH	2
+#define HTTP_SERVER_ASYNC_RETRY_AFTER	"5"
+
+// Open connections: browsers keep several alive per page, the least recently used one is closed for a new client
+#if CONFIG_HTTP_SERVER_HTTPS
+#define HTTP_SERVER_MAX_OPEN_SOCKETS	CONFIG_HTTP_SERVER_TLS_MAX_CONNECTIONS
+#else
+#define HTTP_SERVER_MAX_OPEN_SOCKETS	CONFIG_HTTP_SERVER_MAX_OPEN_SOCKETS
+#endif
+
+// TCP keep-alive probes of idle connections, so stations that left the access point free their socket
+#define HTTP_SERVER_KEEP_ALIVE_IDLE_S		5
+#define HTTP_SERVER_KEEP_ALIVE_INTERVAL_S	5
+#define HTTP_SERVER_KEEP_ALIVE_COUNT		3
+
+// Event bus status messages waiting for the HTTP server monitor
+#define HTTP_SERVER_MONITOR_QUEUE_LENGTH	8
+
+// Largest JSON/CBOR response of the telemetry endpoints
+#define HTTP_SERVER_TELEMETRY_BUFFER_SIZE	512
+
+// Size of the buffer rendered output (/metrics, JSON reports) is collected in before it is sent as a chunk
+#define HTTP_SERVER_RENDER_CHUNK_SIZE	1024
+
 /**
  * Connection status for Wifi
  */
@@ -39,18 +71,11 @@ typedef enum http_server_message
 } http_server_message_e;
 
 /**
- * Structure for the message queue
- */
-typedef struct http_server_queue_message
-{
-	http_server_message_e msgID;
-} http_server_queue_message_t;
-
-/**
- * Sends a message to the queue
+ * Updates the sticky WiFi, OTA and time status from a message and
+ * publishes it on the event bus as a notification, never blocks.
+ * A dropped notification does not lose the status.
  * @param msgID message ID from the http_server_message_e enum.
- * @return pdTRUE if an item was successfully sent to the queue, otherwise pdFALSE.
- * @note Expand the parameter list based on your requirements e.g. how you've expanded the http_server_queue_message_t.
+ * @return pdTRUE if every subscriber received the message, otherwise pdFALSE.
  */
 BaseType_t http_server_monitor_send_message(http_server_message_e msgID);
 
@@ -4,45 +4,80 @@
 #include "freertos/task.h"
 
 #include "app_nvs.h" 
+#include "boot.h"
 #include "wifi_app.h"
+#include "wifi_link.h"
 #include "http_server.h" 
+#include "metrics.h"
+#include "dlog.h"
+#include "event_bus.h"
+#include "ota_app.h"
+#include "ota_pull.h"
 #include "sensors_app.h" 
+#include "sensor_log.h"
+#include "settings.h"
 #include "sntp_time_sync.h"
 
 static const char *TAG = "MAIN_APP";
 
-void app_main(void)
+// ====================================================
+// 1. Inicializa NVS (Non-Volatile Storage)
+// ====================================================
+// Isso é obrigatório para o WiFi funcionar e salvar senhas
+static void main_nvs_start(void)
 {
-    // ====================================================
-    // 1. Inicializa NVS (Non-Volatile Storage)
-    // ====================================================
-    // Isso é obrigatório para o WiFi funcionar e salvar senhas
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+}
 
-    // ====================================================
-    // 2. Inicia a Aplicação WiFi
-    // ====================================================
-    ESP_LOGI(TAG, "Iniciando WiFi...");
-    wifi_app_start();
-
-    ESP_LOGI(TAG, "Iniciando SNTP...");
-    sntp_time_sync_task_start();
+// ====================================================
+// 2. Etapas do boot e suas dependências
+// ====================================================
+// Cada etapa começa assim que as etapas de que depende terminam, no core
+// indicado; etapas independentes rodam em paralelo nos dois cores.
+// Os sensores não dependem da rede e começam logo no core 1.
+static const boot_stage_t main_boot_stages[BOOT_STAGE_COUNT] = {
+    // Métricas do sistema (heap, uptime, stack das tasks) para o /metrics
+    [BOOT_STAGE_METRICS]     = { "metrics", metrics_start, 0, 1 },
+    [BOOT_STAGE_NVS]         = { "nvs", main_nvs_start, 0, 0 },
+    // Log diferido (DLOG*): formata e imprime numa task de baixa prioridade
+    [BOOT_STAGE_DLOG]        = { "dlog", dlog_start, 0, 1 },
+    // Event bus: comandos do WiFi, status (WiFi/OTA/hora) e leituras dos sensores
+    [BOOT_STAGE_EVENT_BUS]   = { "event_bus", event_bus_start, 0, 1 },
+    // Parâmetros (limiares, períodos, faixa do PWM) lidos da NVS uma vez e mantidos em RAM
+    [BOOT_STAGE_SETTINGS]    = { "settings", settings_start, BOOT_DEP(BOOT_STAGE_NVS) | BOOT_DEP(BOOT_STAGE_DLOG), 1 },
+    // Log das leituras na partição "sensorlog": acha o fim do log e assina as leituras no event bus
+    [BOOT_STAGE_SENSOR_LOG]  = { "sensor_log", sensor_log_start, BOOT_DEP(BOOT_STAGE_DLOG) | BOOT_DEP(BOOT_STAGE_EVENT_BUS), 1 },
+    // Sensores (LM35 + Ultrassônico + Atuador): GPIOs, ADC e tasks em sensors_app.c
+    // Dependem dos parâmetros para os limiares e a frequência do PWM, e do log para não perder as primeiras leituras
+    [BOOT_STAGE_SENSORS]     = { "sensors", sensors_app_start,
+                                 BOOT_DEP(BOOT_STAGE_DLOG) | BOOT_DEP(BOOT_STAGE_EVENT_BUS) | BOOT_DEP(BOOT_STAGE_SETTINGS)
+                                 | BOOT_DEP(BOOT_STAGE_SENSOR_LOG), 1 },
+    // WiFi: termina (boot_stage_done) quando a task do WiFi inicia a pilha TCP/IP e o rádio
+    [BOOT_STAGE_WIFI]        = { "wifi", wifi_app_start,
+                                 BOOT_DEP(BOOT_STAGE_NVS) | BOOT_DEP(BOOT_STAGE_DLOG) | BOOT_DEP(BOOT_STAGE_EVENT_BUS), 0, true },
+    // Qualidade do link WiFi (RSSI, modo PHY, desconexoes) para o /wifiLink.json
+    [BOOT_STAGE_WIFI_LINK]   = { "wifi_link", wifi_link_start, BOOT_DEP(BOOT_STAGE_WIFI), 0 },
+    [BOOT_STAGE_SNTP]        = { "sntp", sntp_time_sync_task_start, BOOT_DEP(BOOT_STAGE_WIFI), 1 },
+    // O pipeline de OTA precisa existir antes do servidor aceitar uploads
+    [BOOT_STAGE_OTA]         = { "ota", ota_app_start, BOOT_DEP(BOOT_STAGE_NVS), 1 },
+    // Busca de firmware no servidor de atualizacao local (POST /OTApull ou periodico)
+    [BOOT_STAGE_OTA_PULL]    = { "ota_pull", ota_pull_start, BOOT_DEP(BOOT_STAGE_OTA) | BOOT_DEP(BOOT_STAGE_WIFI), 1 },
+    // Web server: único lugar onde é iniciado
+    // O /settings.json lê e grava os parâmetros e o /sensorLog.json lê o log, que precisam estar prontos
+    [BOOT_STAGE_HTTP_SERVER] = { "http_server", http_server_start,
+                                 BOOT_DEP(BOOT_STAGE_WIFI) | BOOT_DEP(BOOT_STAGE_OTA_PULL) | BOOT_DEP(BOOT_STAGE_SETTINGS)
+                                 | BOOT_DEP(BOOT_STAGE_SENSOR_LOG), 0 },
+};
 
-    ESP_LOGI(TAG, "Iniciando Web Server...");
-    http_server_start();
+void app_main(void)
+{
+    ESP_LOGI(TAG, "Iniciando etapas do boot...");
+    boot_run(main_boot_stages);
 
-    // ====================================================
-    // 4. Inicia os Sensores (LM35 + Ultrassônico + Atuador)
-    // ====================================================
-    // Toda a configuração de GPIOs, ADC e Tasks está dentro desta função
-    // no arquivo sensors_app.c
-    ESP_LOGI(TAG, "Iniciando Sensores e Tasks...");
-    sensors_app_start();
-    
     ESP_LOGI(TAG, "Sistema Completo Iniciado.");
-}
\ No newline at end of file
+}
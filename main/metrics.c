@@ -0,0 +1,245 @@
+/*
+ * metrics.c
+ *
+ *  Metrics registry and Prometheus text renderer.
+ *
+ *  The registry is a singly linked list threaded through the statically
+ *  allocated metrics, so registering needs no memory and scraping walks it
+ *  without taking a lock (metrics are only ever appended).
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "metrics.h"
+
+// Registry
+static metrics_metric_t *g_head = NULL;
+static metrics_metric_t *g_tail = NULL;
+static portMUX_TYPE g_registry_lock = portMUX_INITIALIZER_UNLOCKED;
+
+const uint32_t metrics_latency_bounds_us[13] = {
+	500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 10000000
+};
+
+/**
+ * System gauge callbacks
+ */
+static int32_t metrics_read_free_heap(void *arg)
+{
+	return (int32_t)esp_get_free_heap_size();
+}
+
+static int32_t metrics_read_min_free_heap(void *arg)
+{
+	return (int32_t)esp_get_minimum_free_heap_size();
+}
+
+static int32_t metrics_read_largest_free_block(void *arg)
+{
+	return (int32_t)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
+static int32_t metrics_read_uptime(void *arg)
+{
+	return (int32_t)(esp_timer_get_time() / 1000000);
+}
+
+/**
+ * Stack high-water mark of a task looked up by name, -1 if it is not running.
+ */
+static int32_t metrics_read_task_stack(void *arg)
+{
+	TaskHandle_t task = xTaskGetHandle((const char *)arg);
+
+	// On ESP-IDF the high-water mark is in bytes
+	return (task != NULL) ? (int32_t)uxTaskGetStackHighWaterMark(task) : -1;
+}
+
+#define METRICS_TASK_STACK_GAUGE(_task) \
+	METRICS_GAUGE_FN_INIT("task_stack_free_min_bytes", "Smallest amount of stack the task had left", "task=\"" _task "\"", metrics_read_task_stack, _task)
+
+// System metrics
+static metrics_gauge_t g_free_heap = METRICS_GAUGE_FN_INIT("heap_free_bytes", "Free heap", NULL, metrics_read_free_heap, NULL);
+static metrics_gauge_t g_min_free_heap = METRICS_GAUGE_FN_INIT("heap_min_free_bytes", "Lowest free heap since boot", NULL, metrics_read_min_free_heap, NULL);
+static metrics_gauge_t g_largest_free_block = METRICS_GAUGE_FN_INIT("heap_largest_free_block_bytes", "Largest allocatable block", NULL, metrics_read_largest_free_block, NULL);
+static metrics_gauge_t g_uptime = METRICS_GAUGE_FN_INIT("uptime_seconds", "Seconds since boot", NULL, metrics_read_uptime, NULL);
+static metrics_gauge_t g_task_stacks[] = {
+	METRICS_TASK_STACK_GAUGE("wifi_app_task"),
+	METRICS_TASK_STACK_GAUGE("httpd"),
+	METRICS_TASK_STACK_GAUGE("http_server_monitor"),
+	METRICS_TASK_STACK_GAUGE("http_worker_0"),
+	METRICS_TASK_STACK_GAUGE("http_worker_1"),
+	METRICS_TASK_STACK_GAUGE("task_lm35"),
+	METRICS_TASK_STACK_GAUGE("task_ultrasonic"),
+	METRICS_TASK_STACK_GAUGE("task_pwm"),
+	METRICS_TASK_STACK_GAUGE("sntp_time_sync"),
+	METRICS_TASK_STACK_GAUGE("ota_writer"),
+	METRICS_TASK_STACK_GAUGE("ota_pull"),
+	METRICS_TASK_STACK_GAUGE("wifi_reset_button"),
+	METRICS_TASK_STACK_GAUGE("dlog"),
+};
+
+/**
+ * Checks whether HELP/TYPE were already written for the metric name.
+ */
+static bool metrics_name_seen(const metrics_metric_t *metric)
+{
+	for (const metrics_metric_t *m = g_head; m != metric; m = m->next)
+	{
+		if (strcmp(m->name, metric->name) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Renders the series of a histogram, takes its lock to read the 64 bit sum.
+ */
+static esp_err_t metrics_render_histogram(metrics_histogram_t *histogram, const char *labels, text_writer_fn_t write, void *ctx)
+{
+	const char *name = histogram->base.name;
+	const char *sep = (labels[0] != '\0') ? "," : "";
+	const char *open = (labels[0] != '\0') ? "{" : "";
+	const char *close = (labels[0] != '\0') ? "}" : "";
+	uint32_t cumulative = 0;
+	esp_err_t err = ESP_OK;
+
+	for (int i = 0; i <= histogram->bound_count && err == ESP_OK; i++)
+	{
+		cumulative += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+
+		if (i < histogram->bound_count)
+		{
+			uint32_t bound = histogram->bounds[i];
+			err = text_writer_printf(write, ctx, "%s_bucket{%s%sle=\"%" PRIu32 ".%06" PRIu32 "\"} %" PRIu32 "\n",
+					name, labels, sep, bound / 1000000, bound % 1000000, cumulative);
+		}
+		else
+		{
+			err = text_writer_printf(write, ctx, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu32 "\n", name, labels, sep, cumulative);
+		}
+	}
+
+	if (err == ESP_OK)
+	{
+		uint64_t sum_us;
+
+		portENTER_CRITICAL_SAFE(&histogram->lock);
+		sum_us = histogram->sum_us;
+		portEXIT_CRITICAL_SAFE(&histogram->lock);
+		err = text_writer_printf(write, ctx, "%s_sum%s%s%s %" PRIu64 ".%06" PRIu32 "\n", name, open, labels, close, sum_us / 1000000, (uint32_t)(sum_us % 1000000));
+	}
+	if (err == ESP_OK)
+	{
+		err = text_writer_printf(write, ctx, "%s_count%s%s%s %" PRIu32 "\n", name, open, labels, close, cumulative);
+	}
+
+	return err;
+}
+
+void metrics_start(void)
+{
+	metrics_register(&g_free_heap.base);
+	metrics_register(&g_min_free_heap.base);
+	metrics_register(&g_largest_free_block.base);
+	metrics_register(&g_uptime.base);
+	for (int i = 0; i < sizeof(g_task_stacks) / sizeof(g_task_stacks[0]); i++)
+	{
+		metrics_register(&g_task_stacks[i].base);
+	}
+}
+
+void metrics_register(metrics_metric_t *metric)
+{
+	metrics_metric_t *after = NULL;
+
+	portENTER_CRITICAL(&g_registry_lock);
+	if (metric->next == NULL && metric != g_tail)
+	{
+		// Subsystems start in parallel, a metric goes after the last one of its name
+		for (metrics_metric_t *m = g_head; m != NULL; m = m->next)
+		{
+			if (strcmp(m->name, metric->name) == 0)
+			{
+				after = m;
+			}
+		}
+
+		if (after != NULL && after != g_tail)
+		{
+			metric->next = after->next;
+			after->next = metric;
+		}
+		else if (g_tail == NULL)
+		{
+			g_head = metric;
+			g_tail = metric;
+		}
+		else
+		{
+			g_tail->next = metric;
+			g_tail = metric;
+		}
+	}
+	portEXIT_CRITICAL(&g_registry_lock);
+}
+
+esp_err_t metrics_render(text_writer_fn_t write, void *ctx)
+{
+	static const char *type_names[] = { "counter", "gauge", "histogram" };
+	esp_err_t err = ESP_OK;
+
+	for (const metrics_metric_t *m = g_head; m != NULL && err == ESP_OK; m = m->next)
+	{
+		const char *labels = (m->labels != NULL) ? m->labels : "";
+		const char *open = (labels[0] != '\0') ? "{" : "";
+		const char *close = (labels[0] != '\0') ? "}" : "";
+
+		if (!metrics_name_seen(m))
+		{
+			err = text_writer_printf(write, ctx, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, type_names[m->type]);
+			if (err != ESP_OK)
+			{
+				break;
+			}
+		}
+
+		switch (m->type)
+		{
+			case METRICS_TYPE_COUNTER:
+			{
+				const metrics_counter_t *counter = (const metrics_counter_t *)m;
+				err = text_writer_printf(write, ctx, "%s%s%s%s %" PRIu32 "\n", m->name, open, labels, close, __atomic_load_n(&counter->value, __ATOMIC_RELAXED));
+				break;
+			}
+
+			case METRICS_TYPE_GAUGE:
+			{
+				const metrics_gauge_t *gauge = (const metrics_gauge_t *)m;
+				int32_t value = (gauge->read != NULL) ? gauge->read(gauge->arg) : __atomic_load_n(&gauge->value, __ATOMIC_RELAXED);
+				err = text_writer_printf(write, ctx, "%s%s%s%s %" PRId32 "\n", m->name, open, labels, close, value);
+				break;
+			}
+
+			case METRICS_TYPE_HISTOGRAM:
+				err = metrics_render_histogram((metrics_histogram_t *)m, labels, write, ctx);
+				break;
+		}
+	}
+
+	return err;
+}
@@ -0,0 +1,164 @@
+/*
+ * metrics.h
+ *
+ *  Metrics registry exposed in Prometheus text format by /metrics.
+ *
+ *  Metrics are statically allocated by the module that records them and
+ *  registered once at start up. Recording is a relaxed atomic add or store
+ *  on a 32 bit word (no lock, no allocation), so it can be used on hot
+ *  paths. Histograms record microseconds and are exposed in seconds; their
+ *  64 bit sum is not lock-free on Xtensa and takes a per-histogram spinlock.
+ */
+
+#ifndef MAIN_METRICS_H_
+#define MAIN_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#include "text_writer.h"
+
+// Largest number of buckets (without +Inf) of a histogram
+#define METRICS_HISTOGRAM_MAX_BUCKETS	14
+
+/**
+ * Metric types
+ */
+typedef enum metrics_type
+{
+	METRICS_TYPE_COUNTER = 0,
+	METRICS_TYPE_GAUGE,
+	METRICS_TYPE_HISTOGRAM,
+} metrics_type_e;
+
+/**
+ * Common part of every metric, metrics sharing a name differ by labels
+ */
+typedef struct metrics_metric
+{
+	const char *name;
+	const char *help;
+	const char *labels;				///> e.g. "handler=\"/OTAupdate\"", NULL for none
+	metrics_type_e type;
+	struct metrics_metric *next;
+} metrics_metric_t;
+
+/**
+ * Monotonic counter
+ */
+typedef struct metrics_counter
+{
+	metrics_metric_t base;
+	uint32_t value;
+} metrics_counter_t;
+
+// Gauge callback, evaluated when /metrics is scraped
+typedef int32_t (*metrics_gauge_read_fn_t)(void *arg);
+
+/**
+ * Gauge, either set by its owner or read through a callback on scrape
+ */
+typedef struct metrics_gauge
+{
+	metrics_metric_t base;
+	int32_t value;
+	metrics_gauge_read_fn_t read;	///> NULL to report value
+	void *arg;
+} metrics_gauge_t;
+
+/**
+ * Fixed bucket histogram of microsecond values
+ */
+typedef struct metrics_histogram
+{
+	metrics_metric_t base;
+	const uint32_t *bounds;			///> ascending upper bounds in microseconds
+	uint8_t bound_count;
+	uint32_t counts[METRICS_HISTOGRAM_MAX_BUCKETS + 1];	///> per bucket, the last one is +Inf
+	uint64_t sum_us;				///> 64 bit, sessions and outages add up to hours, guarded by lock
+	portMUX_TYPE lock;
+} metrics_histogram_t;
+
+// Static initializers
+#define METRICS_COUNTER_INIT(_name, _help, _labels) \
+	{ .base = { .name = (_name), .help = (_help), .labels = (_labels), .type = METRICS_TYPE_COUNTER } }
+#define METRICS_GAUGE_INIT(_name, _help, _labels) \
+	{ .base = { .name = (_name), .help = (_help), .labels = (_labels), .type = METRICS_TYPE_GAUGE } }
+#define METRICS_GAUGE_FN_INIT(_name, _help, _labels, _read, _arg) \
+	{ .base = { .name = (_name), .help = (_help), .labels = (_labels), .type = METRICS_TYPE_GAUGE }, .read = (_read), .arg = (_arg) }
+#define METRICS_HISTOGRAM_INIT(_name, _help, _labels, _bounds) \
+	{ .base = { .name = (_name), .help = (_help), .labels = (_labels), .type = METRICS_TYPE_HISTOGRAM }, \
+	  .bounds = (_bounds), .bound_count = sizeof(_bounds) / sizeof((_bounds)[0]), .lock = portMUX_INITIALIZER_UNLOCKED }
+
+// Default latency buckets: 0.5 ms to 10 s
+extern const uint32_t metrics_latency_bounds_us[13];
+
+/**
+ * Registers the system metrics (heap, uptime, task stack high-water marks).
+ */
+void metrics_start(void);
+
+/**
+ * Adds a metric to the registry. Registering the same metric twice has no effect.
+ * Metrics sharing a name are kept together whatever the registration order.
+ * @param metric base of a statically allocated counter, gauge or histogram.
+ */
+void metrics_register(metrics_metric_t *metric);
+
+/**
+ * Renders every registered metric in Prometheus text format.
+ * @param write output function, called once per line.
+ * @param ctx passed to write.
+ * @return ESP_OK, otherwise the first error returned by write.
+ */
+esp_err_t metrics_render(text_writer_fn_t write, void *ctx);
+
+/**
+ * Increments a counter.
+ */
+static inline void metrics_counter_inc(metrics_counter_t *counter)
+{
+	__atomic_fetch_add(&counter->value, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds to a counter.
+ */
+static inline void metrics_counter_add(metrics_counter_t *counter, uint32_t n)
+{
+	__atomic_fetch_add(&counter->value, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sets a gauge.
+ */
+static inline void metrics_gauge_set(metrics_gauge_t *gauge, int32_t value)
+{
+	__atomic_store_n(&gauge->value, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records a value in a histogram.
+ * @param histogram histogram.
+ * @param value_us observed value in microseconds.
+ */
+static inline void metrics_histogram_observe(metrics_histogram_t *histogram, uint64_t value_us)
+{
+	uint8_t bucket = 0;
+
+	while (bucket < histogram->bound_count && value_us > histogram->bounds[bucket])
+	{
+		bucket++;
+	}
+
+	__atomic_fetch_add(&histogram->counts[bucket], 1, __ATOMIC_RELAXED);
+
+	portENTER_CRITICAL_SAFE(&histogram->lock);
+	histogram->sum_us += value_us;
+	portEXIT_CRITICAL_SAFE(&histogram->lock);
+}
+
+#endif /* MAIN_METRICS_H_ */
@@ -0,0 +1,186 @@
+/*
+ * multipart_parser.c
+ *
+ *  Streaming parser for multipart/form-data request bodies.
+ *
+ *  Only the first part is delivered (the web page uploads a single file).
+ *  The parser keeps no copy of the data: body bytes are handed to the callback
+ *  in runs, and the few bytes that may belong to a boundary split between two
+ *  chunks are held back only as a match counter.
+ */
+
+#include <string.h>
+
+#include "multipart_parser.h"
+
+// End of the part headers
+static const char multipart_header_end[] = "\r\n\r\n";
+
+esp_err_t multipart_parser_init(multipart_parser_t *parser, const char *content_type, multipart_data_cb_t on_data, void *ctx)
+{
+	memset(parser, 0x00, sizeof(multipart_parser_t));
+
+	const char *boundary = content_type ? strstr(content_type, "boundary=") : NULL;
+	if (boundary == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+	boundary += strlen("boundary=");
+
+	// The boundary may be quoted and may be followed by other parameters
+	bool quoted = (*boundary == '"');
+	if (quoted)
+	{
+		boundary++;
+	}
+	size_t boundary_len = 0;
+	while (boundary[boundary_len] != '\0' && boundary[boundary_len] != (quoted ? '"' : ';')
+			&& boundary[boundary_len] != '\r' && boundary[boundary_len] != '\n')
+	{
+		boundary_len++;
+	}
+	if (boundary_len == 0 || boundary_len > MULTIPART_MAX_BOUNDARY_LENGTH)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	memcpy(parser->delimiter, "\r\n--", 4);
+	memcpy(parser->delimiter + 4, boundary, boundary_len);
+	parser->delimiter_len = boundary_len + 4;
+	parser->delimiter[parser->delimiter_len] = '\0';
+
+	// The first delimiter is usually at the very start of the body, without the leading CRLF
+	parser->match = 2;
+	parser->state = MULTIPART_STATE_PREAMBLE;
+	parser->on_data = on_data;
+	parser->ctx = ctx;
+
+	return ESP_OK;
+}
+
+/**
+ * Advances the match of a pattern by one byte.
+ * The patterns used here only contain '\r' at positions where restarting the match
+ * from that byte is correct, so no failure table is needed.
+ * @return true when the whole pattern has been matched.
+ */
+static bool multipart_parser_match_byte(multipart_parser_t *parser, const char *pattern, size_t pattern_len, uint8_t c)
+{
+	if ((uint8_t)pattern[parser->match] == c)
+	{
+		parser->match++;
+	}
+	else
+	{
+		parser->match = ((uint8_t)pattern[0] == c) ? 1 : 0;
+	}
+
+	if (parser->match == pattern_len)
+	{
+		parser->match = 0;
+		return true;
+	}
+
+	return false;
+}
+
+esp_err_t multipart_parser_feed(multipart_parser_t *parser, const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len)
+	{
+		switch (parser->state)
+		{
+			case MULTIPART_STATE_PREAMBLE:
+				for (; i < len; i++)
+				{
+					if (multipart_parser_match_byte(parser, parser->delimiter, parser->delimiter_len, data[i]))
+					{
+						parser->state = MULTIPART_STATE_HEADERS;
+						i++;
+						break;
+					}
+				}
+				break;
+
+			case MULTIPART_STATE_HEADERS:
+				for (; i < len; i++)
+				{
+					if (multipart_parser_match_byte(parser, multipart_header_end, sizeof(multipart_header_end) - 1, data[i]))
+					{
+						parser->state = MULTIPART_STATE_BODY;
+						i++;
+						break;
+					}
+				}
+				break;
+
+			case MULTIPART_STATE_BODY:
+			{
+				size_t run_start = i;
+
+				for (; i < len; i++)
+				{
+					uint8_t c = data[i];
+
+					if (parser->match > 0)
+					{
+						if ((uint8_t)parser->delimiter[parser->match] == c)
+						{
+							if (++parser->match == parser->delimiter_len)
+							{
+								parser->match = 0;
+								parser->state = MULTIPART_STATE_DONE;
+								return ESP_OK;
+							}
+							continue;
+						}
+
+						// False alarm: the held back bytes were data after all
+						if (parser->on_data((const uint8_t *)parser->delimiter, parser->match, parser->ctx) != ESP_OK)
+						{
+							parser->state = MULTIPART_STATE_ERROR;
+							return ESP_FAIL;
+						}
+						parser->match = 0;
+						run_start = i;
+					}
+
+					if (c == '\r')
+					{
+						if (i > run_start && parser->on_data(&data[run_start], i - run_start, parser->ctx) != ESP_OK)
+						{
+							parser->state = MULTIPART_STATE_ERROR;
+							return ESP_FAIL;
+						}
+						parser->match = 1;
+						run_start = i + 1;
+					}
+				}
+
+				if (parser->match == 0 && i > run_start && parser->on_data(&data[run_start], i - run_start, parser->ctx) != ESP_OK)
+				{
+					parser->state = MULTIPART_STATE_ERROR;
+					return ESP_FAIL;
+				}
+				break;
+			}
+
+			case MULTIPART_STATE_DONE:
+				// Epilogue and any further parts are ignored
+				return ESP_OK;
+
+			case MULTIPART_STATE_ERROR:
+			default:
+				return ESP_FAIL;
+		}
+	}
+
+	return ESP_OK;
+}
+
+bool multipart_parser_is_done(const multipart_parser_t *parser)
+{
+	return parser->state == MULTIPART_STATE_DONE;
+}
@@ -0,0 +1,78 @@
+/*
+ * multipart_parser.h
+ *
+ *  Streaming parser for multipart/form-data request bodies.
+ */
+
+#ifndef MAIN_MULTIPART_PARSER_H_
+#define MAIN_MULTIPART_PARSER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Maximum boundary length allowed by RFC 2046
+#define MULTIPART_MAX_BOUNDARY_LENGTH	70
+
+/**
+ * Callback invoked with each run of file (part body) bytes.
+ * @param data pointer to the body bytes, only valid during the call.
+ * @param len number of bytes.
+ * @param ctx user context passed to multipart_parser_init.
+ * @return ESP_OK to continue parsing, any other value aborts the parse.
+ */
+typedef esp_err_t (*multipart_data_cb_t)(const uint8_t *data, size_t len, void *ctx);
+
+/**
+ * Parser states
+ */
+typedef enum multipart_parser_state
+{
+	MULTIPART_STATE_PREAMBLE = 0,
+	MULTIPART_STATE_HEADERS,
+	MULTIPART_STATE_BODY,
+	MULTIPART_STATE_DONE,
+	MULTIPART_STATE_ERROR,
+} multipart_parser_state_e;
+
+/**
+ * Parser context, the delimiter match position is kept between chunks
+ * so a boundary split across two recv() calls is still recognised.
+ */
+typedef struct multipart_parser
+{
+	multipart_parser_state_e state;
+	char delimiter[MULTIPART_MAX_BOUNDARY_LENGTH + 5];	///> "\r\n--" + boundary
+	size_t delimiter_len;
+	size_t match;										///> bytes of the current pattern matched so far
+	multipart_data_cb_t on_data;
+	void *ctx;
+} multipart_parser_t;
+
+/**
+ * Initializes the parser from the request Content-Type header value.
+ * @param parser parser context.
+ * @param content_type value of the Content-Type header (multipart/form-data; boundary=...).
+ * @param on_data callback receiving the body bytes of the first part.
+ * @param ctx user context for the callback.
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if no usable boundary was found.
+ */
+esp_err_t multipart_parser_init(multipart_parser_t *parser, const char *content_type, multipart_data_cb_t on_data, void *ctx);
+
+/**
+ * Feeds the next chunk of the request body to the parser.
+ * @param parser parser context.
+ * @param data chunk received from the socket.
+ * @param len chunk length.
+ * @return ESP_OK, ESP_FAIL on malformed input or the callback's error.
+ */
+esp_err_t multipart_parser_feed(multipart_parser_t *parser, const uint8_t *data, size_t len);
+
+/**
+ * @return true once the closing delimiter of the first part has been seen.
+ */
+bool multipart_parser_is_done(const multipart_parser_t *parser);
+
+#endif /* MAIN_MULTIPART_PARSER_H_ */
@@ -0,0 +1,514 @@
+/*
+ * ota_app.c
+ *
+ *  Double-buffered OTA pipeline.
+ *
+ *  The producer (the HTTP handler) copies image bytes into one of
+ *  OTA_APP_BUFFER_COUNT aligned buffers. Full buffers are queued to the OTA
+ *  writer task, which calls esp_ota_write and hands them back through the
+ *  free queue. Network receive therefore only waits on flash when both
+ *  buffers are still being programmed. The partition is opened with
+ *  OTA_WITH_SEQUENTIAL_WRITES so sectors are erased as they are reached
+ *  instead of erasing the whole partition up front.
+ *
+ *  The SHA-256 of the image is computed on the producer side while the
+ *  bytes are copied, so every session (upload, resumed upload or delta)
+ *  can be checked against the hash the client announced.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#include "spi_flash_mmap.h"
+
+#include "ota_app.h"
+#include "tasks_common.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "ota_app";
+
+/**
+ * Buffer handed between the receiver and the writer task
+ */
+typedef struct ota_app_buffer
+{
+	uint8_t *data;
+	size_t len;
+} ota_app_buffer_t;
+
+// Queues of empty and filled pipeline buffers
+static QueueHandle_t ota_app_free_queue_handle;
+static QueueHandle_t ota_app_full_queue_handle;
+
+// Buffers owned by the current session
+static uint8_t *g_buffers[OTA_APP_BUFFER_COUNT];
+
+// Buffer currently being filled by the receiver
+static ota_app_buffer_t g_fill = {0};
+
+// Current session
+static esp_ota_handle_t g_ota_handle;
+static const esp_partition_t *g_update_partition = NULL;
+static volatile esp_err_t g_write_err = ESP_OK;
+static int64_t g_start_time_us;
+static mbedtls_sha256_context g_sha256_ctx;
+static uint8_t g_image_sha256[32];
+static uint8_t g_expected_sha256[32];
+static bool g_check_sha256 = false;
+
+// Transfer statistics
+static ota_app_stats_t g_stats = {0};
+
+// Writer holding the update partition, see ota_app_claim
+static ota_app_owner_e g_owner = OTA_APP_OWNER_NONE;
+
+/**
+ * OTA writer task, programs filled buffers into the update partition.
+ * @param pvParameters parameter which can be passed to the task.
+ */
+static void ota_app_writer_task(void *pvParameters)
+{
+	ota_app_buffer_t buf;
+
+	for (;;)
+	{
+		if (xQueueReceive(ota_app_full_queue_handle, &buf, portMAX_DELAY))
+		{
+			// Once a write failed the rest of the image is discarded, the buffers still go back
+			if (g_write_err == ESP_OK)
+			{
+				esp_err_t err = esp_ota_write(g_ota_handle, buf.data, buf.len);
+				if (err == ESP_OK)
+				{
+					g_stats.bytes_written += buf.len;
+				}
+				else
+				{
+					ESP_LOGE(TAG, "ota_app_writer_task: esp_ota_write failed (%s)", esp_err_to_name(err));
+					g_write_err = err;
+				}
+			}
+
+			buf.len = 0;
+			xQueueSend(ota_app_free_queue_handle, &buf, portMAX_DELAY);
+		}
+	}
+}
+
+/**
+ * Updates the elapsed time and throughput of the session.
+ * @param stats statistics to update.
+ */
+static void ota_app_update_timing(ota_app_stats_t *stats)
+{
+	int64_t elapsed_us = esp_timer_get_time() - g_start_time_us;
+
+	stats->elapsed_ms = (uint32_t)(elapsed_us / 1000);
+	stats->throughput_bps = (elapsed_us > 0) ? (uint32_t)(((int64_t)stats->bytes_written * 1000000) / elapsed_us) : 0;
+}
+
+/**
+ * Waits until the writer task has returned every buffer, then frees them.
+ * @return true if all the buffers came back in time.
+ */
+static bool ota_app_drain_and_free_buffers(void)
+{
+	ota_app_buffer_t buf;
+	bool drained = true;
+
+	for (int i = 0; i < OTA_APP_BUFFER_COUNT; i++)
+	{
+		if (g_buffers[i] == NULL)
+		{
+			continue;
+		}
+		if (g_fill.data == g_buffers[i])
+		{
+			// Held by the receiver, not in any queue
+			continue;
+		}
+		if (xQueueReceive(ota_app_free_queue_handle, &buf, pdMS_TO_TICKS(OTA_APP_BUFFER_WAIT_MS)) != pdTRUE)
+		{
+			drained = false;
+		}
+	}
+
+	if (drained)
+	{
+		for (int i = 0; i < OTA_APP_BUFFER_COUNT; i++)
+		{
+			heap_caps_free(g_buffers[i]);
+			g_buffers[i] = NULL;
+		}
+	}
+	else
+	{
+		// The writer still owns a buffer, leaking it is safer than freeing it under its feet
+		ESP_LOGE(TAG, "ota_app_drain_and_free_buffers: writer task did not return the buffers");
+	}
+
+	g_fill.data = NULL;
+	g_fill.len = 0;
+
+	return drained;
+}
+
+void ota_app_start(void)
+{
+	if (ota_app_full_queue_handle != NULL)
+	{
+		return;
+	}
+
+	ota_app_free_queue_handle = xQueueCreate(OTA_APP_BUFFER_COUNT, sizeof(ota_app_buffer_t));
+	ota_app_full_queue_handle = xQueueCreate(OTA_APP_BUFFER_COUNT, sizeof(ota_app_buffer_t));
+
+	xTaskCreatePinnedToCore(&ota_app_writer_task, "ota_writer", OTA_WRITER_TASK_STACK_SIZE, NULL, OTA_WRITER_TASK_PRIORITY, NULL, OTA_WRITER_TASK_CORE_ID);
+}
+
+/**
+ * Allocates the pipeline and opens the update partition, at image_offset for a resumed session.
+ * @param image_size expected image size, 0 if unknown.
+ * @param image_offset bytes already in flash, 0 for a new image.
+ * @return ESP_OK or the reason the session could not be opened.
+ */
+static esp_err_t ota_app_open(size_t image_size, size_t image_offset)
+{
+	esp_err_t err;
+
+	if (g_stats.in_progress)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	g_update_partition = esp_ota_get_next_update_partition(NULL);
+	if (g_update_partition == NULL)
+	{
+		ESP_LOGE(TAG, "ota_app_open: no OTA update partition");
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	for (int i = 0; i < OTA_APP_BUFFER_COUNT; i++)
+	{
+		g_buffers[i] = heap_caps_aligned_alloc(OTA_APP_BUFFER_ALIGNMENT, OTA_APP_BUFFER_SIZE, MALLOC_CAP_8BIT);
+		if (g_buffers[i] == NULL)
+		{
+			ESP_LOGE(TAG, "ota_app_open: unable to allocate pipeline buffers");
+			for (int j = 0; j < i; j++)
+			{
+				heap_caps_free(g_buffers[j]);
+				g_buffers[j] = NULL;
+			}
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	mbedtls_sha256_init(&g_sha256_ctx);
+	mbedtls_sha256_starts(&g_sha256_ctx, 0);
+
+	if (image_offset == 0)
+	{
+		// Sectors are erased as they are reached, so the erase overlaps with the transfer
+		err = esp_ota_begin(g_update_partition, OTA_WITH_SEQUENTIAL_WRITES, &g_ota_handle);
+	}
+	else
+	{
+		// Hash what is already in flash, one pipeline buffer at a time
+		err = ESP_OK;
+		for (size_t offset = 0; offset < image_offset && err == ESP_OK; offset += OTA_APP_BUFFER_SIZE)
+		{
+			size_t len = MIN(image_offset - offset, OTA_APP_BUFFER_SIZE);
+			err = esp_partition_read(g_update_partition, offset, g_buffers[0], len);
+			if (err == ESP_OK)
+			{
+				mbedtls_sha256_update(&g_sha256_ctx, g_buffers[0], len);
+			}
+		}
+		if (err == ESP_OK)
+		{
+			err = esp_ota_resume(g_update_partition, OTA_WITH_SEQUENTIAL_WRITES, image_offset, &g_ota_handle);
+		}
+	}
+	if (err != ESP_OK)
+	{
+		ESP_LOGE(TAG, "ota_app_open: unable to open the update partition (%s)", esp_err_to_name(err));
+		mbedtls_sha256_free(&g_sha256_ctx);
+		for (int i = 0; i < OTA_APP_BUFFER_COUNT; i++)
+		{
+			heap_caps_free(g_buffers[i]);
+			g_buffers[i] = NULL;
+		}
+		return err;
+	}
+
+	xQueueReset(ota_app_free_queue_handle);
+	xQueueReset(ota_app_full_queue_handle);
+	for (int i = 0; i < OTA_APP_BUFFER_COUNT; i++)
+	{
+		ota_app_buffer_t buf = { .data = g_buffers[i], .len = 0 };
+		xQueueSend(ota_app_free_queue_handle, &buf, 0);
+	}
+	g_fill.data = NULL;
+	g_fill.len = 0;
+	g_write_err = ESP_OK;
+	g_check_sha256 = false;
+
+	memset(&g_stats, 0x00, sizeof(g_stats));
+	g_stats.image_size = image_size;
+	g_stats.bytes_written = image_offset;
+	g_stats.in_progress = true;
+	g_start_time_us = esp_timer_get_time();
+
+	ESP_LOGI(TAG, "ota_app_open: writing to partition subtype %d at offset 0x%" PRIx32 " from image offset %u", g_update_partition->subtype, g_update_partition->address, (unsigned)image_offset);
+
+	return ESP_OK;
+}
+
+bool ota_app_claim(ota_app_owner_e owner)
+{
+	ota_app_owner_e expected = OTA_APP_OWNER_NONE;
+
+	return __atomic_compare_exchange_n(&g_owner, &expected, owner, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void ota_app_release(ota_app_owner_e owner)
+{
+	ota_app_owner_e expected = owner;
+
+	__atomic_compare_exchange_n(&g_owner, &expected, OTA_APP_OWNER_NONE, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+esp_err_t ota_app_begin(size_t image_size)
+{
+	return ota_app_open(image_size, 0);
+}
+
+esp_err_t ota_app_resume(size_t image_size, size_t image_offset)
+{
+	if (image_offset % SPI_FLASH_SEC_SIZE != 0)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	return ota_app_open(image_size, image_offset);
+}
+
+void ota_app_set_image_size(size_t image_size)
+{
+	g_stats.image_size = image_size;
+}
+
+esp_err_t ota_app_write(const uint8_t *data, size_t len)
+{
+	if (!g_stats.in_progress)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	g_stats.bytes_received += len;
+	mbedtls_sha256_update(&g_sha256_ctx, data, len);
+
+	while (len > 0)
+	{
+		if (g_write_err != ESP_OK)
+		{
+			return g_write_err;
+		}
+
+		if (g_fill.data == NULL)
+		{
+			// Back-pressure: wait for the writer to release a buffer
+			if (xQueueReceive(ota_app_free_queue_handle, &g_fill, pdMS_TO_TICKS(OTA_APP_BUFFER_WAIT_MS)) != pdTRUE)
+			{
+				ESP_LOGE(TAG, "ota_app_write: timed out waiting for a free buffer");
+				return ESP_ERR_TIMEOUT;
+			}
+		}
+
+		size_t copy_len = MIN(len, OTA_APP_BUFFER_SIZE - g_fill.len);
+		memcpy(g_fill.data + g_fill.len, data, copy_len);
+		g_fill.len += copy_len;
+		data += copy_len;
+		len -= copy_len;
+
+		if (g_fill.len == OTA_APP_BUFFER_SIZE)
+		{
+			xQueueSend(ota_app_full_queue_handle, &g_fill, portMAX_DELAY);
+			g_fill.data = NULL;
+			g_fill.len = 0;
+		}
+	}
+
+	return ESP_OK;
+}
+
+void ota_app_expect_sha256(const uint8_t *image_sha256)
+{
+	memcpy(g_expected_sha256, image_sha256, sizeof(g_expected_sha256));
+	g_check_sha256 = true;
+}
+
+esp_err_t ota_app_flush(void)
+{
+	if (!g_stats.in_progress)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	if (g_fill.data != NULL)
+	{
+		if (g_fill.len > 0)
+		{
+			xQueueSend(ota_app_full_queue_handle, &g_fill, portMAX_DELAY);
+		}
+		else
+		{
+			xQueueSend(ota_app_free_queue_handle, &g_fill, portMAX_DELAY);
+		}
+		g_fill.data = NULL;
+		g_fill.len = 0;
+	}
+
+	// Every buffer back in the free queue means the writer is idle
+	ota_app_buffer_t returned[OTA_APP_BUFFER_COUNT];
+	int count = 0;
+	while (count < OTA_APP_BUFFER_COUNT && xQueueReceive(ota_app_free_queue_handle, &returned[count], pdMS_TO_TICKS(OTA_APP_BUFFER_WAIT_MS)) == pdTRUE)
+	{
+		count++;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		xQueueSend(ota_app_free_queue_handle, &returned[i], 0);
+	}
+
+	if (count < OTA_APP_BUFFER_COUNT)
+	{
+		ESP_LOGE(TAG, "ota_app_flush: writer task did not return the buffers");
+		return ESP_ERR_TIMEOUT;
+	}
+
+	return g_write_err;
+}
+
+esp_err_t ota_app_end(void)
+{
+	if (!g_stats.in_progress)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	// Queue the last, partially filled buffer
+	if (g_fill.data != NULL && g_fill.len > 0)
+	{
+		xQueueSend(ota_app_full_queue_handle, &g_fill, portMAX_DELAY);
+		g_fill.data = NULL;
+		g_fill.len = 0;
+	}
+
+	bool drained = ota_app_drain_and_free_buffers();
+	ota_app_update_timing(&g_stats);
+	g_stats.in_progress = false;
+
+	mbedtls_sha256_finish(&g_sha256_ctx, g_image_sha256);
+	mbedtls_sha256_free(&g_sha256_ctx);
+
+	esp_err_t err = drained ? g_write_err : ESP_ERR_TIMEOUT;
+	if (err == ESP_OK && g_check_sha256 && memcmp(g_image_sha256, g_expected_sha256, sizeof(g_image_sha256)) != 0)
+	{
+		ESP_LOGE(TAG, "ota_app_end: image does not match the announced SHA-256");
+		err = ESP_ERR_INVALID_CRC;
+	}
+	if (err != ESP_OK)
+	{
+		esp_ota_abort(g_ota_handle);
+		return err;
+	}
+
+	err = esp_ota_end(g_ota_handle);
+	if (err != ESP_OK)
+	{
+		ESP_LOGE(TAG, "ota_app_end: esp_ota_end failed (%s)", esp_err_to_name(err));
+		return err;
+	}
+
+	err = esp_ota_set_boot_partition(g_update_partition);
+	if (err != ESP_OK)
+	{
+		ESP_LOGE(TAG, "ota_app_end: esp_ota_set_boot_partition failed (%s)", esp_err_to_name(err));
+		return err;
+	}
+
+	ESP_LOGI(TAG, "ota_app_end: %" PRIu32 " bytes in %" PRIu32 " ms (%" PRIu32 " B/s)", g_stats.bytes_written, g_stats.elapsed_ms, g_stats.throughput_bps);
+
+	return ESP_OK;
+}
+
+void ota_app_abort(void)
+{
+	if (!g_stats.in_progress)
+	{
+		return;
+	}
+
+	// Make the writer skip whatever is still queued
+	g_write_err = ESP_FAIL;
+	g_fill.len = 0;
+
+	ota_app_drain_and_free_buffers();
+	ota_app_update_timing(&g_stats);
+	g_stats.in_progress = false;
+
+	mbedtls_sha256_free(&g_sha256_ctx);
+	esp_ota_abort(g_ota_handle);
+}
+
+void ota_app_get_image_sha256(uint8_t *image_sha256)
+{
+	memcpy(image_sha256, g_image_sha256, sizeof(g_image_sha256));
+}
+
+esp_err_t ota_app_hash_partition(const esp_partition_t *partition, size_t len, uint8_t *image_sha256)
+{
+	esp_partition_mmap_handle_t mmap_handle;
+	const void *data;
+	esp_err_t err;
+
+	err = esp_partition_mmap(partition, 0, len, ESP_PARTITION_MMAP_DATA, &data, &mmap_handle);
+	if (err != ESP_OK)
+	{
+		return err;
+	}
+	mbedtls_sha256(data, len, image_sha256, 0);
+	esp_partition_munmap(mmap_handle);
+
+	return ESP_OK;
+}
+
+const esp_partition_t *ota_app_get_update_partition(void)
+{
+	if (g_stats.in_progress)
+	{
+		return g_update_partition;
+	}
+
+	return esp_ota_get_next_update_partition(NULL);
+}
+
+void ota_app_get_stats(ota_app_stats_t *stats)
+{
+	*stats = g_stats;
+	if (stats->in_progress)
+	{
+		ota_app_update_timing(stats);
+	}
+}
@@ -0,0 +1,150 @@
+/*
+ * ota_app.h
+ *
+ *  Double-buffered OTA pipeline: the receiving task fills one buffer while
+ *  the OTA writer task programs the other one into flash.
+ */
+
+#ifndef MAIN_OTA_APP_H_
+#define MAIN_OTA_APP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+// Pipeline buffer settings (a multiple of the 4 KB flash sector)
+#define OTA_APP_BUFFER_SIZE			8192
+#define OTA_APP_BUFFER_COUNT		2
+#define OTA_APP_BUFFER_ALIGNMENT	4
+
+// How long the receiver waits for the writer to hand back a buffer
+#define OTA_APP_BUFFER_WAIT_MS		10000
+
+/**
+ * OTA transfer statistics, reported by /OTAstatus
+ */
+typedef struct ota_app_stats
+{
+	bool in_progress;
+	uint32_t image_size;		///> expected size, 0 if unknown
+	uint32_t bytes_received;	///> bytes handed to the pipeline
+	uint32_t bytes_written;		///> bytes programmed into the update partition
+	uint32_t elapsed_ms;		///> since ota_app_begin, frozen by ota_app_end/ota_app_abort
+	uint32_t throughput_bps;	///> bytes_written per second over elapsed_ms
+} ota_app_stats_t;
+
+/**
+ * Writers of the update partition, see ota_app_claim
+ */
+typedef enum ota_app_owner
+{
+	OTA_APP_OWNER_NONE = 0,
+	OTA_APP_OWNER_UPLOAD,		///> browser upload, single-shot or resumable
+	OTA_APP_OWNER_PULL,			///> ota_pull download
+} ota_app_owner_e;
+
+/**
+ * Creates the OTA writer task and its buffer queues.
+ */
+void ota_app_start(void);
+
+/**
+ * Claims the update partition and the resume state for one writer. The
+ * claim is a single atomic compare-and-swap, so an upload and a pull can
+ * never both pass it: whoever loses must not touch ota_resume or the
+ * partition.
+ * @param owner writer claiming the partition.
+ * @return true if the claim succeeded, false if another writer holds it.
+ */
+bool ota_app_claim(ota_app_owner_e owner);
+
+/**
+ * Releases a claim taken with ota_app_claim.
+ * @param owner writer that holds the claim, a mismatch is ignored.
+ */
+void ota_app_release(ota_app_owner_e owner);
+
+/**
+ * Starts a new OTA session on the next update partition.
+ * @param image_size expected image size for progress reporting, 0 if unknown.
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if a session is already running, otherwise the esp_ota_begin error.
+ */
+esp_err_t ota_app_begin(size_t image_size);
+
+/**
+ * Re-opens an interrupted session on the next update partition, continuing at image_offset.
+ * The hash of the bytes already in flash is recomputed so ota_app_get_image_sha256 covers the whole image.
+ * @param image_size expected image size.
+ * @param image_offset bytes already written, a multiple of the flash sector size.
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if a session is already running, otherwise the esp_ota_resume error.
+ */
+esp_err_t ota_app_resume(size_t image_size, size_t image_offset);
+
+/**
+ * Sets the expected image size of the running session, once it is known.
+ * @param image_size expected image size, 0 if unknown.
+ */
+void ota_app_set_image_size(size_t image_size);
+
+/**
+ * Queues image data for flashing, blocks only while both buffers are in use.
+ * @param data image bytes.
+ * @param len number of bytes.
+ * @return ESP_OK, otherwise the first error reported by the writer task.
+ */
+esp_err_t ota_app_write(const uint8_t *data, size_t len);
+
+/**
+ * Waits until every queued byte is in flash, the session stays open.
+ * @return ESP_OK, otherwise the first error reported by the writer task.
+ */
+esp_err_t ota_app_flush(void);
+
+/**
+ * Makes ota_app_end reject the image unless its SHA-256 matches, for the current session only.
+ * @param image_sha256 32 byte hash announced by the client.
+ */
+void ota_app_expect_sha256(const uint8_t *image_sha256);
+
+/**
+ * Flushes the pipeline, validates the image and selects it as the boot partition.
+ * @return ESP_OK if the new image will be booted after restart,
+ *         ESP_ERR_INVALID_CRC if it does not match the hash given to ota_app_expect_sha256.
+ */
+esp_err_t ota_app_end(void);
+
+/**
+ * Cancels the running session and releases the pipeline buffers.
+ */
+void ota_app_abort(void);
+
+/**
+ * Gets the SHA-256 of the image written by the last successful session.
+ * @param image_sha256 32 byte output.
+ */
+void ota_app_get_image_sha256(uint8_t *image_sha256);
+
+/**
+ * Hashes the first bytes of a partition, e.g. an image as its .bin file.
+ * @param partition partition.
+ * @param len bytes to hash.
+ * @param image_sha256 32 byte output.
+ * @return ESP_OK, otherwise the esp_partition_mmap error.
+ */
+esp_err_t ota_app_hash_partition(const esp_partition_t *partition, size_t len, uint8_t *image_sha256);
+
+/**
+ * @return partition the current (or next) session writes to.
+ */
+const esp_partition_t *ota_app_get_update_partition(void);
+
+/**
+ * Gets a snapshot of the current (or last) OTA transfer statistics.
+ * @param stats output.
+ */
+void ota_app_get_stats(ota_app_stats_t *stats);
+
+#endif /* MAIN_OTA_APP_H_ */
@@ -0,0 +1,320 @@
+/*
+ * ota_delta.c
+ *
+ *  Streaming applier for delta OTA updates, see ota_delta.h for the format.
+ *
+ *  The patch is consumed byte-stream style so it can arrive in arbitrary
+ *  chunks (and come out of the gzip inflater). COPY and ADD read the running
+ *  partition through a small buffer, so memory use does not depend on the
+ *  image or patch size.
+ */
+
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+
+#include "ota_app.h"
+#include "ota_delta.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "ota_delta";
+
+/**
+ * Applier states
+ */
+typedef enum ota_delta_state
+{
+	OTA_DELTA_STATE_HEADER = 0,
+	OTA_DELTA_STATE_OPCODE,
+	OTA_DELTA_STATE_ARGS,
+	OTA_DELTA_STATE_INSERT_DATA,
+	OTA_DELTA_STATE_ADD_DATA,
+	OTA_DELTA_STATE_DONE,
+	OTA_DELTA_STATE_ERROR,
+} ota_delta_state_e;
+
+// Current patch
+static ota_delta_state_e g_state;
+static const esp_partition_t *g_source_partition = NULL;
+static uint8_t *g_read_buff = NULL;
+static uint8_t g_header[OTA_DELTA_HEADER_LEN];
+static size_t g_header_len;
+static uint32_t g_old_size;
+static uint32_t g_new_size;
+static uint32_t g_produced;
+
+// Current operation
+static uint8_t g_op;
+static uint8_t g_args[8];
+static size_t g_args_len;
+static size_t g_args_needed;
+static uint32_t g_op_offset;
+static uint32_t g_op_remaining;
+
+/**
+ * Reads a little endian u32.
+ */
+static uint32_t ota_delta_get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Validates the patch header against the running partition.
+ * @return ESP_OK if the patch applies to the running image.
+ */
+static esp_err_t ota_delta_check_header(void)
+{
+	uint8_t running_digest[32];
+
+	if (memcmp(g_header, OTA_DELTA_MAGIC, OTA_DELTA_MAGIC_LEN) != 0)
+	{
+		ESP_LOGE(TAG, "ota_delta_check_header: bad magic");
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+
+	g_old_size = ota_delta_get_u32(&g_header[4]);
+	g_new_size = ota_delta_get_u32(&g_header[8]);
+	if (g_old_size > g_source_partition->size)
+	{
+		ESP_LOGE(TAG, "ota_delta_check_header: source image larger than the running partition");
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	esp_err_t err = esp_partition_get_sha256(g_source_partition, running_digest);
+	if (err != ESP_OK)
+	{
+		ESP_LOGE(TAG, "ota_delta_check_header: unable to hash the running partition (%s)", esp_err_to_name(err));
+		return err;
+	}
+	if (memcmp(running_digest, &g_header[12], sizeof(running_digest)) != 0)
+	{
+		ESP_LOGE(TAG, "ota_delta_check_header: patch was built against a different image");
+		return ESP_ERR_INVALID_VERSION;
+	}
+
+	ESP_LOGI(TAG, "ota_delta_check_header: patching %u byte image into %u bytes", (unsigned)g_old_size, (unsigned)g_new_size);
+
+	return ESP_OK;
+}
+
+/**
+ * Writes reconstructed image bytes, keeping track of the output size.
+ */
+static esp_err_t ota_delta_emit(const uint8_t *data, size_t len)
+{
+	if (g_produced + len > g_new_size)
+	{
+		ESP_LOGE(TAG, "ota_delta_emit: patch produces more than %u bytes", (unsigned)g_new_size);
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+	g_produced += len;
+
+	return ota_app_write(data, len);
+}
+
+/**
+ * Executes a COPY operation from the running partition.
+ */
+static esp_err_t ota_delta_copy(uint32_t offset, uint32_t len)
+{
+	while (len > 0)
+	{
+		size_t chunk = MIN(len, OTA_DELTA_READ_BUFFER_SIZE);
+
+		esp_err_t err = esp_partition_read(g_source_partition, offset, g_read_buff, chunk);
+		if (err == ESP_OK)
+		{
+			err = ota_delta_emit(g_read_buff, chunk);
+		}
+		if (err != ESP_OK)
+		{
+			return err;
+		}
+
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Decodes the arguments of the current operation once they are complete.
+ */
+static esp_err_t ota_delta_start_op(void)
+{
+	switch (g_op)
+	{
+		case OTA_DELTA_OP_INSERT:
+			g_op_remaining = ota_delta_get_u32(&g_args[0]);
+			g_state = (g_op_remaining > 0) ? OTA_DELTA_STATE_INSERT_DATA : OTA_DELTA_STATE_OPCODE;
+			return ESP_OK;
+
+		case OTA_DELTA_OP_COPY:
+		case OTA_DELTA_OP_ADD:
+			g_op_offset = ota_delta_get_u32(&g_args[0]);
+			g_op_remaining = ota_delta_get_u32(&g_args[4]);
+			if (g_op_offset > g_old_size || g_op_remaining > g_old_size - g_op_offset)
+			{
+				ESP_LOGE(TAG, "ota_delta_start_op: source range outside the old image");
+				return ESP_ERR_INVALID_RESPONSE;
+			}
+			if (g_op == OTA_DELTA_OP_COPY)
+			{
+				g_state = OTA_DELTA_STATE_OPCODE;
+				return ota_delta_copy(g_op_offset, g_op_remaining);
+			}
+			g_state = (g_op_remaining > 0) ? OTA_DELTA_STATE_ADD_DATA : OTA_DELTA_STATE_OPCODE;
+			return ESP_OK;
+
+		default:
+			return ESP_ERR_INVALID_RESPONSE;
+	}
+}
+
+esp_err_t ota_delta_begin(void)
+{
+	g_source_partition = esp_ota_get_running_partition();
+
+	g_read_buff = heap_caps_malloc(OTA_DELTA_READ_BUFFER_SIZE, MALLOC_CAP_8BIT);
+	if (g_read_buff == NULL)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+
+	g_state = OTA_DELTA_STATE_HEADER;
+	g_header_len = 0;
+	g_produced = 0;
+
+	return ESP_OK;
+}
+
+esp_err_t ota_delta_write(const uint8_t *data, size_t len)
+{
+	esp_err_t err = ESP_OK;
+	size_t chunk;
+
+	while (len > 0 && err == ESP_OK)
+	{
+		switch (g_state)
+		{
+			case OTA_DELTA_STATE_HEADER:
+				chunk = MIN(len, OTA_DELTA_HEADER_LEN - g_header_len);
+				memcpy(&g_header[g_header_len], data, chunk);
+				g_header_len += chunk;
+				if (g_header_len == OTA_DELTA_HEADER_LEN)
+				{
+					err = ota_delta_check_header();
+					g_state = OTA_DELTA_STATE_OPCODE;
+				}
+				break;
+
+			case OTA_DELTA_STATE_OPCODE:
+				chunk = 1;
+				g_op = data[0];
+				g_args_len = 0;
+				if (g_op == OTA_DELTA_OP_END)
+				{
+					g_state = OTA_DELTA_STATE_DONE;
+				}
+				else if (g_op == OTA_DELTA_OP_INSERT)
+				{
+					g_args_needed = 4;
+					g_state = OTA_DELTA_STATE_ARGS;
+				}
+				else if (g_op == OTA_DELTA_OP_COPY || g_op == OTA_DELTA_OP_ADD)
+				{
+					g_args_needed = 8;
+					g_state = OTA_DELTA_STATE_ARGS;
+				}
+				else
+				{
+					ESP_LOGE(TAG, "ota_delta_write: unknown opcode 0x%02x", g_op);
+					err = ESP_ERR_INVALID_RESPONSE;
+				}
+				break;
+
+			case OTA_DELTA_STATE_ARGS:
+				chunk = MIN(len, g_args_needed - g_args_len);
+				memcpy(&g_args[g_args_len], data, chunk);
+				g_args_len += chunk;
+				if (g_args_len == g_args_needed)
+				{
+					err = ota_delta_start_op();
+				}
+				break;
+
+			case OTA_DELTA_STATE_INSERT_DATA:
+				chunk = MIN(len, g_op_remaining);
+				err = ota_delta_emit(data, chunk);
+				g_op_remaining -= chunk;
+				if (g_op_remaining == 0)
+				{
+					g_state = OTA_DELTA_STATE_OPCODE;
+				}
+				break;
+
+			case OTA_DELTA_STATE_ADD_DATA:
+				chunk = MIN(MIN(len, g_op_remaining), OTA_DELTA_READ_BUFFER_SIZE);
+				err = esp_partition_read(g_source_partition, g_op_offset, g_read_buff, chunk);
+				if (err == ESP_OK)
+				{
+					for (size_t i = 0; i < chunk; i++)
+					{
+						g_read_buff[i] += data[i];
+					}
+					err = ota_delta_emit(g_read_buff, chunk);
+				}
+				g_op_offset += chunk;
+				g_op_remaining -= chunk;
+				if (g_op_remaining == 0)
+				{
+					g_state = OTA_DELTA_STATE_OPCODE;
+				}
+				break;
+
+			case OTA_DELTA_STATE_DONE:
+				// Nothing is expected after END
+				return ESP_OK;
+
+			case OTA_DELTA_STATE_ERROR:
+			default:
+				return ESP_ERR_INVALID_RESPONSE;
+		}
+
+		data += chunk;
+		len -= chunk;
+	}
+
+	if (err != ESP_OK)
+	{
+		g_state = OTA_DELTA_STATE_ERROR;
+	}
+
+	return err;
+}
+
+esp_err_t ota_delta_end(void)
+{
+	bool complete = (g_state == OTA_DELTA_STATE_DONE && g_produced == g_new_size);
+
+	ota_delta_abort();
+
+	if (!complete)
+	{
+		ESP_LOGE(TAG, "ota_delta_end: incomplete patch (%u of %u bytes)", (unsigned)g_produced, (unsigned)g_new_size);
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+
+	return ESP_OK;
+}
+
+void ota_delta_abort(void)
+{
+	heap_caps_free(g_read_buff);
+	g_read_buff = NULL;
+}
@@ -0,0 +1,65 @@
+/*
+ * ota_delta.h
+ *
+ *  Streaming applier for delta (patch based) OTA updates.
+ *
+ *  Patch format, produced by tools/ota_image_tool.py diff (little endian):
+ *
+ *    "ODP1" | old_size u32 | new_size u32 | old_digest[32]
+ *    followed by operations, each starting with an opcode byte:
+ *      0x01 COPY   old_offset u32, len u32       new = old[off, off + len)
+ *      0x02 INSERT len u32, len literal bytes     new = literal
+ *      0x03 ADD    old_offset u32, len u32, len   new[k] = old[off + k] + diff[k]
+ *      0x00 END
+ *
+ *  old_digest is what esp_partition_get_sha256 reports for the running
+ *  partition the patch was built against.
+ */
+
+#ifndef MAIN_OTA_DELTA_H_
+#define MAIN_OTA_DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define OTA_DELTA_MAGIC				"ODP1"
+#define OTA_DELTA_MAGIC_LEN			4
+#define OTA_DELTA_HEADER_LEN		44
+
+#define OTA_DELTA_OP_END			0x00
+#define OTA_DELTA_OP_COPY			0x01
+#define OTA_DELTA_OP_INSERT			0x02
+#define OTA_DELTA_OP_ADD			0x03
+
+// Size of the buffer used to read the running partition
+#define OTA_DELTA_READ_BUFFER_SIZE	1024
+
+/**
+ * Prepares the applier, the running partition is used as the patch source.
+ * @return ESP_OK or ESP_ERR_NO_MEM.
+ */
+esp_err_t ota_delta_begin(void);
+
+/**
+ * Applies the next chunk of the patch, writing the reconstructed image to the OTA pipeline.
+ * @param data patch bytes (already decompressed).
+ * @param len number of bytes.
+ * @return ESP_OK, ESP_ERR_INVALID_VERSION if the patch was built against a different image,
+ *         ESP_ERR_INVALID_RESPONSE on a malformed patch, otherwise the OTA pipeline error.
+ */
+esp_err_t ota_delta_write(const uint8_t *data, size_t len);
+
+/**
+ * Checks that the whole patch was applied and releases the applier memory.
+ * @return ESP_OK if the END operation was reached with the expected image size.
+ */
+esp_err_t ota_delta_end(void);
+
+/**
+ * Releases the applier memory.
+ */
+void ota_delta_abort(void);
+
+#endif /* MAIN_OTA_DELTA_H_ */
@@ -0,0 +1,376 @@
+/*
+ * ota_pull.c
+ *
+ *  Pull mode OTA from a local update server.
+ *
+ *  The manifest names the image version, URL, size and SHA-256. When it
+ *  differs from the running image, esp_https_ota downloads it with Range
+ *  requests of CONFIG_OTA_PULL_REQUEST_SIZE bytes (partial_http_download)
+ *  and with bulk_flash_erase off, so each sector is erased as the download
+ *  reaches it instead of stalling the connection on a full partition erase.
+ *  The downloaded length and SHA-256 are checked against the manifest
+ *  before the image is selected for boot.
+ *  The result goes to the HTTP server monitor like a browser upload does.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "cJSON.h"
+#include "esp_app_desc.h"
+#include "esp_http_client.h"
+#include "esp_https_ota.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+
+#include "http_server.h"
+#include "ota_app.h"
+#include "ota_pull.h"
+#include "ota_resume.h"
+#include "tasks_common.h"
+#include "wifi_app.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "ota_pull";
+
+// OTA pull task handle
+static TaskHandle_t task_ota_pull = NULL;
+
+// Pull progress
+static ota_pull_stats_t g_stats = {0};
+
+/**
+ * Parsed update manifest
+ */
+typedef struct ota_pull_manifest
+{
+	char version[32];
+	char url[256];
+	uint32_t size;
+	uint8_t sha256[32];
+	bool has_sha256;
+} ota_pull_manifest_t;
+
+/**
+ * Decodes a 64 character hex string.
+ * @return true if the string is a valid SHA-256.
+ */
+static bool ota_pull_parse_sha256(const char *hex, uint8_t *sha256)
+{
+	if (hex == NULL || strlen(hex) != 64)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < 32; i++)
+	{
+		unsigned int byte;
+		if (sscanf(&hex[i * 2], "%2x", &byte) != 1)
+		{
+			return false;
+		}
+		sha256[i] = (uint8_t)byte;
+	}
+
+	return true;
+}
+
+/**
+ * Downloads and parses the manifest from CONFIG_OTA_PULL_MANIFEST_URL.
+ * @param manifest output.
+ * @return ESP_OK, otherwise the HTTP or parse error.
+ */
+static esp_err_t ota_pull_fetch_manifest(ota_pull_manifest_t *manifest)
+{
+	char buff[OTA_PULL_MANIFEST_MAX_LEN + 1];
+	int len = 0;
+	esp_err_t err;
+
+	esp_http_client_config_t http_config = {
+			.url = CONFIG_OTA_PULL_MANIFEST_URL,
+			.timeout_ms = OTA_PULL_HTTP_TIMEOUT_MS,
+	};
+	esp_http_client_handle_t client = esp_http_client_init(&http_config);
+	if (client == NULL)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+
+	err = esp_http_client_open(client, 0);
+	if (err == ESP_OK)
+	{
+		esp_http_client_fetch_headers(client);
+		if (esp_http_client_get_status_code(client) != 200)
+		{
+			ESP_LOGE(TAG, "ota_pull_fetch_manifest: HTTP status %d", esp_http_client_get_status_code(client));
+			err = ESP_FAIL;
+		}
+		else
+		{
+			int read_len;
+			while (len < OTA_PULL_MANIFEST_MAX_LEN && (read_len = esp_http_client_read(client, buff + len, OTA_PULL_MANIFEST_MAX_LEN - len)) > 0)
+			{
+				len += read_len;
+			}
+		}
+	}
+	esp_http_client_cleanup(client);
+
+	if (err != ESP_OK)
+	{
+		return err;
+	}
+	buff[len] = '\0';
+
+	cJSON *root = cJSON_Parse(buff);
+	if (root == NULL)
+	{
+		ESP_LOGE(TAG, "ota_pull_fetch_manifest: invalid manifest");
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+
+	const cJSON *version = cJSON_GetObjectItem(root, "version");
+	const cJSON *url = cJSON_GetObjectItem(root, "url");
+	const cJSON *size = cJSON_GetObjectItem(root, "size");
+	const cJSON *sha256 = cJSON_GetObjectItem(root, "sha256");
+
+	memset(manifest, 0x00, sizeof(ota_pull_manifest_t));
+	if (cJSON_IsString(version) && cJSON_IsString(url) && strlen(url->valuestring) < sizeof(manifest->url))
+	{
+		strlcpy(manifest->version, version->valuestring, sizeof(manifest->version));
+		strlcpy(manifest->url, url->valuestring, sizeof(manifest->url));
+		manifest->size = cJSON_IsNumber(size) ? (uint32_t)size->valuedouble : 0;
+		manifest->has_sha256 = cJSON_IsString(sha256) && ota_pull_parse_sha256(sha256->valuestring, manifest->sha256);
+		err = ESP_OK;
+	}
+	else
+	{
+		ESP_LOGE(TAG, "ota_pull_fetch_manifest: manifest needs \"version\" and \"url\"");
+		err = ESP_ERR_INVALID_RESPONSE;
+	}
+	cJSON_Delete(root);
+
+	return err;
+}
+
+/**
+ * Checks the downloaded image against the manifest before it may be booted: the
+ * app header check of esp_https_ota lets a truncated or swapped image through.
+ * @param manifest manifest of the image.
+ * @param ota_handle download, complete.
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE or ESP_ERR_INVALID_CRC on a mismatch.
+ */
+static esp_err_t ota_pull_verify(const ota_pull_manifest_t *manifest, esp_https_ota_handle_t ota_handle)
+{
+	uint32_t image_len = (uint32_t)esp_https_ota_get_image_len_read(ota_handle);
+	uint8_t image_sha256[32];
+
+	if (manifest->size != 0 && image_len != manifest->size)
+	{
+		ESP_LOGE(TAG, "ota_pull_verify: %" PRIu32 " bytes received, the manifest announced %" PRIu32, image_len, manifest->size);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	if (manifest->has_sha256)
+	{
+		// The partition holds the bytes as downloaded, the whole .bin file
+		if (ota_app_hash_partition(esp_ota_get_next_update_partition(NULL), image_len, image_sha256) != ESP_OK
+				|| memcmp(image_sha256, manifest->sha256, sizeof(image_sha256)) != 0)
+		{
+			ESP_LOGE(TAG, "ota_pull_verify: image does not match the manifest SHA-256");
+			return ESP_ERR_INVALID_CRC;
+		}
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Downloads the image with esp_https_ota and selects it as the boot partition.
+ * @param manifest manifest of the image.
+ * @return ESP_OK if the new image will be booted after restart.
+ */
+static esp_err_t ota_pull_download(const ota_pull_manifest_t *manifest)
+{
+	esp_https_ota_handle_t ota_handle = NULL;
+	int64_t start_time_us = esp_timer_get_time();
+	esp_err_t err;
+
+	esp_http_client_config_t http_config = {
+			.url = manifest->url,
+			.timeout_ms = OTA_PULL_HTTP_TIMEOUT_MS,
+			.keep_alive_enable = true,
+	};
+	esp_https_ota_config_t ota_config = {
+			.http_config = &http_config,
+			.partial_http_download = true,
+			.max_http_request_size = CONFIG_OTA_PULL_REQUEST_SIZE,
+			.bulk_flash_erase = false,
+	};
+
+	err = esp_https_ota_begin(&ota_config, &ota_handle);
+	if (err != ESP_OK)
+	{
+		ESP_LOGE(TAG, "ota_pull_download: esp_https_ota_begin failed (%s)", esp_err_to_name(err));
+		return err;
+	}
+
+	g_stats.state = OTA_PULL_STATE_DOWNLOADING;
+	g_stats.image_size = manifest->size;
+	g_stats.bytes_read = 0;
+
+	while ((err = esp_https_ota_perform(ota_handle)) == ESP_ERR_HTTPS_OTA_IN_PROGRESS)
+	{
+		g_stats.bytes_read = esp_https_ota_get_image_len_read(ota_handle);
+		g_stats.elapsed_ms = (uint32_t)((esp_timer_get_time() - start_time_us) / 1000);
+	}
+	g_stats.bytes_read = esp_https_ota_get_image_len_read(ota_handle);
+	g_stats.elapsed_ms = (uint32_t)((esp_timer_get_time() - start_time_us) / 1000);
+
+	if (err != ESP_OK || !esp_https_ota_is_complete_data_received(ota_handle))
+	{
+		ESP_LOGE(TAG, "ota_pull_download: download failed (%s)", esp_err_to_name(err));
+		esp_https_ota_abort(ota_handle);
+		return (err != ESP_OK) ? err : ESP_ERR_INVALID_SIZE;
+	}
+
+	err = ota_pull_verify(manifest, ota_handle);
+	if (err != ESP_OK)
+	{
+		esp_https_ota_abort(ota_handle);
+		return err;
+	}
+
+	err = esp_https_ota_finish(ota_handle);
+	if (err != ESP_OK)
+	{
+		ESP_LOGE(TAG, "ota_pull_download: esp_https_ota_finish failed (%s)", esp_err_to_name(err));
+		return err;
+	}
+
+	ESP_LOGI(TAG, "ota_pull_download: %" PRIu32 " bytes in %" PRIu32 " ms", g_stats.bytes_read, g_stats.elapsed_ms);
+
+	return ESP_OK;
+}
+
+/**
+ * Checks the manifest and installs the image if it is not the running one.
+ */
+static void ota_pull_check(void)
+{
+	ota_pull_manifest_t manifest;
+
+	// Held until the download is over, a browser upload gets 409 meanwhile
+	if (!ota_app_claim(OTA_APP_OWNER_PULL))
+	{
+		ESP_LOGI(TAG, "ota_pull_check: upload in progress, skipping check");
+		return;
+	}
+
+	g_stats.state = OTA_PULL_STATE_CHECKING;
+
+	if (ota_pull_fetch_manifest(&manifest) != ESP_OK)
+	{
+		g_stats.state = OTA_PULL_STATE_FAILED;
+		ota_app_release(OTA_APP_OWNER_PULL);
+		return;
+	}
+
+	// The hash decides when there is one, a rebuilt image may keep its version string
+	const esp_app_desc_t *running_desc = esp_app_get_description();
+	if (manifest.has_sha256 ? ota_resume_is_installed(manifest.sha256)
+			: strncmp(manifest.version, running_desc->version, sizeof(running_desc->version)) == 0)
+	{
+		ESP_LOGI(TAG, "ota_pull_check: version %s is up to date", running_desc->version);
+		g_stats.state = OTA_PULL_STATE_UP_TO_DATE;
+		ota_app_release(OTA_APP_OWNER_PULL);
+		return;
+	}
+
+	ESP_LOGI(TAG, "ota_pull_check: updating %s -> %s from %s", running_desc->version, manifest.version, manifest.url);
+
+	// The download overwrites whatever an interrupted browser upload left behind
+	ota_resume_reset();
+
+	if (ota_pull_download(&manifest) == ESP_OK)
+	{
+		g_stats.state = OTA_PULL_STATE_DONE;
+		http_server_monitor_send_message(HTTP_MSG_OTA_UPDATE_SUCCESSFUL);
+	}
+	else
+	{
+		g_stats.state = OTA_PULL_STATE_FAILED;
+		http_server_monitor_send_message(HTTP_MSG_OTA_UPDATE_FAILED);
+	}
+
+	ota_app_release(OTA_APP_OWNER_PULL);
+}
+
+#if CONFIG_OTA_PULL_AUTO_CHECK
+/**
+ * Station connected callback, checks for an update as soon as there is a network.
+ */
+static void ota_pull_wifi_connected_cb(void)
+{
+	ota_pull_check_now();
+}
+#endif
+
+/**
+ * OTA pull task, waits for a check request (or the check interval) and runs the check.
+ * @param pvParameters parameter which can be passed to the task.
+ */
+static void ota_pull_task(void *pvParameters)
+{
+#if CONFIG_OTA_PULL_AUTO_CHECK
+	const TickType_t check_interval = pdMS_TO_TICKS((uint32_t)CONFIG_OTA_PULL_CHECK_INTERVAL_S * 1000);
+#else
+	const TickType_t check_interval = portMAX_DELAY;
+#endif
+
+	for (;;)
+	{
+		// Woken by ota_pull_check_now, or periodically when auto check is on
+		ulTaskNotifyTake(pdTRUE, check_interval);
+
+		if (wifi_app_is_sta_connected())
+		{
+			ota_pull_check();
+		}
+	}
+}
+
+void ota_pull_start(void)
+{
+	if (task_ota_pull != NULL)
+	{
+		return;
+	}
+
+	xTaskCreatePinnedToCore(&ota_pull_task, "ota_pull", OTA_PULL_TASK_STACK_SIZE, NULL, OTA_PULL_TASK_PRIORITY, &task_ota_pull, OTA_PULL_TASK_CORE_ID);
+
+#if CONFIG_OTA_PULL_AUTO_CHECK
+	wifi_app_set_callback(&ota_pull_wifi_connected_cb);
+#endif
+}
+
+esp_err_t ota_pull_check_now(void)
+{
+	if (task_ota_pull == NULL)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	xTaskNotifyGive(task_ota_pull);
+
+	return ESP_OK;
+}
+
+void ota_pull_get_stats(ota_pull_stats_t *stats)
+{
+	*stats = g_stats;
+}
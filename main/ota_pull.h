@@ -0,0 +1,64 @@
+/*
+ * ota_pull.h
+ *
+ *  Pull mode OTA: the device fetches a manifest from a local update server
+ *  and downloads the image it points to with esp_https_ota.
+ */
+
+#ifndef MAIN_OTA_PULL_H_
+#define MAIN_OTA_PULL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Largest manifest accepted from the update server
+#define OTA_PULL_MANIFEST_MAX_LEN	512
+
+// HTTP timeout for the manifest and image requests
+#define OTA_PULL_HTTP_TIMEOUT_MS	10000
+
+/**
+ * Pull states, reported by /OTAstatus
+ */
+typedef enum ota_pull_state
+{
+	OTA_PULL_STATE_IDLE = 0,
+	OTA_PULL_STATE_CHECKING,
+	OTA_PULL_STATE_DOWNLOADING,
+	OTA_PULL_STATE_UP_TO_DATE,
+	OTA_PULL_STATE_DONE,
+	OTA_PULL_STATE_FAILED,
+} ota_pull_state_e;
+
+/**
+ * Pull progress
+ */
+typedef struct ota_pull_stats
+{
+	ota_pull_state_e state;
+	uint32_t image_size;		///> from the manifest, 0 if not given
+	uint32_t bytes_read;		///> downloaded and written so far
+	uint32_t elapsed_ms;		///> of the last download
+} ota_pull_stats_t;
+
+/**
+ * Starts the OTA pull task. With CONFIG_OTA_PULL_AUTO_CHECK the manifest is
+ * checked once the station gets an IP and then periodically.
+ */
+void ota_pull_start(void);
+
+/**
+ * Asks the pull task to check the manifest now.
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if the task is not running.
+ */
+esp_err_t ota_pull_check_now(void);
+
+/**
+ * Gets a snapshot of the pull progress.
+ * @param stats output.
+ */
+void ota_pull_get_stats(ota_pull_stats_t *stats);
+
+#endif /* MAIN_OTA_PULL_H_ */
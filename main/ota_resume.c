@@ -0,0 +1,281 @@
+/*
+ * ota_resume.c
+ *
+ *  Resumable, chunked OTA uploads, see ota_resume.h for the protocol.
+ *
+ *  The OTA pipeline session stays open between chunks so consecutive
+ *  requests stream straight into flash. It is only re-opened (with
+ *  esp_ota_resume) when the previous chunk failed or the device restarted.
+ */
+
+#include <string.h>
+
+#include "esp_image_format.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+
+#include "app_nvs.h"
+#include "ota_app.h"
+#include "ota_resume.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "ota_resume";
+
+// Persisted progress of the current upload, loaded from NVS on first use
+static app_nvs_ota_progress_t g_progress = {0};
+static bool g_progress_loaded = false;
+static bool g_progress_valid = false;
+
+// True while the OTA pipeline session belongs to the resumable upload
+static bool g_session_open = false;
+
+// Chunk being received
+static uint32_t g_chunk_start;
+static uint32_t g_chunk_len;
+
+// SHA-256 of the running image, hashed on first use
+static uint8_t g_running_sha256[32];
+static bool g_running_sha256_valid = false;
+
+/**
+ * Loads the persisted progress the first time it is needed.
+ */
+static void ota_resume_load_progress(void)
+{
+	if (!g_progress_loaded)
+	{
+		g_progress_valid = app_nvs_load_ota_progress(&g_progress);
+		g_progress_loaded = true;
+	}
+}
+
+/**
+ * Checks that the persisted progress belongs to the image and is still in the update partition.
+ */
+static bool ota_resume_progress_matches(const uint8_t *image_sha256, uint32_t image_size)
+{
+	const esp_partition_t *partition = ota_app_get_update_partition();
+
+	ota_resume_load_progress();
+
+	return g_progress_valid
+			&& partition != NULL
+			&& g_progress.partition_address == partition->address
+			&& g_progress.image_size == image_size
+			&& memcmp(g_progress.image_sha256, image_sha256, sizeof(g_progress.image_sha256)) == 0;
+}
+
+/**
+ * Forgets the persisted progress.
+ */
+static void ota_resume_clear_progress(void)
+{
+	g_progress_valid = false;
+	g_progress_loaded = true;
+	app_nvs_clear_ota_progress();
+}
+
+/**
+ * Hashes the running image the way clients hash the .bin file: the app partition up to
+ * the image length, appended digest included. esp_partition_get_sha256 returns that
+ * appended digest, which covers the image without itself and never matches the file.
+ * Works whatever flashed the image, OTA or serial.
+ * @param image_sha256 32 byte output.
+ * @return false if the running image could not be read.
+ */
+static bool ota_resume_get_running_sha256(uint8_t *image_sha256)
+{
+	if (!__atomic_load_n(&g_running_sha256_valid, __ATOMIC_ACQUIRE))
+	{
+		const esp_partition_t *running = esp_ota_get_running_partition();
+		esp_partition_pos_t pos;
+		esp_image_metadata_t metadata;
+
+		if (running == NULL)
+		{
+			return false;
+		}
+
+		pos.offset = running->address;
+		pos.size = running->size;
+		if (esp_image_get_metadata(&pos, &metadata) != ESP_OK
+				|| ota_app_hash_partition(running, metadata.image_len, g_running_sha256) != ESP_OK)
+		{
+			ESP_LOGE(TAG, "ota_resume_get_running_sha256: unable to read the running image");
+			return false;
+		}
+
+		__atomic_store_n(&g_running_sha256_valid, true, __ATOMIC_RELEASE);
+	}
+
+	memcpy(image_sha256, g_running_sha256, sizeof(g_running_sha256));
+
+	return true;
+}
+
+bool ota_resume_is_installed(const uint8_t *image_sha256)
+{
+	uint8_t running_sha256[32];
+
+	if (!ota_resume_get_running_sha256(running_sha256))
+	{
+		return false;
+	}
+
+	return memcmp(running_sha256, image_sha256, sizeof(running_sha256)) == 0;
+}
+
+uint32_t ota_resume_get_next_offset(const uint8_t *image_sha256, uint32_t image_size)
+{
+	return ota_resume_progress_matches(image_sha256, image_size) ? g_progress.offset : 0;
+}
+
+esp_err_t ota_resume_chunk_begin(const uint8_t *image_sha256, uint32_t start, uint32_t image_size)
+{
+	esp_err_t err;
+
+	if (start % OTA_RESUME_CHUNK_ALIGN != 0 || start >= image_size)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if (start == 0)
+	{
+		// A new upload, whatever was there before is discarded
+		if (g_session_open)
+		{
+			ota_app_abort();
+			g_session_open = false;
+		}
+
+		err = ota_app_begin(image_size);
+		if (err != ESP_OK)
+		{
+			return err;
+		}
+		g_session_open = true;
+
+		memcpy(g_progress.image_sha256, image_sha256, sizeof(g_progress.image_sha256));
+		g_progress.image_size = image_size;
+		g_progress.offset = 0;
+		g_progress.partition_address = ota_app_get_update_partition()->address;
+		g_progress_valid = true;
+		g_progress_loaded = true;
+		app_nvs_save_ota_progress(&g_progress);
+	}
+	else
+	{
+		if (!ota_resume_progress_matches(image_sha256, image_size) || start != g_progress.offset)
+		{
+			return ESP_ERR_INVALID_ARG;
+		}
+
+		if (!g_session_open)
+		{
+			err = ota_app_resume(image_size, start);
+			if (err != ESP_OK)
+			{
+				return err;
+			}
+			g_session_open = true;
+			ESP_LOGI(TAG, "ota_resume_chunk_begin: resuming upload at offset %u", (unsigned)start);
+		}
+	}
+
+	ota_app_expect_sha256(image_sha256);
+	g_chunk_start = start;
+	g_chunk_len = 0;
+
+	return ESP_OK;
+}
+
+esp_err_t ota_resume_chunk_write(const uint8_t *data, size_t len)
+{
+	if (!g_session_open)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (g_chunk_start + g_chunk_len + len > g_progress.image_size)
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	g_chunk_len += len;
+
+	return ota_app_write(data, len);
+}
+
+esp_err_t ota_resume_chunk_end(bool *image_complete)
+{
+	esp_err_t err;
+
+	*image_complete = false;
+
+	if (!g_session_open)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	if (g_chunk_start + g_chunk_len < g_progress.image_size)
+	{
+		// Only chunks that ended on a sector boundary can be resumed after
+		if ((g_chunk_start + g_chunk_len) % OTA_RESUME_CHUNK_ALIGN != 0)
+		{
+			ota_resume_chunk_abort();
+			return ESP_ERR_INVALID_SIZE;
+		}
+
+		// The offset is only persisted once the bytes are in flash
+		err = ota_app_flush();
+		if (err != ESP_OK)
+		{
+			ota_resume_chunk_abort();
+			return err;
+		}
+
+		g_progress.offset = g_chunk_start + g_chunk_len;
+		app_nvs_save_ota_progress(&g_progress);
+
+		return ESP_OK;
+	}
+
+	g_session_open = false;
+	err = ota_app_end();
+
+	// Either way the partition content can not be resumed any more
+	ota_resume_clear_progress();
+	if (err != ESP_OK)
+	{
+		return err;
+	}
+
+	g_progress.offset = g_progress.image_size;
+	*image_complete = true;
+
+	return ESP_OK;
+}
+
+void ota_resume_chunk_abort(void)
+{
+	if (g_session_open)
+	{
+		ota_app_abort();
+		g_session_open = false;
+	}
+}
+
+void ota_resume_reset(void)
+{
+	ota_resume_chunk_abort();
+
+	ota_resume_load_progress();
+	if (g_progress_valid)
+	{
+		ota_resume_clear_progress();
+	}
+}
+
+uint32_t ota_resume_get_offset(void)
+{
+	return g_progress.offset;
+}
@@ -0,0 +1,83 @@
+/*
+ * ota_resume.h
+ *
+ *  Resumable, chunked OTA uploads.
+ *
+ *  The client announces the SHA-256 and size of the image, then sends it as
+ *  POST /OTAupdate requests carrying "Content-Range: bytes start-end/size".
+ *  Each chunk is flushed to flash before the new offset is persisted in NVS,
+ *  so after a dropped connection (or a reboot) /OTAresume.json reports where
+ *  to continue. Only raw images can be resumed, the byte offset must map 1:1
+ *  to the partition.
+ */
+
+#ifndef MAIN_OTA_RESUME_H_
+#define MAIN_OTA_RESUME_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Chunks must start on a flash sector boundary so a resumed session can re-erase it
+#define OTA_RESUME_CHUNK_ALIGN		4096
+
+/**
+ * Checks whether the image is the one the device is running, by the SHA-256 of the
+ * running image (hashed once, whether it was flashed over OTA or serial).
+ * @param image_sha256 32 byte hash of the .bin file.
+ * @return true if flashing it again would be redundant.
+ */
+bool ota_resume_is_installed(const uint8_t *image_sha256);
+
+/**
+ * Gets the offset the upload of the image should continue from.
+ * @param image_sha256 32 byte hash of the image.
+ * @param image_size size of the image.
+ * @return committed offset of a matching interrupted upload, 0 otherwise.
+ */
+uint32_t ota_resume_get_next_offset(const uint8_t *image_sha256, uint32_t image_size);
+
+/**
+ * Starts receiving a chunk. A chunk at offset 0 discards any previous upload.
+ * @param image_sha256 32 byte hash of the image.
+ * @param start offset of the first byte of the chunk.
+ * @param image_size size of the whole image.
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if start is not chunk aligned or not the committed offset of this image,
+ *         ESP_ERR_INVALID_STATE if the OTA pipeline is still busy with another session, otherwise the OTA pipeline error.
+ */
+esp_err_t ota_resume_chunk_begin(const uint8_t *image_sha256, uint32_t start, uint32_t image_size);
+
+/**
+ * Writes chunk data to the OTA pipeline.
+ * @param data image bytes.
+ * @param len number of bytes.
+ * @return ESP_OK, otherwise the OTA pipeline error.
+ */
+esp_err_t ota_resume_chunk_write(const uint8_t *data, size_t len);
+
+/**
+ * Commits the chunk: flushes it to flash and persists the new offset. The last chunk
+ * verifies the image hash and selects the new boot partition.
+ * @param image_complete set to true when the last chunk was committed.
+ * @return ESP_OK, ESP_ERR_INVALID_CRC if the image does not match its hash, otherwise the OTA error.
+ */
+esp_err_t ota_resume_chunk_end(bool *image_complete);
+
+/**
+ * Drops the chunk being received, the upload can be resumed from the last committed offset.
+ */
+void ota_resume_chunk_abort(void);
+
+/**
+ * Forgets any interrupted upload, must be called before writing the update partition by other means.
+ */
+void ota_resume_reset(void);
+
+/**
+ * @return committed offset of the current (or last) resumable upload.
+ */
+uint32_t ota_resume_get_offset(void);
+
+#endif /* MAIN_OTA_RESUME_H_ */
@@ -0,0 +1,443 @@
+/*
+ * ota_stream.c
+ *
+ *  Decodes an uploaded firmware stream into the OTA pipeline.
+ *
+ *  Two stages, each detected from the first bytes it sees:
+ *  - transfer: a gzip upload is inflated on the fly with the miniz inflater
+ *    from ROM. RAM use is bounded by the 32 KB deflate window plus the
+ *    decompressor state, allocated only for the duration of a gzip session.
+ *    The gzip CRC trailer is not checked: esp_ota_end already validates the
+ *    decompressed image and its appended SHA-256.
+ *  - image: a delta patch (ota_delta.h) is applied against the running
+ *    partition, anything else is written to the OTA pipeline as the image.
+ */
+
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "rom/miniz.h"
+
+#include "ota_app.h"
+#include "ota_delta.h"
+#include "ota_stream.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "ota_stream";
+
+// gzip header constants (RFC 1952)
+#define GZIP_ID1				0x1F
+#define GZIP_ID2				0x8B
+#define GZIP_CM_DEFLATE			8
+#define GZIP_FIXED_HEADER_LEN	10
+#define GZIP_FLG_FHCRC			0x02
+#define GZIP_FLG_FEXTRA			0x04
+#define GZIP_FLG_FNAME			0x08
+#define GZIP_FLG_FCOMMENT		0x10
+
+/**
+ * Decoder states
+ */
+typedef enum ota_stream_state
+{
+	OTA_STREAM_STATE_DETECT = 0,
+	OTA_STREAM_STATE_RAW,
+	OTA_STREAM_STATE_GZIP_HEADER,
+	OTA_STREAM_STATE_GZIP_EXTRA_LEN,
+	OTA_STREAM_STATE_GZIP_EXTRA,
+	OTA_STREAM_STATE_GZIP_NAME,
+	OTA_STREAM_STATE_GZIP_COMMENT,
+	OTA_STREAM_STATE_GZIP_HCRC,
+	OTA_STREAM_STATE_GZIP_INFLATE,
+	OTA_STREAM_STATE_GZIP_TRAILER,
+	OTA_STREAM_STATE_ERROR,
+} ota_stream_state_e;
+
+/**
+ * Image stage states
+ */
+typedef enum ota_stream_image_state
+{
+	OTA_STREAM_IMAGE_DETECT = 0,
+	OTA_STREAM_IMAGE_RAW,
+	OTA_STREAM_IMAGE_DELTA,
+} ota_stream_image_state_e;
+
+// Current session
+static ota_stream_state_e g_state;
+static ota_stream_format_e g_format = OTA_STREAM_FORMAT_UNKNOWN;
+static uint32_t g_bytes_in;
+static size_t g_upload_size;
+
+// Image stage, the first bytes are held until the delta magic is ruled in or out
+static ota_stream_image_state_e g_image_state;
+static uint8_t g_magic[OTA_DELTA_MAGIC_LEN];
+static size_t g_magic_len;
+
+// gzip header parsing
+static uint8_t g_gzip_header[GZIP_FIXED_HEADER_LEN];
+static size_t g_gzip_header_len;
+static uint8_t g_gzip_flags;
+static size_t g_gzip_skip;
+
+// Inflater, allocated only for gzip uploads
+static tinfl_decompressor *g_inflator = NULL;
+static uint8_t *g_dict = NULL;
+static size_t g_dict_ofs;
+
+/**
+ * Releases the inflater memory.
+ */
+static void ota_stream_free_inflator(void)
+{
+	heap_caps_free(g_inflator);
+	heap_caps_free(g_dict);
+	g_inflator = NULL;
+	g_dict = NULL;
+}
+
+/**
+ * Allocates and initializes the inflater.
+ * @return ESP_OK or ESP_ERR_NO_MEM.
+ */
+static esp_err_t ota_stream_alloc_inflator(void)
+{
+	g_inflator = heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_8BIT);
+	g_dict = heap_caps_malloc(TINFL_LZ_DICT_SIZE, MALLOC_CAP_8BIT);
+	if (g_inflator == NULL || g_dict == NULL)
+	{
+		ESP_LOGE(TAG, "ota_stream_alloc_inflator: unable to allocate the inflater");
+		ota_stream_free_inflator();
+		return ESP_ERR_NO_MEM;
+	}
+
+	tinfl_init(g_inflator);
+	g_dict_ofs = 0;
+
+	return ESP_OK;
+}
+
+/**
+ * Image stage: passes decoded upload bytes to the delta applier or the OTA pipeline.
+ * @param data decoded bytes.
+ * @param len number of bytes.
+ * @return ESP_OK, otherwise the delta applier or OTA pipeline error.
+ */
+static esp_err_t ota_stream_emit(const uint8_t *data, size_t len)
+{
+	esp_err_t err = ESP_OK;
+
+	if (g_image_state == OTA_STREAM_IMAGE_DETECT)
+	{
+		while (len > 0 && g_magic_len < OTA_DELTA_MAGIC_LEN && *data == (uint8_t)OTA_DELTA_MAGIC[g_magic_len])
+		{
+			g_magic[g_magic_len++] = *data++;
+			len--;
+		}
+
+		if (g_magic_len == OTA_DELTA_MAGIC_LEN)
+		{
+			ESP_LOGI(TAG, "ota_stream_emit: delta patch");
+			g_image_state = OTA_STREAM_IMAGE_DELTA;
+			g_format = (g_format == OTA_STREAM_FORMAT_GZIP) ? OTA_STREAM_FORMAT_GZIP_DELTA : OTA_STREAM_FORMAT_DELTA;
+			err = ota_delta_begin();
+			if (err == ESP_OK)
+			{
+				err = ota_delta_write(g_magic, g_magic_len);
+			}
+		}
+		else if (len > 0)
+		{
+			// Not a patch, the held bytes belong to the image
+			g_image_state = OTA_STREAM_IMAGE_RAW;
+			if (g_format == OTA_STREAM_FORMAT_RAW)
+			{
+				ota_app_set_image_size(g_upload_size);
+			}
+			if (g_magic_len > 0)
+			{
+				err = ota_app_write(g_magic, g_magic_len);
+			}
+		}
+	}
+
+	if (err != ESP_OK || len == 0)
+	{
+		return err;
+	}
+
+	return (g_image_state == OTA_STREAM_IMAGE_DELTA) ? ota_delta_write(data, len) : ota_app_write(data, len);
+}
+
+/**
+ * Inflates deflate data into the image stage.
+ * @param data deflate stream bytes.
+ * @param len number of bytes.
+ * @param consumed set to the number of input bytes used (less than len once the stream ends).
+ * @return ESP_OK, ESP_ERR_INVALID_RESPONSE on corrupt data, otherwise the image stage error.
+ */
+static esp_err_t ota_stream_inflate(const uint8_t *data, size_t len, size_t *consumed)
+{
+	*consumed = 0;
+
+	for (;;)
+	{
+		size_t in_bytes = len;
+		size_t out_bytes = TINFL_LZ_DICT_SIZE - g_dict_ofs;
+
+		tinfl_status status = tinfl_decompress(g_inflator, data, &in_bytes, g_dict, g_dict + g_dict_ofs, &out_bytes, TINFL_FLAG_HAS_MORE_INPUT);
+
+		data += in_bytes;
+		len -= in_bytes;
+		*consumed += in_bytes;
+
+		if (out_bytes > 0)
+		{
+			esp_err_t err = ota_stream_emit(g_dict + g_dict_ofs, out_bytes);
+			if (err != ESP_OK)
+			{
+				return err;
+			}
+			g_dict_ofs = (g_dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+		}
+
+		if (status < TINFL_STATUS_DONE)
+		{
+			ESP_LOGE(TAG, "ota_stream_inflate: corrupt deflate stream (%d)", status);
+			return ESP_ERR_INVALID_RESPONSE;
+		}
+		if (status == TINFL_STATUS_DONE)
+		{
+			g_state = OTA_STREAM_STATE_GZIP_TRAILER;
+			return ESP_OK;
+		}
+		if (status == TINFL_STATUS_NEEDS_MORE_INPUT && (len == 0 || (in_bytes == 0 && out_bytes == 0)))
+		{
+			return ESP_OK;
+		}
+		// TINFL_STATUS_HAS_MORE_OUTPUT: the window wrapped, go around again
+	}
+}
+
+/**
+ * Skips the variable part of the gzip header.
+ * @param c next header byte.
+ */
+static void ota_stream_gzip_header_byte(uint8_t c)
+{
+	switch (g_state)
+	{
+		case OTA_STREAM_STATE_GZIP_HEADER:
+			g_gzip_header[g_gzip_header_len++] = c;
+			if (g_gzip_header_len < GZIP_FIXED_HEADER_LEN)
+			{
+				return;
+			}
+			if (g_gzip_header[1] != GZIP_ID2 || g_gzip_header[2] != GZIP_CM_DEFLATE)
+			{
+				ESP_LOGE(TAG, "ota_stream_gzip_header_byte: not a deflate gzip stream");
+				g_state = OTA_STREAM_STATE_ERROR;
+				return;
+			}
+			g_gzip_flags = g_gzip_header[3];
+			g_gzip_skip = 0;
+			break;
+
+		case OTA_STREAM_STATE_GZIP_EXTRA_LEN:
+			// Two bytes, little endian
+			g_gzip_skip |= (size_t)c << (8 * g_gzip_header_len++);
+			if (g_gzip_header_len < 2)
+			{
+				return;
+			}
+			g_state = OTA_STREAM_STATE_GZIP_EXTRA;
+			if (g_gzip_skip > 0)
+			{
+				return;
+			}
+			break;
+
+		case OTA_STREAM_STATE_GZIP_EXTRA:
+		case OTA_STREAM_STATE_GZIP_HCRC:
+			if (--g_gzip_skip > 0)
+			{
+				return;
+			}
+			break;
+
+		case OTA_STREAM_STATE_GZIP_NAME:
+		case OTA_STREAM_STATE_GZIP_COMMENT:
+			if (c != '\0')
+			{
+				return;
+			}
+			break;
+
+		default:
+			return;
+	}
+
+	// The current field is complete, move to the next optional one
+	if (g_state == OTA_STREAM_STATE_GZIP_HEADER && (g_gzip_flags & GZIP_FLG_FEXTRA))
+	{
+		g_state = OTA_STREAM_STATE_GZIP_EXTRA_LEN;
+		g_gzip_header_len = 0;
+	}
+	else if (g_state <= OTA_STREAM_STATE_GZIP_EXTRA && (g_gzip_flags & GZIP_FLG_FNAME))
+	{
+		g_state = OTA_STREAM_STATE_GZIP_NAME;
+	}
+	else if (g_state <= OTA_STREAM_STATE_GZIP_NAME && (g_gzip_flags & GZIP_FLG_FCOMMENT))
+	{
+		g_state = OTA_STREAM_STATE_GZIP_COMMENT;
+	}
+	else if (g_state <= OTA_STREAM_STATE_GZIP_COMMENT && (g_gzip_flags & GZIP_FLG_FHCRC))
+	{
+		g_state = OTA_STREAM_STATE_GZIP_HCRC;
+		g_gzip_skip = 2;
+	}
+	else
+	{
+		g_state = OTA_STREAM_STATE_GZIP_INFLATE;
+	}
+}
+
+esp_err_t ota_stream_begin(size_t upload_size)
+{
+	// The upload may be compressed or a patch, its size is not the image size
+	esp_err_t err = ota_app_begin(0);
+	if (err != ESP_OK)
+	{
+		return err;
+	}
+
+	g_state = OTA_STREAM_STATE_DETECT;
+	g_format = OTA_STREAM_FORMAT_UNKNOWN;
+	g_bytes_in = 0;
+	g_upload_size = upload_size;
+	g_gzip_header_len = 0;
+	g_image_state = OTA_STREAM_IMAGE_DETECT;
+	g_magic_len = 0;
+
+	return ESP_OK;
+}
+
+esp_err_t ota_stream_write(const uint8_t *data, size_t len)
+{
+	esp_err_t err;
+	size_t consumed;
+
+	g_bytes_in += len;
+
+	while (len > 0)
+	{
+		switch (g_state)
+		{
+			case OTA_STREAM_STATE_DETECT:
+				if (data[0] == GZIP_ID1)
+				{
+					err = ota_stream_alloc_inflator();
+					if (err != ESP_OK)
+					{
+						g_state = OTA_STREAM_STATE_ERROR;
+						return err;
+					}
+					ESP_LOGI(TAG, "ota_stream_write: gzip compressed image");
+					g_format = OTA_STREAM_FORMAT_GZIP;
+					g_state = OTA_STREAM_STATE_GZIP_HEADER;
+				}
+				else
+				{
+					g_format = OTA_STREAM_FORMAT_RAW;
+					g_state = OTA_STREAM_STATE_RAW;
+				}
+				break;
+
+			case OTA_STREAM_STATE_RAW:
+				err = ota_stream_emit(data, len);
+				if (err != ESP_OK)
+				{
+					g_state = OTA_STREAM_STATE_ERROR;
+				}
+				return err;
+
+			case OTA_STREAM_STATE_GZIP_INFLATE:
+				err = ota_stream_inflate(data, len, &consumed);
+				if (err != ESP_OK)
+				{
+					g_state = OTA_STREAM_STATE_ERROR;
+					return err;
+				}
+				data += consumed;
+				len -= consumed;
+				break;
+
+			case OTA_STREAM_STATE_GZIP_TRAILER:
+				// CRC32 and ISIZE, the image itself is verified by esp_ota_end
+				return ESP_OK;
+
+			case OTA_STREAM_STATE_ERROR:
+				return ESP_ERR_INVALID_RESPONSE;
+
+			default:
+				ota_stream_gzip_header_byte(*data++);
+				len--;
+				break;
+		}
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t ota_stream_end(void)
+{
+	esp_err_t err = ESP_OK;
+	bool complete = (g_state == OTA_STREAM_STATE_RAW || g_state == OTA_STREAM_STATE_GZIP_TRAILER);
+
+	ota_stream_free_inflator();
+
+	if (!complete)
+	{
+		ESP_LOGE(TAG, "ota_stream_end: upload ended in state %d", g_state);
+		err = ESP_ERR_INVALID_RESPONSE;
+	}
+	else if (g_image_state == OTA_STREAM_IMAGE_DELTA)
+	{
+		err = ota_delta_end();
+	}
+	else if (g_image_state == OTA_STREAM_IMAGE_DETECT && g_magic_len > 0)
+	{
+		// Upload shorter than the delta magic, let esp_ota_end reject it
+		err = ota_app_write(g_magic, g_magic_len);
+	}
+
+	if (err != ESP_OK)
+	{
+		if (g_image_state == OTA_STREAM_IMAGE_DELTA)
+		{
+			ota_delta_abort();
+		}
+		ota_app_abort();
+		return err;
+	}
+
+	return ota_app_end();
+}
+
+void ota_stream_abort(void)
+{
+	ota_stream_free_inflator();
+	ota_delta_abort();
+	ota_app_abort();
+}
+
+ota_stream_format_e ota_stream_get_format(void)
+{
+	return g_format;
+}
+
+uint32_t ota_stream_get_bytes_in(void)
+{
+	return g_bytes_in;
+}
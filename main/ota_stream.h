@@ -0,0 +1,66 @@
+/*
+ * ota_stream.h
+ *
+ *  Decodes an uploaded firmware stream (raw, gzip compressed and/or delta
+ *  patch) into the OTA pipeline.
+ */
+
+#ifndef MAIN_OTA_STREAM_H_
+#define MAIN_OTA_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/**
+ * Upload formats, detected from the first bytes of the stream
+ */
+typedef enum ota_stream_format
+{
+	OTA_STREAM_FORMAT_UNKNOWN = 0,
+	OTA_STREAM_FORMAT_RAW,			///> plain .bin image
+	OTA_STREAM_FORMAT_GZIP,			///> .bin.gz produced by the ota_image_gz build target
+	OTA_STREAM_FORMAT_DELTA,		///> patch against the running image (ota_delta.h)
+	OTA_STREAM_FORMAT_GZIP_DELTA,	///> gzip compressed patch, the default output of ota_image_tool.py diff
+} ota_stream_format_e;
+
+/**
+ * Starts a new OTA session.
+ * @param upload_size size of the upload as sent by the client, 0 if unknown. Reported as the
+ * image size only once the upload turns out to be a plain image, compressed uploads and
+ * patches leave the image size unknown.
+ * @return ESP_OK, otherwise the ota_app_begin error.
+ */
+esp_err_t ota_stream_begin(size_t upload_size);
+
+/**
+ * Decodes the next chunk of the upload into the OTA pipeline.
+ * @param data uploaded bytes.
+ * @param len number of bytes.
+ * @return ESP_OK, ESP_ERR_INVALID_RESPONSE on corrupt input, otherwise the OTA pipeline error.
+ */
+esp_err_t ota_stream_write(const uint8_t *data, size_t len);
+
+/**
+ * Finishes the session, see ota_app_end.
+ * @return ESP_OK if the new image will be booted after restart.
+ */
+esp_err_t ota_stream_end(void);
+
+/**
+ * Cancels the session and releases the decoder memory.
+ */
+void ota_stream_abort(void);
+
+/**
+ * @return format of the current (or last) upload.
+ */
+ota_stream_format_e ota_stream_get_format(void);
+
+/**
+ * @return number of uploaded (possibly compressed) bytes of the current (or last) upload.
+ */
+uint32_t ota_stream_get_bytes_in(void);
+
+#endif /* MAIN_OTA_STREAM_H_ */
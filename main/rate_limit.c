@@ -0,0 +1,129 @@
+/*
+ * rate_limit.c
+ *
+ *  Token bucket rate limiting per client IP and route class.
+ */
+
+#include <stddef.h>
+
+#include "esp_timer.h"
+
+#include "rate_limit.h"
+
+/**
+ * Buckets of one client
+ */
+typedef struct rate_limit_client
+{
+	uint32_t ip;
+	uint32_t last_seen_ms;
+	bool in_use;
+	rate_limit_bucket_t buckets[RATE_LIMIT_CLASS_COUNT];
+} rate_limit_client_t;
+
+static const rate_limit_config_t g_configs[RATE_LIMIT_CLASS_COUNT] = {
+	[RATE_LIMIT_CLASS_STATIC] = { CONFIG_HTTP_RATE_LIMIT_STATIC_RATE, CONFIG_HTTP_RATE_LIMIT_STATIC_BURST },
+	[RATE_LIMIT_CLASS_POLL] = { CONFIG_HTTP_RATE_LIMIT_POLL_RATE, CONFIG_HTTP_RATE_LIMIT_POLL_BURST },
+	[RATE_LIMIT_CLASS_CONTROL] = { CONFIG_HTTP_RATE_LIMIT_CONTROL_RATE, CONFIG_HTTP_RATE_LIMIT_CONTROL_BURST },
+};
+
+static rate_limit_client_t g_clients[RATE_LIMIT_MAX_CLIENTS];
+
+const char *rate_limit_class_name(rate_limit_class_e cls)
+{
+	static const char *names[] = { "static", "poll", "control", "none" };
+
+	return names[cls];
+}
+
+void rate_limit_bucket_init(rate_limit_bucket_t *bucket, const rate_limit_config_t *config, uint32_t now_ms)
+{
+	bucket->tokens_milli = (uint32_t)config->burst * 1000;
+	bucket->last_ms = now_ms;
+}
+
+bool rate_limit_bucket_take(rate_limit_bucket_t *bucket, const rate_limit_config_t *config, uint32_t now_ms, uint32_t *retry_after_s)
+{
+	uint32_t capacity = (uint32_t)config->burst * 1000;
+	uint32_t elapsed_ms = now_ms - bucket->last_ms;
+
+	// rate_per_s tokens per second is rate_per_s thousandths per millisecond,
+	// the comparison keeps a long idle time from overflowing the product
+	if (elapsed_ms >= (capacity - bucket->tokens_milli) / config->rate_per_s)
+	{
+		bucket->tokens_milli = capacity;
+	}
+	else
+	{
+		bucket->tokens_milli += elapsed_ms * config->rate_per_s;
+	}
+	bucket->last_ms = now_ms;
+
+	if (bucket->tokens_milli >= 1000)
+	{
+		bucket->tokens_milli -= 1000;
+		return true;
+	}
+
+	if (retry_after_s != NULL)
+	{
+		// Rounded up, Retry-After has a one second resolution
+		uint32_t missing_ms = (1000 - bucket->tokens_milli + config->rate_per_s - 1) / config->rate_per_s;
+		*retry_after_s = (missing_ms + 999) / 1000;
+	}
+
+	return false;
+}
+
+/**
+ * Finds the client, or takes over a free slot or the least recently seen one.
+ */
+static rate_limit_client_t *rate_limit_get_client(uint32_t ip, uint32_t now_ms)
+{
+	rate_limit_client_t *victim = NULL;
+
+	for (int i = 0; i < RATE_LIMIT_MAX_CLIENTS; i++)
+	{
+		rate_limit_client_t *client = &g_clients[i];
+
+		if (!client->in_use)
+		{
+			if (victim == NULL || victim->in_use)
+			{
+				victim = client;
+			}
+		}
+		else if (client->ip == ip)
+		{
+			return client;
+		}
+		else if (victim == NULL || (victim->in_use && now_ms - client->last_seen_ms > now_ms - victim->last_seen_ms))
+		{
+			victim = client;
+		}
+	}
+
+	victim->ip = ip;
+	victim->in_use = true;
+	for (int c = 0; c < RATE_LIMIT_CLASS_COUNT; c++)
+	{
+		rate_limit_bucket_init(&victim->buckets[c], &g_configs[c], now_ms);
+	}
+
+	return victim;
+}
+
+bool rate_limit_admit(uint32_t client_ip, rate_limit_class_e cls, uint32_t *retry_after_s)
+{
+	if (cls >= RATE_LIMIT_CLASS_COUNT)
+	{
+		return true;
+	}
+
+	uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+	rate_limit_client_t *client = rate_limit_get_client(client_ip, now_ms);
+
+	client->last_seen_ms = now_ms;
+
+	return rate_limit_bucket_take(&client->buckets[cls], &g_configs[cls], now_ms, retry_after_s);
+}
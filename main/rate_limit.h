@@ -0,0 +1,88 @@
+/*
+ * rate_limit.h
+ *
+ *  Per-client admission control for the HTTP server.
+ *
+ *  Every client IP gets one token bucket per route class, so a tab polling
+ *  /dhtSensor.json too fast only empties its own polling bucket: the Wi-Fi
+ *  management and OTA routes of that client, and every route of the other
+ *  clients, keep being served. Buckets hold thousandths of a token so low
+ *  rates refill smoothly.
+ *
+ *  The client table is only used from the httpd task and is not locked.
+ */
+
+#ifndef MAIN_RATE_LIMIT_H_
+#define MAIN_RATE_LIMIT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Clients tracked at once, the least recently seen one is replaced
+#define RATE_LIMIT_MAX_CLIENTS		CONFIG_HTTP_RATE_LIMIT_MAX_CLIENTS
+
+/**
+ * Route classes, each with its own rate and burst
+ */
+typedef enum rate_limit_class
+{
+	RATE_LIMIT_CLASS_STATIC = 0,	///> page, scripts, styles
+	RATE_LIMIT_CLASS_POLL,			///> telemetry and status polled by the page
+	RATE_LIMIT_CLASS_CONTROL,		///> Wi-Fi management and OTA control
+	RATE_LIMIT_CLASS_COUNT,
+	RATE_LIMIT_CLASS_NONE = RATE_LIMIT_CLASS_COUNT,	///> never limited (OTA image transfer)
+} rate_limit_class_e;
+
+/**
+ * Rate and burst of a class
+ */
+typedef struct rate_limit_config
+{
+	uint16_t rate_per_s;			///> tokens added per second
+	uint16_t burst;					///> bucket capacity
+} rate_limit_config_t;
+
+/**
+ * Token bucket
+ */
+typedef struct rate_limit_bucket
+{
+	uint32_t tokens_milli;			///> thousandths of a token
+	uint32_t last_ms;				///> time of the last refill
+} rate_limit_bucket_t;
+
+/**
+ * Gets the name of a class, as in the metric labels.
+ * @param cls route class.
+ * @return the name, a string literal (safe for DLOG), "none" for RATE_LIMIT_CLASS_NONE.
+ */
+const char *rate_limit_class_name(rate_limit_class_e cls);
+
+/**
+ * Fills a bucket.
+ * @param bucket bucket to reset.
+ * @param config rate and burst of the bucket.
+ * @param now_ms current time in milliseconds.
+ */
+void rate_limit_bucket_init(rate_limit_bucket_t *bucket, const rate_limit_config_t *config, uint32_t now_ms);
+
+/**
+ * Refills a bucket for the time elapsed and takes one token if there is one.
+ * @param bucket bucket to take from.
+ * @param config rate and burst of the bucket.
+ * @param now_ms current time in milliseconds.
+ * @param retry_after_s if the token was refused, seconds until one is available.
+ * @return true if the token was taken.
+ */
+bool rate_limit_bucket_take(rate_limit_bucket_t *bucket, const rate_limit_config_t *config, uint32_t now_ms, uint32_t *retry_after_s);
+
+/**
+ * Admits or refuses a request of a client.
+ * @param client_ip IPv4 address of the client, network byte order.
+ * @param cls route class of the request.
+ * @param retry_after_s if the request was refused, seconds the client should wait.
+ * @return true if the request may be handled.
+ */
+bool rate_limit_admit(uint32_t client_ip, rate_limit_class_e cls, uint32_t *retry_after_s);
+
+#endif /* MAIN_RATE_LIMIT_H_ */
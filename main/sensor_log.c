@@ -0,0 +1,633 @@
+/*
+ * sensor_log.c
+ *
+ *  Circular page log in the "sensorlog" partition. One mutex serializes the
+ *  page buffer and every flash access: the log task holds it to add a
+ *  record or write a page, readers for one page read at a time, so an
+ *  export never holds the writer for long.
+ *
+ *  A page being read can be erased and rewritten in between, the reader
+ *  checks the sequence number and the CRC of every page it reads.
+ *
+ *  Each sensor fills its own page, a Gorilla block (gorilla.h) of its
+ *  readings, quantized to the resolution of the sensor. Pages of the first
+ *  layout (fixed size records, all sensors mixed) are still read.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "sys/param.h"
+
+#include "dlog.h"
+#include "event_bus.h"
+#include "gorilla.h"
+#include "metrics.h"
+#include "sensor_log.h"
+#include "tasks_common.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "sensor_log";
+
+// Label of the partition in partitions.csv
+static const char sensor_log_partition_label[] = "sensorlog";
+
+#define SENSOR_LOG_MAGIC				0x474F4C53		// "SLOG"
+#define SENSOR_LOG_ERASED				0xFFFFFFFF
+
+// Layouts of a page: sensor_log_record_t array (read only), Gorilla block of one sensor
+#define SENSOR_LOG_FORMAT_RECORDS		1
+#define SENSOR_LOG_FORMAT_GORILLA		2
+
+// Sensors logged, event_bus_sensor_e values
+#define SENSOR_LOG_SENSORS				2
+
+// Bytes of the Gorilla block of a page
+#define SENSOR_LOG_BLOCK_BYTES			(SENSOR_LOG_PAGE_SIZE - sizeof(sensor_log_page_header_t) - 8)
+
+// Unix time of 2016, earlier times mean the clock was not set (as sntp_time_sync.c)
+#define SENSOR_LOG_CLOCK_SET_S			1451606400
+
+// Sensor readings waiting for the log task
+#define SENSOR_LOG_EVENT_QUEUE_LENGTH	8
+
+/**
+ * Page as written to flash, up to the last record or block byte
+ */
+typedef struct sensor_log_page
+{
+	sensor_log_page_header_t header;
+	union
+	{
+		sensor_log_record_t records[SENSOR_LOG_PAGE_RECORDS];	///> SENSOR_LOG_FORMAT_RECORDS, header.count records
+		struct
+		{
+			uint8_t sensor;
+			uint8_t flags;			///> of every reading of the block
+			uint16_t bytes;			///> of data
+			float quantum;			///> gorilla_encoder_init quantum
+			uint8_t data[SENSOR_LOG_BLOCK_BYTES];
+		} block;					///> SENSOR_LOG_FORMAT_GORILLA, header.count readings
+	};
+} sensor_log_page_t;
+
+_Static_assert(sizeof(sensor_log_page_t) == SENSOR_LOG_PAGE_SIZE, "sensor_log_page_t must fill a page");
+
+/**
+ * Page being filled for a sensor
+ */
+typedef struct sensor_log_writer
+{
+	sensor_log_page_t page;
+	gorilla_encoder_t encoder;
+	int64_t start_us;				///> when the first reading was added
+} sensor_log_writer_t;
+
+// Resolution kept per sensor: the LM35 reads whole mV (0.1 °C), the ultrasonic sensor is accurate to a few mm
+static const float sensor_log_quanta[SENSOR_LOG_SENSORS] = {
+	[EVENT_BUS_SENSOR_TEMPERATURE] = 0.1f,
+	[EVENT_BUS_SENSOR_DISTANCE] = 0.1f,
+};
+
+static const esp_partition_t *g_partition;
+static uint32_t g_pages;			// pages of the partition
+static uint32_t g_sector_pages;		// pages of an erase sector
+
+// Next page to write and oldest page kept, guarded by g_lock
+static uint32_t g_next_seq;
+static uint32_t g_oldest_seq;
+
+// Pages being filled, guarded by g_lock
+static sensor_log_writer_t g_writers[SENSOR_LOG_SENSORS];
+
+static SemaphoreHandle_t g_lock;
+
+// Serializes the readers, they share one page buffer
+static SemaphoreHandle_t g_read_lock;
+static sensor_log_page_t g_read_page;
+
+static event_bus_subscriber_t *g_subscriber;
+
+static metrics_counter_t g_records = METRICS_COUNTER_INIT("sensor_log_records_total", "Sensor readings added to the flash log", NULL);
+static metrics_counter_t g_pages_written = METRICS_COUNTER_INIT("sensor_log_pages_written_total", "Pages written to the flash log", NULL);
+static metrics_counter_t g_erases = METRICS_COUNTER_INIT("sensor_log_sector_erases_total", "Flash log sectors erased, each sector once per pass over the partition", NULL);
+static metrics_counter_t g_write_errors = METRICS_COUNTER_INIT("sensor_log_write_errors_total", "Flash log pages lost to an erase or write error", NULL);
+static metrics_counter_t g_bad_pages = METRICS_COUNTER_INIT("sensor_log_bad_pages_total", "Flash log pages skipped by a read, CRC mismatch or overwritten meanwhile", NULL);
+
+/**
+ * Bytes of a page after the header, 0 if its counts don't fit a page.
+ */
+static size_t sensor_log_body_size(const sensor_log_page_t *page)
+{
+	if (page->header.format == SENSOR_LOG_FORMAT_RECORDS)
+	{
+		return (page->header.count <= SENSOR_LOG_PAGE_RECORDS) ? page->header.count * sizeof(sensor_log_record_t) : 0;
+	}
+
+	return (page->block.bytes <= SENSOR_LOG_BLOCK_BYTES) ? offsetof(sensor_log_page_t, block.data) - sizeof(page->header) + page->block.bytes : 0;
+}
+
+/**
+ * CRC of a page, header up to crc and body.
+ */
+static uint32_t sensor_log_crc(const sensor_log_page_t *page, size_t body_size)
+{
+	uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&page->header, offsetof(sensor_log_page_header_t, crc));
+
+	return esp_rom_crc32_le(crc, (const uint8_t *)page + sizeof(page->header), body_size);
+}
+
+/**
+ * Reads the header of the page at a position of the partition.
+ */
+static esp_err_t sensor_log_read_header(uint32_t pos, sensor_log_page_header_t *header)
+{
+	return esp_partition_read(g_partition, (size_t)pos * SENSOR_LOG_PAGE_SIZE, header, sizeof(*header));
+}
+
+/**
+ * Checks that a header was written for the page at a position, CRC aside.
+ */
+static bool sensor_log_header_valid(const sensor_log_page_header_t *header, uint32_t pos)
+{
+	return header->magic == SENSOR_LOG_MAGIC && header->seq % g_pages == pos
+			&& (header->format == SENSOR_LOG_FORMAT_RECORDS || header->format == SENSOR_LOG_FORMAT_GORILLA);
+}
+
+/**
+ * Finds the next page to write and the oldest page kept. Reads the first
+ * page of each sector, then the pages of the newest sector.
+ */
+static void sensor_log_scan(void)
+{
+	sensor_log_page_header_t header;
+	bool found = false;
+	uint32_t head_sector = 0;
+	uint32_t head_seq = 0;
+	uint32_t oldest_seq = 0;
+
+	for (uint32_t sector = 0; sector < g_pages / g_sector_pages; sector++)
+	{
+		// The first page is enough unless it was torn, then the next written one tells the sector
+		for (uint32_t i = 0; i < g_sector_pages; i++)
+		{
+			uint32_t pos = sector * g_sector_pages + i;
+
+			if (sensor_log_read_header(pos, &header) != ESP_OK || (header.magic == SENSOR_LOG_ERASED && header.seq == SENSOR_LOG_ERASED))
+			{
+				break;
+			}
+			if (sensor_log_header_valid(&header, pos))
+			{
+				uint32_t seq = header.seq - i;
+
+				if (!found || seq > head_seq)
+				{
+					head_sector = sector;
+					head_seq = seq;
+				}
+				if (!found || seq < oldest_seq)
+				{
+					oldest_seq = seq;
+				}
+				found = true;
+				break;
+			}
+		}
+	}
+
+	if (!found)
+	{
+		g_next_seq = 0;
+		g_oldest_seq = 0;
+		DLOGI(TAG, "sensor_log_scan: empty log, %" PRIu32 " pages", g_pages);
+		return;
+	}
+
+	// Pages are written in order, the last one not erased ends the log
+	g_next_seq = head_seq + 1;
+	for (uint32_t i = g_sector_pages; i-- > 0;)
+	{
+		if (sensor_log_read_header(head_sector * g_sector_pages + i, &header) == ESP_OK
+				&& !(header.magic == SENSOR_LOG_ERASED && header.seq == SENSOR_LOG_ERASED))
+		{
+			g_next_seq = head_seq + i + 1;
+			break;
+		}
+	}
+	g_oldest_seq = oldest_seq;
+
+	DLOGI(TAG, "sensor_log_scan: pages %" PRIu32 " to %" PRIu32 " of %" PRIu32, g_oldest_seq, g_next_seq - 1, g_pages);
+}
+
+/**
+ * Writes the page of a sensor, erasing the sector first when the page starts one.
+ * Called with g_lock held.
+ */
+static esp_err_t sensor_log_write_page(sensor_log_writer_t *writer)
+{
+	sensor_log_page_t *page = &writer->page;
+	uint32_t pos = g_next_seq % g_pages;
+	esp_err_t err = ESP_OK;
+
+	if (page->header.count == 0)
+	{
+		return ESP_OK;
+	}
+
+	if (pos % g_sector_pages == 0)
+	{
+		err = esp_partition_erase_range(g_partition, (size_t)pos * SENSOR_LOG_PAGE_SIZE, g_partition->erase_size);
+		if (err == ESP_OK)
+		{
+			metrics_counter_inc(&g_erases);
+			if (g_next_seq >= g_pages)
+			{
+				g_oldest_seq = MAX(g_oldest_seq, g_next_seq - g_pages + g_sector_pages);
+			}
+		}
+		else
+		{
+			// The sector can't be written, the next page starts the following one
+			g_next_seq += g_sector_pages;
+		}
+	}
+
+	if (err == ESP_OK)
+	{
+		size_t body_size;
+
+		page->header.magic = SENSOR_LOG_MAGIC;
+		page->header.seq = g_next_seq;
+		page->header.format = SENSOR_LOG_FORMAT_GORILLA;
+		page->header.reserved = 0;
+		page->block.bytes = (uint16_t)gorilla_encoder_bytes(&writer->encoder);
+		body_size = sensor_log_body_size(page);
+		page->header.crc = sensor_log_crc(page, body_size);
+
+		err = esp_partition_write(g_partition, (size_t)pos * SENSOR_LOG_PAGE_SIZE, page, sizeof(page->header) + body_size);
+		g_next_seq++;
+	}
+
+	if (err == ESP_OK)
+	{
+		metrics_counter_inc(&g_pages_written);
+	}
+	else
+	{
+		metrics_counter_inc(&g_write_errors);
+		DLOGE(TAG, "sensor_log_write_page: Error (%s) writing page %" PRIu32, esp_err_to_name(err), g_next_seq - 1);
+	}
+
+	page->header.count = 0;
+
+	return err;
+}
+
+/**
+ * Writes the pages whose first reading is CONFIG_SENSOR_LOG_FLUSH_S old, or all of them.
+ * Called with g_lock held.
+ * @param all write every page with readings.
+ * @param wait receives the time until the next page is due, portMAX_DELAY if none is waiting.
+ * @return ESP_OK, otherwise the first error of sensor_log_write_page.
+ */
+static esp_err_t sensor_log_write_due(bool all, TickType_t *wait)
+{
+	esp_err_t err = ESP_OK;
+
+	*wait = portMAX_DELAY;
+
+	for (int i = 0; i < SENSOR_LOG_SENSORS; i++)
+	{
+		sensor_log_writer_t *writer = &g_writers[i];
+		int64_t left_us = writer->start_us + (int64_t)CONFIG_SENSOR_LOG_FLUSH_S * 1000000 - esp_timer_get_time();
+
+		if (writer->page.header.count == 0)
+		{
+			continue;
+		}
+		if (all || left_us <= 0)
+		{
+			esp_err_t write_err = sensor_log_write_page(writer);
+
+			err = (err == ESP_OK) ? write_err : err;
+		}
+		else
+		{
+			*wait = MIN(*wait, pdMS_TO_TICKS(left_us / 1000) + 1);
+		}
+	}
+
+	return err;
+}
+
+/**
+ * Adds a reading to the page buffer, writes the page once full.
+ */
+static void sensor_log_add(const event_bus_event_t *event)
+{
+	struct timeval now;
+	uint32_t age_ms = (uint32_t)(esp_timer_get_time() / 1000) - event->time_ms;
+	event_bus_sensor_e sensor = event->data.sensor.sensor;
+	sensor_log_writer_t *writer;
+	int64_t time_ms;
+	uint8_t flags = 0;
+
+	if (sensor >= SENSOR_LOG_SENSORS)
+	{
+		return;
+	}
+	writer = &g_writers[sensor];
+
+	gettimeofday(&now, NULL);
+	if (now.tv_sec >= SENSOR_LOG_CLOCK_SET_S)
+	{
+		time_ms = (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000 - age_ms;
+	}
+	else
+	{
+		time_ms = event->time_ms;
+		flags = SENSOR_LOG_FLAG_UPTIME;
+	}
+
+	xSemaphoreTake(g_lock, portMAX_DELAY);
+	// The clock was set, uptime and Unix times don't share a block
+	if (writer->page.header.count > 0 && writer->page.block.flags != flags)
+	{
+		sensor_log_write_page(writer);
+	}
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (writer->page.header.count == 0)
+		{
+			writer->page.block.sensor = (uint8_t)sensor;
+			writer->page.block.flags = flags;
+			writer->page.block.quantum = sensor_log_quanta[sensor];
+			gorilla_encoder_init(&writer->encoder, writer->page.block.data, sizeof(writer->page.block.data), writer->page.block.quantum);
+			writer->start_us = esp_timer_get_time();
+		}
+		if (gorilla_encode(&writer->encoder, time_ms, event->data.sensor.value))
+		{
+			writer->page.header.count++;
+			break;
+		}
+		// Full, the reading starts the next page
+		sensor_log_write_page(writer);
+	}
+	xSemaphoreGive(g_lock);
+
+	metrics_counter_inc(&g_records);
+}
+
+/**
+ * Receives the readings, writes a partial page once its first reading is
+ * CONFIG_SENSOR_LOG_FLUSH_S old.
+ * @param pvParameters unused.
+ */
+static void sensor_log_task(void *pvParameters)
+{
+	event_bus_event_t event;
+
+	for (;;)
+	{
+		TickType_t wait;
+
+		xSemaphoreTake(g_lock, portMAX_DELAY);
+		sensor_log_write_due(false, &wait);
+		xSemaphoreGive(g_lock);
+
+		if (event_bus_receive(g_subscriber, &event, wait))
+		{
+			sensor_log_add(&event);
+		}
+	}
+}
+
+/**
+ * Shutdown handler, writes the readings waiting in RAM before esp_restart.
+ */
+static void sensor_log_shutdown(void)
+{
+	sensor_log_flush();
+}
+
+void sensor_log_start(void)
+{
+	const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, sensor_log_partition_label);
+
+	if (partition == NULL || partition->erase_size % SENSOR_LOG_PAGE_SIZE != 0 || partition->size < 2 * partition->erase_size)
+	{
+		DLOGE(TAG, "sensor_log_start: no usable %s partition, log disabled", sensor_log_partition_label);
+		return;
+	}
+
+	g_sector_pages = partition->erase_size / SENSOR_LOG_PAGE_SIZE;
+	g_pages = partition->size / partition->erase_size * g_sector_pages;
+	g_lock = xSemaphoreCreateMutex();
+	g_read_lock = xSemaphoreCreateMutex();
+	g_partition = partition;
+
+	sensor_log_scan();
+
+	metrics_register(&g_records.base);
+	metrics_register(&g_pages_written.base);
+	metrics_register(&g_erases.base);
+	metrics_register(&g_write_errors.base);
+	metrics_register(&g_bad_pages.base);
+
+	g_subscriber = event_bus_subscribe("sensor_log", EVENT_BUS_TOPIC_BIT(EVENT_BUS_TOPIC_SENSOR), SENSOR_LOG_EVENT_QUEUE_LENGTH);
+	if (g_subscriber == NULL)
+	{
+		return;
+	}
+
+	xTaskCreatePinnedToCore(&sensor_log_task, "sensor_log", SENSOR_LOG_TASK_STACK_SIZE, NULL, SENSOR_LOG_TASK_PRIORITY, NULL, SENSOR_LOG_TASK_CORE_ID);
+	esp_register_shutdown_handler(sensor_log_shutdown);
+}
+
+esp_err_t sensor_log_flush(void)
+{
+	TickType_t wait;
+	esp_err_t err;
+
+	if (g_partition == NULL)
+	{
+		return ESP_OK;
+	}
+
+	// On restart the log task may be anywhere, don't wait forever for it
+	if (xSemaphoreTake(g_lock, pdMS_TO_TICKS(1000)) != pdTRUE)
+	{
+		return ESP_ERR_TIMEOUT;
+	}
+	err = sensor_log_write_due(true, &wait);
+	xSemaphoreGive(g_lock);
+
+	return err;
+}
+
+/**
+ * Calls visit for each reading of a page read back from flash.
+ * @param records incremented by the readings visited.
+ * @return ESP_OK, otherwise the first error of visit.
+ */
+static esp_err_t sensor_log_visit_page(const sensor_log_page_t *page, sensor_log_visit_fn_t visit, void *ctx, size_t *records)
+{
+	gorilla_decoder_t dec;
+	sensor_log_record_t record;
+	int64_t time_ms;
+	esp_err_t err = ESP_OK;
+
+	if (page->header.format == SENSOR_LOG_FORMAT_RECORDS)
+	{
+		for (int i = 0; err == ESP_OK && i < page->header.count; i++)
+		{
+			err = visit(&page->records[i], ctx);
+			(*records)++;
+		}
+		return err;
+	}
+
+	record.sensor = page->block.sensor;
+	record.flags = page->block.flags;
+	gorilla_decoder_init(&dec, page->block.data, page->block.bytes, page->header.count, page->block.quantum);
+	while (err == ESP_OK && gorilla_decode(&dec, &time_ms, &record.value))
+	{
+		record.time_s = (uint32_t)(time_ms / 1000);
+		record.time_ms = (uint16_t)(time_ms % 1000);
+		err = visit(&record, ctx);
+		(*records)++;
+	}
+	if (dec.error)
+	{
+		metrics_counter_inc(&g_bad_pages);
+	}
+
+	return err;
+}
+
+esp_err_t sensor_log_read(uint32_t seq, size_t limit, sensor_log_visit_fn_t visit, void *ctx, uint32_t *next)
+{
+	sensor_log_page_t *page = &g_read_page;
+	esp_err_t err = ESP_OK;
+	size_t records = 0;
+
+	*next = seq;
+	if (g_partition == NULL)
+	{
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	if (limit == 0)
+	{
+		limit = SENSOR_LOG_READ_LIMIT;
+	}
+
+	xSemaphoreTake(g_read_lock, portMAX_DELAY);
+
+	while (err == ESP_OK && records < limit)
+	{
+		size_t body_size;
+
+		xSemaphoreTake(g_lock, portMAX_DELAY);
+		seq = MAX(seq, g_oldest_seq);
+		if (seq >= g_next_seq)
+		{
+			xSemaphoreGive(g_lock);
+			break;
+		}
+		err = esp_partition_read(g_partition, (size_t)(seq % g_pages) * SENSOR_LOG_PAGE_SIZE, page, sizeof(*page));
+		xSemaphoreGive(g_lock);
+
+		if (err != ESP_OK)
+		{
+			break;
+		}
+
+		body_size = sensor_log_body_size(page);
+		if (sensor_log_header_valid(&page->header, seq % g_pages) && page->header.seq == seq && body_size > 0
+				&& page->header.crc == sensor_log_crc(page, body_size))
+		{
+			err = sensor_log_visit_page(page, visit, ctx, &records);
+		}
+		else
+		{
+			metrics_counter_inc(&g_bad_pages);
+		}
+		seq++;
+	}
+	*next = seq;
+
+	xSemaphoreGive(g_read_lock);
+
+	return err;
+}
+
+/**
+ * Output of sensor_log_render_json
+ */
+typedef struct sensor_log_render_ctx
+{
+	text_writer_fn_t write;
+	void *ctx;
+	bool first;
+} sensor_log_render_ctx_t;
+
+/**
+ * Formats a record for sensor_log_render_json.
+ */
+static esp_err_t sensor_log_render_record(const sensor_log_record_t *record, void *ctx)
+{
+	sensor_log_render_ctx_t *render = ctx;
+	bool first = render->first;
+
+	render->first = false;
+
+	return text_writer_printf(render->write, render->ctx, "%s[%" PRIu32 ",%u,%u,%g,%u]", first ? "" : ",",
+			record->time_s, record->time_ms, record->sensor, (double)record->value, record->flags);
+}
+
+esp_err_t sensor_log_render_json(uint32_t seq, size_t limit, text_writer_fn_t write, void *ctx)
+{
+	sensor_log_render_ctx_t render = { .write = write, .ctx = ctx, .first = true };
+	uint32_t oldest = 0;
+	unsigned pending = 0;
+	uint32_t next;
+	esp_err_t err;
+
+	err = write("{\"records\":[", 12, ctx);
+	if (err == ESP_OK)
+	{
+		err = sensor_log_read(seq, limit, sensor_log_render_record, &render, &next);
+		if (err == ESP_ERR_NOT_SUPPORTED)
+		{
+			err = ESP_OK;
+		}
+	}
+	if (err != ESP_OK)
+	{
+		return err;
+	}
+
+	if (g_partition != NULL)
+	{
+		xSemaphoreTake(g_lock, portMAX_DELAY);
+		oldest = g_oldest_seq;
+		for (int i = 0; i < SENSOR_LOG_SENSORS; i++)
+		{
+			pending += g_writers[i].page.header.count;
+		}
+		xSemaphoreGive(g_lock);
+	}
+
+	return text_writer_printf(write, ctx, "],\"oldest\":%" PRIu32 ",\"next\":%" PRIu32 ",\"pending\":%u}", oldest, next, pending);
+}
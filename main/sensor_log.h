@@ -0,0 +1,116 @@
+/*
+ * sensor_log.h
+ *
+ *  Sensor readings kept in flash across restarts, OTA restarts included.
+ *
+ *  The "sensorlog" data partition is a circular log of 256 byte pages, each
+ *  written once: a header (sequence number, reading count, CRC) and the
+ *  readings of one sensor, compressed (gorilla.h) to about 1 byte each.
+ *  Readings received from the event bus are batched in RAM and written a
+ *  page at a time, so the sensor tasks never wait for flash. A page is
+ *  flushed early after CONFIG_SENSOR_LOG_FLUSH_S and on restart.
+ *
+ *  Page n always lives at page n % pages of the partition, so the log
+ *  wraps through every sector in turn and each sector is erased once per
+ *  pass (wear leveling without a mapping table). At boot only the first
+ *  page of each sector is read to find the newest sector. A page whose CRC
+ *  does not match (power lost while writing it) is skipped.
+ */
+
+#ifndef MAIN_SENSOR_LOG_H_
+#define MAIN_SENSOR_LOG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "text_writer.h"
+
+// Bytes of a page, the flash program page
+#define SENSOR_LOG_PAGE_SIZE			256
+
+// Records a page of the first layout holds after its header
+#define SENSOR_LOG_PAGE_RECORDS			((SENSOR_LOG_PAGE_SIZE - sizeof(sensor_log_page_header_t)) / sizeof(sensor_log_record_t))
+
+// Records of one read when the caller gives no limit, and the most /sensorLog.json returns
+#define SENSOR_LOG_READ_LIMIT			1000
+
+/**
+ * Record flags
+ */
+#define SENSOR_LOG_FLAG_UPTIME			0x01	///> time is the uptime, the clock was not set yet
+
+/**
+ * Page header
+ */
+typedef struct sensor_log_page_header
+{
+	uint32_t magic;
+	uint32_t seq;					///> page number since the log was created
+	uint16_t count;					///> readings in the page
+	uint8_t format;					///> layout of the records, see sensor_log.c
+	uint8_t reserved;
+	uint32_t crc;					///> CRC32 of the header up to crc and of the records
+} sensor_log_page_header_t;
+
+/**
+ * Record
+ */
+typedef struct sensor_log_record
+{
+	uint32_t time_s;				///> Unix time, or uptime with SENSOR_LOG_FLAG_UPTIME
+	uint16_t time_ms;				///> milliseconds of time_s
+	uint8_t sensor;					///> event_bus_sensor_e
+	uint8_t flags;
+	float value;
+} sensor_log_record_t;
+
+/**
+ * Called for each record of sensor_log_read.
+ * @param record record.
+ * @param ctx user context.
+ * @return ESP_OK to continue.
+ */
+typedef esp_err_t (*sensor_log_visit_fn_t)(const sensor_log_record_t *record, void *ctx);
+
+/**
+ * Finds the end of the log, subscribes to the sensor readings and starts
+ * the task writing them. Without the partition the log stays disabled.
+ */
+void sensor_log_start(void);
+
+/**
+ * Writes the records waiting in RAM, called on restart.
+ * @return ESP_OK if nothing was waiting or the page was written.
+ */
+esp_err_t sensor_log_flush(void);
+
+/**
+ * Reads the records saved from page seq on, one page at a time. Pages hold
+ * one sensor each: the readings of a sensor come in time order, those of
+ * different sensors interleave by page. Pages overwritten meanwhile are
+ * skipped. Readings still waiting in RAM are not read.
+ * @param seq first page, 0 for the oldest page kept.
+ * @param limit records after which the read stops at the end of a page.
+ * @param visit called for each record.
+ * @param ctx passed to visit.
+ * @param next receives the page to continue from.
+ * @return ESP_OK, ESP_ERR_NOT_SUPPORTED without the partition, otherwise the first error of visit or of the flash.
+ */
+esp_err_t sensor_log_read(uint32_t seq, size_t limit, sensor_log_visit_fn_t visit, void *ctx, uint32_t *next);
+
+/**
+ * Renders records of the log as JSON, see sensor_log_read:
+ * {"records":[[time_s,time_ms,sensor,value,flags],...],"oldest":120,"next":180,"pending":7}
+ * pending counts the records still waiting in RAM, next is the seq of the following request.
+ * @param seq first page.
+ * @param limit records after which the read stops at the end of a page.
+ * @param write output function.
+ * @param ctx passed to write.
+ * @return ESP_OK, otherwise the first error returned by write.
+ */
+esp_err_t sensor_log_render_json(uint32_t seq, size_t limit, text_writer_fn_t write, void *ctx);
+
+#endif /* MAIN_SENSOR_LOG_H_ */
@@ -13,14 +13,18 @@
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
 #include "driver/ledc.h"
+#include "esp_timer.h"
+#include "metrics.h"
+#include "dlog.h"
+#include "event_bus.h"
+#include "boot.h"
+#include "settings.h"
 
 static const char *TAG = "SENSORS_APP";
 
 // Configurações do LM35
+// Limiares, períodos e faixa do PWM são parâmetros (settings.h), alteráveis pelo /settings.json
 #define EXAMPLE_ADC_ATTEN     ADC_ATTEN_DB_12
-#define TEMP_ACIONAR          40.0       
-#define TEMP_DESLIGAR         37.0
-#define MAX_DISTANCE_CM       400 // 4 metros
 
 // Variáveis Globais
 static float g_current_temp = 0.0;
@@ -31,6 +35,18 @@ static bool g_presence_state = false;
 // PWM duty atual
 static int current_duty = 0;
 
+// Inscrição da task_pwm nas leituras publicadas no event bus
+static event_bus_subscriber_t *pwm_subscriber = NULL;
+
+// Métricas das leituras (latência em microssegundos)
+static metrics_counter_t m_lm35_reads = METRICS_COUNTER_INIT("sensor_reads_total", "Leituras de sensor", "sensor=\"lm35\"");
+static metrics_counter_t m_ultrasonic_reads = METRICS_COUNTER_INIT("sensor_reads_total", "Leituras de sensor", "sensor=\"ultrasonic\"");
+static metrics_counter_t m_lm35_errors = METRICS_COUNTER_INIT("sensor_read_errors_total", "Leituras de sensor com falha", "sensor=\"lm35\"");
+static metrics_counter_t m_ultrasonic_errors = METRICS_COUNTER_INIT("sensor_read_errors_total", "Leituras de sensor com falha", "sensor=\"ultrasonic\"");
+static metrics_histogram_t m_lm35_latency = METRICS_HISTOGRAM_INIT("sensor_read_duration_seconds", "Tempo de leitura do sensor", "sensor=\"lm35\"", metrics_latency_bounds_us);
+static metrics_histogram_t m_ultrasonic_latency = METRICS_HISTOGRAM_INIT("sensor_read_duration_seconds", "Tempo de leitura do sensor", "sensor=\"ultrasonic\"", metrics_latency_bounds_us);
+static metrics_gauge_t m_pwm_duty = METRICS_GAUGE_INIT("cooling_pwm_duty", "Duty atual do PWM de resfriamento (0-8191)", NULL);
+
 // Handles do ADC
 static adc_oneshot_unit_handle_t adc1_handle;
 static adc_cali_handle_t adc1_cali_handle = NULL;
@@ -74,35 +90,63 @@ void sensors_app_start(void) {
     // Inicializa PWM
     pwm_init();
 
+    // Registra as métricas (mesmo nome em sequência, como o formato Prometheus exige)
+    metrics_register(&m_lm35_reads.base);
+    metrics_register(&m_ultrasonic_reads.base);
+    metrics_register(&m_lm35_errors.base);
+    metrics_register(&m_ultrasonic_errors.base);
+    metrics_register(&m_lm35_latency.base);
+    metrics_register(&m_ultrasonic_latency.base);
+    metrics_register(&m_pwm_duty.base);
+
     // Cria tasks
     xTaskCreatePinnedToCore(task_lm35, "task_lm35", LM35_TASK_STACK_SIZE, NULL, LM35_TASK_PRIORITY, NULL, LM35_TASK_CORE_ID);
     xTaskCreatePinnedToCore(task_ultrasonic, "task_ultrasonic", ULTRASONIC_TASK_STACK_SIZE, NULL, ULTRASONIC_TASK_PRIORITY, NULL, ULTRASONIC_TASK_CORE_ID);
+    pwm_subscriber = event_bus_subscribe("task_pwm", EVENT_BUS_TOPIC_BIT(EVENT_BUS_TOPIC_SENSOR), 4);
     xTaskCreatePinnedToCore(task_pwm, "task_pwm", 2048, NULL, 4, NULL, 1);
 
     ESP_LOGI(TAG, "Sensores + PWM Iniciados");
 }
 
+// Publica uma leitura no event bus (não bloqueia; se a fila de um inscrito estiver cheia, a leitura é descartada e contada)
+static void sensors_publish(event_bus_sensor_e sensor, float value) {
+    event_bus_event_t event = {
+        .topic = EVENT_BUS_TOPIC_SENSOR,
+        .data.sensor = { .sensor = sensor, .value = value },
+    };
+    event_bus_publish(&event);
+    boot_mark(BOOT_MILESTONE_FIRST_SAMPLE);
+}
+
 // --- Task LM35 ---
 void task_lm35(void *pvParameters) {
     int adc_raw, voltage;
     while (1) {
-        if (adc_oneshot_read(adc1_handle, LM35_CHANNEL, &adc_raw) == ESP_OK) {
+        int64_t start_us = esp_timer_get_time();
+        esp_err_t read_err = adc_oneshot_read(adc1_handle, LM35_CHANNEL, &adc_raw);
+        metrics_histogram_observe(&m_lm35_latency, (uint32_t)(esp_timer_get_time() - start_us));
+        metrics_counter_inc(&m_lm35_reads);
+        if (read_err != ESP_OK) {
+            metrics_counter_inc(&m_lm35_errors);
+        }
+        if (read_err == ESP_OK) {
             if (do_calibration) {
                 adc_cali_raw_to_voltage(adc1_cali_handle, adc_raw, &voltage);
                 float temp = (float)voltage / 10.0;
                 g_current_temp = temp;
+                sensors_publish(EVENT_BUS_SENSOR_TEMPERATURE, temp);
 
-                if ((temp >= TEMP_ACIONAR) && !g_actuator_state) {
+                if ((temp >= settings_get_float(SETTINGS_TEMP_ON)) && !g_actuator_state) {
                     g_actuator_state = true;
                     ESP_LOGW(TAG, "Temp alta (%.1f). Atuador LIGADO.", temp);
-                } else if ((temp <= TEMP_DESLIGAR) && g_actuator_state) {
+                } else if ((temp <= settings_get_float(SETTINGS_TEMP_OFF)) && g_actuator_state) {
                     g_actuator_state = false;
                     ESP_LOGW(TAG, "Temp normal (%.1f). Atuador DESLIGADO.", temp);
                 }
             }
         }
         gpio_set_level(ACTUATOR_GPIO, g_actuator_state ? 1 : 0);
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        vTaskDelay(pdMS_TO_TICKS(settings_get_int(SETTINGS_LM35_PERIOD_MS)));
     }
 }
 
@@ -113,34 +157,51 @@ void task_ultrasonic(void *pvParameters) {
 
     while (1) {
         float distance_meters;
-        if (ultrasonic_measure(&sensor, MAX_DISTANCE_CM/100.0, &distance_meters) == ESP_OK) {
+        int64_t start_us = esp_timer_get_time();
+        esp_err_t read_err = ultrasonic_measure(&sensor, settings_get_int(SETTINGS_MAX_DISTANCE_CM)/100.0, &distance_meters);
+        metrics_histogram_observe(&m_ultrasonic_latency, (uint32_t)(esp_timer_get_time() - start_us));
+        metrics_counter_inc(&m_ultrasonic_reads);
+        if (read_err != ESP_OK) {
+            metrics_counter_inc(&m_ultrasonic_errors);
+        }
+        if (read_err == ESP_OK) {
             g_current_distance = distance_meters * 100.0;
-            g_presence_state = (g_current_distance < 50.0);
+            g_presence_state = (g_current_distance < settings_get_float(SETTINGS_PRESENCE_CM));
+            sensors_publish(EVENT_BUS_SENSOR_DISTANCE, g_current_distance);
             gpio_set_level(PRESENCE_GPIO, g_presence_state ? 1 : 0);
         }
-        vTaskDelay(pdMS_TO_TICKS(500));
+        vTaskDelay(pdMS_TO_TICKS(settings_get_int(SETTINGS_ULTRASONIC_PERIOD_MS)));
     }
 }
 
 // --- Task PWM (duty proporcional à temperatura) ---
 void task_pwm(void *pvParameters) {
     const int duty_max = 8191; // 13 bits
-    const float temp_min = 25.0;
-    const float temp_max = 50.0;
+
+    event_bus_event_t event;
 
     while (1) {
-        float temp = g_current_temp;
+        // Reage a cada leitura do LM35 em vez de consultar g_current_temp
+        if (!event_bus_receive(pwm_subscriber, &event, portMAX_DELAY) || event.data.sensor.sensor != EVENT_BUS_SENSOR_TEMPERATURE) {
+            continue;
+        }
+        float temp = event.data.sensor.value;
+
+        // Lidos a cada leitura: uma alteração vale a partir da próxima
+        float temp_min = settings_get_float(SETTINGS_PWM_TEMP_MIN);
+        float temp_max = settings_get_float(SETTINGS_PWM_TEMP_MAX);
 
         int duty = 0;
-        if (temp > temp_min) {
+        if (temp_max <= temp_min) {
+            // Faixa inválida (alterada pela metade): liga tudo acima do mínimo
+            duty = (temp > temp_min) ? duty_max : 0;
+        } else if (temp > temp_min) {
             duty = (int)(((temp - temp_min) / (temp_max - temp_min)) * duty_max);
             if (duty > duty_max) duty = duty_max;
         }
 
         pwm_set_duty(duty);
-        ESP_LOGI("PWM", "Temp: %.1f °C -> Duty: %d (%.1f%%)", temp, duty, sensors_get_cooling_power());
-
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        DLOGI("PWM", "Temp: %.1f °C -> Duty: %d (%.1f%%)", temp, duty, sensors_get_cooling_power()); // formatado na task dlog
     }
 }
 
@@ -150,7 +211,7 @@ void pwm_init(void) {
         .speed_mode       = LEDC_HIGH_SPEED_MODE,
         .timer_num        = LEDC_TIMER_0,
         .duty_resolution  = LEDC_TIMER_13_BIT,
-        .freq_hz          = 500,
+        .freq_hz          = settings_get_int(SETTINGS_PWM_FREQ_HZ), // aplicada só no boot
         .clk_cfg          = LEDC_AUTO_CLK
     };
     ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
@@ -170,6 +231,7 @@ void pwm_init(void) {
 
 void pwm_set_duty(uint32_t duty) {
     current_duty = duty;
+    metrics_gauge_set(&m_pwm_duty, duty);
     ledc_set_duty(LEDC_HIGH_SPEED_MODE, LEDC_CHANNEL_0, duty);
     ledc_update_duty(LEDC_HIGH_SPEED_MODE, LEDC_CHANNEL_0);
 }
@@ -0,0 +1,513 @@
+/*
+ * settings.c
+ *
+ *  Settings schema, RAM copy and background saving. The saved blob is a
+ *  list of (id, type, value) entries: a setting added to the schema gets
+ *  its default, the entry of a removed one is ignored, and a value of the
+ *  wrong type or out of the current range falls back to the default.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "sys/param.h"
+
+#include "dlog.h"
+#include "metrics.h"
+#include "settings.h"
+#include "tasks_common.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "settings";
+
+// NVS name space and key of the saved settings
+static const char settings_namespace[] = "settings";
+static const char settings_blob_key[] = "values";
+
+/**
+ * Type of a setting
+ */
+typedef enum settings_type
+{
+	SETTINGS_TYPE_INT = 0,
+	SETTINGS_TYPE_FLOAT,
+} settings_type_e;
+
+/**
+ * Value of a setting, bits is what the RAM copy and the blob hold
+ */
+typedef union settings_value
+{
+	int32_t i;
+	float f;
+	uint32_t bits;
+} settings_value_t;
+
+/**
+ * Schema entry
+ */
+typedef struct settings_schema
+{
+	const char *name;
+	uint16_t id;					///> saved with the value, never reused for another setting
+	uint8_t type;					///> settings_type_e
+	settings_value_t def;
+	settings_value_t min;
+	settings_value_t max;
+} settings_schema_t;
+
+#define SETTINGS_INT(_name, _id, _def, _min, _max) \
+	{ .name = (_name), .id = (_id), .type = SETTINGS_TYPE_INT, .def = { .i = (_def) }, .min = { .i = (_min) }, .max = { .i = (_max) } }
+#define SETTINGS_FLOAT(_name, _id, _def, _min, _max) \
+	{ .name = (_name), .id = (_id), .type = SETTINGS_TYPE_FLOAT, .def = { .f = (_def) }, .min = { .f = (_min) }, .max = { .f = (_max) } }
+
+// Defaults are the values the firmware used before they became settings
+static const settings_schema_t g_schema[SETTINGS_COUNT] = {
+	[SETTINGS_TEMP_ON]              = SETTINGS_FLOAT("temp_on", 1, 40.0f, 0.0f, 125.0f),
+	[SETTINGS_TEMP_OFF]             = SETTINGS_FLOAT("temp_off", 2, 37.0f, 0.0f, 125.0f),
+	[SETTINGS_PRESENCE_CM]          = SETTINGS_FLOAT("presence_cm", 3, 50.0f, 2.0f, 400.0f),
+	[SETTINGS_MAX_DISTANCE_CM]      = SETTINGS_INT("max_distance_cm", 4, 400, 20, 400),
+	[SETTINGS_LM35_PERIOD_MS]       = SETTINGS_INT("lm35_period_ms", 5, 1000, 100, 60000),
+	[SETTINGS_ULTRASONIC_PERIOD_MS] = SETTINGS_INT("ultrasonic_period_ms", 6, 500, 60, 60000),
+	[SETTINGS_PWM_TEMP_MIN]         = SETTINGS_FLOAT("pwm_temp_min", 7, 25.0f, 0.0f, 125.0f),
+	[SETTINGS_PWM_TEMP_MAX]         = SETTINGS_FLOAT("pwm_temp_max", 8, 50.0f, 0.0f, 125.0f),
+	[SETTINGS_PWM_FREQ_HZ]          = SETTINGS_INT("pwm_freq_hz", 9, 500, 1, 5000),
+};
+
+/**
+ * Float settings that must stay below another one
+ */
+typedef struct settings_order
+{
+	settings_key_e lower;
+	settings_key_e upper;
+} settings_order_t;
+
+// The actuator switches off below the temperature it switches on at, and the PWM range is not empty
+static const settings_order_t g_orders[] = {
+	{ SETTINGS_TEMP_OFF, SETTINGS_TEMP_ON },
+	{ SETTINGS_PWM_TEMP_MIN, SETTINGS_PWM_TEMP_MAX },
+};
+
+/**
+ * Saved blob
+ */
+typedef struct settings_saved_entry
+{
+	uint16_t id;
+	uint8_t type;
+	uint8_t reserved;
+	uint32_t bits;
+} settings_saved_entry_t;
+
+typedef struct settings_saved
+{
+	uint16_t schema_version;
+	uint16_t count;
+	settings_saved_entry_t entries[SETTINGS_MAX_SAVED];
+} settings_saved_t;
+
+// RAM copy, read without locking; g_dirty is set until the copy is saved
+static uint32_t g_values[SETTINGS_COUNT];
+static bool g_dirty;
+static portMUX_TYPE g_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Serializes saving between the task and settings_flush, and guards g_blob
+static SemaphoreHandle_t g_commit_lock;
+static settings_saved_t g_blob;
+
+// Task that saves the changes once they settle
+static TaskHandle_t g_task;
+
+static metrics_counter_t g_changes = METRICS_COUNTER_INIT("settings_changes_total", "Setting changes applied", NULL);
+static metrics_counter_t g_commits = METRICS_COUNTER_INIT("settings_commits_total", "Flash writes of the settings, one per burst of changes", NULL);
+static metrics_counter_t g_commit_errors = METRICS_COUNTER_INIT("settings_commit_errors_total", "Settings writes that failed, retried on the next change or restart", NULL);
+
+/**
+ * Checks a value against the range of its setting.
+ */
+static bool settings_in_range(const settings_schema_t *schema, settings_value_t value)
+{
+	if (schema->type == SETTINGS_TYPE_FLOAT)
+	{
+		// false for NaN too
+		return value.f >= schema->min.f && value.f <= schema->max.f;
+	}
+
+	return value.i >= schema->min.i && value.i <= schema->max.i;
+}
+
+/**
+ * Checks an order rule on a full set of values.
+ */
+static bool settings_in_order(const uint32_t *values, const settings_order_t *order)
+{
+	settings_value_t lower = { .bits = values[order->lower] };
+	settings_value_t upper = { .bits = values[order->upper] };
+
+	return lower.f < upper.f;
+}
+
+/**
+ * Loads the defaults, then the saved values that still fit the schema.
+ */
+static void settings_load(void)
+{
+	nvs_handle_t handle;
+	size_t size = sizeof(g_blob);
+	esp_err_t esp_err;
+	int loaded = 0;
+
+	for (int i = 0; i < SETTINGS_COUNT; i++)
+	{
+		g_values[i] = g_schema[i].def.bits;
+	}
+
+	// No name space until the first save
+	if (nvs_open(settings_namespace, NVS_READONLY, &handle) != ESP_OK)
+	{
+		DLOGI(TAG, "settings_load: nothing saved, using defaults");
+		return;
+	}
+	esp_err = nvs_get_blob(handle, settings_blob_key, &g_blob, &size);
+	nvs_close(handle);
+
+	if (esp_err != ESP_OK || size < offsetof(settings_saved_t, entries))
+	{
+		DLOGW(TAG, "settings_load: (%s) reading saved settings, using defaults", esp_err_to_name(esp_err));
+		return;
+	}
+	if (g_blob.schema_version != SETTINGS_SCHEMA_VERSION)
+	{
+		// Ids keep their meaning across versions, a version change only matters to a migration written for it
+		DLOGW(TAG, "settings_load: saved with schema %u, running %u", g_blob.schema_version, SETTINGS_SCHEMA_VERSION);
+	}
+
+	size_t count = MIN(g_blob.count, (size - offsetof(settings_saved_t, entries)) / sizeof(settings_saved_entry_t));
+	for (size_t e = 0; e < count; e++)
+	{
+		const settings_saved_entry_t *entry = &g_blob.entries[e];
+
+		for (int i = 0; i < SETTINGS_COUNT; i++)
+		{
+			settings_value_t value = { .bits = entry->bits };
+
+			if (g_schema[i].id == entry->id && g_schema[i].type == entry->type && settings_in_range(&g_schema[i], value))
+			{
+				g_values[i] = value.bits;
+				loaded++;
+				break;
+			}
+		}
+	}
+
+	// Pairs saved before the order rules existed can contradict each other
+	for (int o = 0; o < sizeof(g_orders) / sizeof(g_orders[0]); o++)
+	{
+		if (!settings_in_order(g_values, &g_orders[o]))
+		{
+			DLOGW(TAG, "settings_load: %s not below %s, using defaults", g_schema[g_orders[o].lower].name, g_schema[g_orders[o].upper].name);
+			g_values[g_orders[o].lower] = g_schema[g_orders[o].lower].def.bits;
+			g_values[g_orders[o].upper] = g_schema[g_orders[o].upper].def.bits;
+		}
+	}
+
+	DLOGI(TAG, "settings_load: %d of %d settings loaded", loaded, SETTINGS_COUNT);
+}
+
+/**
+ * Saves the RAM copy if it changed since the last save. All settings are
+ * written as one blob, NVS keeps the previous one until the new one is complete.
+ * @return ESP_OK if nothing was pending or the settings were saved.
+ */
+static esp_err_t settings_commit(void)
+{
+	nvs_handle_t handle;
+	esp_err_t esp_err;
+
+	xSemaphoreTake(g_commit_lock, portMAX_DELAY);
+
+	portENTER_CRITICAL(&g_lock);
+	bool dirty = g_dirty;
+	g_dirty = false;
+	for (int i = 0; i < SETTINGS_COUNT; i++)
+	{
+		g_blob.entries[i] = (settings_saved_entry_t){ .id = g_schema[i].id, .type = g_schema[i].type, .bits = g_values[i] };
+	}
+	portEXIT_CRITICAL(&g_lock);
+
+	if (!dirty)
+	{
+		xSemaphoreGive(g_commit_lock);
+		return ESP_OK;
+	}
+
+	g_blob.schema_version = SETTINGS_SCHEMA_VERSION;
+	g_blob.count = SETTINGS_COUNT;
+
+	esp_err = nvs_open(settings_namespace, NVS_READWRITE, &handle);
+	if (esp_err == ESP_OK)
+	{
+		esp_err = nvs_set_blob(handle, settings_blob_key, &g_blob, offsetof(settings_saved_t, entries) + SETTINGS_COUNT * sizeof(settings_saved_entry_t));
+		if (esp_err == ESP_OK)
+		{
+			esp_err = nvs_commit(handle);
+		}
+		nvs_close(handle);
+	}
+
+	if (esp_err != ESP_OK)
+	{
+		// Saved with the next change or on restart
+		portENTER_CRITICAL(&g_lock);
+		g_dirty = true;
+		portEXIT_CRITICAL(&g_lock);
+		metrics_counter_inc(&g_commit_errors);
+		DLOGE(TAG, "settings_commit: Error (%s) saving settings", esp_err_to_name(esp_err));
+	}
+	else
+	{
+		metrics_counter_inc(&g_commits);
+	}
+
+	xSemaphoreGive(g_commit_lock);
+
+	return esp_err;
+}
+
+/**
+ * Waits for changes and saves them once they settle.
+ * @param pvParameters unused.
+ */
+static void settings_task(void *pvParameters)
+{
+	for (;;)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		// Every change restarts the quiet time, up to the longest delay after the first one
+		int64_t deadline_us = esp_timer_get_time() + (int64_t)CONFIG_SETTINGS_COMMIT_MAX_DELAY_MS * 1000;
+		for (;;)
+		{
+			int64_t left_ms = (deadline_us - esp_timer_get_time()) / 1000;
+
+			if (left_ms <= 0 || ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MIN(left_ms, CONFIG_SETTINGS_COMMIT_DELAY_MS))) == 0)
+			{
+				break;
+			}
+		}
+
+		settings_commit();
+	}
+}
+
+/**
+ * Shutdown handler, a restart must not lose changes still waiting to be saved.
+ */
+static void settings_shutdown(void)
+{
+	settings_flush();
+}
+
+void settings_start(void)
+{
+	g_commit_lock = xSemaphoreCreateMutex();
+
+	settings_load();
+
+	metrics_register(&g_changes.base);
+	metrics_register(&g_commits.base);
+	metrics_register(&g_commit_errors.base);
+
+	xTaskCreatePinnedToCore(&settings_task, "settings", SETTINGS_TASK_STACK_SIZE, NULL, SETTINGS_TASK_PRIORITY, &g_task, SETTINGS_TASK_CORE_ID);
+	esp_register_shutdown_handler(settings_shutdown);
+}
+
+esp_err_t settings_apply(const settings_change_t *change)
+{
+	uint32_t values[SETTINGS_COUNT];
+	uint32_t changed = 0;
+
+	// The order rules see the values as they are after the change, checked and stored under one lock
+	portENTER_CRITICAL(&g_lock);
+	for (int i = 0; i < SETTINGS_COUNT; i++)
+	{
+		values[i] = (change->staged & (1U << i)) ? change->values[i] : g_values[i];
+	}
+	for (int o = 0; o < sizeof(g_orders) / sizeof(g_orders[0]); o++)
+	{
+		if (!settings_in_order(values, &g_orders[o]))
+		{
+			portEXIT_CRITICAL(&g_lock);
+			return ESP_ERR_INVALID_ARG;
+		}
+	}
+	for (int i = 0; i < SETTINGS_COUNT; i++)
+	{
+		if (g_values[i] != values[i])
+		{
+			__atomic_store_n(&g_values[i], values[i], __ATOMIC_RELAXED);
+			changed |= 1U << i;
+		}
+	}
+	if (changed != 0)
+	{
+		g_dirty = true;
+	}
+	portEXIT_CRITICAL(&g_lock);
+
+	for (int i = 0; i < SETTINGS_COUNT; i++)
+	{
+		if (changed & (1U << i))
+		{
+			metrics_counter_inc(&g_changes);
+			DLOGI(TAG, "%s changed", g_schema[i].name);
+		}
+	}
+	if (changed != 0 && g_task != NULL)
+	{
+		xTaskNotifyGive(g_task);
+	}
+
+	return ESP_OK;
+}
+
+int32_t settings_get_int(settings_key_e key)
+{
+	settings_value_t value = { .bits = __atomic_load_n(&g_values[key], __ATOMIC_RELAXED) };
+
+	return (g_schema[key].type == SETTINGS_TYPE_INT) ? value.i : 0;
+}
+
+float settings_get_float(settings_key_e key)
+{
+	settings_value_t value = { .bits = __atomic_load_n(&g_values[key], __ATOMIC_RELAXED) };
+
+	return (g_schema[key].type == SETTINGS_TYPE_FLOAT) ? value.f : 0.0f;
+}
+
+esp_err_t settings_set_int(settings_key_e key, int32_t value)
+{
+	settings_value_t v = { .i = value };
+	settings_change_t change = { .staged = 1U << key };
+
+	if (key >= SETTINGS_COUNT || g_schema[key].type != SETTINGS_TYPE_INT || !settings_in_range(&g_schema[key], v))
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	change.values[key] = v.bits;
+	return settings_apply(&change);
+}
+
+esp_err_t settings_set_float(settings_key_e key, float value)
+{
+	settings_value_t v = { .f = value };
+	settings_change_t change = { .staged = 1U << key };
+
+	if (key >= SETTINGS_COUNT || g_schema[key].type != SETTINGS_TYPE_FLOAT || !settings_in_range(&g_schema[key], v))
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	change.values[key] = v.bits;
+	return settings_apply(&change);
+}
+
+esp_err_t settings_stage_text(settings_change_t *change, const char *name, const char *text)
+{
+	settings_value_t value;
+	char *end;
+	int key;
+
+	for (key = 0; key < SETTINGS_COUNT && strcmp(g_schema[key].name, name) != 0; key++)
+	{
+	}
+	if (key == SETTINGS_COUNT)
+	{
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	if (g_schema[key].type == SETTINGS_TYPE_FLOAT)
+	{
+		value.f = strtof(text, &end);
+	}
+	else
+	{
+		long parsed = strtol(text, &end, 10);
+		value.i = (parsed < INT32_MIN || parsed > INT32_MAX) ? INT32_MIN : (int32_t)parsed;
+	}
+	if (end == text || *end != '\0' || !settings_in_range(&g_schema[key], value))
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	change->values[key] = value.bits;
+	change->staged |= 1U << key;
+	return ESP_OK;
+}
+
+esp_err_t settings_flush(void)
+{
+	if (g_commit_lock == NULL)
+	{
+		return ESP_OK;
+	}
+
+	return settings_commit();
+}
+
+/**
+ * Formats a value of a setting.
+ */
+static int settings_format(char *buf, size_t size, uint8_t type, settings_value_t value)
+{
+	if (type == SETTINGS_TYPE_FLOAT)
+	{
+		return snprintf(buf, size, "%g", (double)value.f);
+	}
+
+	return snprintf(buf, size, "%ld", (long)value.i);
+}
+
+esp_err_t settings_render_json(text_writer_fn_t write, void *ctx)
+{
+	char value[16], min[16], max[16], def[16];
+	bool pending;
+	esp_err_t err;
+
+	portENTER_CRITICAL(&g_lock);
+	pending = g_dirty;
+	portEXIT_CRITICAL(&g_lock);
+
+	err = text_writer_printf(write, ctx, "{\"schema\":%u,\"pending\":%s,\"settings\":{", SETTINGS_SCHEMA_VERSION, pending ? "true" : "false");
+
+	for (int i = 0; err == ESP_OK && i < SETTINGS_COUNT; i++)
+	{
+		const settings_schema_t *schema = &g_schema[i];
+		settings_value_t current = { .bits = __atomic_load_n(&g_values[i], __ATOMIC_RELAXED) };
+
+		settings_format(value, sizeof(value), schema->type, current);
+		settings_format(min, sizeof(min), schema->type, schema->min);
+		settings_format(max, sizeof(max), schema->type, schema->max);
+		settings_format(def, sizeof(def), schema->type, schema->def);
+
+		err = text_writer_printf(write, ctx, "%s\"%s\":{\"value\":%s,\"min\":%s,\"max\":%s,\"default\":%s}",
+				(i > 0) ? "," : "", schema->name, value, min, max, def);
+	}
+	if (err == ESP_OK)
+	{
+		err = write("}}", 2, ctx);
+	}
+
+	return err;
+}
@@ -0,0 +1,128 @@
+/*
+ * settings.h
+ *
+ *  Typed settings (thresholds, periods, PWM range) kept in RAM and saved
+ *  to NVS in the background.
+ *
+ *  Every setting has a type, a default and a valid range in the schema of
+ *  settings.c. Reads come from the RAM copy and never touch flash. Changes
+ *  are applied at once and saved after CONFIG_SETTINGS_COMMIT_DELAY_MS
+ *  without further changes (at most CONFIG_SETTINGS_COMMIT_MAX_DELAY_MS
+ *  after the first one), so a burst of changes costs one flash write.
+ *  All settings are one NVS blob, written whole: after a power loss the
+ *  previous or the new set is loaded, never a mix.
+ */
+
+#ifndef MAIN_SETTINGS_H_
+#define MAIN_SETTINGS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "text_writer.h"
+
+// Version of the schema the saved blob was written with, saved for migrations (e.g. a unit change); ids are never reused
+#define SETTINGS_SCHEMA_VERSION		1
+
+// Entries read from a saved blob, ids of settings since removed included
+#define SETTINGS_MAX_SAVED			32
+
+/**
+ * Settings, index of the schema in settings.c
+ */
+typedef enum settings_key
+{
+	SETTINGS_TEMP_ON = 0,				///> float, °C that switches the actuator on
+	SETTINGS_TEMP_OFF,					///> float, °C that switches the actuator off
+	SETTINGS_PRESENCE_CM,				///> float, distance below which presence is reported
+	SETTINGS_MAX_DISTANCE_CM,			///> int, range of the ultrasonic measurement
+	SETTINGS_LM35_PERIOD_MS,			///> int, temperature sampling period
+	SETTINGS_ULTRASONIC_PERIOD_MS,		///> int, distance sampling period
+	SETTINGS_PWM_TEMP_MIN,				///> float, °C of 0 % cooling duty
+	SETTINGS_PWM_TEMP_MAX,				///> float, °C of 100 % cooling duty
+	SETTINGS_PWM_FREQ_HZ,				///> int, cooling PWM frequency, applied at boot
+	SETTINGS_COUNT,
+} settings_key_e;
+
+/**
+ * Changes staged by settings_stage_text, applied together by settings_apply
+ */
+typedef struct settings_change
+{
+	uint32_t values[SETTINGS_COUNT];
+	uint32_t staged;				///> bit per settings_key_e, zero for an empty change
+} settings_change_t;
+
+/**
+ * Loads the saved settings (defaults for the missing or invalid ones), starts
+ * the task that saves changes and registers the settings metrics.
+ */
+void settings_start(void);
+
+/**
+ * Gets an int setting, never blocks.
+ * @param key setting.
+ * @return the value, 0 if the setting is not an int.
+ */
+int32_t settings_get_int(settings_key_e key);
+
+/**
+ * Gets a float setting, never blocks.
+ * @param key setting.
+ * @return the value, 0 if the setting is not a float.
+ */
+float settings_get_float(settings_key_e key);
+
+/**
+ * Changes an int setting, saved in the background.
+ * @param key setting.
+ * @param value new value.
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if out of range, out of order or not an int setting.
+ */
+esp_err_t settings_set_int(settings_key_e key, int32_t value);
+
+/**
+ * Changes a float setting, saved in the background.
+ * @param key setting.
+ * @param value new value.
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if out of range, out of order or not a float setting.
+ */
+esp_err_t settings_set_float(settings_key_e key, float value);
+
+/**
+ * Stages a change of a setting given by name and text, as received from the web page.
+ * @param change change to add to.
+ * @param name name of the setting, as in settings_render_json.
+ * @param text value, parsed by the type of the setting.
+ * @return ESP_OK, ESP_ERR_NOT_FOUND for an unknown name, ESP_ERR_INVALID_ARG for an invalid value.
+ */
+esp_err_t settings_stage_text(settings_change_t *change, const char *name, const char *text);
+
+/**
+ * Applies staged changes, all or none. temp_off must stay below temp_on and
+ * pwm_temp_min below pwm_temp_max, checked on the values after the change.
+ * @param change staged changes.
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if the result breaks an order rule.
+ */
+esp_err_t settings_apply(const settings_change_t *change);
+
+/**
+ * Saves the pending changes now, called on restart.
+ * @return ESP_OK if nothing was pending or the changes were saved.
+ */
+esp_err_t settings_flush(void);
+
+/**
+ * Renders the settings as JSON, with their range and default:
+ * {"schema":1,"pending":false,"settings":{"temp_on":{"value":40,"min":0,"max":125,"default":40},...}}
+ * pending is true while changes wait to be saved.
+ * @param write output function.
+ * @param ctx passed to write.
+ * @return ESP_OK, otherwise the first error returned by write.
+ */
+esp_err_t settings_render_json(text_writer_fn_t write, void *ctx);
+
+#endif /* MAIN_SETTINGS_H_ */
@@ -0,0 +1,97 @@
+/*
+ * snapshot.c
+ *
+ *  A reader increments the count of the slot it loaded as current, then
+ *  checks it is still current; a writer publishes, then only reuses slots
+ *  whose count it reads as 0. With sequentially consistent operations on
+ *  both sides, either the reader sees the new current and backs off, or
+ *  the writer sees the count and leaves the slot alone. A reader that
+ *  pins a slot a writer is refilling cannot see it current before it is
+ *  published, and backs off too.
+ */
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "snapshot.h"
+
+/**
+ * Reference count at the start of a slot.
+ */
+static inline uint32_t *snapshot_refs(uint8_t *slot)
+{
+	return (uint32_t *)slot;
+}
+
+void snapshot_init(snapshot_t *snapshot, void *storage, size_t size, const void *initial)
+{
+	snapshot->slots = storage;
+	snapshot->size = size;
+	snapshot->slot_size = SNAPSHOT_SLOT_SIZE(size);
+	memset(storage, 0x00, (size_t)snapshot->slot_size * SNAPSHOT_VERSIONS);
+	if (initial != NULL)
+	{
+		memcpy(snapshot->slots + SNAPSHOT_HEADER_SIZE, initial, size);
+	}
+	snapshot->write_lock = xSemaphoreCreateMutexStatic(&snapshot->write_lock_buffer);
+	__atomic_store_n(&snapshot->current, snapshot->slots, __ATOMIC_SEQ_CST);
+}
+
+const void *snapshot_acquire(snapshot_t *snapshot)
+{
+	for (;;)
+	{
+		uint8_t *slot = __atomic_load_n(&snapshot->current, __ATOMIC_SEQ_CST);
+
+		__atomic_fetch_add(snapshot_refs(slot), 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&snapshot->current, __ATOMIC_SEQ_CST) == slot)
+		{
+			return slot + SNAPSHOT_HEADER_SIZE;
+		}
+
+		// A new version was published in between
+		__atomic_fetch_sub(snapshot_refs(slot), 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void snapshot_release(snapshot_t *snapshot, const void *data)
+{
+	__atomic_fetch_sub(snapshot_refs((uint8_t *)data - SNAPSHOT_HEADER_SIZE), 1, __ATOMIC_SEQ_CST);
+}
+
+void snapshot_publish(snapshot_t *snapshot, const void *data)
+{
+	uint8_t *slot = NULL;
+
+	xSemaphoreTake(snapshot->write_lock, portMAX_DELAY);
+
+	while (slot == NULL)
+	{
+		uint8_t *current = __atomic_load_n(&snapshot->current, __ATOMIC_SEQ_CST);
+
+		for (int i = 0; i < SNAPSHOT_VERSIONS; i++)
+		{
+			uint8_t *candidate = snapshot->slots + (size_t)i * snapshot->slot_size;
+
+			if (candidate != current && __atomic_load_n(snapshot_refs(candidate), __ATOMIC_SEQ_CST) == 0)
+			{
+				slot = candidate;
+				break;
+			}
+		}
+
+		if (slot == NULL)
+		{
+			// Readers hold a version for a few copies, let them finish
+			vTaskDelay(1);
+		}
+	}
+
+	memcpy(slot + SNAPSHOT_HEADER_SIZE, data, snapshot->size);
+	__atomic_store_n(&snapshot->current, slot, __ATOMIC_SEQ_CST);
+
+	xSemaphoreGive(snapshot->write_lock);
+}
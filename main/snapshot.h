@@ -0,0 +1,78 @@
+/*
+ * snapshot.h
+ *
+ *  Versioned configuration published as immutable snapshots (RCU style).
+ *
+ *  A writer copies the new version into a free slot and publishes it with
+ *  one pointer store; readers pin the current version with a reference
+ *  count and read it in place, they never block and never see a version
+ *  being written. A slot is reused once it is neither current nor pinned.
+ *  Writers are serialized by a mutex.
+ */
+
+#ifndef MAIN_SNAPSHOT_H_
+#define MAIN_SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Versions kept, the current one and room for readers still pinning older ones
+#define SNAPSHOT_VERSIONS			4
+
+// Bytes of the slot header (reference count), keeps 8 byte data aligned
+#define SNAPSHOT_HEADER_SIZE		8
+
+// Bytes a slot takes
+#define SNAPSHOT_SLOT_SIZE(_size)	(SNAPSHOT_HEADER_SIZE + (((_size) + 7) & ~(size_t)7))
+
+/**
+ * Declares static storage for a snapshot of _size bytes
+ */
+#define SNAPSHOT_STORAGE(_name, _size) \
+	static uint64_t _name[SNAPSHOT_SLOT_SIZE(_size) * SNAPSHOT_VERSIONS / 8]
+
+/**
+ * Snapshot
+ */
+typedef struct snapshot
+{
+	uint8_t *slots;
+	uint32_t size;
+	uint32_t slot_size;
+	uint8_t *current;				///> slot of the published version
+	SemaphoreHandle_t write_lock;
+	StaticSemaphore_t write_lock_buffer;
+} snapshot_t;
+
+/**
+ * Initializes a snapshot and publishes its first version.
+ * @param snapshot snapshot to initialize.
+ * @param storage see SNAPSHOT_STORAGE.
+ * @param size size of the data.
+ * @param initial first version, NULL for zeros.
+ */
+void snapshot_init(snapshot_t *snapshot, void *storage, size_t size, const void *initial);
+
+/**
+ * Pins the current version, never blocks.
+ * @return data of the version, valid until snapshot_release.
+ */
+const void *snapshot_acquire(snapshot_t *snapshot);
+
+/**
+ * Unpins a version returned by snapshot_acquire.
+ */
+void snapshot_release(snapshot_t *snapshot, const void *data);
+
+/**
+ * Copies data into a new version and publishes it. Readers that pinned the
+ * previous version keep reading it. Waits for a free slot if every older
+ * version is still pinned.
+ * @param data new version, size bytes.
+ */
+void snapshot_publish(snapshot_t *snapshot, const void *data);
+
+#endif /* MAIN_SNAPSHOT_H_ */
@@ -9,6 +9,10 @@
 #ifndef MAIN_TASKS_COMMON_H_
 #define MAIN_TASKS_COMMON_H_
 
+// Boot workers, one per core, run the boot stages (see boot.c) and exit
+#define BOOT_WORKER_STACK_SIZE              4096
+#define BOOT_WORKER_PRIORITY                1       // same as app_main
+
 // ===================================================
 // Core 0 Tasks (WiFi & Network Stack)
 // ===================================================
@@ -23,6 +27,12 @@
 #define HTTP_SERVER_TASK_STACK_SIZE         8192
 #define HTTP_SERVER_TASK_PRIORITY           4
 #define HTTP_SERVER_TASK_CORE_ID            0
+#define HTTP_SERVER_TLS_TASK_STACK_SIZE     10240   // TLS handshakes run on the httpd task
+
+// HTTP server workers (OTA upload and other long handlers, off the httpd task)
+#define HTTP_SERVER_WORKER_STACK_SIZE       8192
+#define HTTP_SERVER_WORKER_PRIORITY         3
+#define HTTP_SERVER_WORKER_CORE_ID          1
 
 // HTTP Server Monitor task
 #define HTTP_SERVER_MONITOR_STACK_SIZE      4096
@@ -48,6 +58,31 @@
 #define SNTP_TIME_SYNC_TASK_PRIORITY        4
 #define SNTP_TIME_SYNC_TASK_CORE_ID         1
 
+// OTA writer task (programs flash while the HTTP server keeps receiving)
+#define OTA_WRITER_TASK_STACK_SIZE          4096
+#define OTA_WRITER_TASK_PRIORITY            5
+#define OTA_WRITER_TASK_CORE_ID             1
+
+// OTA pull task (manifest check and download from the local update server)
+#define OTA_PULL_TASK_STACK_SIZE            6144
+#define OTA_PULL_TASK_PRIORITY              3
+#define OTA_PULL_TASK_CORE_ID               1
+
+// Deferred logging task (formats and prints the queued log records)
+#define DLOG_TASK_STACK_SIZE                3072
+#define DLOG_TASK_PRIORITY                  1
+#define DLOG_TASK_CORE_ID                   1
+
+// Settings task (saves setting changes to NVS once they settle)
+#define SETTINGS_TASK_STACK_SIZE            3072
+#define SETTINGS_TASK_PRIORITY              1
+#define SETTINGS_TASK_CORE_ID               1
+
+// Sensor log task (batches the readings into flash pages)
+#define SENSOR_LOG_TASK_STACK_SIZE          3072
+#define SENSOR_LOG_TASK_PRIORITY            2
+#define SENSOR_LOG_TASK_CORE_ID             1
+
 #define WIFI_RESET_BUTTON_TASK_STACK_SIZE   2048
 #define WIFI_RESET_BUTTON_TASK_PRIORITY     6
 #define WIFI_RESET_BUTTON_TASK_CORE_ID      0
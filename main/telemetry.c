@@ -0,0 +1,228 @@
+/*
+ * telemetry.c
+ *
+ *  JSON and CBOR encoders for the telemetry field model.
+ *
+ *  The CBOR encoder only covers what the field model needs: a definite
+ *  length map with text keys and unsigned/negative integer, float32,
+ *  boolean and text values, each head in its shortest form.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "telemetry.h"
+
+// CBOR major types (RFC 8949 section 3.1)
+#define CBOR_MAJOR_UNSIGNED		0
+#define CBOR_MAJOR_NEGATIVE		1
+#define CBOR_MAJOR_TEXT			3
+#define CBOR_MAJOR_MAP			5
+
+// CBOR simple values and float marker
+#define CBOR_FALSE				0xF4
+#define CBOR_TRUE				0xF5
+#define CBOR_FLOAT32			0xFA
+
+/**
+ * Output cursor, len keeps counting past the end so overflow is detected once at the end
+ */
+typedef struct telemetry_out
+{
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+} telemetry_out_t;
+
+/**
+ * Appends raw bytes.
+ */
+static void telemetry_put(telemetry_out_t *out, const void *data, size_t len)
+{
+	if (out->len + len <= out->size)
+	{
+		memcpy(out->buf + out->len, data, len);
+	}
+	out->len += len;
+}
+
+/**
+ * Appends a CBOR head: major type and argument in its shortest form.
+ */
+static void telemetry_cbor_head(telemetry_out_t *out, uint8_t major, uint32_t arg)
+{
+	uint8_t head[5];
+	size_t len;
+
+	if (arg < 24)
+	{
+		head[0] = (major << 5) | arg;
+		len = 1;
+	}
+	else if (arg <= 0xFF)
+	{
+		head[0] = (major << 5) | 24;
+		head[1] = arg;
+		len = 2;
+	}
+	else if (arg <= 0xFFFF)
+	{
+		head[0] = (major << 5) | 25;
+		head[1] = arg >> 8;
+		head[2] = arg;
+		len = 3;
+	}
+	else
+	{
+		head[0] = (major << 5) | 26;
+		head[1] = arg >> 24;
+		head[2] = arg >> 16;
+		head[3] = arg >> 8;
+		head[4] = arg;
+		len = 5;
+	}
+
+	telemetry_put(out, head, len);
+}
+
+/**
+ * Appends a CBOR text string.
+ */
+static void telemetry_cbor_text(telemetry_out_t *out, const char *s)
+{
+	size_t len = strlen(s);
+
+	telemetry_cbor_head(out, CBOR_MAJOR_TEXT, len);
+	telemetry_put(out, s, len);
+}
+
+/**
+ * Appends a JSON string with quotes and backslashes escaped.
+ */
+static void telemetry_json_string(telemetry_out_t *out, const char *s)
+{
+	telemetry_put(out, "\"", 1);
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"' || *s == '\\')
+		{
+			telemetry_put(out, "\\", 1);
+		}
+		if ((uint8_t)*s >= 0x20)
+		{
+			telemetry_put(out, s, 1);
+		}
+	}
+	telemetry_put(out, "\"", 1);
+}
+
+size_t telemetry_encode_json(const telemetry_field_t *fields, size_t count, char *buf, size_t size)
+{
+	telemetry_out_t out = { .buf = (uint8_t *)buf, .size = size, .len = 0 };
+	char number[24];
+	int number_len;
+
+	telemetry_put(&out, "{", 1);
+	for (size_t i = 0; i < count; i++)
+	{
+		const telemetry_field_t *field = &fields[i];
+
+		if (i > 0)
+		{
+			telemetry_put(&out, ",", 1);
+		}
+		telemetry_json_string(&out, field->key);
+		telemetry_put(&out, ":", 1);
+
+		switch (field->type)
+		{
+			case TELEMETRY_TYPE_INT:
+			case TELEMETRY_TYPE_FLOAT:
+				if (field->type == TELEMETRY_TYPE_INT)
+				{
+					number_len = snprintf(number, sizeof(number), "%ld", (long)field->value.i);
+				}
+				else
+				{
+					number_len = snprintf(number, sizeof(number), "%.*f", field->decimals, field->value.f);
+				}
+				if (field->json_quoted)
+				{
+					telemetry_put(&out, "\"", 1);
+				}
+				telemetry_put(&out, number, number_len);
+				if (field->json_quoted)
+				{
+					telemetry_put(&out, "\"", 1);
+				}
+				break;
+
+			case TELEMETRY_TYPE_BOOL:
+				telemetry_put(&out, field->value.b ? "true" : "false", field->value.b ? 4 : 5);
+				break;
+
+			case TELEMETRY_TYPE_STRING:
+				telemetry_json_string(&out, field->value.s);
+				break;
+		}
+	}
+	telemetry_put(&out, "}", 1);
+
+	// Room for the terminator
+	if (out.len >= size)
+	{
+		return 0;
+	}
+	buf[out.len] = '\0';
+
+	return out.len;
+}
+
+size_t telemetry_encode_cbor(const telemetry_field_t *fields, size_t count, uint8_t *buf, size_t size)
+{
+	telemetry_out_t out = { .buf = buf, .size = size, .len = 0 };
+
+	telemetry_cbor_head(&out, CBOR_MAJOR_MAP, count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const telemetry_field_t *field = &fields[i];
+
+		telemetry_cbor_text(&out, field->key);
+
+		switch (field->type)
+		{
+			case TELEMETRY_TYPE_INT:
+				if (field->value.i >= 0)
+				{
+					telemetry_cbor_head(&out, CBOR_MAJOR_UNSIGNED, (uint32_t)field->value.i);
+				}
+				else
+				{
+					telemetry_cbor_head(&out, CBOR_MAJOR_NEGATIVE, (uint32_t)(-1 - field->value.i));
+				}
+				break;
+
+			case TELEMETRY_TYPE_FLOAT:
+			{
+				uint32_t bits;
+				memcpy(&bits, &field->value.f, sizeof(bits));
+				uint8_t f32[5] = { CBOR_FLOAT32, bits >> 24, bits >> 16, bits >> 8, bits };
+				telemetry_put(&out, f32, sizeof(f32));
+				break;
+			}
+
+			case TELEMETRY_TYPE_BOOL:
+			{
+				uint8_t simple = field->value.b ? CBOR_TRUE : CBOR_FALSE;
+				telemetry_put(&out, &simple, 1);
+				break;
+			}
+
+			case TELEMETRY_TYPE_STRING:
+				telemetry_cbor_text(&out, field->value.s);
+				break;
+		}
+	}
+
+	return (out.len <= size) ? out.len : 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * telemetry.h
+ *
+ *  Field model shared by the JSON and CBOR encodings of the sensor and
+ *  status endpoints. A handler fills an array of fields once and the
+ *  encoder chosen by content negotiation serializes it.
+ */
+
+#ifndef MAIN_TELEMETRY_H_
+#define MAIN_TELEMETRY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Media type selected with "Accept: application/cbor"
+#define TELEMETRY_CBOR_MEDIA_TYPE	"application/cbor"
+
+/**
+ * Field value types
+ */
+typedef enum telemetry_type
+{
+	TELEMETRY_TYPE_INT = 0,
+	TELEMETRY_TYPE_FLOAT,
+	TELEMETRY_TYPE_BOOL,
+	TELEMETRY_TYPE_STRING,
+} telemetry_type_e;
+
+/**
+ * One key/value pair of an endpoint response
+ */
+typedef struct telemetry_field
+{
+	const char *key;
+	telemetry_type_e type;
+	union
+	{
+		int32_t i;
+		float f;
+		bool b;
+		const char *s;
+	} value;
+	uint8_t decimals;		///> digits after the point for FLOAT in JSON
+	bool json_quoted;		///> JSON writes the number as a string, as the web page expects
+} telemetry_field_t;
+
+// Field initializers
+#define TELEMETRY_INT(_key, _v)				{ .key = (_key), .type = TELEMETRY_TYPE_INT, .value.i = (_v) }
+#define TELEMETRY_INT_QUOTED(_key, _v)		{ .key = (_key), .type = TELEMETRY_TYPE_INT, .value.i = (_v), .json_quoted = true }
+#define TELEMETRY_FLOAT(_key, _v, _dec)		{ .key = (_key), .type = TELEMETRY_TYPE_FLOAT, .value.f = (_v), .decimals = (_dec) }
+#define TELEMETRY_FLOAT_QUOTED(_key, _v, _dec) { .key = (_key), .type = TELEMETRY_TYPE_FLOAT, .value.f = (_v), .decimals = (_dec), .json_quoted = true }
+#define TELEMETRY_BOOL(_key, _v)			{ .key = (_key), .type = TELEMETRY_TYPE_BOOL, .value.b = (_v) }
+#define TELEMETRY_STRING(_key, _v)			{ .key = (_key), .type = TELEMETRY_TYPE_STRING, .value.s = (_v) }
+
+/**
+ * Encodes the fields as a JSON object.
+ * @param fields fields to encode.
+ * @param count number of fields.
+ * @param buf output buffer, NUL terminated on success.
+ * @param size size of buf.
+ * @return length of the JSON text, 0 if it does not fit.
+ */
+size_t telemetry_encode_json(const telemetry_field_t *fields, size_t count, char *buf, size_t size);
+
+/**
+ * Encodes the fields as a CBOR map (RFC 8949) with native integer, float32 and boolean values.
+ * @param fields fields to encode.
+ * @param count number of fields.
+ * @param buf output buffer.
+ * @param size size of buf.
+ * @return length of the encoding, 0 if it does not fit.
+ */
+size_t telemetry_encode_cbor(const telemetry_field_t *fields, size_t count, uint8_t *buf, size_t size);
+
+#endif /* MAIN_TELEMETRY_H_ */
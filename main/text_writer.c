@@ -0,0 +1,28 @@
+/*
+ * text_writer.c
+ *
+ *  Formatting helper of the renderers, see text_writer.h.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "text_writer.h"
+
+esp_err_t text_writer_printf(text_writer_fn_t write, void *ctx, const char *fmt, ...)
+{
+	char line[TEXT_WRITER_LINE_SIZE];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	if (len < 0 || len >= sizeof(line))
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	return write(line, len, ctx);
+}
@@ -0,0 +1,38 @@
+/*
+ * text_writer.h
+ *
+ *  Output callback shared by the renderers (metrics, boot timeline, scan
+ *  results, link history, settings, sensor log, log history): a renderer
+ *  hands its text in pieces to a writer, which collects or sends them, so
+ *  no renderer needs a buffer the size of its whole output.
+ */
+
+#ifndef MAIN_TEXT_WRITER_H_
+#define MAIN_TEXT_WRITER_H_
+
+#include <stddef.h>
+
+#include "esp_err.h"
+
+// Longest piece text_writer_printf formats
+#define TEXT_WRITER_LINE_SIZE		256
+
+/**
+ * Writer.
+ * @param data text to append.
+ * @param len length of the text.
+ * @param ctx user context.
+ * @return ESP_OK to continue.
+ */
+typedef esp_err_t (*text_writer_fn_t)(const char *data, size_t len, void *ctx);
+
+/**
+ * snprintf to the writer.
+ * @param write writer.
+ * @param ctx passed to write.
+ * @param fmt format, the text must fit in TEXT_WRITER_LINE_SIZE - 1 bytes.
+ * @return the write result, ESP_ERR_INVALID_SIZE if the text does not fit.
+ */
+esp_err_t text_writer_printf(text_writer_fn_t write, void *ctx, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#endif /* MAIN_TEXT_WRITER_H_ */
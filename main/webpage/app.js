@@ -4,6 +4,7 @@
 var seconds = null;
 var otaTimerVar = null;
 var wifiConnectInterval = null;
+var wifiScanPolls = 0;
 
 $(document).ready(function(){
     getSSID();
@@ -11,6 +12,7 @@ $(document).ready(function(){
     startSensorInterval();
     startLocalTimeInterval();
     getConnectInfo();
+    getWifiScan();
     
     $("#connect_wifi").on("click", function(){
         checkCredentials();
@@ -80,10 +82,18 @@ function updateFirmware()
     if (fileSelect.files && fileSelect.files.length == 1) 
     {
         var file = fileSelect.files[0];
-        formData.set("file", file, file.name);
         document.getElementById("ota_update_status").innerHTML = "Enviando " + file.name + ", aguarde...";
         document.getElementById("ota_update_status").className = "status-msg";
 
+        // Imagens .bin sao enviadas em blocos e podem ser retomadas; .gz e .odp vao inteiros
+        if (file.name.toLowerCase().endsWith(".bin"))
+        {
+            uploadFirmwareResumable(file);
+            return;
+        }
+
+        formData.set("file", file, file.name);
+
         var request = new XMLHttpRequest();
         request.upload.addEventListener("progress", updateProgress);
         request.open('POST', "/OTAupdate");
@@ -96,6 +106,141 @@ function updateFirmware()
     }
 }
 
+/**
+ * Resumable upload settings: chunk size (multiple of the 4 KB flash sector) and retries per chunk
+ */
+var OTA_CHUNK_SIZE = 65536;
+var OTA_CHUNK_RETRIES = 5;
+
+/**
+ * Uploads a raw image in Content-Range chunks. The device reports where an
+ * interrupted upload of the same image stopped, and whether it is already running.
+ */
+function uploadFirmwareResumable(file)
+{
+    var reader = new FileReader();
+
+    reader.onload = function() {
+        var image = new Uint8Array(reader.result);
+        var hash = sha256Hex(image);
+        var retries = 0;
+
+        var queryOffset = function(onOffset) {
+            $.ajax({
+                url: '/OTAresume.json',
+                type: 'POST',
+                headers: {'X-OTA-Image-SHA256': hash, 'X-OTA-Image-Size': image.length},
+                dataType: 'json',
+                success: onOffset,
+                error: function() { retryChunk(); }
+            });
+        };
+
+        var sendChunk = function(offset) {
+            var end = Math.min(offset + OTA_CHUNK_SIZE, image.length) - 1;
+            var xhr = new XMLHttpRequest();
+
+            xhr.open('POST', "/OTAupdate");
+            xhr.setRequestHeader("Content-Range", "bytes " + offset + "-" + end + "/" + image.length);
+            xhr.setRequestHeader("X-OTA-Image-SHA256", hash);
+            xhr.onload = function() {
+                if (xhr.status == 200 || xhr.status == 416) {
+                    var response = JSON.parse(xhr.responseText);
+                    retries = 0;
+                    if (response.complete == 1) {
+                        getUpdateStatus();
+                    } else {
+                        document.getElementById("ota_update_status").innerHTML = "Enviado " + (response.next_offset / 1024).toFixed(0) + " de " + (image.length / 1024).toFixed(0) + " KB";
+                        sendChunk(response.next_offset);
+                    }
+                } else if (xhr.status == 503) {
+                    // Pipeline ocupado: o mesmo chunk pode ser reenviado
+                    retryChunk();
+                } else {
+                    getUpdateStatus();
+                }
+            };
+            xhr.onerror = function() { retryChunk(); };
+            xhr.send(image.subarray(offset, end + 1));
+        };
+
+        // Conexao caiu: pergunta ao dispositivo onde parou e continua de la
+        var retryChunk = function() {
+            if (++retries > OTA_CHUNK_RETRIES) {
+                document.getElementById("ota_update_status").innerHTML = "Erro no Upload! Selecione o arquivo novamente para continuar.";
+                document.getElementById("ota_update_status").style.color = "red";
+                return;
+            }
+            setTimeout(function() {
+                queryOffset(function(response) { sendChunk(response.next_offset); });
+            }, 2000);
+        };
+
+        queryOffset(function(response) {
+            if (response.installed == 1) {
+                document.getElementById("ota_update_status").innerHTML = "Este firmware já está instalado.";
+                return;
+            }
+            sendChunk(response.next_offset);
+        });
+    };
+
+    reader.readAsArrayBuffer(file);
+}
+
+/**
+ * SHA-256 of a byte array as a hex string. crypto.subtle is only available
+ * over HTTPS, so the web page served from the device hashes it by hand.
+ */
+function sha256Hex(data)
+{
+    var k = [
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    ];
+    var h = [0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19];
+    var w = new Uint32Array(64);
+
+    // Padding: 0x80, zeros, then the bit length as a 64 bit big endian value
+    var padded = new Uint8Array(((data.length + 9 + 63) >> 6) << 6);
+    padded.set(data);
+    padded[data.length] = 0x80;
+    var view = new DataView(padded.buffer);
+    view.setUint32(padded.length - 8, Math.floor(data.length / 0x20000000));
+    view.setUint32(padded.length - 4, data.length << 3);
+
+    var rotr = function(x, n) { return (x >>> n) | (x << (32 - n)); };
+
+    for (var off = 0; off < padded.length; off += 64) {
+        for (var i = 0; i < 16; i++) {
+            w[i] = view.getUint32(off + i * 4);
+        }
+        for (var i = 16; i < 64; i++) {
+            var s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >>> 3);
+            var s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >>> 10);
+            w[i] = (w[i - 16] + s0 + w[i - 7] + s1) | 0;
+        }
+
+        var a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (var i = 0; i < 64; i++) {
+            var t1 = (hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i]) | 0;
+            var t2 = ((rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c))) | 0;
+            hh = g; g = f; f = e; e = (d + t1) | 0;
+            d = c; c = b; b = a; a = (t1 + t2) | 0;
+        }
+        h[0] = (h[0] + a) | 0; h[1] = (h[1] + b) | 0; h[2] = (h[2] + c) | 0; h[3] = (h[3] + d) | 0;
+        h[4] = (h[4] + e) | 0; h[5] = (h[5] + f) | 0; h[6] = (h[6] + g) | 0; h[7] = (h[7] + hh) | 0;
+    }
+
+    return h.map(function(x) { return ("00000000" + (x >>> 0).toString(16)).slice(-8); }).join("");
+}
+
 function updateProgress(oEvent) 
 {
     if (oEvent.lengthComputable) {
@@ -115,6 +260,8 @@ function getUpdateStatus()
         var response = JSON.parse(xhr.responseText);
         document.getElementById("latest_firmware").innerHTML = response.compile_date + " - " + response.compile_time
 
+        showUpdateStats(response);
+
         if (response.ota_update_status == 1) 
         {
             seconds = 10;
@@ -128,6 +275,62 @@ function getUpdateStatus()
     }
 }
 
+/**
+ * OTA pull states reported by /OTAstatus (ota_pull_state_e)
+ */
+var OTA_PULL_STATE_CHECKING = 1;
+var OTA_PULL_STATE_DOWNLOADING = 2;
+var OTA_PULL_STATE_UP_TO_DATE = 3;
+var OTA_PULL_STATE_FAILED = 5;
+
+/**
+ * Asks the device to check the local update server, then follows the download
+ */
+function pullFirmware()
+{
+    $.post('/OTApull', function() {
+        document.getElementById("ota_update_status").innerHTML = "Verificando servidor de atualização...";
+        setTimeout(pullFirmwareStatus, 1000);
+    }).fail(function() {
+        document.getElementById("ota_update_status").innerHTML = "Busca de atualização indisponível";
+    });
+}
+
+function pullFirmwareStatus()
+{
+    $.post('/OTAstatus', function(response) {
+        if (response.ota_pull_state == OTA_PULL_STATE_CHECKING) {
+            setTimeout(pullFirmwareStatus, 1000);
+        } else if (response.ota_pull_state == OTA_PULL_STATE_DOWNLOADING) {
+            var total = response.ota_pull_size > 0 ? " de " + (response.ota_pull_size / 1024).toFixed(0) : "";
+            document.getElementById("ota_update_status").innerHTML = "Baixando " + (response.ota_pull_bytes / 1024).toFixed(0) + total + " KB";
+            setTimeout(pullFirmwareStatus, 1000);
+        } else if (response.ota_pull_state == OTA_PULL_STATE_UP_TO_DATE) {
+            document.getElementById("ota_update_status").innerHTML = "O firmware já está atualizado.";
+        } else if (response.ota_pull_state == OTA_PULL_STATE_FAILED) {
+            document.getElementById("ota_update_status").innerHTML = "Erro ao buscar atualização!";
+            document.getElementById("ota_update_status").style.color = "red";
+        } else {
+            getUpdateStatus();
+        }
+    }, 'json');
+}
+
+/**
+ * Shows size, elapsed time and throughput of the last firmware upload
+ */
+function showUpdateStats(response)
+{
+    if (response.ota_bytes_written === undefined || response.ota_bytes_written == 0) {
+        return;
+    }
+
+    var kbytes = (response.ota_bytes_written / 1024).toFixed(1);
+    var secs = (response.ota_elapsed_ms / 1000).toFixed(1);
+    var kbps = (response.ota_throughput_bps / 1024).toFixed(1);
+    document.getElementById("ota_update_stats").innerHTML = kbytes + " KB em " + secs + " s (" + kbps + " KB/s)";
+}
+
 function otaRebootTimer() 
 {   
     document.getElementById("ota_update_status").innerHTML = "Sucesso! Reiniciando em: " + seconds + "s";
@@ -234,6 +437,25 @@ function showPassword()
     }
 }
 
+/**
+ * Fills the SSID suggestions from the cached scan, polls while a scan runs
+ */
+function getWifiScan()
+{
+    $.getJSON('/wifiScan.json', function(data) {
+        var list = $("#scan_ssids").empty();
+
+        $.each(data["aps"], function(i, ap) {
+            $("<option>").attr("value", ap["ssid"]).text(ap["rssi"] + " dBm").appendTo(list);
+        });
+
+        if (data["scanning"] && wifiScanPolls < 10) {
+            wifiScanPolls++;
+            setTimeout(getWifiScan, 2000);
+        }
+    });
+}
+
 function getConnectInfo()
 {
     $.getJSON('/wifiConnectInfo.json', function(data)
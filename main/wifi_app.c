@@ -5,19 +5,32 @@
  *      Author: kjagu
  */
 
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
 
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "lwip/netdb.h"
 
 #include "app_nvs.h"
+#include "boot.h"
+#include "event_bus.h"
 #include "http_server.h"
+#include "metrics.h"
+#include "snapshot.h"
 #include "tasks_common.h"
 #include "wifi_app.h"
+#include "wifi_link.h"
 
 // Tag used for ESP serial console messages
 static const char TAG [] = "wifi_app";
@@ -25,11 +38,90 @@ static const char TAG [] = "wifi_app";
 // WiFi application callback
 static wifi_connected_event_callback_t wifi_connected_event_cb;
 
-// Used for returning the WiFi configuration
-wifi_config_t *wifi_config = NULL;
+// Station credentials and access point configuration, published as immutable versions
+static snapshot_t g_sta_config;
+SNAPSHOT_STORAGE(g_sta_config_storage, sizeof(wifi_app_sta_config_t));
+static snapshot_t g_ap_config;
+SNAPSHOT_STORAGE(g_ap_config_storage, sizeof(wifi_ap_config_t));
+
+// Failed connection attempts since the last IP address, sets the backoff before the next one
+static uint32_t g_reconnect_attempts;
+
+// Fires the next connection attempt once the backoff is over, and resends dropped commands
+static esp_timer_handle_t wifi_app_reconnect_timer;
+
+// Set when the backoff is armed, cleared when the timer fires
+static bool g_backoff_due;
+
+// Commands to the WiFi application task dropped by a full event bus, one bit per wifi_app_message_e, and their data
+static uint32_t g_dropped_commands;
+static uint16_t g_dropped_reason;
+static wifi_app_reconnect_e g_dropped_reconnect;
+
+// When the link dropped, 0 while it is up or was never up
+static int64_t g_outage_start_us;
+
+// Cleared when the user disconnects, failed attempts are then not retried
+static bool g_reconnect_enabled;
+
+// Access point and lease of the last successful connection, see wifi_app_connect_sta
+static app_nvs_sta_cache_t g_sta_cache;
+static bool g_sta_cache_valid;
+
+// true while the attempt in progress is directed to a known access point (cached or selected)
+static bool g_fast_connect;
+
+// Access point picked by wifi_app_select_network for the next attempt, and whether the attempt in progress uses it
+static uint8_t g_select_bssid[6];
+static uint8_t g_select_channel;
+static bool g_select_valid;
+static bool g_select_connect;
+
+/**
+ * Network of the scan cache, the strongest access point seen for its SSID
+ */
+typedef struct wifi_app_scan_ap
+{
+	char ssid[MAX_SSID_LENGTH + 1];
+	int8_t rssi;
+	uint8_t channel;
+	uint8_t authmode;				///> wifi_auth_mode_t
+} wifi_app_scan_ap_t;
+
+/**
+ * Scan cache, published as immutable versions so /wifiScan.json never waits for a scan
+ */
+typedef struct wifi_app_scan_result
+{
+	int64_t time_us;				///> when the scan finished, 0 before the first one
+	uint8_t count;
+	wifi_app_scan_ap_t aps[WIFI_APP_SCAN_MAX_APS];
+} wifi_app_scan_result_t;
+
+static snapshot_t g_scan;
+SNAPSHOT_STORAGE(g_scan_storage, sizeof(wifi_app_scan_result_t));
+
+// Set when the reconnect backoff expired during a background scan, the attempt follows the scan
+static bool g_reconnect_after_scan;
+
+// Set by wifi_app_scan_request until the scan it asked for is done or failed, so requests never queue a second one
+static bool g_scan_pending;
+
+// true while a background scan started by the WiFi application task is running
+static bool g_scan_running;
+
+// When the last scan started (background or network selection), rate limits the background scans
+static uint32_t g_scan_start_ms;
+
+// Priority given with the credentials entered on the web page, -1 keeps the saved one
+static int g_connect_priority = -1;
+
+// true while the station has an IP address, read by the event handler to tell a drop from a failed attempt
+static bool g_link_up;
 
-// Used to track the number for retries when a connection attempt fails
-static int g_retry_number;
+// Start of the connection attempt in progress (0 when none) and how long the last one took to get an IP
+static int64_t g_connect_start_us;
+static uint32_t g_time_to_ip_ms;
 
 /**
  * Wifi application event group handle and status bits
@@ -40,13 +132,568 @@ const int WIFI_APP_CONNECTING_FROM_HTTP_SERVER_BIT			= BIT1;
 const int WIFI_APP_USER_REQUESTED_STA_DISCONNECT_BIT		= BIT2;
 const int WIFI_APP_STA_CONNECTED_GOT_IP_BIT					= BIT3;
 
-// Queue handle used to manipulate the main queue of events
-static QueueHandle_t wifi_app_queue_handle;
+// Event bus subscription of the WiFi application task
+static event_bus_subscriber_t *wifi_app_subscriber;
 
 // netif objects for the station and access point
 esp_netif_t* esp_netif_sta = NULL;
 esp_netif_t* esp_netif_ap  = NULL;
 
+// WiFi state machine metrics, wifi_app_msg_metrics is indexed by wifi_app_message_e
+#define WIFI_APP_MSG_METRIC(_msg) METRICS_COUNTER_INIT("wifi_app_messages_total", "Messages handled by the WiFi application task", "msg=\"" _msg "\"")
+static metrics_counter_t wifi_app_msg_metrics[WIFI_APP_MSG_COUNT] = {
+	[WIFI_APP_MSG_CONNECTING_FROM_HTTP_SERVER] = WIFI_APP_MSG_METRIC("connecting_from_http_server"),
+	[WIFI_APP_MSG_STA_CONNECTED_GOT_IP] = WIFI_APP_MSG_METRIC("sta_connected_got_ip"),
+	[WIFI_APP_MSG_USER_REQUESTED_STA_DISCONNECT] = WIFI_APP_MSG_METRIC("user_requested_sta_disconnect"),
+	[WIFI_APP_MSG_LOAD_SAVED_CREDENTIALS] = WIFI_APP_MSG_METRIC("load_saved_credentials"),
+	[WIFI_APP_MSG_STA_DISCONNECTED] = WIFI_APP_MSG_METRIC("sta_disconnected"),
+	[WIFI_APP_MSG_STA_RECONNECT] = WIFI_APP_MSG_METRIC("sta_reconnect"),
+	[WIFI_APP_MSG_STA_SELECT_NETWORK] = WIFI_APP_MSG_METRIC("sta_select_network"),
+	[WIFI_APP_MSG_SCAN_START] = WIFI_APP_MSG_METRIC("scan_start"),
+	[WIFI_APP_MSG_SCAN_DONE] = WIFI_APP_MSG_METRIC("scan_done"),
+};
+static metrics_counter_t wifi_app_commands_dropped = METRICS_COUNTER_INIT("wifi_app_commands_dropped_total", "Commands to the WiFi application task dropped by a full event bus and sent again", NULL);
+static metrics_counter_t wifi_app_disconnect_events = METRICS_COUNTER_INIT("wifi_sta_disconnect_events_total", "Station disconnect events, retries included", NULL);
+static metrics_gauge_t wifi_app_sta_connected = METRICS_GAUGE_INIT("wifi_sta_connected", "1 while the station has an IP address", NULL);
+static metrics_histogram_t wifi_app_time_to_ip_fast = METRICS_HISTOGRAM_INIT("wifi_time_to_ip_seconds", "Time from the connection attempt to the IP address", "path=\"fast\"", metrics_latency_bounds_us);
+static metrics_histogram_t wifi_app_time_to_ip_scan = METRICS_HISTOGRAM_INIT("wifi_time_to_ip_seconds", "Time from the connection attempt to the IP address", "path=\"scan\"", metrics_latency_bounds_us);
+static metrics_counter_t wifi_app_fast_connect_fallbacks = METRICS_COUNTER_INIT("wifi_fast_connect_fallbacks_total", "Directed connections to the cached access point that failed and fell back to a scan", NULL);
+static metrics_counter_t wifi_app_reconnect_attempts = METRICS_COUNTER_INIT("wifi_reconnect_attempts_total", "Connection attempts started after a backoff", NULL);
+static metrics_gauge_t wifi_app_reconnect_backoff = METRICS_GAUGE_INIT("wifi_reconnect_backoff_ms", "Backoff before the pending connection attempt", NULL);
+static metrics_counter_t wifi_app_network_selections = METRICS_COUNTER_INIT("wifi_network_selections_total", "Scans ranking the saved networks", NULL);
+static metrics_counter_t wifi_app_scans_started = METRICS_COUNTER_INIT("wifi_scans_total", "Background scans for the web page", "result=\"started\"");
+static metrics_counter_t wifi_app_scans_failed = METRICS_COUNTER_INIT("wifi_scans_total", "Background scans for the web page", "result=\"failed\"");
+static metrics_counter_t wifi_app_scans_aborted = METRICS_COUNTER_INIT("wifi_scans_total", "Background scans for the web page", "result=\"aborted\"");
+static metrics_counter_t wifi_app_scan_requests_cached = METRICS_COUNTER_INIT("wifi_scan_requests_total", "Scan requests, and what answered them", "served=\"cache\"");
+static metrics_counter_t wifi_app_scan_requests_throttled = METRICS_COUNTER_INIT("wifi_scan_requests_total", "Scan requests, and what answered them", "served=\"throttled\"");
+static metrics_counter_t wifi_app_scan_requests_scan = METRICS_COUNTER_INIT("wifi_scan_requests_total", "Scan requests, and what answered them", "served=\"scan\"");
+
+// Outages last from seconds (access point reboot) to hours
+static const uint32_t wifi_app_outage_bounds_us[] = {
+	1000000, 2000000, 5000000, 10000000, 30000000, 60000000, 120000000, 300000000, 600000000, 1800000000,
+};
+static metrics_histogram_t wifi_app_outage_duration = METRICS_HISTOGRAM_INIT("wifi_outage_duration_seconds", "Time from a link drop to the next IP address", NULL, wifi_app_outage_bounds_us);
+
+/**
+ * Reads the length of the outage in progress, for the wifi_outage_seconds gauge.
+ */
+static int32_t wifi_app_read_outage(void *arg)
+{
+	int64_t start_us = g_outage_start_us;
+
+	return (start_us == 0) ? 0 : (int32_t)((esp_timer_get_time() - start_us) / 1000000);
+}
+static metrics_gauge_t wifi_app_outage = METRICS_GAUGE_FN_INIT("wifi_outage_seconds", "Length of the outage in progress, 0 while connected", NULL, wifi_app_read_outage, NULL);
+
+/**
+ * Sends a command from the event handler, the timer or the task itself to the WiFi
+ * application task. The bus drops events when a queue is full, and a lost reconnect,
+ * got IP or disconnect would leave the station offline for good: a dropped command is
+ * counted, logged and sent again by the reconnect timer after WIFI_APP_COMMAND_RETRY_MS.
+ * @param msgID message ID.
+ * @param reason wifi_err_reason_t of WIFI_APP_MSG_STA_DISCONNECTED.
+ * @param reconnect connection of WIFI_APP_MSG_STA_RECONNECT.
+ */
+static void wifi_app_send_command(wifi_app_message_e msgID, uint16_t reason, wifi_app_reconnect_e reconnect)
+{
+	event_bus_event_t event = {
+		.topic = EVENT_BUS_TOPIC_WIFI_APP,
+		.data.wifi_app = { .msgID = msgID, .reason = reason, .reconnect = reconnect },
+	};
+
+	if (event_bus_publish(&event))
+	{
+		return;
+	}
+
+	if (msgID == WIFI_APP_MSG_STA_DISCONNECTED)
+	{
+		g_dropped_reason = reason;
+	}
+	else if (msgID == WIFI_APP_MSG_STA_RECONNECT)
+	{
+		g_dropped_reconnect = reconnect;
+	}
+	__atomic_or_fetch(&g_dropped_commands, 1U << msgID, __ATOMIC_SEQ_CST);
+
+	metrics_counter_inc(&wifi_app_commands_dropped);
+	ESP_LOGW(TAG, "wifi_app_send_command: event bus full, message %d dropped, retrying", msgID);
+
+	// A pending backoff resends it when it fires, it is not cut short
+	if (!esp_timer_is_active(wifi_app_reconnect_timer))
+	{
+		esp_timer_start_once(wifi_app_reconnect_timer, (uint64_t)WIFI_APP_COMMAND_RETRY_MS * 1000);
+	}
+}
+
+/**
+ * Replaces the scan cache with scan records: one entry per SSID with its strongest
+ * access point, hidden networks left out, strongest first.
+ * @param records scan records.
+ * @param record_count number of records.
+ */
+static void wifi_app_scan_store(const wifi_ap_record_t *records, uint16_t record_count)
+{
+	// Static, only built by the WiFi application task
+	static wifi_app_scan_result_t result;
+
+	memset(&result, 0x00, sizeof(result));
+	for (int r = 0; r < record_count; r++)
+	{
+		const char *ssid = (const char *)records[r].ssid;
+		int i, pos;
+
+		if (ssid[0] == '\0')
+		{
+			continue;
+		}
+
+		// Another access point of a network already listed, keep the stronger one
+		for (i = 0; i < result.count && strncmp(result.aps[i].ssid, ssid, MAX_SSID_LENGTH) != 0; i++)
+		{
+		}
+		if (i < result.count)
+		{
+			if (records[r].rssi <= result.aps[i].rssi)
+			{
+				continue;
+			}
+			memmove(&result.aps[i], &result.aps[i + 1], (result.count - i - 1) * sizeof(wifi_app_scan_ap_t));
+			result.count--;
+		}
+
+		// Insert in RSSI order, the weakest network falls off a full list
+		for (pos = 0; pos < result.count && result.aps[pos].rssi >= records[r].rssi; pos++)
+		{
+		}
+		if (pos == WIFI_APP_SCAN_MAX_APS)
+		{
+			continue;
+		}
+		if (result.count == WIFI_APP_SCAN_MAX_APS)
+		{
+			result.count--;
+		}
+		memmove(&result.aps[pos + 1], &result.aps[pos], (result.count - pos) * sizeof(wifi_app_scan_ap_t));
+		result.count++;
+
+		memset(&result.aps[pos], 0x00, sizeof(wifi_app_scan_ap_t));
+		memcpy(result.aps[pos].ssid, ssid, strnlen(ssid, MAX_SSID_LENGTH));
+		result.aps[pos].rssi = records[r].rssi;
+		result.aps[pos].channel = records[r].primary;
+		result.aps[pos].authmode = records[r].authmode;
+	}
+
+	result.time_us = esp_timer_get_time();
+	snapshot_publish(&g_scan, &result);
+}
+
+/**
+ * Starts the background scan asked for by wifi_app_scan_request, without waiting for it.
+ */
+static void wifi_app_scan_start(void)
+{
+	esp_err_t esp_err;
+
+	__atomic_store_n(&g_scan_start_ms, (uint32_t)(esp_timer_get_time() / 1000), __ATOMIC_RELAXED);
+
+	// Refused while the driver connects the station, the page asks again later
+	esp_err = esp_wifi_scan_start(NULL, false);
+	if (esp_err != ESP_OK)
+	{
+		ESP_LOGW(TAG, "wifi_app_scan_start: %s", esp_err_to_name(esp_err));
+		metrics_counter_inc(&wifi_app_scans_failed);
+		__atomic_store_n(&g_scan_pending, false, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	g_scan_running = true;
+	metrics_counter_inc(&wifi_app_scans_started);
+}
+
+/**
+ * Reads the records of the finished background scan into the scan cache.
+ */
+static void wifi_app_scan_done(void)
+{
+	wifi_ap_record_t *records;
+	uint16_t record_count = WIFI_APP_SCAN_MAX_RECORDS;
+
+	// Aborted by a connection attempt in the meantime
+	if (!g_scan_running)
+	{
+		return;
+	}
+	g_scan_running = false;
+
+	// Reading the records frees the list of the driver, so does clearing it
+	records = malloc(WIFI_APP_SCAN_MAX_RECORDS * sizeof(wifi_ap_record_t));
+	if (records == NULL || esp_wifi_scan_get_ap_records(&record_count, records) != ESP_OK)
+	{
+		esp_wifi_clear_ap_list();
+		metrics_counter_inc(&wifi_app_scans_failed);
+	}
+	else
+	{
+		wifi_app_scan_store(records, record_count);
+		ESP_LOGI(TAG, "wifi_app_scan_done: %u access points", record_count);
+	}
+	free(records);
+
+	__atomic_store_n(&g_scan_pending, false, __ATOMIC_SEQ_CST);
+
+	if (g_reconnect_after_scan)
+	{
+		g_reconnect_after_scan = false;
+		wifi_app_send_command(WIFI_APP_MSG_STA_RECONNECT, 0, WIFI_APP_RECONNECT_BACKOFF);
+	}
+}
+
+/**
+ * Stops the background scan in progress, the station cannot connect while the driver scans.
+ */
+static void wifi_app_scan_abort(void)
+{
+	if (!g_scan_running)
+	{
+		return;
+	}
+
+	g_scan_running = false;
+	g_reconnect_after_scan = false;
+	esp_wifi_scan_stop();
+	esp_wifi_clear_ap_list();
+	metrics_counter_inc(&wifi_app_scans_aborted);
+	__atomic_store_n(&g_scan_pending, false, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Connects the ESP32 to an external AP using the updated station configuration.
+ * An access point picked by wifi_app_select_network is connected to directly.
+ * @param use_cache connect straight to the cached access point and channel (and
+ * reuse the cached lease if CONFIG_WIFI_APP_REUSE_LEASE), instead of scanning.
+ */
+static void wifi_app_connect_sta(bool use_cache)
+{
+	wifi_config_t wifi_config;
+	wifi_config_t *config = &wifi_config;
+	const wifi_app_sta_config_t *sta_config = wifi_app_sta_config_acquire();
+	bool cache_matches = g_sta_cache_valid && strncmp(g_sta_cache.ssid, sta_config->ssid, sizeof(g_sta_cache.ssid)) == 0;
+
+	memset(config, 0x00, sizeof(wifi_config_t));
+	memcpy(config->sta.ssid, sta_config->ssid, MAX_SSID_LENGTH);
+	memcpy(config->sta.password, sta_config->password, MAX_PASSWORD_LENGTH);
+	wifi_app_sta_config_release(sta_config);
+
+	wifi_app_scan_abort();
+
+#if !CONFIG_WIFI_APP_FAST_CONNECT
+	use_cache = false;
+#endif
+	g_select_connect = g_select_valid;
+	g_select_valid = false;
+	g_fast_connect = g_select_connect || (use_cache && cache_matches);
+	if (g_fast_connect)
+	{
+		// Probes a single channel for a single BSSID, no scan of the band
+		memcpy(config->sta.bssid, g_select_connect ? g_select_bssid : g_sta_cache.bssid, sizeof(config->sta.bssid));
+		config->sta.bssid_set = true;
+		config->sta.channel = g_select_connect ? g_select_channel : g_sta_cache.channel;
+	}
+	else
+	{
+		config->sta.bssid_set = false;
+		config->sta.channel = 0;
+	}
+
+#if CONFIG_WIFI_APP_REUSE_LEASE
+	if (g_fast_connect && cache_matches && memcmp(config->sta.bssid, g_sta_cache.bssid, sizeof(g_sta_cache.bssid)) == 0 && g_sta_cache.ip != 0)
+	{
+		esp_netif_ip_info_t ip_info = {
+			.ip.addr = g_sta_cache.ip,
+			.netmask.addr = g_sta_cache.netmask,
+			.gw.addr = g_sta_cache.gw,
+		};
+		esp_netif_dns_info_t dns_info = {
+			.ip.type = ESP_IPADDR_TYPE_V4,
+			.ip.u_addr.ip4.addr = g_sta_cache.dns,
+		};
+
+		// The address is set when the link comes up, IP_EVENT_STA_GOT_IP follows without a DHCP exchange
+		esp_netif_dhcpc_stop(esp_netif_sta);
+		esp_netif_set_ip_info(esp_netif_sta, &ip_info);
+		esp_netif_set_dns_info(esp_netif_sta, ESP_NETIF_DNS_MAIN, &dns_info);
+	}
+	else
+	{
+		// Already running unless a cached lease was applied before
+		esp_netif_dhcpc_start(esp_netif_sta);
+	}
+#endif
+
+	if (g_connect_start_us == 0)
+	{
+		g_connect_start_us = esp_timer_get_time();
+	}
+
+	ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, config));
+	ESP_ERROR_CHECK(esp_wifi_connect());
+}
+
+/**
+ * Picks the saved network to connect to when several are saved: one scan, then every
+ * access point of a saved network is scored by its RSSI, the network priority and a bonus
+ * for the network that connected last. The winner is loaded in the station configuration
+ * and its access point is the target of the next wifi_app_connect_sta.
+ * Skipped while credentials entered on the web page are being tried.
+ * @return true if a network was selected, otherwise the station configuration is unchanged.
+ */
+static bool wifi_app_select_network(void)
+{
+	app_nvs_network_t networks[APP_NVS_MAX_NETWORKS];
+	wifi_ap_record_t *records;
+	uint16_t record_count = WIFI_APP_SELECT_MAX_APS;
+	size_t count;
+	int recent = -1, best_network = -1, best_record = -1;
+	int best_score = INT32_MIN;
+
+	if ((xEventGroupGetBits(wifi_app_event_group) & WIFI_APP_CONNECTING_FROM_HTTP_SERVER_BIT) || g_scan_running
+			|| !app_nvs_load_networks(networks, &count) || count < 2)
+	{
+		return false;
+	}
+
+	records = malloc(WIFI_APP_SELECT_MAX_APS * sizeof(wifi_ap_record_t));
+	if (records == NULL)
+	{
+		return false;
+	}
+
+	metrics_counter_inc(&wifi_app_network_selections);
+	__atomic_store_n(&g_scan_start_ms, (uint32_t)(esp_timer_get_time() / 1000), __ATOMIC_RELAXED);
+	if (esp_wifi_scan_start(NULL, true) != ESP_OK || esp_wifi_scan_get_ap_records(&record_count, records) != ESP_OK)
+	{
+		ESP_LOGW(TAG, "wifi_app_select_network: scan failed");
+		free(records);
+		return false;
+	}
+
+	// The web page gets the results too
+	wifi_app_scan_store(records, record_count);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (networks[i].last_success != 0 && (recent < 0 || networks[i].last_success > networks[recent].last_success))
+		{
+			recent = i;
+		}
+	}
+
+	for (int r = 0; r < record_count; r++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (strncmp((const char *)records[r].ssid, networks[i].ssid, sizeof(networks[i].ssid)) != 0)
+			{
+				continue;
+			}
+
+			int score = records[r].rssi + networks[i].priority * WIFI_APP_SELECT_PRIORITY_DB + ((i == recent) ? WIFI_APP_SELECT_RECENT_DB : 0);
+			if (score > best_score)
+			{
+				best_score = score;
+				best_network = i;
+				best_record = r;
+			}
+		}
+	}
+
+	if (best_network < 0)
+	{
+		ESP_LOGI(TAG, "wifi_app_select_network: none of the %u saved networks in range (%u access points)", (unsigned)count, record_count);
+		free(records);
+		return false;
+	}
+
+	wifi_app_set_sta_config(networks[best_network].ssid, networks[best_network].password);
+	memcpy(g_select_bssid, records[best_record].bssid, sizeof(g_select_bssid));
+	g_select_channel = records[best_record].primary;
+	g_select_valid = true;
+
+	ESP_LOGI(TAG, "wifi_app_select_network: %s, RSSI %d, channel %u", networks[best_network].ssid, records[best_record].rssi, g_select_channel);
+	free(records);
+
+	return true;
+}
+
+/**
+ * Records the access point and lease of the connection that just got an IP address,
+ * the NVS cache is only written when they changed.
+ */
+static void wifi_app_update_sta_cache(void)
+{
+	app_nvs_sta_cache_t cache;
+	wifi_ap_record_t ap_info;
+	esp_netif_ip_info_t ip_info;
+	esp_netif_dns_info_t dns_info;
+
+	if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK || esp_netif_get_ip_info(esp_netif_sta, &ip_info) != ESP_OK)
+	{
+		return;
+	}
+
+	memset(&cache, 0x00, sizeof(cache));
+	const wifi_app_sta_config_t *sta_config = wifi_app_sta_config_acquire();
+	memcpy(cache.ssid, sta_config->ssid, MAX_SSID_LENGTH);
+	wifi_app_sta_config_release(sta_config);
+	memcpy(cache.bssid, ap_info.bssid, sizeof(cache.bssid));
+	cache.channel = ap_info.primary;
+	cache.ip = ip_info.ip.addr;
+	cache.netmask = ip_info.netmask.addr;
+	cache.gw = ip_info.gw.addr;
+	if (esp_netif_get_dns_info(esp_netif_sta, ESP_NETIF_DNS_MAIN, &dns_info) == ESP_OK && dns_info.ip.type == ESP_IPADDR_TYPE_V4)
+	{
+		cache.dns = dns_info.ip.u_addr.ip4.addr;
+	}
+
+	if (g_sta_cache_valid && memcmp(&cache, &g_sta_cache, sizeof(cache)) == 0)
+	{
+		return;
+	}
+
+	if (app_nvs_save_sta_cache(&cache) == ESP_OK)
+	{
+		g_sta_cache = cache;
+		g_sta_cache_valid = true;
+	}
+}
+
+/**
+ * Removes the network of the station configuration from the saved list, on a user disconnect.
+ */
+static void wifi_app_forget_network(void)
+{
+	const wifi_app_sta_config_t *sta_config = wifi_app_sta_config_acquire();
+
+	app_nvs_forget_network(sta_config->ssid);
+	if (g_sta_cache_valid && strncmp(g_sta_cache.ssid, sta_config->ssid, sizeof(g_sta_cache.ssid)) == 0)
+	{
+		g_sta_cache_valid = false;
+	}
+	wifi_app_sta_config_release(sta_config);
+}
+
+/**
+ * Tells the WiFi application task that the station is disconnected for good.
+ * @param reason wifi_err_reason_t of the last disconnection.
+ */
+static void wifi_app_disconnected(uint16_t reason)
+{
+	wifi_app_send_command(WIFI_APP_MSG_STA_DISCONNECTED, reason, WIFI_APP_RECONNECT_BACKOFF);
+}
+
+/**
+ * Asks the WiFi application task for a connection attempt. The event handler never
+ * connects itself: the connection state belongs to the task, and the default event
+ * loop task has too small a stack for a connection.
+ * @param reconnect how to connect.
+ */
+static void wifi_app_request_reconnect(wifi_app_reconnect_e reconnect)
+{
+	wifi_app_send_command(WIFI_APP_MSG_STA_RECONNECT, 0, reconnect);
+}
+
+/**
+ * Gets the delay before a connection attempt: the initial backoff doubled for every
+ * further attempt up to the cap, of which a random half is taken off (equal jitter),
+ * so devices dropped by the same outage do not all come back at the same instant.
+ * @param attempt failed attempts so far, from 1.
+ * @return delay in milliseconds.
+ */
+static uint32_t wifi_app_backoff_ms(uint32_t attempt)
+{
+	uint32_t delay_ms = CONFIG_WIFI_APP_BACKOFF_INITIAL_MS;
+
+	for (uint32_t i = 1; i < attempt && delay_ms < CONFIG_WIFI_APP_BACKOFF_MAX_MS; i++)
+	{
+		delay_ms *= 2;
+	}
+	if (delay_ms > CONFIG_WIFI_APP_BACKOFF_MAX_MS)
+	{
+		delay_ms = CONFIG_WIFI_APP_BACKOFF_MAX_MS;
+	}
+
+	return delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+}
+
+/**
+ * Schedules the next connection attempt after a failed one, or gives up. Credentials
+ * entered on the web page get MAX_CONNECTION_RETRIES attempts so the page can report
+ * the failure, saved credentials are retried forever with CONFIG_WIFI_APP_RECONNECT_FOREVER.
+ * @param reason wifi_err_reason_t of the failure.
+ */
+static void wifi_app_reconnect_later(uint16_t reason)
+{
+	bool limited = (xEventGroupGetBits(wifi_app_event_group) & WIFI_APP_CONNECTING_FROM_HTTP_SERVER_BIT) != 0;
+
+#if !CONFIG_WIFI_APP_RECONNECT_FOREVER
+	limited = true;
+#endif
+
+	g_reconnect_attempts++;
+	if (!g_reconnect_enabled || (limited && g_reconnect_attempts > MAX_CONNECTION_RETRIES))
+	{
+		g_connect_start_us = 0;
+		metrics_gauge_set(&wifi_app_reconnect_backoff, 0);
+		wifi_app_disconnected(reason);
+		return;
+	}
+
+	uint32_t delay_ms = wifi_app_backoff_ms(g_reconnect_attempts);
+
+	ESP_LOGI(TAG, "Connection attempt %lu failed, next one in %lu ms", (unsigned long)g_reconnect_attempts, (unsigned long)delay_ms);
+	metrics_gauge_set(&wifi_app_reconnect_backoff, delay_ms);
+	__atomic_store_n(&g_backoff_due, true, __ATOMIC_SEQ_CST);
+	esp_timer_stop(wifi_app_reconnect_timer);
+	esp_timer_start_once(wifi_app_reconnect_timer, (uint64_t)delay_ms * 1000);
+}
+
+/**
+ * Cancels the pending backoff, commands waiting to be sent again still go out.
+ */
+static void wifi_app_cancel_backoff(void)
+{
+	esp_timer_stop(wifi_app_reconnect_timer);
+	__atomic_store_n(&g_backoff_due, false, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&g_dropped_commands, __ATOMIC_SEQ_CST) != 0)
+	{
+		esp_timer_start_once(wifi_app_reconnect_timer, (uint64_t)WIFI_APP_COMMAND_RETRY_MS * 1000);
+	}
+}
+
+/**
+ * Reconnect timer callback, resends the dropped commands and hands the attempt
+ * to the WiFi application task once the backoff is over.
+ */
+static void wifi_app_reconnect_timer_cb(void *arg)
+{
+	uint32_t dropped = __atomic_exchange_n(&g_dropped_commands, 0, __ATOMIC_SEQ_CST);
+
+	for (int msgID = 0; dropped != 0; msgID++, dropped >>= 1)
+	{
+		if (dropped & 1)
+		{
+			wifi_app_send_command((wifi_app_message_e)msgID, g_dropped_reason, g_dropped_reconnect);
+		}
+	}
+
+	if (__atomic_exchange_n(&g_backoff_due, false, __ATOMIC_SEQ_CST))
+	{
+		wifi_app_send_command(WIFI_APP_MSG_STA_RECONNECT, 0, WIFI_APP_RECONNECT_BACKOFF);
+	}
+}
+
 /**
  * WiFi application event handler
  * @param arg data, aside from event data, that is passed to the handler when it is called
@@ -80,25 +727,68 @@ static void wifi_app_event_handler(void *arg, esp_event_base_t event_base, int32
 				ESP_LOGI(TAG, "WIFI_EVENT_STA_START");
 				break;
 
+			case WIFI_EVENT_SCAN_DONE:
+				// Blocking scans of the network selection read their records themselves
+				if (g_scan_running)
+				{
+					wifi_app_send_command(WIFI_APP_MSG_SCAN_DONE, 0, WIFI_APP_RECONNECT_BACKOFF);
+				}
+				break;
+
 			case WIFI_EVENT_STA_CONNECTED:
 				ESP_LOGI(TAG, "WIFI_EVENT_STA_CONNECTED");
 				break;
 
 			case WIFI_EVENT_STA_DISCONNECTED:
 				ESP_LOGI(TAG, "WIFI_EVENT_STA_DISCONNECTED");
+				metrics_counter_inc(&wifi_app_disconnect_events);
 
-				wifi_event_sta_disconnected_t *wifi_event_sta_disconnected = (wifi_event_sta_disconnected_t*)malloc(sizeof(wifi_event_sta_disconnected_t));
-				*wifi_event_sta_disconnected = *((wifi_event_sta_disconnected_t*)event_data);
-				printf("WIFI_EVENT_STA_DISCONNECTED, reason code %d\n", wifi_event_sta_disconnected->reason);
+				// Only read here, no copy needed
+				wifi_event_sta_disconnected_t *wifi_event_sta_disconnected = (wifi_event_sta_disconnected_t*)event_data;
+				ESP_LOGI(TAG, "WIFI_EVENT_STA_DISCONNECTED, reason code %d", wifi_event_sta_disconnected->reason);
+				wifi_link_record_disconnect(wifi_event_sta_disconnected->reason);
+
+				bool link_was_up = g_link_up;
+				g_link_up = false;
+
+				if (link_was_up)
+				{
+					g_outage_start_us = esp_timer_get_time();
+					xEventGroupClearBits(wifi_app_event_group, WIFI_APP_STA_CONNECTED_GOT_IP_BIT);
+					metrics_gauge_set(&wifi_app_sta_connected, 0);
+				}
 
-				if (g_retry_number < MAX_CONNECTION_RETRIES)
+				if (xEventGroupGetBits(wifi_app_event_group) & WIFI_APP_USER_REQUESTED_STA_DISCONNECT_BIT)
 				{
-					esp_wifi_connect();
-					g_retry_number ++;
+					g_connect_start_us = 0;
+					g_outage_start_us = 0;
+					wifi_app_disconnected(wifi_event_sta_disconnected->reason);
+				}
+				else if (g_fast_connect && g_reconnect_enabled)
+				{
+					// The access point did not answer on its channel, maybe the device moved to another site
+					metrics_counter_inc(&wifi_app_fast_connect_fallbacks);
+					if (g_select_connect)
+					{
+						ESP_LOGI(TAG, "Connection to the selected access point failed, scanning");
+						wifi_app_request_reconnect(WIFI_APP_RECONNECT_SCAN);
+					}
+					else
+					{
+						ESP_LOGI(TAG, "Fast connect to the cached access point failed, selecting a network");
+						wifi_app_send_command(WIFI_APP_MSG_STA_SELECT_NETWORK, 0, WIFI_APP_RECONNECT_BACKOFF);
+					}
+				}
+				else if (link_was_up && g_reconnect_enabled)
+				{
+					// The link dropped, go straight back to the access point it was on
+					g_connect_start_us = 0;
+					g_reconnect_attempts = 0;
+					wifi_app_request_reconnect(WIFI_APP_RECONNECT_CACHED);
 				}
 				else
 				{
-					wifi_app_send_message(WIFI_APP_MSG_STA_DISCONNECTED);
+					wifi_app_reconnect_later(wifi_event_sta_disconnected->reason);
 				}
 
 				break;
@@ -111,7 +801,32 @@ static void wifi_app_event_handler(void *arg, esp_event_base_t event_base, int32
 			case IP_EVENT_STA_GOT_IP:
 				ESP_LOGI(TAG, "IP_EVENT_STA_GOT_IP");
 
-				wifi_app_send_message(WIFI_APP_MSG_STA_CONNECTED_GOT_IP);
+				if (g_connect_start_us != 0)
+				{
+					uint32_t elapsed_us = (uint32_t)(esp_timer_get_time() - g_connect_start_us);
+
+					metrics_histogram_observe(g_fast_connect ? &wifi_app_time_to_ip_fast : &wifi_app_time_to_ip_scan, elapsed_us);
+					g_time_to_ip_ms = elapsed_us / 1000;
+					g_connect_start_us = 0;
+					ESP_LOGI(TAG, "IP address %lu ms after the connection attempt (%s)", (unsigned long)g_time_to_ip_ms, g_fast_connect ? "cached access point" : "scan");
+				}
+				g_fast_connect = false;
+				g_select_connect = false;
+				g_link_up = true;
+				g_reconnect_attempts = 0;
+				metrics_gauge_set(&wifi_app_reconnect_backoff, 0);
+
+				if (g_outage_start_us != 0)
+				{
+					int64_t outage_us = esp_timer_get_time() - g_outage_start_us;
+
+					metrics_histogram_observe(&wifi_app_outage_duration, (uint64_t)outage_us);
+					ESP_LOGI(TAG, "Link back after %lu s", (unsigned long)(outage_us / 1000000));
+					g_outage_start_us = 0;
+				}
+
+				boot_mark(BOOT_MILESTONE_STA_GOT_IP);
+				wifi_app_send_command(WIFI_APP_MSG_STA_CONNECTED_GOT_IP, 0, WIFI_APP_RECONNECT_BACKOFF);
 
 				break;
 		}
@@ -182,27 +897,20 @@ static void wifi_app_soft_ap_config(void)
 
 	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));						///> Setting the mode as Access Point / Station Mode
 	ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_AP, &ap_config));			///> Set our configuration
+	snapshot_publish(&g_ap_config, &ap_config.ap);								///> Readers no longer ask the driver
 	ESP_ERROR_CHECK(esp_wifi_set_bandwidth(WIFI_IF_AP, WIFI_AP_BANDWIDTH));		///> Our default bandwidth 20 MHz
 	ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_STA_POWER_SAVE));						///> Power save set to "NONE"
 
 }
 
-/**
- * Connects the ESP32 to an external AP using the updated station configuration
- */
-static void wifi_app_connect_sta(void)
-{
-	ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, wifi_app_get_wifi_config()));
-	ESP_ERROR_CHECK(esp_wifi_connect());
-}
-
 /**
  * Main task for the WiFi application
  * @param pvParameters parameter which can be passed to the task
  */
 static void wifi_app_task(void *pvParameters)
 {
-	wifi_app_queue_message_t msg;
+	event_bus_event_t event;
+	wifi_app_message_e msgID;
 	EventBits_t eventBits;
 
 	// Initialize the event handler
@@ -217,14 +925,24 @@ static void wifi_app_task(void *pvParameters)
 	// Start WiFi
 	ESP_ERROR_CHECK(esp_wifi_start());
 
+	// The TCP/IP stack and the access point are up, the stages waiting on WiFi (web server included) can start
+	boot_stage_done(BOOT_STAGE_WIFI);
+
 	// Send first event message
 	wifi_app_send_message(WIFI_APP_MSG_LOAD_SAVED_CREDENTIALS);
 
 	for (;;)
 	{
-		if (xQueueReceive(wifi_app_queue_handle, &msg, portMAX_DELAY))
+		if (event_bus_receive(wifi_app_subscriber, &event, portMAX_DELAY))
 		{
-			switch (msg.msgID)
+			msgID = event.data.wifi_app.msgID;
+
+			if (msgID < WIFI_APP_MSG_COUNT)
+			{
+				metrics_counter_inc(&wifi_app_msg_metrics[msgID]);
+			}
+
+			switch (msgID)
 			{
 				case WIFI_APP_MSG_LOAD_SAVED_CREDENTIALS:
 					ESP_LOGI(TAG, "WIFI_APP_MSG_LOAD_SAVED_CREDENTIALS");
@@ -232,7 +950,10 @@ static void wifi_app_task(void *pvParameters)
 					if (app_nvs_load_sta_creds())
 					{
 						ESP_LOGI(TAG, "Loaded station configuration");
-						wifi_app_connect_sta();
+						g_sta_cache_valid = app_nvs_load_sta_cache(&g_sta_cache);
+						g_reconnect_enabled = true;
+						wifi_app_select_network();
+						wifi_app_connect_sta(true);
 						xEventGroupSetBits(wifi_app_event_group, WIFI_APP_CONNECTING_USING_SAVED_CREDS_BIT);
 					}
 					else
@@ -240,16 +961,6 @@ static void wifi_app_task(void *pvParameters)
 						ESP_LOGI(TAG, "Unable to load station configuration");
 					}
 
-					// Next, start the web server
-					wifi_app_send_message(WIFI_APP_MSG_START_HTTP_SERVER);
-
-					break;
-
-				case WIFI_APP_MSG_START_HTTP_SERVER:
-					ESP_LOGI(TAG, "WIFI_APP_MSG_START_HTTP_SERVER");
-
-					http_server_start();
-
 					break;
 
 				case WIFI_APP_MSG_CONNECTING_FROM_HTTP_SERVER:
@@ -257,11 +968,14 @@ static void wifi_app_task(void *pvParameters)
 
 					xEventGroupSetBits(wifi_app_event_group, WIFI_APP_CONNECTING_FROM_HTTP_SERVER_BIT);
 
-					// Attempt a connection
-					wifi_app_connect_sta();
+					// Attempt a connection, the cache belongs to the previous credentials
+					g_sta_cache_valid = false;
+					wifi_app_connect_sta(false);
 
-					// Set current number of retries to zero
-					g_retry_number = 0;
+					// Set current number of retries to zero, a pending backoff belongs to the previous credentials
+					wifi_app_cancel_backoff();
+					g_reconnect_attempts = 0;
+					g_reconnect_enabled = true;
 
 					// Let the HTTP server know about the connection attempt
 					http_server_monitor_send_message(HTTP_MSG_WIFI_CONNECT_INIT);
@@ -272,18 +986,24 @@ static void wifi_app_task(void *pvParameters)
 					ESP_LOGI(TAG, "WIFI_APP_MSG_STA_CONNECTED_GOT_IP");
 
 					xEventGroupSetBits(wifi_app_event_group, WIFI_APP_STA_CONNECTED_GOT_IP_BIT);
+					metrics_gauge_set(&wifi_app_sta_connected, 1);
 
 					http_server_monitor_send_message(HTTP_MSG_WIFI_CONNECT_SUCCESS);
 
 					eventBits = xEventGroupGetBits(wifi_app_event_group);
-					if (eventBits & WIFI_APP_CONNECTING_USING_SAVED_CREDS_BIT) ///> Save STA creds only if connecting from the http server (not loaded from NVS)
+					if (eventBits & WIFI_APP_CONNECTING_USING_SAVED_CREDS_BIT)
 					{
 						xEventGroupClearBits(wifi_app_event_group, WIFI_APP_CONNECTING_USING_SAVED_CREDS_BIT); ///> Clear the bits, in case we want to disconnect and reconnect, then start again
 					}
-					else
-					{
-						app_nvs_save_sta_creds();
-					}
+
+					// Add the network to the saved list or rank it as the most recent success
+					const wifi_app_sta_config_t *sta_config = wifi_app_sta_config_acquire();
+					app_nvs_save_network(sta_config->ssid, sta_config->password,
+							(eventBits & WIFI_APP_CONNECTING_FROM_HTTP_SERVER_BIT) ? g_connect_priority : -1, true);
+					wifi_app_sta_config_release(sta_config);
+
+					// Remember the access point and lease for the next connection
+					wifi_app_update_sta_cache();
 
 					if (eventBits & WIFI_APP_CONNECTING_FROM_HTTP_SERVER_BIT)
 					{
@@ -302,27 +1022,36 @@ static void wifi_app_task(void *pvParameters)
 					ESP_LOGI(TAG, "WIFI_APP_MSG_USER_REQUESTED_STA_DISCONNECT");
 
 					eventBits = xEventGroupGetBits(wifi_app_event_group);
+					g_reconnect_enabled = false;
+					wifi_app_cancel_backoff();
 
 					if (eventBits & WIFI_APP_STA_CONNECTED_GOT_IP_BIT)
 					{
 						xEventGroupSetBits(wifi_app_event_group, WIFI_APP_USER_REQUESTED_STA_DISCONNECT_BIT);
 
-						g_retry_number = MAX_CONNECTION_RETRIES;
 						ESP_ERROR_CHECK(esp_wifi_disconnect());
-						app_nvs_clear_sta_creds();
+						wifi_app_forget_network();
+					}
+					else if (g_reconnect_attempts > 0 || g_outage_start_us != 0)
+					{
+						// Reconnecting: stop, an attempt in progress fails and is not retried
+						esp_wifi_disconnect();
+						wifi_app_forget_network();
+						g_outage_start_us = 0;
+						http_server_monitor_send_message(HTTP_MSG_WIFI_USER_DISCONNECT);
 					}
 
 					break;
 
 				case WIFI_APP_MSG_STA_DISCONNECTED:
-					ESP_LOGI(TAG, "WIFI_APP_MSG_STA_DISCONNECTED");
+					ESP_LOGI(TAG, "WIFI_APP_MSG_STA_DISCONNECTED, reason %u", event.data.wifi_app.reason);
 
 					eventBits = xEventGroupGetBits(wifi_app_event_group);
 					if (eventBits & WIFI_APP_CONNECTING_USING_SAVED_CREDS_BIT)
 					{
+						// The saved networks are kept, the device may be out of range of all of them for now
 						ESP_LOGI(TAG, "WIFI_APP_MSG_STA_DISCONNECTED: ATTEMPT USING SAVED CREDENTIALS");
 						xEventGroupClearBits(wifi_app_event_group, WIFI_APP_CONNECTING_USING_SAVED_CREDS_BIT);
-						app_nvs_clear_sta_creds();
 					}
 					else if (eventBits & WIFI_APP_CONNECTING_FROM_HTTP_SERVER_BIT)
 					{
@@ -338,17 +1067,73 @@ static void wifi_app_task(void *pvParameters)
 					}
 					else
 					{
+						// Only reached without CONFIG_WIFI_APP_RECONNECT_FOREVER
 						ESP_LOGI(TAG, "WIFI_APP_MSG_STA_DISCONNECTED: ATTEMPT FAILED, CHECK WIFI ACCESS POINT AVAILABILITY");
-						// Adjust this case to your needs - maybe you want to keep trying to connect...
 					}
 
 					if (eventBits & WIFI_APP_STA_CONNECTED_GOT_IP_BIT)
 					{
 						xEventGroupClearBits(wifi_app_event_group, WIFI_APP_STA_CONNECTED_GOT_IP_BIT);
+						metrics_gauge_set(&wifi_app_sta_connected, 0);
+					}
+
+					break;
+
+				case WIFI_APP_MSG_STA_RECONNECT:
+					ESP_LOGI(TAG, "WIFI_APP_MSG_STA_RECONNECT, mode %d", event.data.wifi_app.reconnect);
+
+					// Skip if a user disconnect or new credentials overtook the backoff
+					eventBits = xEventGroupGetBits(wifi_app_event_group);
+					if (g_reconnect_enabled && !g_link_up && !(eventBits & WIFI_APP_USER_REQUESTED_STA_DISCONNECT_BIT))
+					{
+						if (event.data.wifi_app.reconnect != WIFI_APP_RECONNECT_BACKOFF)
+						{
+							// Right after the event, a background scan is aborted
+							wifi_app_connect_sta(event.data.wifi_app.reconnect == WIFI_APP_RECONNECT_CACHED);
+							break;
+						}
+
+						if (g_scan_running)
+						{
+							// A scan takes a few seconds, let the page get its results first
+							g_reconnect_after_scan = true;
+							break;
+						}
+
+						metrics_counter_inc(&wifi_app_reconnect_attempts);
+						wifi_app_select_network();
+						wifi_app_connect_sta(true);
 					}
 
 					break;
 
+				case WIFI_APP_MSG_STA_SELECT_NETWORK:
+					ESP_LOGI(TAG, "WIFI_APP_MSG_STA_SELECT_NETWORK");
+
+					eventBits = xEventGroupGetBits(wifi_app_event_group);
+					if (g_reconnect_enabled && !g_link_up && !(eventBits & WIFI_APP_USER_REQUESTED_STA_DISCONNECT_BIT))
+					{
+						// Directed to the best saved network in range, a scan connection to the current one otherwise
+						wifi_app_select_network();
+						wifi_app_connect_sta(false);
+					}
+
+					break;
+
+				case WIFI_APP_MSG_SCAN_START:
+					ESP_LOGI(TAG, "WIFI_APP_MSG_SCAN_START");
+
+					wifi_app_scan_start();
+
+					break;
+
+				case WIFI_APP_MSG_SCAN_DONE:
+					ESP_LOGI(TAG, "WIFI_APP_MSG_SCAN_DONE");
+
+					wifi_app_scan_done();
+
+					break;
+
 				default:
 					break;
 
@@ -359,14 +1144,168 @@ static void wifi_app_task(void *pvParameters)
 
 BaseType_t wifi_app_send_message(wifi_app_message_e msgID)
 {
-	wifi_app_queue_message_t msg;
-	msg.msgID = msgID;
-	return xQueueSend(wifi_app_queue_handle, &msg, portMAX_DELAY);
+	event_bus_event_t event = {
+		.topic = EVENT_BUS_TOPIC_WIFI_APP,
+		.data.wifi_app = { .msgID = msgID },
+	};
+
+	return event_bus_publish(&event) ? pdTRUE : pdFALSE;
+}
+
+const wifi_app_sta_config_t *wifi_app_sta_config_acquire(void)
+{
+	return snapshot_acquire(&g_sta_config);
+}
+
+void wifi_app_sta_config_release(const wifi_app_sta_config_t *config)
+{
+	snapshot_release(&g_sta_config, config);
+}
+
+void wifi_app_set_sta_config(const char *ssid, const char *password)
+{
+	wifi_app_sta_config_t config;
+
+	// Sources are not always terminated (NVS blobs, full wifi_config_t fields)
+	memset(&config, 0x00, sizeof(config));
+	if (ssid != NULL)
+	{
+		memcpy(config.ssid, ssid, strnlen(ssid, MAX_SSID_LENGTH));
+	}
+	if (password != NULL)
+	{
+		memcpy(config.password, password, strnlen(password, MAX_PASSWORD_LENGTH));
+	}
+
+	snapshot_publish(&g_sta_config, &config);
+}
+
+const wifi_ap_config_t *wifi_app_ap_config_acquire(void)
+{
+	return snapshot_acquire(&g_ap_config);
+}
+
+void wifi_app_ap_config_release(const wifi_ap_config_t *config)
+{
+	snapshot_release(&g_ap_config, config);
 }
 
-wifi_config_t* wifi_app_get_wifi_config(void)
+void wifi_app_set_connect_priority(int priority)
 {
-	return wifi_config;
+	g_connect_priority = priority;
+}
+
+uint32_t wifi_app_get_time_to_ip_ms(void)
+{
+	return g_time_to_ip_ms;
+}
+
+uint32_t wifi_app_get_reconnect_attempts(void)
+{
+	return g_reconnect_attempts;
+}
+
+void wifi_app_scan_request(void)
+{
+	const wifi_app_scan_result_t *scan = snapshot_acquire(&g_scan);
+	int64_t time_us = scan->time_us;
+	uint32_t start_ms = __atomic_load_n(&g_scan_start_ms, __ATOMIC_RELAXED);
+	uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+
+	snapshot_release(&g_scan, scan);
+
+	if (time_us != 0 && esp_timer_get_time() - time_us < (int64_t)CONFIG_WIFI_APP_SCAN_TTL_S * 1000000)
+	{
+		metrics_counter_inc(&wifi_app_scan_requests_cached);
+		return;
+	}
+
+	// One scan at a time, and no more than one per interval whoever asks
+	if ((start_ms != 0 && now_ms - start_ms < CONFIG_WIFI_APP_SCAN_MIN_INTERVAL_S * 1000)
+			|| __atomic_exchange_n(&g_scan_pending, true, __ATOMIC_SEQ_CST))
+	{
+		metrics_counter_inc(&wifi_app_scan_requests_throttled);
+		return;
+	}
+
+	metrics_counter_inc(&wifi_app_scan_requests_scan);
+	if (wifi_app_send_message(WIFI_APP_MSG_SCAN_START) != pdTRUE)
+	{
+		__atomic_store_n(&g_scan_pending, false, __ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * Writes a JSON string, quotes and backslashes escaped and control characters dropped.
+ */
+static esp_err_t wifi_app_write_json_string(text_writer_fn_t write, void *ctx, const char *s)
+{
+	char escaped[2 * MAX_SSID_LENGTH + 2];
+	size_t len = 0;
+
+	escaped[len++] = '"';
+	for (; *s != '\0' && len < sizeof(escaped) - 2; s++)
+	{
+		if (*s == '"' || *s == '\\')
+		{
+			escaped[len++] = '\\';
+		}
+		if ((uint8_t)*s >= 0x20)
+		{
+			escaped[len++] = *s;
+		}
+	}
+	escaped[len++] = '"';
+
+	return write(escaped, len, ctx);
+}
+
+esp_err_t wifi_app_scan_render_json(text_writer_fn_t write, void *ctx)
+{
+	const wifi_app_scan_result_t *scan = snapshot_acquire(&g_scan);
+	bool scanning = __atomic_load_n(&g_scan_pending, __ATOMIC_SEQ_CST);
+	esp_err_t err;
+
+	err = text_writer_printf(write, ctx, "{\"ageMs\":%ld,\"scanning\":%s,\"aps\":[",
+			(scan->time_us == 0) ? -1L : (long)((esp_timer_get_time() - scan->time_us) / 1000), scanning ? "true" : "false");
+
+	for (int i = 0; err == ESP_OK && i < scan->count; i++)
+	{
+		err = write((i > 0) ? ",{\"ssid\":" : "{\"ssid\":", (i > 0) ? 9 : 8, ctx);
+		if (err == ESP_OK)
+		{
+			err = wifi_app_write_json_string(write, ctx, scan->aps[i].ssid);
+		}
+		if (err == ESP_OK)
+		{
+			err = text_writer_printf(write, ctx, ",\"rssi\":%d,\"channel\":%u,\"auth\":%u}", scan->aps[i].rssi, scan->aps[i].channel, scan->aps[i].authmode);
+		}
+	}
+	if (err == ESP_OK)
+	{
+		err = write("]}", 2, ctx);
+	}
+
+	snapshot_release(&g_scan, scan);
+
+	return err;
+}
+
+int8_t wifi_app_get_rssi(void)
+{
+	wifi_ap_record_t ap_info;
+
+	if (!wifi_app_is_sta_connected() || esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
+	{
+		return 0;
+	}
+
+	return ap_info.rssi;
+}
+
+bool wifi_app_is_sta_connected(void)
+{
+	return (xEventGroupGetBits(wifi_app_event_group) & WIFI_APP_STA_CONNECTED_GOT_IP_BIT) != 0;
 }
 
 void wifi_app_set_callback(wifi_connected_event_callback_t cb)
@@ -386,12 +1325,43 @@ void wifi_app_start(void)
 	// Disable default WiFi logging messages
 	esp_log_level_set("wifi", ESP_LOG_NONE);
 
-	// Allocate memory for the wifi configuration
-	wifi_config = (wifi_config_t*)malloc(sizeof(wifi_config_t));
-	memset(wifi_config, 0x00, sizeof(wifi_config_t));
+	// Empty configurations until credentials are loaded and the access point is configured
+	snapshot_init(&g_sta_config, g_sta_config_storage, sizeof(wifi_app_sta_config_t), NULL);
+	snapshot_init(&g_ap_config, g_ap_config_storage, sizeof(wifi_ap_config_t), NULL);
+	snapshot_init(&g_scan, g_scan_storage, sizeof(wifi_app_scan_result_t), NULL);
+
+	// Register the WiFi metrics
+	for (int i = 0; i < WIFI_APP_MSG_COUNT; i++)
+	{
+		metrics_register(&wifi_app_msg_metrics[i].base);
+	}
+	metrics_register(&wifi_app_commands_dropped.base);
+	metrics_register(&wifi_app_disconnect_events.base);
+	metrics_register(&wifi_app_sta_connected.base);
+	metrics_register(&wifi_app_time_to_ip_fast.base);
+	metrics_register(&wifi_app_time_to_ip_scan.base);
+	metrics_register(&wifi_app_network_selections.base);
+	metrics_register(&wifi_app_scans_started.base);
+	metrics_register(&wifi_app_scans_failed.base);
+	metrics_register(&wifi_app_scans_aborted.base);
+	metrics_register(&wifi_app_scan_requests_cached.base);
+	metrics_register(&wifi_app_scan_requests_throttled.base);
+	metrics_register(&wifi_app_scan_requests_scan.base);
+	metrics_register(&wifi_app_fast_connect_fallbacks.base);
+	metrics_register(&wifi_app_reconnect_attempts.base);
+	metrics_register(&wifi_app_reconnect_backoff.base);
+	metrics_register(&wifi_app_outage_duration.base);
+	metrics_register(&wifi_app_outage.base);
+
+	// Timer of the reconnect backoff
+	const esp_timer_create_args_t reconnect_timer_args = {
+			.callback = &wifi_app_reconnect_timer_cb,
+			.name = "wifi_reconnect",
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&reconnect_timer_args, &wifi_app_reconnect_timer));
 
-	// Create message queue
-	wifi_app_queue_handle = xQueueCreate(3, sizeof(wifi_app_queue_message_t));
+	// Subscribe to the WiFi application commands
+	wifi_app_subscriber = event_bus_subscribe("wifi_app", EVENT_BUS_TOPIC_BIT(EVENT_BUS_TOPIC_WIFI_APP), WIFI_APP_EVENT_QUEUE_LENGTH);
 
 	// Create Wifi application event group
 	wifi_app_event_group = xEventGroupCreate();
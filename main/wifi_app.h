@@ -8,10 +8,13 @@
 #ifndef MAIN_WIFI_APP_H_
 #define MAIN_WIFI_APP_H_
 
+#include "esp_err.h"
 #include "esp_netif.h"
 #include "esp_wifi_types.h"
 #include "freertos/FreeRTOS.h"
 
+#include "text_writer.h"
+
 // Callback typedef
 typedef void (*wifi_connected_event_callback_t)(void);
 
@@ -29,7 +32,14 @@ typedef void (*wifi_connected_event_callback_t)(void);
 #define WIFI_STA_POWER_SAVE			WIFI_PS_NONE		// Power save not used
 #define MAX_SSID_LENGTH				32					// IEEE standard maximum
 #define MAX_PASSWORD_LENGTH			64					// IEEE standard maximum
-#define MAX_CONNECTION_RETRIES		5					// Retry number on disconnect
+#define MAX_CONNECTION_RETRIES		5					// Attempts for credentials entered on the web page
+#define WIFI_APP_EVENT_QUEUE_LENGTH	8					// Event bus messages waiting for the WiFi application task
+#define WIFI_APP_SELECT_MAX_APS		20					// Scan records ranked by the network selection
+#define WIFI_APP_SELECT_PRIORITY_DB	10					// Selection score of a priority step, in dB of RSSI
+#define WIFI_APP_SELECT_RECENT_DB	5					// Selection bonus of the network that connected last, in dB of RSSI
+#define WIFI_APP_SCAN_MAX_RECORDS	40					// Scan records read from the driver, the rest are dropped
+#define WIFI_APP_SCAN_MAX_APS		20					// Networks kept by the scan cache, one per SSID, strongest first
+#define WIFI_APP_COMMAND_RETRY_MS	100					// Delay before a command dropped by a full event bus is sent again
 
 // netif object for the Station and Access Point
 extern esp_netif_t* esp_netif_sta;
@@ -41,28 +51,32 @@ extern esp_netif_t* esp_netif_ap;
  */
 typedef enum wifi_app_message
 {
-	WIFI_APP_MSG_START_HTTP_SERVER = 0,
-	WIFI_APP_MSG_CONNECTING_FROM_HTTP_SERVER,
+	WIFI_APP_MSG_CONNECTING_FROM_HTTP_SERVER = 0,
 	WIFI_APP_MSG_STA_CONNECTED_GOT_IP,
 	WIFI_APP_MSG_USER_REQUESTED_STA_DISCONNECT,
 	WIFI_APP_MSG_LOAD_SAVED_CREDENTIALS,
 	WIFI_APP_MSG_STA_DISCONNECTED,
+	WIFI_APP_MSG_STA_RECONNECT,
+	WIFI_APP_MSG_STA_SELECT_NETWORK,
+	WIFI_APP_MSG_SCAN_START,
+	WIFI_APP_MSG_SCAN_DONE,
+	WIFI_APP_MSG_COUNT,
 } wifi_app_message_e;
 
 /**
- * Structure for the message queue
- * @note Expand this based on application requirements e.g. add another type and parameter as required
+ * How the WiFi application task connects on WIFI_APP_MSG_STA_RECONNECT
  */
-typedef struct wifi_app_queue_message
+typedef enum wifi_app_reconnect
 {
-	wifi_app_message_e msgID;
-} wifi_app_queue_message_t;
+	WIFI_APP_RECONNECT_BACKOFF = 0,		///> after a backoff: select the best saved network, then connect (cached access point if it matches)
+	WIFI_APP_RECONNECT_CACHED,			///> straight back to the cached access point, the link just dropped
+	WIFI_APP_RECONNECT_SCAN,			///> scan for the configured network, the directed connection failed
+} wifi_app_reconnect_e;
 
 /**
- * Sends a message to the queue
+ * Publishes a message to the WiFi application task on the event bus, never blocks
  * @param msgID message ID from the wifi_app_message_e enum.
- * @return pdTRUE if an item was successfully sent to the queue, otherwise pdFALSE.
- * @note Expand the parameter list based on your requirements e.g. how you've expanded the wifi_app_queue_message_t.
+ * @return pdTRUE if the task received the message, otherwise pdFALSE.
  */
 BaseType_t wifi_app_send_message(wifi_app_message_e msgID);
 
@@ -72,9 +86,41 @@ BaseType_t wifi_app_send_message(wifi_app_message_e msgID);
 void wifi_app_start(void);
 
 /**
- * Gets the wifi configuration
+ * Station credentials, published as immutable versions (see snapshot.h)
+ */
+typedef struct wifi_app_sta_config
+{
+	char ssid[MAX_SSID_LENGTH + 1];
+	char password[MAX_PASSWORD_LENGTH + 1];
+} wifi_app_sta_config_t;
+
+/**
+ * Pins the current station credentials, never blocks.
+ * @return credentials, valid until wifi_app_sta_config_release.
+ */
+const wifi_app_sta_config_t *wifi_app_sta_config_acquire(void);
+void wifi_app_sta_config_release(const wifi_app_sta_config_t *config);
+
+/**
+ * Publishes new station credentials, used by the next connection attempt.
+ * @param ssid SSID, at most MAX_SSID_LENGTH characters are used, NULL for none.
+ * @param password password, at most MAX_PASSWORD_LENGTH characters are used, NULL for none.
  */
-wifi_config_t* wifi_app_get_wifi_config(void);
+void wifi_app_set_sta_config(const char *ssid, const char *password);
+
+/**
+ * Pins the current access point configuration, never blocks.
+ * @return configuration, valid until wifi_app_ap_config_release.
+ */
+const wifi_ap_config_t *wifi_app_ap_config_acquire(void);
+void wifi_app_ap_config_release(const wifi_ap_config_t *config);
+
+/**
+ * Sets the priority the credentials of the next WIFI_APP_MSG_CONNECTING_FROM_HTTP_SERVER
+ * are saved with, higher is preferred when several saved networks are in range.
+ * @param priority 0 to 255, -1 to keep the saved priority.
+ */
+void wifi_app_set_connect_priority(int priority);
 
 /**
  * Sets the callback function.
@@ -86,9 +132,45 @@ void wifi_app_set_callback(wifi_connected_event_callback_t cb);
  */
 void wifi_app_call_callback(void);
 
+/**
+ * Gets how long the last connection attempt took from esp_wifi_connect to the IP address.
+ * @return milliseconds, 0 before the first connection.
+ */
+uint32_t wifi_app_get_time_to_ip_ms(void);
+
+/**
+ * Checks whether the station is connected and has an IP address.
+ * @return true if connected.
+ */
+bool wifi_app_is_sta_connected(void);
+
+/**
+ * Gets the failed attempts of the reconnection in progress.
+ * @return 0 while connected.
+ */
+uint32_t wifi_app_get_reconnect_attempts(void);
+
+/**
+ * Asks for a background scan unless the cached results are younger than
+ * CONFIG_WIFI_APP_SCAN_TTL_S, a scan is already pending or running, or the
+ * last one started less than CONFIG_WIFI_APP_SCAN_MIN_INTERVAL_S ago.
+ * Never blocks, the results replace the cache when the scan is done.
+ */
+void wifi_app_scan_request(void);
+
+/**
+ * Renders the scan cache as JSON, strongest network first:
+ * {"ageMs":1200,"scanning":false,"aps":[{"ssid":"home","rssi":-52,"channel":6,"auth":3},...]}
+ * ageMs is -1 before the first scan, auth is a wifi_auth_mode_t.
+ * @param write output function.
+ * @param ctx passed to write.
+ * @return ESP_OK, otherwise the first error returned by write.
+ */
+esp_err_t wifi_app_scan_render_json(text_writer_fn_t write, void *ctx);
+
 /**
  * Gets the RSSI value of the Wifi connection.
- * @return current RSSI level.
+ * @return current RSSI level in dBm, 0 while not connected.
  */
 int8_t wifi_app_get_rssi(void);
 
@@ -0,0 +1,313 @@
+/*
+ * wifi_link.c
+ *
+ *  Station link quality sampler. The esp_timer callback takes a sample and
+ *  the WiFi event handler records disconnections, both under one spinlock
+ *  held for a few stores; the web handler copies the histories out under
+ *  the same lock and formats them outside it.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "sys/param.h"
+
+#include "metrics.h"
+#include "wifi_app.h"
+#include "wifi_link.h"
+
+// Tag used for ESP serial console messages
+static const char TAG[] = "wifi_link";
+
+static esp_timer_handle_t wifi_link_timer;
+static portMUX_TYPE g_link_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Sample history, g_sample_count counts every sample taken, the slot is count % length
+static wifi_link_sample_t g_samples[CONFIG_WIFI_LINK_HISTORY_LENGTH];
+static uint32_t g_sample_count;
+
+// Disconnect history, same layout
+static wifi_link_disconnect_t g_disconnects[WIFI_LINK_DISCONNECT_HISTORY];
+static uint32_t g_disconnect_count;
+
+// Disconnect events since the last sample
+static uint32_t g_disconnects_pending;
+
+// Last RSSI sampled while connected, kept through the outage for the disconnect history
+static int8_t g_last_rssi;
+
+// Snapshots formatted by wifi_link_render_json, static so they don't live on the httpd task stack
+static wifi_link_sample_t g_render_samples[CONFIG_WIFI_LINK_HISTORY_LENGTH];
+static wifi_link_disconnect_t g_render_disconnects[WIFI_LINK_DISCONNECT_HISTORY];
+
+static const int8_t wifi_link_rssi_bounds[WIFI_LINK_RSSI_BUCKETS - 1] = WIFI_LINK_RSSI_BOUNDS;
+
+// Link metrics, indexed by RSSI bucket and by wifi_link_reason_class_e
+#define WIFI_LINK_RSSI_METRIC(_dbm) METRICS_COUNTER_INIT("wifi_rssi_samples_total", "Connected link samples by RSSI bucket (not cumulative), upper bound in dBm", "bucket=\"" _dbm "\"")
+static metrics_counter_t wifi_link_rssi_samples[WIFI_LINK_RSSI_BUCKETS] = {
+	WIFI_LINK_RSSI_METRIC("-90"),
+	WIFI_LINK_RSSI_METRIC("-80"),
+	WIFI_LINK_RSSI_METRIC("-70"),
+	WIFI_LINK_RSSI_METRIC("-67"),
+	WIFI_LINK_RSSI_METRIC("-60"),
+	WIFI_LINK_RSSI_METRIC("-50"),
+	WIFI_LINK_RSSI_METRIC("+Inf"),
+};
+static const char *wifi_link_reason_names[WIFI_LINK_REASON_COUNT] = {
+	"beacon_timeout", "no_ap_found", "auth", "assoc", "local", "other",
+};
+#define WIFI_LINK_REASON_METRIC(_class) METRICS_COUNTER_INIT("wifi_disconnect_reasons_total", "Station disconnect events by reason class", "class=\"" _class "\"")
+static metrics_counter_t wifi_link_reasons[WIFI_LINK_REASON_COUNT] = {
+	WIFI_LINK_REASON_METRIC("beacon_timeout"),
+	WIFI_LINK_REASON_METRIC("no_ap_found"),
+	WIFI_LINK_REASON_METRIC("auth"),
+	WIFI_LINK_REASON_METRIC("assoc"),
+	WIFI_LINK_REASON_METRIC("local"),
+	WIFI_LINK_REASON_METRIC("other"),
+};
+
+/**
+ * Reads the RSSI of the last sample, for the wifi_rssi_dbm gauge.
+ */
+static int32_t wifi_link_read_rssi(void *arg)
+{
+	uint32_t count = __atomic_load_n(&g_sample_count, __ATOMIC_RELAXED);
+
+	return (count == 0) ? 0 : g_samples[(count - 1) % CONFIG_WIFI_LINK_HISTORY_LENGTH].rssi;
+}
+static metrics_gauge_t wifi_link_rssi = METRICS_GAUGE_FN_INIT("wifi_rssi_dbm", "RSSI of the last link sample, 0 while not connected", NULL, wifi_link_read_rssi, NULL);
+
+/**
+ * Gets the class of a disconnect reason.
+ * @param reason wifi_err_reason_t.
+ */
+static wifi_link_reason_class_e wifi_link_classify(uint8_t reason)
+{
+	switch (reason)
+	{
+		case WIFI_REASON_BEACON_TIMEOUT:
+			return WIFI_LINK_REASON_BEACON_TIMEOUT;
+
+		case WIFI_REASON_NO_AP_FOUND:
+			return WIFI_LINK_REASON_NO_AP_FOUND;
+
+		case WIFI_REASON_AUTH_EXPIRE:
+		case WIFI_REASON_AUTH_FAIL:
+		case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+		case WIFI_REASON_HANDSHAKE_TIMEOUT:
+			return WIFI_LINK_REASON_AUTH;
+
+		case WIFI_REASON_ASSOC_FAIL:
+			return WIFI_LINK_REASON_ASSOC;
+
+		case WIFI_REASON_ASSOC_LEAVE:
+			return WIFI_LINK_REASON_LOCAL;
+
+		default:
+			return WIFI_LINK_REASON_OTHER;
+	}
+}
+
+/**
+ * Gets the RSSI bucket of a sample.
+ */
+static int wifi_link_rssi_bucket(int8_t rssi)
+{
+	int bucket = 0;
+
+	while (bucket < WIFI_LINK_RSSI_BUCKETS - 1 && rssi > wifi_link_rssi_bounds[bucket])
+	{
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/**
+ * Sampler timer callback, runs in the esp_timer task.
+ */
+static void wifi_link_timer_cb(void *arg)
+{
+	wifi_link_sample_t sample = {
+		.uptime_s = (uint32_t)(esp_timer_get_time() / 1000000),
+		.phymode = WIFI_LINK_PHYMODE_NONE,
+		.reconnect_attempts = (uint16_t)MIN(wifi_app_get_reconnect_attempts(), UINT16_MAX),
+	};
+	wifi_ap_record_t ap_info;
+	wifi_phy_mode_t phymode;
+
+	if (wifi_app_is_sta_connected() && esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+	{
+		sample.rssi = ap_info.rssi;
+		sample.channel = ap_info.primary;
+		if (esp_wifi_sta_get_negotiated_phymode(&phymode) == ESP_OK)
+		{
+			sample.phymode = phymode;
+		}
+		metrics_counter_inc(&wifi_link_rssi_samples[wifi_link_rssi_bucket(sample.rssi)]);
+	}
+
+	portENTER_CRITICAL(&g_link_lock);
+	sample.disconnects = (uint8_t)MIN(g_disconnects_pending, UINT8_MAX);
+	g_disconnects_pending = 0;
+	if (sample.rssi != 0)
+	{
+		g_last_rssi = sample.rssi;
+	}
+	g_samples[g_sample_count % CONFIG_WIFI_LINK_HISTORY_LENGTH] = sample;
+	__atomic_store_n(&g_sample_count, g_sample_count + 1, __ATOMIC_RELAXED);
+	portEXIT_CRITICAL(&g_link_lock);
+}
+
+void wifi_link_record_disconnect(uint8_t reason)
+{
+	wifi_link_disconnect_t event = {
+		.uptime_s = (uint32_t)(esp_timer_get_time() / 1000000),
+		.reason = reason,
+	};
+
+	metrics_counter_inc(&wifi_link_reasons[wifi_link_classify(reason)]);
+
+	portENTER_CRITICAL(&g_link_lock);
+	event.rssi = g_last_rssi;
+	g_disconnects[g_disconnect_count % WIFI_LINK_DISCONNECT_HISTORY] = event;
+	g_disconnect_count++;
+	g_disconnects_pending++;
+	portEXIT_CRITICAL(&g_link_lock);
+}
+
+size_t wifi_link_get_samples(wifi_link_sample_t *samples)
+{
+	size_t count;
+	uint32_t first;
+
+	portENTER_CRITICAL(&g_link_lock);
+	count = MIN(g_sample_count, CONFIG_WIFI_LINK_HISTORY_LENGTH);
+	first = g_sample_count - count;
+	for (size_t i = 0; i < count; i++)
+	{
+		samples[i] = g_samples[(first + i) % CONFIG_WIFI_LINK_HISTORY_LENGTH];
+	}
+	portEXIT_CRITICAL(&g_link_lock);
+
+	return count;
+}
+
+/**
+ * Gets the short name of a PHY mode.
+ */
+static const char *wifi_link_phymode_name(uint8_t phymode)
+{
+	switch (phymode)
+	{
+		case WIFI_PHY_MODE_LR:		return "lr";
+		case WIFI_PHY_MODE_11B:		return "11b";
+		case WIFI_PHY_MODE_11G:		return "11g";
+		case WIFI_PHY_MODE_HT20:	return "11n-ht20";
+		case WIFI_PHY_MODE_HT40:	return "11n-ht40";
+		case WIFI_PHY_MODE_HE20:	return "11ax-he20";
+		case WIFI_LINK_PHYMODE_NONE: return "none";
+		default:					return "other";
+	}
+}
+
+esp_err_t wifi_link_render_json(text_writer_fn_t write, void *ctx)
+{
+	size_t sample_count = wifi_link_get_samples(g_render_samples);
+	size_t disconnect_count;
+	uint32_t first;
+	esp_err_t err;
+
+	portENTER_CRITICAL(&g_link_lock);
+	disconnect_count = MIN(g_disconnect_count, WIFI_LINK_DISCONNECT_HISTORY);
+	first = g_disconnect_count - disconnect_count;
+	for (size_t i = 0; i < disconnect_count; i++)
+	{
+		g_render_disconnects[i] = g_disconnects[(first + i) % WIFI_LINK_DISCONNECT_HISTORY];
+	}
+	portEXIT_CRITICAL(&g_link_lock);
+
+	const wifi_link_sample_t *last = (sample_count > 0) ? &g_render_samples[sample_count - 1] : NULL;
+	err = text_writer_printf(write, ctx, "{\"rssi\":%d,\"channel\":%u,\"phyMode\":\"%s\",\"periodS\":%d,\"rssiHistogram\":{\"bounds\":[",
+			last ? last->rssi : 0, last ? last->channel : 0, wifi_link_phymode_name(last ? last->phymode : WIFI_LINK_PHYMODE_NONE),
+			CONFIG_WIFI_LINK_SAMPLE_PERIOD_S);
+
+	for (int i = 0; err == ESP_OK && i < WIFI_LINK_RSSI_BUCKETS - 1; i++)
+	{
+		err = text_writer_printf(write, ctx, "%s%d", (i > 0) ? "," : "", wifi_link_rssi_bounds[i]);
+	}
+	if (err == ESP_OK)
+	{
+		err = write("],\"counts\":[", 12, ctx);
+	}
+	for (int i = 0; err == ESP_OK && i < WIFI_LINK_RSSI_BUCKETS; i++)
+	{
+		err = text_writer_printf(write, ctx, "%s%" PRIu32, (i > 0) ? "," : "", __atomic_load_n(&wifi_link_rssi_samples[i].value, __ATOMIC_RELAXED));
+	}
+	if (err == ESP_OK)
+	{
+		err = write("]},\"disconnectReasons\":{", 24, ctx);
+	}
+	for (int i = 0; err == ESP_OK && i < WIFI_LINK_REASON_COUNT; i++)
+	{
+		err = text_writer_printf(write, ctx, "%s\"%s\":%" PRIu32, (i > 0) ? "," : "", wifi_link_reason_names[i],
+				__atomic_load_n(&wifi_link_reasons[i].value, __ATOMIC_RELAXED));
+	}
+	if (err == ESP_OK)
+	{
+		err = write("},\"samples\":[", 13, ctx);
+	}
+	for (size_t i = 0; err == ESP_OK && i < sample_count; i++)
+	{
+		const wifi_link_sample_t *s = &g_render_samples[i];
+
+		err = text_writer_printf(write, ctx, "%s[%" PRIu32 ",%d,%u,%u,%u,%u]", (i > 0) ? "," : "",
+				s->uptime_s, s->rssi, s->channel, s->phymode, s->disconnects, s->reconnect_attempts);
+	}
+	if (err == ESP_OK)
+	{
+		err = write("],\"disconnects\":[", 17, ctx);
+	}
+	for (size_t i = 0; err == ESP_OK && i < disconnect_count; i++)
+	{
+		const wifi_link_disconnect_t *d = &g_render_disconnects[i];
+
+		err = text_writer_printf(write, ctx, "%s[%" PRIu32 ",%u,%d]", (i > 0) ? "," : "", d->uptime_s, d->reason, d->rssi);
+	}
+	if (err == ESP_OK)
+	{
+		err = write("]}", 2, ctx);
+	}
+
+	return err;
+}
+
+void wifi_link_start(void)
+{
+	const esp_timer_create_args_t timer_args = {
+			.callback = &wifi_link_timer_cb,
+			.name = "wifi_link",
+	};
+
+	metrics_register(&wifi_link_rssi.base);
+	for (int i = 0; i < WIFI_LINK_RSSI_BUCKETS; i++)
+	{
+		metrics_register(&wifi_link_rssi_samples[i].base);
+	}
+	for (int i = 0; i < WIFI_LINK_REASON_COUNT; i++)
+	{
+		metrics_register(&wifi_link_reasons[i].base);
+	}
+
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &wifi_link_timer));
+	ESP_ERROR_CHECK(esp_timer_start_periodic(wifi_link_timer, (uint64_t)CONFIG_WIFI_LINK_SAMPLE_PERIOD_S * 1000000));
+
+	ESP_LOGI(TAG, "Sampling the link every %d s, %d samples kept", CONFIG_WIFI_LINK_SAMPLE_PERIOD_S, CONFIG_WIFI_LINK_HISTORY_LENGTH);
+}
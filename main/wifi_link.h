@@ -0,0 +1,102 @@
+/*
+ * wifi_link.h
+ *
+ *  Station link quality: a periodic sampler of the RSSI, channel and PHY
+ *  mode of the access point, the disconnections and the reconnection
+ *  attempts, kept in fixed size histories next to an RSSI histogram and
+ *  per class disconnect counters. Served by /wifiLink.json and /metrics.
+ *
+ *  A weak RSSI or beacon timeouts ahead of slow uplinks point at the
+ *  radio, a good RSSI with a quiet disconnect history points at the
+ *  firmware or the network behind the access point.
+ */
+
+#ifndef MAIN_WIFI_LINK_H_
+#define MAIN_WIFI_LINK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "text_writer.h"
+
+// Disconnections kept in the history
+#define WIFI_LINK_DISCONNECT_HISTORY	16
+
+// Upper bounds (dBm) of the RSSI histogram buckets, the last bucket is everything stronger
+#define WIFI_LINK_RSSI_BOUNDS			{ -90, -80, -70, -67, -60, -50 }
+#define WIFI_LINK_RSSI_BUCKETS			7
+
+/**
+ * Classes of wifi_err_reason_t counted by wifi_link_record_disconnect
+ */
+typedef enum wifi_link_reason_class
+{
+	WIFI_LINK_REASON_BEACON_TIMEOUT = 0,	///> access point lost, radio side
+	WIFI_LINK_REASON_NO_AP_FOUND,			///> nothing answered the probe or scan
+	WIFI_LINK_REASON_AUTH,					///> authentication or key handshake failed
+	WIFI_LINK_REASON_ASSOC,					///> association refused or expired
+	WIFI_LINK_REASON_LOCAL,					///> this station left (user disconnect, new credentials)
+	WIFI_LINK_REASON_OTHER,
+	WIFI_LINK_REASON_COUNT,
+} wifi_link_reason_class_e;
+
+/**
+ * One sample of the link, taken every CONFIG_WIFI_LINK_SAMPLE_PERIOD_S
+ */
+typedef struct wifi_link_sample
+{
+	uint32_t uptime_s;
+	int8_t rssi;					///> dBm, 0 while not connected
+	uint8_t channel;				///> 0 while not connected
+	uint8_t phymode;				///> wifi_phy_mode_t, WIFI_LINK_PHYMODE_NONE while not connected
+	uint8_t disconnects;			///> disconnect events since the previous sample, saturates at 255
+	uint16_t reconnect_attempts;	///> failed attempts of the reconnection in progress
+} wifi_link_sample_t;
+
+#define WIFI_LINK_PHYMODE_NONE			0xFF
+
+/**
+ * One disconnect event
+ */
+typedef struct wifi_link_disconnect
+{
+	uint32_t uptime_s;
+	uint8_t reason;					///> wifi_err_reason_t
+	int8_t rssi;					///> last RSSI sampled while connected
+} wifi_link_disconnect_t;
+
+/**
+ * Registers the link metrics and starts the sampler.
+ */
+void wifi_link_start(void);
+
+/**
+ * Records a station disconnect event, link drops and failed attempts alike.
+ * Called from the WiFi event handler.
+ * @param reason wifi_err_reason_t of the event.
+ */
+void wifi_link_record_disconnect(uint8_t reason);
+
+/**
+ * Copies the sample history, oldest first.
+ * @param samples output, CONFIG_WIFI_LINK_HISTORY_LENGTH entries.
+ * @return number of samples copied.
+ */
+size_t wifi_link_get_samples(wifi_link_sample_t *samples);
+
+/**
+ * Renders the link state and histories as JSON:
+ * {"rssi":-61,"channel":6,"phyMode":"11n","periodS":10,
+ *  "rssiHistogram":{"bounds":[...],"counts":[...]},
+ *  "disconnectReasons":{"beacon_timeout":0,...},
+ *  "samples":[[uptime_s,rssi,channel,phymode,disconnects,reconnect_attempts],...],
+ *  "disconnects":[[uptime_s,reason,rssi],...]}
+ * @param write output function.
+ * @param ctx passed to write.
+ * @return ESP_OK, otherwise the first error returned by write.
+ */
+esp_err_t wifi_link_render_json(text_writer_fn_t write, void *ctx);
+
+#endif /* MAIN_WIFI_LINK_H_ */
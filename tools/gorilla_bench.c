@@ -0,0 +1,315 @@
+/*
+ * gorilla_bench.c
+ *
+ *  Host benchmark of includes/gorilla.c on sensor traces: compression ratio
+ *  and encode/decode time per sample, XOR and quantized coding, in blocks
+ *  the size of a sensor log page. Every block is decoded back and checked
+ *  (exact for XOR, within quantum / 2 when quantized).
+ *
+ *  Traces are /sensorLog.json exports of a device, records
+ *  [time_s,time_ms,sensor,value,flags]; several files (successive ?seq=
+ *  pages) are read in order. Without files the bench generates a day of
+ *  readings modeled on sensors_app.c: the LM35 every 1000 ms plus a tick
+ *  of jitter, in 0.1 °C steps (whole mV), and the ultrasonic sensor every
+ *  500 ms plus the echo time, from a µs echo, with someone passing by now
+ *  and then. The times are host times, they rank the codings, they do not
+ *  predict cycle counts on the ESP32.
+ *
+ *      curl -o trace1.json 'http://192.168.0.1/sensorLog.json'
+ *      cc -O2 -Iincludes tools/gorilla_bench.c includes/gorilla.c -lm -o gorilla_bench
+ *      ./gorilla_bench [trace1.json ...]
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gorilla.h"
+
+// Data bytes of a compressed sensor log page (256 bytes less the page and block headers)
+#define BLOCK_BYTES			232
+
+// Bytes of an uncompressed sensor log record
+#define RECORD_BYTES		12
+
+// Encode/decode passes timed over each trace
+#define PASSES				20
+
+#define SENSORS				2
+
+static const char *sensor_names[SENSORS] = { "temperature", "distance" };
+
+// Resolution used by sensor_log.c for each sensor
+static const float sensor_quanta[SENSORS] = { 0.1f, 0.1f };
+
+/**
+ * Series of one sensor
+ */
+typedef struct trace
+{
+	int64_t *times;
+	float *values;
+	size_t count;
+	size_t capacity;
+} trace_t;
+
+static trace_t g_traces[SENSORS];
+
+static void trace_add(trace_t *trace, int64_t time, float value)
+{
+	if (trace->count == trace->capacity)
+	{
+		trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+		trace->times = realloc(trace->times, trace->capacity * sizeof(*trace->times));
+		trace->values = realloc(trace->values, trace->capacity * sizeof(*trace->values));
+		if (trace->times == NULL || trace->values == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	trace->times[trace->count] = time;
+	trace->values[trace->count] = value;
+	trace->count++;
+}
+
+/**
+ * Reads the records of a /sensorLog.json export.
+ */
+static int trace_load(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	char *text;
+	long size;
+	size_t records = 0;
+
+	if (file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	text = malloc(size + 1);
+	if (text == NULL || fread(text, 1, size, file) != (size_t)size)
+	{
+		fprintf(stderr, "%s: read error\n", path);
+		fclose(file);
+		free(text);
+		return -1;
+	}
+	text[size] = '\0';
+	fclose(file);
+
+	for (char *p = strchr(text, '['); p != NULL; p = strchr(p + 1, '['))
+	{
+		unsigned time_s, time_ms, sensor, flags;
+		float value;
+
+		if (sscanf(p, "[%u,%u,%u,%f,%u]", &time_s, &time_ms, &sensor, &value, &flags) == 5 && sensor < SENSORS)
+		{
+			trace_add(&g_traces[sensor], (int64_t)time_s * 1000 + time_ms, value);
+			records++;
+		}
+	}
+	free(text);
+
+	printf("%s: %zu records\n", path, records);
+
+	return 0;
+}
+
+/**
+ * Generates a day of readings as sensors_app.c takes them.
+ */
+static void trace_generate(void)
+{
+	const int64_t day_ms = 24 * 3600 * 1000LL;
+	const int64_t start = 1700000000000LL;
+	int64_t present_until = 0;
+
+	srand(1);
+
+	// LM35: 10 mV/°C read in whole mV, a slow daily swing and 1-2 mV of noise
+	for (int64_t t = start; t < start + day_ms; t += 1000 + ((rand() % 4 == 0) ? 10 : 0))
+	{
+		double mv = 300.0 + 40.0 * sin(2 * M_PI * (t - start) / day_ms) + (rand() % 5 - 2) * 0.5;
+
+		trace_add(&g_traces[0], t, (float)lround(mv) / 10.0f);
+	}
+
+	// Ultrasonic: echo time in µs, 0.01715 cm per µs, a wall at 250 cm or someone closer
+	for (int64_t t = start; t < start + day_ms; )
+	{
+		double cm = 250.0;
+		long echo_us;
+
+		if (t >= present_until && rand() % 2000 == 0)
+		{
+			present_until = t + 20000 + rand() % 60000;
+		}
+		if (t < present_until)
+		{
+			cm = 40.0 + rand() % 30;
+		}
+		echo_us = lround(cm / 0.01715) + rand() % 21 - 10;
+
+		trace_add(&g_traces[1], t, (float)(echo_us * 0.01715));
+		t += 500 + echo_us / 1000 + ((rand() % 4 == 0) ? 10 : 0);
+	}
+
+	printf("generated: one day, %zu temperature and %zu distance readings\n", g_traces[0].count, g_traces[1].count);
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Encodes a trace in blocks, decodes it back and prints the figures.
+ */
+static int bench(const char *name, const trace_t *trace, float quantum)
+{
+	size_t max_blocks = trace->count;
+	uint8_t *blocks = malloc(max_blocks * BLOCK_BYTES);
+	uint32_t *counts = calloc(max_blocks, sizeof(*counts));
+	uint32_t *sizes = calloc(max_blocks, sizeof(*sizes));
+	size_t nblocks = 0;
+	size_t bytes = 0;
+	double max_error = 0.0;
+	double start, encode_s, decode_s;
+
+	if (blocks == NULL || counts == NULL || sizes == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	start = now_s();
+	for (int pass = 0; pass < PASSES; pass++)
+	{
+		gorilla_encoder_t enc;
+
+		nblocks = 0;
+		gorilla_encoder_init(&enc, blocks, BLOCK_BYTES, quantum);
+		for (size_t i = 0; i < trace->count; i++)
+		{
+			if (!gorilla_encode(&enc, trace->times[i], trace->values[i]))
+			{
+				counts[nblocks] = enc.count;
+				sizes[nblocks] = (uint32_t)gorilla_encoder_bytes(&enc);
+				nblocks++;
+				gorilla_encoder_init(&enc, blocks + nblocks * BLOCK_BYTES, BLOCK_BYTES, quantum);
+				gorilla_encode(&enc, trace->times[i], trace->values[i]);
+			}
+		}
+		counts[nblocks] = enc.count;
+		sizes[nblocks] = (uint32_t)gorilla_encoder_bytes(&enc);
+		nblocks++;
+	}
+	encode_s = now_s() - start;
+
+	start = now_s();
+	for (int pass = 0; pass < PASSES; pass++)
+	{
+		size_t i = 0;
+
+		for (size_t b = 0; b < nblocks; b++)
+		{
+			gorilla_decoder_t dec;
+			int64_t time;
+			float value;
+
+			gorilla_decoder_init(&dec, blocks + b * BLOCK_BYTES, sizes[b], counts[b], quantum);
+			while (gorilla_decode(&dec, &time, &value))
+			{
+				if (pass == 0)
+				{
+					double error = fabs((double)value - trace->values[i]);
+
+					if (time != trace->times[i] || (quantum == 0.0f && value != trace->values[i])
+							|| error > quantum / 2 + 1e-4 * fabs(trace->values[i]))
+					{
+						fprintf(stderr, "%s: sample %zu decoded as (%lld, %g), was (%lld, %g)\n", name, i,
+								(long long)time, value, (long long)trace->times[i], trace->values[i]);
+						return -1;
+					}
+					if (error > max_error)
+					{
+						max_error = error;
+					}
+				}
+				i++;
+			}
+			if (dec.error)
+			{
+				fprintf(stderr, "%s: block %zu corrupt\n", name, b);
+				return -1;
+			}
+		}
+		if (i != trace->count)
+		{
+			fprintf(stderr, "%s: %zu samples decoded of %zu\n", name, i, trace->count);
+			return -1;
+		}
+	}
+	decode_s = now_s() - start;
+
+	for (size_t b = 0; b < nblocks; b++)
+	{
+		bytes += sizes[b];
+	}
+
+	printf("%-12s %-9s %8zu %6zu %8.2f %7.1fx %7.1fx %8.1f %8.1f %9.2g\n", name,
+			(quantum > 0.0f) ? "quantized" : "xor", trace->count, nblocks,
+			bytes * 8.0 / trace->count,
+			(double)trace->count * RECORD_BYTES / bytes,
+			(double)trace->count * RECORD_BYTES / (nblocks * BLOCK_BYTES),
+			encode_s * 1e9 / (PASSES * trace->count), decode_s * 1e9 / (PASSES * trace->count), max_error);
+
+	free(blocks);
+	free(counts);
+	free(sizes);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (trace_load(argv[i]) != 0)
+		{
+			return 1;
+		}
+	}
+	if (argc == 1)
+	{
+		trace_generate();
+	}
+
+	// ratio: against 12 byte log records; page ratio: with the unused end of every block
+	printf("\n%-12s %-9s %8s %6s %8s %8s %8s %8s %8s %9s\n", "sensor", "coding", "samples", "blocks",
+			"b/sample", "ratio", "pages", "enc ns", "dec ns", "max err");
+	for (int s = 0; s < SENSORS; s++)
+	{
+		if (g_traces[s].count == 0)
+		{
+			continue;
+		}
+		if (bench(sensor_names[s], &g_traces[s], 0.0f) != 0 || bench(sensor_names[s], &g_traces[s], sensor_quanta[s]) != 0)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
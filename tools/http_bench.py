@@ -0,0 +1,325 @@
+#!/usr/bin/env python3
+"""
+http_bench.py
+
+Load generator and latency benchmark for the web server (main/http_server.c).
+
+Replays the traffic of the web page against a device and reports, per
+route, the requests per second and the p50/p95/p99 latency seen by the
+client, next to the server counters read from /metrics before and after.
+
+    dashboard   every client loads the page (index, scripts, styles) and then
+                polls like app.js: /dhtSensor.json every 2 s, /localTime.json
+                every 10 s; one extra client scrapes /metrics every 15 s.
+                --speed divides the intervals.
+    saturate    every client requests the polled routes back to back, for the
+                throughput the server sustains.
+
+--ota-image uploads an image to /OTAupdate during the run, like the page
+does for .gz/.odp files, to measure the other routes while the flash is
+written. The device boots the image when the upload succeeds, so upload
+the build it is already running.
+
+The rate limiter (CONFIG_HTTP_RATE_LIMIT_*) answers 429 to clients over
+their rate; those are counted apart and left out of the latencies. Raise
+the limits to measure the handlers, keep them to measure admission.
+--new-connections opens a connection per request, like many short-lived
+clients, instead of keeping one alive per client.
+
+Baselines: --save-baseline writes the results, --baseline compares a run
+with them and exits with 1 if the p99 of a route or the total throughput
+got worse than --threshold. Save a baseline from a run on the hardware
+and commit it next to the change it measures.
+
+Example, from a laptop connected to the access point of the device:
+
+    python tools/http_bench.py dashboard --clients 5 --speed 4 --duration 60
+    python tools/http_bench.py saturate --clients 3 --save-baseline bench.json
+"""
+import argparse
+import http.client
+import json
+import re
+import sys
+import threading
+import time
+import urllib.parse
+import uuid
+
+# Files loaded with the page, and what app.js requests once on load
+PAGE_ROUTES = [
+    ('GET', '/'),
+    ('GET', '/app.css'),
+    ('GET', '/jquery-3.3.1.min.js'),
+    ('GET', '/app.js'),
+    ('GET', '/favicon.ico'),
+    ('GET', '/apSSID.json'),
+    ('POST', '/OTAstatus'),
+    ('GET', '/wifiConnectInfo.json'),
+    ('GET', '/wifiScan.json'),
+]
+
+# Routes app.js polls and their interval in seconds
+POLL_ROUTES = [
+    ('GET', '/dhtSensor.json', 2.0),
+    ('GET', '/localTime.json', 10.0),
+]
+
+METRICS_SCRAPE_INTERVAL_S = 15.0
+
+# Server counters reported as before/after deltas
+METRICS_COUNTERS = [
+    'http_rate_limited_total',
+    'http_async_rejected_total',
+    'http_sessions_opened_total',
+    'http_sessions_closed_total',
+    'http_session_reused_requests_total',
+]
+
+REQUEST_TIMEOUT_S = 10.0
+
+
+class RouteStats:
+    def __init__(self):
+        self.latencies_ms = []
+        self.statuses = {}
+        self.errors = 0
+
+    def merge(self, other: 'RouteStats'):
+        self.latencies_ms.extend(other.latencies_ms)
+        for status, count in other.statuses.items():
+            self.statuses[status] = self.statuses.get(status, 0) + count
+        self.errors += other.errors
+
+
+class Client:
+    """One browser: a connection kept alive between requests unless new_connections."""
+
+    def __init__(self, host: str, port: int, new_connections: bool):
+        self.host = host
+        self.port = port
+        self.new_connections = new_connections
+        self.conn = None
+        self.stats = {}
+
+    def request(self, method: str, path: str, body: bytes = None, headers: dict = None) -> bytes:
+        stats = self.stats.setdefault('{} {}'.format(method, path), RouteStats())
+        start = time.perf_counter()
+        try:
+            if self.conn is None:
+                self.conn = http.client.HTTPConnection(self.host, self.port, timeout=REQUEST_TIMEOUT_S)
+            self.conn.request(method, path, body=body, headers=headers or {})
+            response = self.conn.getresponse()
+            data = response.read()
+        except (OSError, http.client.HTTPException):
+            stats.errors += 1
+            self.close()
+            return None
+
+        elapsed_ms = (time.perf_counter() - start) * 1000.0
+        stats.statuses[response.status] = stats.statuses.get(response.status, 0) + 1
+        if 200 <= response.status < 300:
+            stats.latencies_ms.append(elapsed_ms)
+        if self.new_connections or response.will_close:
+            self.close()
+        return data
+
+    def close(self):
+        if self.conn is not None:
+            self.conn.close()
+            self.conn = None
+
+
+def run_dashboard(client: Client, stop: threading.Event, speed: float):
+    for method, path in PAGE_ROUTES:
+        client.request(method, path)
+
+    now = time.monotonic()
+    next_poll = [now] * len(POLL_ROUTES)
+    while not stop.is_set():
+        for i, (method, path, interval) in enumerate(POLL_ROUTES):
+            if time.monotonic() >= next_poll[i]:
+                client.request(method, path)
+                next_poll[i] += interval / speed
+        stop.wait(max(0.0, min(next_poll) - time.monotonic()))
+
+
+def run_metrics_scraper(client: Client, stop: threading.Event, speed: float):
+    while not stop.is_set():
+        client.request('GET', '/metrics')
+        stop.wait(METRICS_SCRAPE_INTERVAL_S / speed)
+
+
+def run_saturate(client: Client, stop: threading.Event, speed: float):
+    while not stop.is_set():
+        for method, path, _ in POLL_ROUTES:
+            client.request(method, path)
+
+
+def run_ota_upload(client: Client, image: bytes, name: str):
+    # Same multipart body as the FormData of updateFirmware() in app.js
+    boundary = uuid.uuid4().hex
+    body = ('--{}\r\nContent-Disposition: form-data; name="file"; filename="{}"\r\n'
+            'Content-Type: application/octet-stream\r\n\r\n').format(boundary, name).encode() + image + \
+        '\r\n--{}--\r\n'.format(boundary).encode()
+    client.request('POST', '/OTAupdate', body=body,
+                   headers={'Content-Type': 'multipart/form-data; boundary=' + boundary})
+
+
+def read_counters(host: str, port: int) -> dict:
+    """Sums of the METRICS_COUNTERS series by name and labels, empty if /metrics could not be read."""
+    client = Client(host, port, True)
+    text = client.request('GET', '/metrics')
+    counters = {}
+    if text is None:
+        return counters
+    for line in text.decode('utf-8', 'replace').splitlines():
+        match = re.match(r'^([a-z_]+)(\{[^}]*\})? (\d+)', line)
+        if match and match.group(1) in METRICS_COUNTERS:
+            counters[match.group(1) + (match.group(2) or '')] = int(match.group(3))
+    return counters
+
+
+def percentile(sorted_values: list, p: float) -> float:
+    # Nearest rank
+    if not sorted_values:
+        return 0.0
+    rank = max(1, int(round(p / 100.0 * len(sorted_values) + 0.5)))
+    return sorted_values[min(rank, len(sorted_values)) - 1]
+
+
+def summarize(stats: dict, duration_s: float) -> dict:
+    routes = {}
+    for route, s in sorted(stats.items()):
+        latencies = sorted(s.latencies_ms)
+        routes[route] = {
+            'requests': sum(s.statuses.values()) + s.errors,
+            'rps': len(latencies) / duration_s,
+            'p50_ms': percentile(latencies, 50),
+            'p95_ms': percentile(latencies, 95),
+            'p99_ms': percentile(latencies, 99),
+            'max_ms': latencies[-1] if latencies else 0.0,
+            'statuses': {str(k): v for k, v in sorted(s.statuses.items())},
+            'errors': s.errors,
+        }
+    return {
+        'duration_s': duration_s,
+        'total_rps': sum(r['rps'] for r in routes.values()),
+        'routes': routes,
+    }
+
+
+def print_summary(summary: dict):
+    print('{:<28} {:>7} {:>8} {:>8} {:>8} {:>8} {:>8}  {}'.format(
+        'route', 'reqs', 'ok/s', 'p50 ms', 'p95 ms', 'p99 ms', 'max ms', 'status (errors)'))
+    for route, r in summary['routes'].items():
+        statuses = ' '.join('{}:{}'.format(k, v) for k, v in r['statuses'].items())
+        print('{:<28} {:>7} {:>8.2f} {:>8.1f} {:>8.1f} {:>8.1f} {:>8.1f}  {} ({})'.format(
+            route, r['requests'], r['rps'], r['p50_ms'], r['p95_ms'], r['p99_ms'], r['max_ms'], statuses, r['errors']))
+    print('total {:.2f} ok/s over {:.1f} s'.format(summary['total_rps'], summary['duration_s']))
+
+
+def compare(summary: dict, baseline: dict, threshold: float) -> bool:
+    """Prints the changes against the baseline, returns False on a regression."""
+    ok = True
+    for route, r in summary['routes'].items():
+        base = baseline['routes'].get(route)
+        if base is None or base['p99_ms'] == 0.0:
+            continue
+        change = r['p99_ms'] / base['p99_ms'] - 1.0
+        worse = change > threshold
+        ok = ok and not worse
+        print('{:<28} p99 {:8.1f} -> {:8.1f} ms ({:+.0%}){}'.format(route, base['p99_ms'], r['p99_ms'], change, '  REGRESSION' if worse else ''))
+
+    if baseline['total_rps'] > 0.0:
+        change = summary['total_rps'] / baseline['total_rps'] - 1.0
+        worse = change < -threshold
+        ok = ok and not worse
+        print('{:<28} {:8.2f} -> {:8.2f} ok/s ({:+.0%}){}'.format('total', baseline['total_rps'], summary['total_rps'], change, '  REGRESSION' if worse else ''))
+    return ok
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('mix', choices=['dashboard', 'saturate'], help='traffic mix')
+    parser.add_argument('--url', default='http://192.168.4.1', help='device address (default: the access point)')
+    parser.add_argument('--clients', type=int, default=5, help='concurrent clients (default: 5, the access point limit)')
+    parser.add_argument('--duration', type=float, default=30.0, help='seconds to run (default: 30)')
+    parser.add_argument('--speed', type=float, default=1.0, help='dashboard: poll this many times faster than app.js')
+    parser.add_argument('--new-connections', action='store_true', help='open a connection per request')
+    parser.add_argument('--ota-image', help='upload this image to /OTAupdate during the run')
+    parser.add_argument('--json', help='write the results to this file')
+    parser.add_argument('--save-baseline', help='write the results as a baseline to this file')
+    parser.add_argument('--baseline', help='compare with this baseline')
+    parser.add_argument('--threshold', type=float, default=0.2, help='regression threshold, fraction (default: 0.2)')
+    args = parser.parse_args()
+
+    url = urllib.parse.urlsplit(args.url)
+    if url.scheme != 'http':
+        print('only http:// is supported', file=sys.stderr)
+        return 2
+    host, port = url.hostname, url.port or 80
+
+    before = read_counters(host, port)
+
+    stop = threading.Event()
+    run = run_dashboard if args.mix == 'dashboard' else run_saturate
+    clients = [Client(host, port, args.new_connections) for _ in range(args.clients)]
+    threads = [threading.Thread(target=run, args=(c, stop, args.speed)) for c in clients]
+    if args.mix == 'dashboard':
+        clients.append(Client(host, port, args.new_connections))
+        threads.append(threading.Thread(target=run_metrics_scraper, args=(clients[-1], stop, args.speed)))
+    if args.ota_image:
+        with open(args.ota_image, 'rb') as f:
+            image = f.read()
+        clients.append(Client(host, port, False))
+        threads.append(threading.Thread(target=run_ota_upload, args=(clients[-1], image, args.ota_image.split('/')[-1])))
+
+    start = time.monotonic()
+    for t in threads:
+        t.daemon = True
+        t.start()
+    try:
+        time.sleep(args.duration)
+    except KeyboardInterrupt:
+        pass
+    stop.set()
+    for t in threads:
+        t.join(REQUEST_TIMEOUT_S)
+    duration_s = time.monotonic() - start
+    for c in clients:
+        c.close()
+
+    stats = {}
+    for c in clients:
+        for route, s in c.stats.items():
+            stats.setdefault(route, RouteStats()).merge(s)
+    summary = summarize(stats, duration_s)
+    summary['mix'] = args.mix
+    summary['clients'] = args.clients
+
+    after = read_counters(host, port)
+    summary['server_counters'] = {k: after[k] - before.get(k, 0) for k in sorted(after)}
+
+    print_summary(summary)
+    for name, delta in summary['server_counters'].items():
+        print('{:<60} {:+d}'.format(name, delta))
+
+    for path in (args.json, args.save_baseline):
+        if path:
+            with open(path, 'w') as f:
+                json.dump(summary, f, indent=2)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        if baseline.get('mix') != args.mix:
+            print('baseline is a {} run, this is a {} run'.format(baseline.get('mix'), args.mix), file=sys.stderr)
+            return 2
+        if not compare(summary, baseline, args.threshold):
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,305 @@
+/*
+ * lf_ring_bench.c
+ *
+ *  Host stress check and benchmark of includes/lf_ring.c.
+ *
+ *  The stress runs push sequence numbers from producer threads and check
+ *  on the consumer side that nothing is lost, duplicated or reordered per
+ *  producer. The benchmark compares the rings with a bounded queue built
+ *  on a mutex and two condition variables, the host stand-in for
+ *  xQueueSend/xQueueReceive (a critical section and a copy per call). The
+ *  figures are host figures: they rank the designs, they do not predict
+ *  cycle counts on the ESP32. A side that finds the ring full or empty
+ *  yields, as a task would block, so the runs also make progress on a
+ *  single CPU.
+ *
+ *      cc -O2 -pthread -Iincludes tools/lf_ring_bench.c includes/lf_ring.c -o lf_ring_bench
+ *      ./lf_ring_bench [items]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lf_ring.h"
+
+#define RING_SLOTS			256
+#define MPSC_PRODUCERS		4
+
+/**
+ * Element, about the size of a sensor sample or an event bus event
+ */
+typedef struct bench_elem
+{
+	uint32_t producer;
+	uint32_t seq;
+	uint32_t payload[2];
+} bench_elem_t;
+
+LF_SPSC_STORAGE(g_spsc_storage, sizeof(bench_elem_t), RING_SLOTS);
+LF_MPSC_STORAGE(g_mpsc_storage, sizeof(bench_elem_t), RING_SLOTS);
+
+static lf_spsc_t g_spsc;
+static lf_mpsc_t g_mpsc;
+static uint32_t g_items;
+
+/**
+ * Bounded queue locked by a mutex, for comparison
+ */
+typedef struct locked_queue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	uint32_t head;
+	uint32_t tail;
+	bench_elem_t slots[RING_SLOTS];
+} locked_queue_t;
+
+static locked_queue_t g_locked = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static void locked_send(locked_queue_t *q, const bench_elem_t *elem)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->head - q->tail == RING_SLOTS)
+	{
+		pthread_cond_wait(&q->not_full, &q->lock);
+	}
+	q->slots[q->head++ % RING_SLOTS] = *elem;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void locked_receive(locked_queue_t *q, bench_elem_t *elem)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->head == q->tail)
+	{
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+	*elem = q->slots[q->tail++ % RING_SLOTS];
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *spsc_producer(void *arg)
+{
+	bench_elem_t elem = { 0 };
+
+	(void)arg;
+
+	for (elem.seq = 0; elem.seq < g_items; )
+	{
+		if (lf_spsc_push(&g_spsc, &elem))
+		{
+			elem.seq++;
+		}
+		else
+		{
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static void *mpsc_producer(void *arg)
+{
+	bench_elem_t elem = { .producer = (uint32_t)(uintptr_t)arg };
+	uint32_t count = g_items / MPSC_PRODUCERS;
+
+	for (elem.seq = 0; elem.seq < count; )
+	{
+		if (lf_mpsc_push(&g_mpsc, &elem))
+		{
+			elem.seq++;
+		}
+		else
+		{
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static void *locked_producer(void *arg)
+{
+	bench_elem_t elem = { 0 };
+
+	(void)arg;
+
+	for (elem.seq = 0; elem.seq < g_items; elem.seq++)
+	{
+		locked_send(&g_locked, &elem);
+	}
+
+	return NULL;
+}
+
+/**
+ * One producer thread, the calling thread consumes and checks the order.
+ */
+static int run_spsc(void)
+{
+	pthread_t thread;
+	bench_elem_t elem;
+	uint32_t expected = 0;
+	double start = now_s();
+
+	lf_spsc_init(&g_spsc, g_spsc_storage, sizeof(bench_elem_t), RING_SLOTS);
+	pthread_create(&thread, NULL, spsc_producer, NULL);
+	while (expected < g_items)
+	{
+		if (!lf_spsc_pop(&g_spsc, &elem))
+		{
+			sched_yield();
+			continue;
+		}
+		if (elem.seq != expected)
+		{
+			fprintf(stderr, "spsc: got %u, expected %u\n", elem.seq, expected);
+			return 1;
+		}
+		expected++;
+	}
+	pthread_join(thread, NULL);
+
+	printf("lf_spsc   1 producer  %8.1f ns/item\n", (now_s() - start) * 1e9 / g_items);
+	return 0;
+}
+
+/**
+ * MPSC_PRODUCERS producer threads, every producer's sequence must arrive in order.
+ */
+static int run_mpsc(void)
+{
+	pthread_t threads[MPSC_PRODUCERS];
+	uint32_t expected[MPSC_PRODUCERS] = { 0 };
+	uint32_t total = g_items / MPSC_PRODUCERS * MPSC_PRODUCERS;
+	bench_elem_t elem;
+	double start = now_s();
+
+	lf_mpsc_init(&g_mpsc, g_mpsc_storage, sizeof(bench_elem_t), RING_SLOTS);
+	for (uintptr_t i = 0; i < MPSC_PRODUCERS; i++)
+	{
+		pthread_create(&threads[i], NULL, mpsc_producer, (void *)i);
+	}
+	for (uint32_t received = 0; received < total; )
+	{
+		if (!lf_mpsc_pop(&g_mpsc, &elem))
+		{
+			sched_yield();
+			continue;
+		}
+		if (elem.producer >= MPSC_PRODUCERS || elem.seq != expected[elem.producer])
+		{
+			fprintf(stderr, "mpsc: producer %u sent %u, expected %u\n", elem.producer, elem.seq,
+					elem.producer < MPSC_PRODUCERS ? expected[elem.producer] : 0);
+			return 1;
+		}
+		expected[elem.producer]++;
+		received++;
+	}
+	for (int i = 0; i < MPSC_PRODUCERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	if (lf_mpsc_pop(&g_mpsc, &elem))
+	{
+		fprintf(stderr, "mpsc: element left over\n");
+		return 1;
+	}
+
+	printf("lf_mpsc   %d producers %8.1f ns/item (%u pushes refused, ring full)\n", MPSC_PRODUCERS,
+			(now_s() - start) * 1e9 / total, lf_mpsc_get_dropped(&g_mpsc));
+	return 0;
+}
+
+/**
+ * Same as run_spsc over the locked queue.
+ */
+static int run_locked(void)
+{
+	pthread_t thread;
+	bench_elem_t elem;
+	double start = now_s();
+
+	pthread_create(&thread, NULL, locked_producer, NULL);
+	for (uint32_t expected = 0; expected < g_items; expected++)
+	{
+		locked_receive(&g_locked, &elem);
+		if (elem.seq != expected)
+		{
+			fprintf(stderr, "locked: got %u, expected %u\n", elem.seq, expected);
+			return 1;
+		}
+	}
+	pthread_join(thread, NULL);
+
+	printf("locked    1 producer  %8.1f ns/item\n", (now_s() - start) * 1e9 / g_items);
+	return 0;
+}
+
+/**
+ * Push and pop from one thread, the cost of the calls without contention.
+ */
+static void run_uncontended(void)
+{
+	bench_elem_t elem = { 0 };
+	double start;
+
+	lf_spsc_init(&g_spsc, g_spsc_storage, sizeof(bench_elem_t), RING_SLOTS);
+	start = now_s();
+	for (uint32_t i = 0; i < g_items; i++)
+	{
+		lf_spsc_push(&g_spsc, &elem);
+		lf_spsc_pop(&g_spsc, &elem);
+	}
+	printf("lf_spsc   push+pop    %8.1f ns/pair, one thread\n", (now_s() - start) * 1e9 / g_items);
+
+	lf_mpsc_init(&g_mpsc, g_mpsc_storage, sizeof(bench_elem_t), RING_SLOTS);
+	start = now_s();
+	for (uint32_t i = 0; i < g_items; i++)
+	{
+		lf_mpsc_push(&g_mpsc, &elem);
+		lf_mpsc_pop(&g_mpsc, &elem);
+	}
+	printf("lf_mpsc   push+pop    %8.1f ns/pair, one thread\n", (now_s() - start) * 1e9 / g_items);
+
+	start = now_s();
+	for (uint32_t i = 0; i < g_items; i++)
+	{
+		locked_send(&g_locked, &elem);
+		locked_receive(&g_locked, &elem);
+	}
+	printf("locked    send+recv   %8.1f ns/pair, one thread\n", (now_s() - start) * 1e9 / g_items);
+}
+
+int main(int argc, char **argv)
+{
+	g_items = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : 2000000;
+
+	if (run_spsc() != 0 || run_mpsc() != 0 || run_locked() != 0)
+	{
+		return 1;
+	}
+	run_uncontended();
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+ota_image_tool.py
+
+Prepares firmware images for the /OTAupdate endpoint.
+
+    gzip    compress build/oneshot_read.bin into a .bin.gz the device
+            inflates on the fly while flashing
+    diff    build a delta patch that turns the image currently running on
+            the device into a new one (see main/ota_delta.h for the format)
+
+Example, keeping the .bin that was flashed last time:
+
+    python tools/ota_image_tool.py diff released.bin build/oneshot_read.bin -o update.odp
+"""
+import argparse
+import gzip
+import hashlib
+import struct
+import sys
+
+# Delta patch format, must match main/ota_delta.h
+DELTA_MAGIC = b'ODP1'
+DELTA_OP_END = 0x00
+DELTA_OP_COPY = 0x01
+DELTA_OP_INSERT = 0x02
+DELTA_OP_ADD = 0x03
+
+# Length of the exact seed match and of the shortest region worth a COPY/ADD op
+DELTA_SEED_LEN = 12
+DELTA_MIN_MATCH = 24
+
+
+def cmd_gzip(args: argparse.Namespace) -> int:
+    with open(args.image, 'rb') as f:
+        image = f.read()
+
+    # mtime=0 keeps the output reproducible for identical builds
+    packed = gzip.compress(image, compresslevel=9, mtime=0)
+
+    output = args.output or args.image + '.gz'
+    with open(output, 'wb') as f:
+        f.write(packed)
+
+    print('{}: {} -> {} bytes ({:.1f}%)'.format(output, len(image), len(packed), 100.0 * len(packed) / len(image)))
+    return 0
+
+
+def image_digest(image: bytes) -> bytes:
+    """Digest the device reports for an app partition (esp_partition_get_sha256)."""
+    # Images built with the appended SHA-256 report that hash, others the hash of the whole image
+    if len(image) > 32 and hashlib.sha256(image[:-32]).digest() == image[-32:]:
+        return image[-32:]
+    return hashlib.sha256(image).digest()
+
+
+def delta_extend(old: bytes, o: int, new: bytes, n: int) -> int:
+    """Length of the approximate match at old[o:], new[n:], scored like bsdiff."""
+    limit = min(len(old) - o, len(new) - n)
+    score = best_score = best_len = 0
+    for k in range(limit):
+        score += 1 if old[o + k] == new[n + k] else -1
+        if score > best_score:
+            best_score, best_len = score, k + 1
+        elif score < best_score - 2 * DELTA_MIN_MATCH:
+            break
+    return best_len
+
+
+def delta_ops(old: bytes, new: bytes) -> list:
+    # Index 4-byte aligned seeds, any match longer than SEED_LEN + 3 is found
+    index = {}
+    for o in range(0, len(old) - DELTA_SEED_LEN + 1, 4):
+        index.setdefault(old[o:o + DELTA_SEED_LEN], o)
+
+    ops = []
+    literal_start = n = 0
+    expected = 0
+    while n <= len(new) - DELTA_SEED_LEN:
+        seed = new[n:n + DELTA_SEED_LEN]
+        # Continuing right after the previous match is the most likely hit
+        o = expected if old[expected:expected + DELTA_SEED_LEN] == seed else index.get(seed)
+        length = delta_extend(old, o, new, n) if o is not None else 0
+        if length < DELTA_MIN_MATCH:
+            n += 1
+            continue
+
+        # Grow the match backwards into the pending literal while bytes agree
+        while n > literal_start and o > 0 and old[o - 1] == new[n - 1]:
+            n, o, length = n - 1, o - 1, length + 1
+
+        if n > literal_start:
+            ops.append((DELTA_OP_INSERT, new[literal_start:n]))
+        if old[o:o + length] == new[n:n + length]:
+            ops.append((DELTA_OP_COPY, o, length))
+        else:
+            diff = bytes((new[n + k] - old[o + k]) & 0xFF for k in range(length))
+            ops.append((DELTA_OP_ADD, o, diff))
+
+        n += length
+        literal_start = n
+        expected = o + length
+
+    if literal_start < len(new):
+        ops.append((DELTA_OP_INSERT, new[literal_start:]))
+    return ops
+
+
+def cmd_diff(args: argparse.Namespace) -> int:
+    with open(args.old, 'rb') as f:
+        old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+
+    patch = bytearray(DELTA_MAGIC)
+    patch += struct.pack('<II', len(old), len(new))
+    patch += image_digest(old)
+
+    for op in delta_ops(old, new):
+        if op[0] == DELTA_OP_COPY:
+            patch += struct.pack('<BII', DELTA_OP_COPY, op[1], op[2])
+        elif op[0] == DELTA_OP_ADD:
+            patch += struct.pack('<BII', DELTA_OP_ADD, op[1], len(op[2])) + op[2]
+        else:
+            patch += struct.pack('<BI', DELTA_OP_INSERT, len(op[1])) + op[1]
+    patch += struct.pack('<B', DELTA_OP_END)
+
+    # ADD payloads are mostly zeros, so the patch is gzipped unless asked not to
+    data = bytes(patch) if args.no_gzip else gzip.compress(bytes(patch), compresslevel=9, mtime=0)
+
+    with open(args.output, 'wb') as f:
+        f.write(data)
+
+    print('{}: {} bytes ({:.1f}% of the new image)'.format(args.output, len(data), 100.0 * len(data) / len(new)))
+    return 0
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Firmware image tool for OTA updates')
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('gzip', help='compress an image for /OTAupdate')
+    p.add_argument('image', help='application .bin')
+    p.add_argument('-o', '--output', help='output file (default: <image>.gz)')
+    p.set_defaults(func=cmd_gzip)
+
+    p = sub.add_parser('diff', help='build a delta patch for /OTAupdate')
+    p.add_argument('old', help='.bin currently running on the device')
+    p.add_argument('new', help='new application .bin')
+    p.add_argument('-o', '--output', required=True, help='output patch file')
+    p.add_argument('--no-gzip', action='store_true', help='do not compress the patch')
+    p.set_defaults(func=cmd_diff)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
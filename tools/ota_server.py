@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+ota_server.py
+
+Local update server for the pull mode OTA (main/ota_pull.c).
+
+Serves a firmware image and the manifest that points to it:
+
+    GET /manifest.json   {"version", "url", "size", "sha256"}
+    GET /firmware.bin    the image, with Range support for the partial
+                         download done by esp_https_ota
+
+The version is read from the app description embedded in the image, so a
+device already running that build reports "up to date". Set
+CONFIG_OTA_PULL_MANIFEST_URL to http://<this host>:<port>/manifest.json.
+
+Example:
+
+    python tools/ota_server.py build/oneshot_read.bin --port 8070
+"""
+import argparse
+import hashlib
+import http.server
+import json
+import os
+import re
+import socket
+import struct
+import sys
+
+# esp_image_header_t (24 bytes) + first segment header (8 bytes), then esp_app_desc_t
+APP_DESC_OFFSET = 32
+APP_DESC_MAGIC = 0xABCD5432
+APP_DESC_VERSION_OFFSET = 16
+APP_DESC_VERSION_LEN = 32
+
+
+def image_version(image: bytes) -> str:
+    desc = image[APP_DESC_OFFSET:APP_DESC_OFFSET + APP_DESC_VERSION_OFFSET + APP_DESC_VERSION_LEN]
+    if len(desc) < APP_DESC_VERSION_OFFSET + APP_DESC_VERSION_LEN or struct.unpack_from('<I', desc)[0] != APP_DESC_MAGIC:
+        raise ValueError('no app description found, is this an ESP-IDF app image?')
+    version = desc[APP_DESC_VERSION_OFFSET:]
+    return version.split(b'\0', 1)[0].decode('ascii', 'replace')
+
+
+def local_address() -> str:
+    # The address the device reaches us at, not 127.0.0.1
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        try:
+            s.connect(('10.255.255.255', 1))
+            return s.getsockname()[0]
+        except OSError:
+            return '127.0.0.1'
+
+
+class OtaRequestHandler(http.server.BaseHTTPRequestHandler):
+    image = b''
+    manifest = b''
+
+    # esp_https_ota keeps the connection open between range requests
+    protocol_version = 'HTTP/1.1'
+
+    def send_body(self, status: int, body: bytes, content_type: str, extra_headers: dict = None) -> None:
+        self.send_response(status)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        for name, value in (extra_headers or {}).items():
+            self.send_header(name, value)
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self) -> None:
+        if self.path == '/manifest.json':
+            self.send_body(200, self.manifest, 'application/json')
+        elif self.path == '/firmware.bin':
+            self.send_image()
+        else:
+            self.send_body(404, b'not found', 'text/plain')
+
+    def send_image(self) -> None:
+        size = len(self.image)
+        match = re.fullmatch(r'bytes=(\d+)-(\d*)', self.headers.get('Range', ''))
+        if match is None:
+            self.send_body(200, self.image, 'application/octet-stream', {'Accept-Ranges': 'bytes'})
+            return
+
+        start = int(match.group(1))
+        end = min(int(match.group(2)) if match.group(2) else size - 1, size - 1)
+        if start > end:
+            self.send_body(416, b'', 'application/octet-stream', {'Content-Range': f'bytes */{size}'})
+            return
+
+        self.send_body(206, self.image[start:end + 1], 'application/octet-stream',
+                       {'Accept-Ranges': 'bytes', 'Content-Range': f'bytes {start}-{end}/{size}'})
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('image', help='application image, e.g. build/oneshot_read.bin')
+    parser.add_argument('--port', type=int, default=8070)
+    parser.add_argument('--host', default=None, help='address advertised in the manifest (default: autodetect)')
+    parser.add_argument('--version', default=None, help='override the version read from the image')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+
+    try:
+        version = args.version or image_version(image)
+    except ValueError as e:
+        print(f'{args.image}: {e}', file=sys.stderr)
+        return 1
+
+    host = args.host or local_address()
+    manifest = {
+        'version': version,
+        'url': f'http://{host}:{args.port}/firmware.bin',
+        'size': len(image),
+        'sha256': hashlib.sha256(image).hexdigest(),
+    }
+
+    OtaRequestHandler.image = image
+    OtaRequestHandler.manifest = json.dumps(manifest).encode()
+
+    print(f'serving {os.path.basename(args.image)} version {version} ({len(image)} bytes)')
+    print(f'manifest: http://{host}:{args.port}/manifest.json')
+
+    server = http.server.ThreadingHTTPServer(('', args.port), OtaRequestHandler)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())